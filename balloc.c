@@ -0,0 +1,761 @@
+/*
+ *  fs/sfs/balloc.c
+ *
+ *  Block allocator of sfs: the on-disk blk bitmap, plus the per-open-file
+ *  reservation windows that keep concurrent writers off the global lock.
+ *  Also discard of free blks: FITRIM, and `-o discard' for freed blks.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* struct buffer_head, sb_bread() */
+#include <linux/bitops.h>      /* find_next_zero_bit_le() and friends */
+#include <linux/slab.h>
+#include <linux/shrinker.h>
+#include <linux/percpu_counter.h>
+#include <linux/blkdev.h>      /* sb_issue_discard() */
+#include <linux/sched.h>       /* cond_resched() */
+
+#include "sfs.h"
+#include "sfs_trace.h"
+
+/*
+ * How a reservation window works:
+ *   - When an open file need a blk and its window is empty, we take
+ *     s_bmap_lock, search the blk bitmap for a run of s_rsv_blks free
+ *     blks(starting right after the previous window of this file) and mark
+ *     the whole run as used in the bitmap.
+ *   - Later allocations of this file are served from the window under the
+ *     window's own spinlock, without touching the bitmap at all.
+ *   - On close(), on memory pressure(shrinker) or when the bitmap runs out of
+ *     free blks, whatever is left in the window is cleared from the bitmap.
+ * Since each open file fills its own window, concurrent appenders do not
+ * interleave their blks. NOTE that reserved-but-unused blks stay marked on
+ * disk if we crash before giving them back.
+ */
+
+/* number of zero bits in the first `nbits' bits of a bitmap */
+unsigned long sfs_bitmap_count_free(void *bitmap, unsigned long nbits) {
+    unsigned long bit = 0, end, nfree = 0;
+
+    while ((bit = find_next_zero_bit_le(bitmap, nbits, bit)) < nbits) {
+        end = find_next_bit_le(bitmap, nbits, bit);
+        nfree += end - bit;
+        bit = end;
+    }
+    return nfree;
+}
+
+/*
+ * The blk bitmap span s_bmap_blocks blks from sfs_blk_bitmap: the bit of blk
+ * b is bit b % SFS_BITS_PER_BLK of bitmap blk b / SFS_BITS_PER_BLK. The
+ * helpers below hide that, and only read one bitmap blk at a time.
+ */
+#define SFS_BITS_PER_BLK(sb) ((sb)->s_blocksize << 3)
+
+/* read the bitmap blk holding the bit of `blk_nr'. Caller brelse() it */
+static struct buffer_head *sfs_bmap_bh(struct super_block *sb,
+                                       unsigned long blk_nr) {
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_bitmap +
+                      blk_nr / SFS_BITS_PER_BLK(sb));
+    if (unlikely(!bh))
+        SFSD(SFS_KERN_LEVEL "FAIL sb_bread() blk bitmap !!\n");
+    return bh;
+}
+
+/*
+ * first blk in [start, end) whose bit is set(`set' != 0) or clear, `end' if
+ * there is none. A bitmap blk that can't be read is taken as all used
+ */
+unsigned long sfs_bmap_find(struct super_block *sb, unsigned long start,
+                                   unsigned long end, int set) {
+    unsigned long per_blk = SFS_BITS_PER_BLK(sb), base, lim, bit;
+    struct buffer_head *bh;
+
+    while (start < end) {
+        base = round_down(start, per_blk);
+        lim = min(end - base, per_blk);
+        bh = sfs_bmap_bh(sb, start);
+        if (unlikely(!bh))
+            return set ? start : end;
+        if (set)
+            bit = find_next_bit_le(bh->b_data, lim, start - base);
+        else
+            bit = find_next_zero_bit_le(bh->b_data, lim, start - base);
+        brelse(bh);
+        if (bit < lim)
+            return base + bit;
+        start = base + lim;
+    }
+    return end;
+}
+
+/*
+ * set(`set' != 0) or clear the bits of [start, start + count), and tell the
+ * free extent index(fextent.c) about it. 0 on success
+ */
+static int sfs_bmap_change(struct super_block *sb, unsigned long start,
+                           unsigned long count, int set) {
+    unsigned long per_blk = SFS_BITS_PER_BLK(sb), end = start + count, n;
+    unsigned long first;
+    struct buffer_head *bh;
+
+    while (start < end) {
+        bh = sfs_bmap_bh(sb, start);
+        if (unlikely(!bh))
+            return -EIO;
+        n = min(end, round_down(start, per_blk) + per_blk);
+        for (first = start; start < n; start++) {
+            if (set)
+                __set_bit_le(start % per_blk, bh->b_data);
+            else
+                __clear_bit_le(start % per_blk, bh->b_data);
+        }
+        mark_buffer_dirty(bh);
+        brelse(bh);
+        /* per bitmap blk, so the index follow what really changed */
+        if (set)
+            __sfs_fext_use(sb, first, n - first);
+        else
+            __sfs_fext_free(sb, first, n - first);
+    }
+    return 0;
+}
+
+/* free blks in the whole blk bitmap, for the free count at mount */
+unsigned long sfs_bmap_count_free(struct super_block *sb) {
+    unsigned long blk = 0, end = SFS_S_INFO(sb)->s_blocks_count, used;
+    unsigned long nfree = 0;
+
+    while ((blk = sfs_bmap_find(sb, blk, end, 0)) < end) {
+        used = sfs_bmap_find(sb, blk, end, 1);
+        nfree += used - blk;
+        blk = used;
+    }
+    return nfree;
+}
+
+/* you have to update the blk bit map yourself */
+unsigned int __sfs_get_unused_blk(struct super_block *sb) {
+    unsigned long blk_nr, nbits = SFS_S_INFO(sb)->s_blocks_count;
+    long first = __sfs_fext_first(sb);
+
+    if (first >= 0)
+        return first;
+    /* bits past the end of the device are never handed out */
+    blk_nr = sfs_bmap_find(sb, 0, nbits, 0);
+    return blk_nr < nbits ? blk_nr : 0;
+}
+
+/* update bitmap. 0 on success */
+int sfs_update_blk_bmp_bit(struct super_block *sb, uint64_t blk_nr) {
+    if (blk_nr >= SFS_S_INFO(sb)->s_blocks_count) {
+        printk(SFS_KERN_LEVEL "Too large blk_nr to test:[%llu]. aborted.\n",
+               blk_nr);
+        return -EINVAL;
+    }
+    return sfs_bmap_change(sb, blk_nr, 1, 1);
+}
+
+/* lowest-free-bit allocation. caller hold s_bmap_lock. 0 on fail */
+static unsigned int __sfs_new_blk(struct super_block *sb) {
+    unsigned int blk_nr;
+
+    blk_nr = __sfs_get_unused_blk(sb);
+    if (!blk_nr)
+        return 0;
+    if (sfs_update_blk_bmp_bit(sb, blk_nr)) {
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_update_blk_bmp_bit()!\n");
+        return 0;
+    }
+    percpu_counter_dec(&SFS_S_INFO(sb)->s_freeblks_counter);
+    return blk_nr;
+}
+
+/* clear [blk_nr, blk_nr + count) in blk bitmap. caller hold s_bmap_lock */
+static void __sfs_free_blks(struct super_block *sb, unsigned long blk_nr,
+                            unsigned long count) {
+    if (blk_nr + count > SFS_S_INFO(sb)->s_blocks_count) {
+        printk(SFS_KERN_LEVEL "Too large blk range to free:[%lu, +%lu]\n",
+               blk_nr, count);
+        return;
+    }
+    if (sfs_bmap_change(sb, blk_nr, count, 0))
+        return;
+    percpu_counter_add(&SFS_S_INFO(sb)->s_freeblks_counter, count);
+}
+
+/*
+ * fill a newly allocated blk with zeros in the buffer cache(no read), so that
+ * whatever a deleted file left there never show up in a hole or in a dir.
+ * The blk is written along with `inode' on fsync(), if inode is not NULL
+ */
+int sfs_zero_blk(struct super_block *sb, unsigned int blk_nr,
+                 struct inode *inode) {
+    struct buffer_head *bh;
+
+    bh = sb_getblk(sb, SFS_S_INFO(sb)->sfs_blk_start + blk_nr);
+    if (unlikely(!bh)) {
+        SFSD(SFS_KERN_LEVEL "FAIL sb_getblk() !!\n");
+        return -EIO;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    if (inode)
+        mark_buffer_dirty_inode(bh, inode);
+    else
+        mark_buffer_dirty(bh);
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Discard. With `-o discard', blks a file give up are not cleared in the blk
+ * bitmap right away. They are queued(adjacent runs merged) with their bits
+ * still set, so they can not be handed out again while the discard is
+ * pending, and sfs_flush_discards() discard a whole batch then clear them.
+ * That happen on sync(2)/umount, when the queue grow past
+ * s_discard_batch blks(SFS_DISCARD_BATCH_BLKS by default), or when allocation run out of blks. A crash before
+ * that leave the queued blks marked on disk.
+ */
+struct sfs_discard_ext {
+    struct list_head list;      /* on sfs_sb_info->s_discard_list */
+    unsigned long start;
+    unsigned long len;
+};
+
+static int sfs_discard_supported(struct super_block *sb) {
+    return blk_queue_discard(bdev_get_queue(sb->s_bdev));
+}
+
+static int sfs_issue_discard(struct super_block *sb, unsigned long start,
+                             unsigned long len) {
+    return sb_issue_discard(sb, start, len, GFP_NOFS, 0);
+}
+
+/* `-o discard' on a device that can't is simply turned off */
+void sfs_discard_check(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    if ((sbi->s_mount_opt & SFS_MOUNT_DISCARD) && !sfs_discard_supported(sb)) {
+        printk(SFS_KERN_LEVEL "device does not support discard, "
+                              "ignoring -o discard\n");
+        sbi->s_mount_opt &= ~SFS_MOUNT_DISCARD;
+    }
+}
+
+/* a file freed [blk_nr, blk_nr + count). caller hold s_bmap_lock */
+static void __sfs_release_blks(struct super_block *sb, unsigned long blk_nr,
+                               unsigned long count) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_discard_ext *ext;
+
+    if (!(sbi->s_mount_opt & SFS_MOUNT_DISCARD)) {
+        __sfs_free_blks(sb, blk_nr, count);
+        return;
+    }
+    if (!list_empty(&sbi->s_discard_list)) {
+        ext = list_last_entry(&sbi->s_discard_list, struct sfs_discard_ext,
+                              list);
+        if (ext->start + ext->len == blk_nr) {
+            ext->len += count;
+            sbi->s_discard_blks += count;
+            return;
+        }
+    }
+    ext = kmalloc(sizeof(struct sfs_discard_ext), GFP_NOFS);
+    if (unlikely(!ext)) {
+        /* no discard for these, that's all */
+        __sfs_free_blks(sb, blk_nr, count);
+        return;
+    }
+    ext->start = blk_nr;
+    ext->len = count;
+    list_add_tail(&ext->list, &sbi->s_discard_list);
+    sbi->s_discard_blks += count;
+}
+
+/* discard everything queued and give the blks back to the bitmap */
+void sfs_flush_discards(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_discard_ext *ext, *tmp;
+    LIST_HEAD(batch);
+
+    mutex_lock(&sbi->s_bmap_lock);
+    list_splice_init(&sbi->s_discard_list, &batch);
+    sbi->s_discard_blks = 0;
+    mutex_unlock(&sbi->s_bmap_lock);
+    if (list_empty(&batch))
+        return;
+
+    /* the bits are still set, nobody can take these blks meanwhile */
+    list_for_each_entry(ext, &batch, list)
+        if (sfs_issue_discard(sb, ext->start, ext->len))
+            SFSD(SFS_KERN_LEVEL "FAIL discard [%lu, +%lu]\n",
+                 ext->start, ext->len);
+
+    mutex_lock(&sbi->s_bmap_lock);
+    list_for_each_entry_safe(ext, tmp, &batch, list) {
+        __sfs_free_blks(sb, ext->start, ext->len);
+        kfree(ext);
+    }
+    mutex_unlock(&sbi->s_bmap_lock);
+}
+
+/*
+ * FITRIM: discard the free runs of at least `minlen' bytes within
+ * [start, start + len). On return range->len is how many bytes were
+ * discarded. s_bmap_lock is held while a run is being discarded so that it
+ * can not be allocated and written under our feet, but dropped in between.
+ */
+int sfs_trim_fs(struct super_block *sb, struct fstrim_range *range) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long blk, end, bit, next, minlen, trimmed = 0;
+    int err = 0;
+
+    if (!sfs_discard_supported(sb))
+        return -EOPNOTSUPP;
+
+    blk = range->start >> sb->s_blocksize_bits;
+    end = sbi->s_blocks_count;
+    if (range->len < ((u64)end << sb->s_blocksize_bits) &&
+        blk + (range->len >> sb->s_blocksize_bits) < end)
+        end = blk + (range->len >> sb->s_blocksize_bits);
+    minlen = max_t(unsigned long, 1,
+                   DIV_ROUND_UP(range->minlen, sb->s_blocksize));
+    if (blk >= sbi->s_blocks_count)
+        return -EINVAL;
+
+    while (blk < end) {
+        mutex_lock(&sbi->s_bmap_lock);
+        bit = sfs_bmap_find(sb, blk, end, 0);
+        next = bit < end ? sfs_bmap_find(sb, bit, end, 1) : end;
+        if (bit < end && next - bit >= minlen) {
+            err = sfs_issue_discard(sb, bit, next - bit);
+            if (!err)
+                trimmed += next - bit;
+        }
+        mutex_unlock(&sbi->s_bmap_lock);
+        if (err)
+            break;
+        blk = next;
+        cond_resched();
+    }
+
+    range->len = (u64)trimmed << sb->s_blocksize_bits;
+    return trimmed ? 0 : err;
+}
+
+/*
+ * search for a run of `want' free blks, starting at `goal' and wrapping
+ * around at the end. If there is no such run, a shorter one is used(the
+ * longest with the free extent index, else the first found). Return the
+ * first blk of the run and store its length in `*len'(0 if the bitmap is
+ * full).
+ */
+static unsigned long sfs_find_free_run(struct super_block *sb,
+                                       unsigned long goal, unsigned long want,
+                                       unsigned long *len) {
+    unsigned long nbits = SFS_S_INFO(sb)->s_blocks_count;
+    unsigned long start, end, pos, limit;
+    unsigned long best = 0, best_len = 0;
+    int pass;
+
+    if (goal >= nbits)
+        goal = 0;
+    if (!__sfs_fext_find_near(sb, goal, want, &start, len))
+        return start;
+    for (pass = 0; pass < 2; pass++) {
+        pos = pass ? 0 : goal;
+        limit = pass ? goal : nbits;
+        while (pos < limit) {
+            start = sfs_bmap_find(sb, pos, limit, 0);
+            if (start >= limit)
+                break;
+            end = sfs_bmap_find(sb, start, min(nbits, start + want), 1);
+            if (end - start == want) {
+                *len = want;
+                return start;
+            }
+            if (!best_len) {
+                best = start;
+                best_len = end - start;
+            }
+            pos = end;
+        }
+    }
+    *len = best_len;
+    return best;
+}
+
+/* take one blk out of a window. 0 if the window is empty */
+static unsigned int sfs_rsv_take(struct sfs_rsv_window *rsv) {
+    unsigned int blk_nr = 0;
+
+    spin_lock(&rsv->lock);
+    if (rsv->next < rsv->end)
+        blk_nr = rsv->next++;
+    spin_unlock(&rsv->lock);
+    return blk_nr;
+}
+
+/*
+ * reserve a new window for `rsv' and return its first blk(0 on fail). The new
+ * window is searched right after the old one so that the file keeps growing
+ * contiguously. caller hold s_bmap_lock.
+ */
+static unsigned int sfs_rsv_refill(struct super_block *sb,
+                                   struct sfs_rsv_window *rsv) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long goal, start, len;
+
+    goal = rsv->end ? rsv->end : sbi->s_rsv_goal;
+    start = sfs_find_free_run(sb, goal, sbi->s_rsv_blks, &len);
+    if (!len || sfs_bmap_change(sb, start, len, 1))
+        return 0;
+    percpu_counter_sub(&sbi->s_freeblks_counter, len);
+
+    /* the next file opened start its window after this one */
+    sbi->s_rsv_goal = start + len;
+
+    spin_lock(&rsv->lock);
+    rsv->next = start + 1;
+    rsv->end = start + len;
+    spin_unlock(&rsv->lock);
+    return start;
+}
+
+/* give back unused blks of a window. caller hold s_bmap_lock */
+static void __sfs_rsv_drop(struct super_block *sb, struct sfs_rsv_window *rsv) {
+    unsigned long start, end;
+
+    spin_lock(&rsv->lock);
+    start = rsv->next;
+    end = rsv->end;
+    /* keep `end' where it was, so that next refill start from here again */
+    rsv->next = rsv->end = start;
+    spin_unlock(&rsv->lock);
+
+    if (start < end)
+        __sfs_free_blks(sb, start, end - start);
+}
+
+static void __sfs_rsv_drop_all(struct super_block *sb) {
+    struct sfs_rsv_window *rsv;
+
+    list_for_each_entry(rsv, &SFS_S_INFO(sb)->s_rsv_list, list)
+        __sfs_rsv_drop(sb, rsv);
+}
+
+/*
+ * allocate one blk for a file and mark it in the blk bitmap. If `rsv' is not
+ * NULL the blk comes from the file's reservation window. Return blk nr on
+ * success, 0 if we are running out of blk.
+ */
+unsigned int sfs_new_blk(struct super_block *sb, struct sfs_rsv_window *rsv) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    u64 start = sfs_lat_start();
+    unsigned int blk_nr;
+
+    trace_sfs_new_blk_enter(sb, 1);
+    /* windows turned off through sysfs since the file was opened */
+    if (rsv && !READ_ONCE(sbi->s_rsv_blks))
+        rsv = NULL;
+    if (rsv) {
+        blk_nr = sfs_rsv_take(rsv);
+        if (likely(blk_nr))
+            goto out;
+    }
+
+    mutex_lock(&sbi->s_bmap_lock);
+    if (rsv) {
+        /* somebody sharing this file may have refilled it while we wait */
+        blk_nr = sfs_rsv_take(rsv);
+        if (!blk_nr)
+            blk_nr = sfs_rsv_refill(sb, rsv);
+    } else {
+        blk_nr = __sfs_new_blk(sb);
+    }
+    if (!blk_nr && sbi->s_rsv_nr) {
+        /* bitmap full: take back what the other open files reserved */
+        __sfs_rsv_drop_all(sb);
+        blk_nr = __sfs_new_blk(sb);
+    }
+    mutex_unlock(&sbi->s_bmap_lock);
+
+    if (!blk_nr && sbi->s_discard_blks) {
+        /* still full: blks waiting for discard are the last resort */
+        sfs_flush_discards(sb);
+        mutex_lock(&sbi->s_bmap_lock);
+        blk_nr = __sfs_new_blk(sb);
+        mutex_unlock(&sbi->s_bmap_lock);
+    }
+
+    if (!blk_nr)
+        SFSD(SFS_KERN_LEVEL "running out of blk!\n");
+out:
+    trace_sfs_new_blk_exit(sb, blk_nr, blk_nr ? 1 : 0);
+    sfs_lat_account(sb, SFS_OP_NEW_BLK, start);
+    return blk_nr;
+}
+
+/*
+ * read the refcount table blk holding the entry of `blk_nr'. The entry is at
+ * bh->b_data[*off]. Caller brelse() the bh.
+ */
+static struct buffer_head *sfs_refcnt_bh(struct super_block *sb,
+                                         unsigned long blk_nr,
+                                         unsigned int *off) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct buffer_head *bh;
+
+    if (unlikely(blk_nr >= sbi->s_blocks_count)) {
+        printk(SFS_KERN_LEVEL "blk [%lu] out of refcount table\n", blk_nr);
+        return NULL;
+    }
+    bh = sb_bread(sb, sbi->sfs_refcnt_start + blk_nr / sb->s_blocksize);
+    if (unlikely(!bh)) {
+        SFSD(SFS_KERN_LEVEL "FAIL sb_bread() refcount table !!\n");
+        return NULL;
+    }
+    *off = blk_nr % sb->s_blocksize;
+    return bh;
+}
+
+/*
+ * drop one extra owner of `blk_nr'. Return 1 if it had one(so the blk is
+ * still in use), 0 if the caller was the last owner. s_bmap_lock held.
+ */
+static int __sfs_refcnt_put(struct super_block *sb, unsigned long blk_nr) {
+    struct buffer_head *bh;
+    unsigned int off;
+    int shared = 0;
+
+    bh = sfs_refcnt_bh(sb, blk_nr, &off);
+    if (unlikely(!bh))
+        return 1;       /* better leak the blk than free it twice */
+    if (bh->b_data[off]) {
+        bh->b_data[off]--;
+        mark_buffer_dirty(bh);
+        shared = 1;
+    }
+    brelse(bh);
+    return shared;
+}
+
+/* is `blk_nr' owned by more than one file(i.e. must be copied on write) ? */
+int sfs_blk_shared(struct super_block *sb, unsigned long blk_nr) {
+    struct buffer_head *bh;
+    unsigned int off;
+    int shared;
+
+    bh = sfs_refcnt_bh(sb, blk_nr, &off);
+    if (unlikely(!bh))
+        return 1;
+    shared = bh->b_data[off] != 0;
+    brelse(bh);
+    return shared;
+}
+
+/* add an owner to the in-use blk `blk_nr'. -EMLINK if it has too many */
+int sfs_blk_ref(struct super_block *sb, unsigned long blk_nr) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct buffer_head *bh;
+    unsigned int off;
+    int err = 0;
+
+    mutex_lock(&sbi->s_bmap_lock);
+    bh = sfs_refcnt_bh(sb, blk_nr, &off);
+    if (unlikely(!bh)) {
+        err = -EIO;
+        goto out;
+    }
+    if ((unsigned char)bh->b_data[off] == SFS_REFCNT_MAX) {
+        err = -EMLINK;
+    } else {
+        bh->b_data[off]++;
+        mark_buffer_dirty(bh);
+    }
+    brelse(bh);
+out:
+    mutex_unlock(&sbi->s_bmap_lock);
+    return err;
+}
+
+/*
+ * a file give up [blk_nr, blk_nr + count). Blks still owned by a reflink
+ * clone only lose one owner, the others are cleared in blk bitmap
+ */
+void sfs_free_blks(struct super_block *sb, unsigned long blk_nr,
+                   unsigned long count) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    u64 start = sfs_lat_start();
+    unsigned long i, run = blk_nr;
+
+    trace_sfs_free_blks_enter(sb, count);
+    mutex_lock(&sbi->s_bmap_lock);
+    for (i = blk_nr; i < blk_nr + count; i++) {
+        if (!__sfs_refcnt_put(sb, i))
+            continue;
+        /* `i' is still in use: free the run before it */
+        if (i > run)
+            __sfs_release_blks(sb, run, i - run);
+        run = i + 1;
+    }
+    if (blk_nr + count > run)
+        __sfs_release_blks(sb, run, blk_nr + count - run);
+    mutex_unlock(&sbi->s_bmap_lock);
+
+    if (sbi->s_discard_blks >= READ_ONCE(sbi->s_discard_batch))
+        sfs_flush_discards(sb);
+    trace_sfs_free_blks_exit(sb, blk_nr, count);
+    sfs_lat_account(sb, SFS_OP_FREE_BLKS, start);
+}
+
+/*
+ * allocate `want' contiguous blks: the smallest free run that is long
+ * enough, or without the free extent index the first such run from the
+ * start of the device. Return its first blk, 0 if there is no run that long
+ */
+unsigned long sfs_new_blk_run(struct super_block *sb, unsigned long want) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    u64 t = sfs_lat_start();
+    unsigned long start, len;
+
+    trace_sfs_new_blk_run_enter(sb, want);
+    mutex_lock(&sbi->s_bmap_lock);
+    if (__sfs_fext_find_best(sb, want, &start, &len))
+        start = sfs_find_free_run(sb, 0, want, &len);
+    if (len < want || sfs_bmap_change(sb, start, len, 1))
+        start = 0;
+    else
+        percpu_counter_sub(&sbi->s_freeblks_counter, len);
+    mutex_unlock(&sbi->s_bmap_lock);
+    trace_sfs_new_blk_run_exit(sb, start, start ? len : 0);
+    sfs_lat_account(sb, SFS_OP_NEW_BLK_RUN, t);
+    return start;
+}
+
+/*
+ * set up an (empty) reservation window for a file opened for writing. NULL
+ * when s_rsv_max files have one already, the file then allocate blk by blk
+ */
+struct sfs_rsv_window *sfs_rsv_alloc(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_rsv_window *rsv;
+
+    rsv = kzalloc(sizeof(struct sfs_rsv_window), GFP_KERNEL);
+    if (unlikely(!rsv))
+        return NULL;
+    spin_lock_init(&rsv->lock);
+
+    mutex_lock(&sbi->s_bmap_lock);
+    if (sbi->s_rsv_nr >= sbi->s_rsv_max) {
+        mutex_unlock(&sbi->s_bmap_lock);
+        kfree(rsv);
+        return NULL;
+    }
+    list_add(&rsv->list, &sbi->s_rsv_list);
+    sbi->s_rsv_nr++;
+    mutex_unlock(&sbi->s_bmap_lock);
+    return rsv;
+}
+
+/* blks reserved in windows but not used yet */
+unsigned long sfs_rsv_reserved(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_rsv_window *rsv;
+    unsigned long n = 0;
+
+    mutex_lock(&sbi->s_bmap_lock);
+    list_for_each_entry(rsv, &sbi->s_rsv_list, list) {
+        spin_lock(&rsv->lock);
+        n += rsv->end - rsv->next;
+        spin_unlock(&rsv->lock);
+    }
+    mutex_unlock(&sbi->s_bmap_lock);
+    return n;
+}
+
+/* called on close(): give back unused blks and free the window */
+void sfs_rsv_release(struct super_block *sb, struct sfs_rsv_window *rsv) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    mutex_lock(&sbi->s_bmap_lock);
+    __sfs_rsv_drop(sb, rsv);
+    list_del(&rsv->list);
+    sbi->s_rsv_nr--;
+    mutex_unlock(&sbi->s_bmap_lock);
+    kfree(rsv);
+}
+
+static unsigned long sfs_rsv_shrink_count(struct shrinker *shrink,
+                                          struct shrink_control *sc) {
+    struct sfs_sb_info *sbi = container_of(shrink, struct sfs_sb_info,
+                                           s_rsv_shrinker);
+    return READ_ONCE(sbi->s_rsv_nr);
+}
+
+/*
+ * under memory pressure, empty some windows. The window itself stays with
+ * its file, it just have to reserve again on the next write
+ */
+static unsigned long sfs_rsv_shrink_scan(struct shrinker *shrink,
+                                         struct shrink_control *sc) {
+    struct sfs_sb_info *sbi = container_of(shrink, struct sfs_sb_info,
+                                           s_rsv_shrinker);
+    struct sfs_rsv_window *rsv;
+    unsigned long freed = 0;
+
+    /* giving blks back mean bitmap I/O */
+    if (!(sc->gfp_mask & __GFP_FS))
+        return SHRINK_STOP;
+    if (!mutex_trylock(&sbi->s_bmap_lock))
+        return SHRINK_STOP;
+    list_for_each_entry(rsv, &sbi->s_rsv_list, list) {
+        if (freed >= sc->nr_to_scan)
+            break;
+        __sfs_rsv_drop(sbi->sb, rsv);
+        freed++;
+    }
+    mutex_unlock(&sbi->s_bmap_lock);
+    return freed;
+}
+
+int sfs_rsv_init(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    mutex_init(&sbi->s_bmap_lock);
+    INIT_LIST_HEAD(&sbi->s_rsv_list);
+    INIT_LIST_HEAD(&sbi->s_discard_list);
+    sbi->s_discard_blks = 0;
+    sbi->s_rsv_nr = 0;
+    /* the bitmap is shared with metadata, start data windows after that */
+    sbi->s_rsv_goal = SFS_DATA_START(sbi);
+
+    sbi->s_rsv_shrinker.count_objects = sfs_rsv_shrink_count;
+    sbi->s_rsv_shrinker.scan_objects = sfs_rsv_shrink_scan;
+    sbi->s_rsv_shrinker.seeks = DEFAULT_SEEKS;
+    return register_shrinker(&sbi->s_rsv_shrinker);
+}
+
+void sfs_rsv_destroy(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    unregister_shrinker(&sbi->s_rsv_shrinker);
+    /* every file is closed by now, but be safe */
+    mutex_lock(&sbi->s_bmap_lock);
+    __sfs_rsv_drop_all(sb);
+    mutex_unlock(&sbi->s_bmap_lock);
+}
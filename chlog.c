@@ -0,0 +1,242 @@
+/*
+ *  fs/sfs/chlog.c
+ *
+ *  The change log: an optional ring of s_chlog_blocks blks(mkfs.sfs -C)
+ *  right after the refcount table, where every create, write, unlink, mkdir
+ *  and rmdir leave a record {seq, ino, dir, op}. An incremental backup ask
+ *  for the records after the last seq it saw(SFS_IOC_GETCHANGES, see
+ *  sfs-changes.c) instead of crawling the tree.
+ *    - the record of seq s always live in slot s % slots, so the ring need
+ *      no head pointer: the newest seq is found again at mount by reading
+ *      the log. seq 0 is a never written slot;
+ *    - the log blks are written back like any other metadata buffer. If the
+ *      fs was not cleanly umounted(or changed by sfs-fuse, which keep no
+ *      log) the last records may be missing, so the seq jump a whole ring
+ *      ahead at mount(and a SFS_CHLOG_GAP record mark it): every reader's
+ *      cursor is then too old, and it is told to do a full scan once
+ *      (SFS_CHLOG_LOST);
+ *    - a write is not logged again while an earlier write record of the
+ *      same file is in the log and nobody has read it yet: whoever read
+ *      that record later look at the file after this write anyway.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* sb_bread() */
+#include <linux/capability.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <asm/uaccess.h>
+
+#include "sfs.h"
+
+/* records handed out by one SFS_IOC_GETCHANGES at most */
+#define SFS_CHLOG_MAX_REQ 1024
+
+/* the buffer holding slot `slot', with `rec' pointed at it */
+static struct buffer_head *sfs_chlog_slot(struct super_block *sb,
+                                          unsigned long slot,
+                                          struct sfs_chlog_rec **rec) {
+    unsigned long per_blk = SFS_CHLOG_RECS_PER_BLK(sb->s_blocksize);
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, SFS_S_INFO(sb)->s_chlog_start + slot / per_blk);
+    if (unlikely(!bh))
+        return NULL;
+    *rec = (struct sfs_chlog_rec *)bh->b_data + slot % per_blk;
+    return bh;
+}
+
+/* log that `op' happened to `ino'(in dir `dir') */
+void sfs_chlog_add(struct super_block *sb, unsigned long ino,
+                   unsigned long dir, int op) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_chlog_rec *rec;
+    struct buffer_head *bh;
+    u64 seq;
+
+    if (!sbi->s_chlog_nr || (sb->s_flags & MS_RDONLY))
+        return;
+    mutex_lock(&sbi->s_chlog_lock);
+    if (op == SFS_CHLOG_WRITE && sbi->s_chlog_wseq[ino] >= sbi->s_chlog_first &&
+        sbi->s_chlog_wseq[ino] > sbi->s_chlog_read)
+        goto out;
+
+    seq = ++sbi->s_chlog_last;
+    bh = sfs_chlog_slot(sb, seq % sbi->s_chlog_nr, &rec);
+    if (unlikely(!bh)) {
+        /* a reader from before this seq can't be told about it */
+        printk(SFS_KERN_LEVEL "%s: FAIL writing change log record [%llu]\n",
+               sb->s_id, seq);
+        sbi->s_chlog_first = seq + 1;
+        goto out;
+    }
+    rec->seq = seq;
+    rec->ino = ino;
+    rec->dir = dir;
+    rec->op = op;
+    rec->pad = 0;
+    mark_buffer_dirty(bh);
+    brelse(bh);
+
+    sbi->s_chlog_wseq[ino] = op == SFS_CHLOG_WRITE ? seq : 0;
+    if (seq - sbi->s_chlog_first >= sbi->s_chlog_nr)
+        sbi->s_chlog_first = seq - sbi->s_chlog_nr + 1;
+out:
+    mutex_unlock(&sbi->s_chlog_lock);
+}
+
+/* SFS_IOC_GETCHANGES: see sfs_chlog_req */
+long sfs_ioc_getchanges(struct file *filp, struct sfs_chlog_req __user *arg) {
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_chlog_rec *recs, *rec;
+    struct buffer_head *bh = NULL;
+    struct sfs_chlog_req req;
+    unsigned long slot, per_blk = SFS_CHLOG_RECS_PER_BLK(sb->s_blocksize);
+    u32 n = 0, max;
+    u64 seq;
+    int err = 0;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (!sbi->s_chlog_nr)
+        return -EOPNOTSUPP;
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    max = min_t(u32, req.nr, SFS_CHLOG_MAX_REQ);
+    /* nr 0 only ask for first/last */
+    recs = kmalloc(max(max, 1U) * sizeof(*recs), GFP_KERNEL);
+    if (!recs)
+        return -ENOMEM;
+
+    mutex_lock(&sbi->s_chlog_lock);
+    req.first = sbi->s_chlog_first;
+    req.last = sbi->s_chlog_last;
+    req.flags = 0;
+    seq = req.cursor + 1;
+    /* too old, or from a log that lost its end in a crash */
+    if (seq < req.first || req.cursor > req.last) {
+        req.flags |= SFS_CHLOG_LOST;
+        seq = req.first;
+    }
+    for (; seq <= req.last && n < max; seq++) {
+        slot = seq % sbi->s_chlog_nr;
+        if (!bh || slot % per_blk == 0) {
+            brelse(bh);
+            bh = sfs_chlog_slot(sb, slot, &rec);
+            if (unlikely(!bh)) {
+                err = -EIO;
+                break;
+            }
+        } else {
+            rec++;
+        }
+        /* e.g. a record lost to an I/O error, see sfs_chlog_add() */
+        if (rec->seq == seq)
+            recs[n++] = *rec;
+    }
+    brelse(bh);
+    req.cursor = seq - 1;
+    req.nr = n;
+    if (req.cursor > sbi->s_chlog_read)
+        sbi->s_chlog_read = req.cursor;
+    mutex_unlock(&sbi->s_chlog_lock);
+
+    if (!err && n && copy_to_user((void __user *)(unsigned long)req.recs,
+                                  recs, n * sizeof(*recs)))
+        err = -EFAULT;
+    if (!err && copy_to_user(arg, &req, sizeof(req)))
+        err = -EFAULT;
+    kfree(recs);
+    return err;
+}
+
+/* find where the log left off. Before the state on disk is marked dirty */
+int sfs_chlog_init(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long per_blk = SFS_CHLOG_RECS_PER_BLK(sb->s_blocksize), i, j;
+    struct sfs_chlog_rec *rec;
+    struct buffer_head *bh;
+    u64 last = 0, first;
+    int pass;
+
+    mutex_init(&sbi->s_chlog_lock);
+    sbi->s_chlog_nr = sbi->s_chlog_blocks * per_blk;
+    sbi->s_chlog_read = 0;
+    if (!sbi->s_chlog_nr)
+        return 0;
+    sbi->s_chlog_wseq = vzalloc(min_t(unsigned long, sb->s_blocksize * 8,
+                                      SFS_MAX_INODES) * sizeof(u64));
+    if (!sbi->s_chlog_wseq)
+        return -ENOMEM;
+
+    /* the newest seq, then the oldest one still in the ring before it */
+    first = ~0ULL;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < sbi->s_chlog_blocks; i++) {
+            bh = sb_bread(sb, sbi->s_chlog_start + i);
+            if (unlikely(!bh)) {
+                printk(SFS_KERN_LEVEL "FAIL reading the change log\n");
+                sfs_chlog_destroy(sb);
+                return -EIO;
+            }
+            rec = (struct sfs_chlog_rec *)bh->b_data;
+            for (j = 0; j < per_blk; j++) {
+                if (!pass && rec[j].seq > last)
+                    last = rec[j].seq;
+                else if (pass && rec[j].seq && rec[j].seq < first &&
+                         last - rec[j].seq < sbi->s_chlog_nr)
+                    first = rec[j].seq;
+            }
+            brelse(bh);
+        }
+    }
+    if (!last)
+        first = 1;
+
+    sbi->s_chlog_first = first;
+    sbi->s_chlog_last = last;
+    sfs_chlog_start(sb);
+    return 0;
+}
+
+/*
+ * at mount or remount read-write, before the state on disk is marked dirty.
+ * The records of the last moments may never have reached the disk. The gap
+ * record make the jump stick even if nothing else is logged before the next
+ * umount
+ */
+void sfs_chlog_start(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    u64 last = sbi->s_chlog_last;
+
+    if (!sbi->s_chlog_nr || (sb->s_flags & MS_RDONLY))
+        return;
+    if ((sbi->s_state & SFS_STATE_CLEAN) &&
+        !(sbi->s_state & SFS_STATE_CHLOG_GAP))
+        return;
+    printk(SFS_KERN_LEVEL "%s: change log may miss changes, readers "
+           "before seq [%llu] have to rescan\n", sb->s_id, last + 1);
+    mutex_lock(&sbi->s_chlog_lock);
+    sbi->s_chlog_first = last + sbi->s_chlog_nr;
+    sbi->s_chlog_last = sbi->s_chlog_first - 1;
+    mutex_unlock(&sbi->s_chlog_lock);
+    sfs_chlog_add(sb, SFS_ROOTINO, SFS_ROOTINO, SFS_CHLOG_GAP);
+    sbi->s_state &= ~SFS_STATE_CHLOG_GAP;
+}
+
+void sfs_chlog_destroy(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    vfree(sbi->s_chlog_wseq);
+    sbi->s_chlog_wseq = NULL;
+}
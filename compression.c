@@ -0,0 +1,367 @@
+/*
+ *  fs/sfs/compression.c
+ *
+ *  Transparent lz4 compression of file data. Turned on per file(or per dir,
+ *  for files created under it) by the SFS_COMPR_FL inode flag, see ioctl.c.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* struct buffer_head, sb_bread() */
+#include <linux/vmalloc.h>
+#include <linux/lz4.h>
+#include <asm/uaccess.h>
+
+#include "sfs.h"
+
+/*
+ * How a compressed file is laid out:
+ *   - The direct blks are grouped into clusters of SFS_COMPR_CLUSTER_BLKS
+ *     blks, cluster c cover directs[c * SFS_COMPR_CLUSTER_BLKS ...]. Every
+ *     read()/write() work on whole clusters.
+ *   - If bit c of sii->i_cmap is set, cluster c is stored compressed: its
+ *     first blks hold a struct sfs_compr_hdr followed by the lz4 stream and
+ *     the rest of its directs are 0(i.e. the blks are given back).
+ *   - Otherwise the cluster is stored raw, exactly like a normal file. That
+ *     is what happen to data that does not compress into fewer blks.
+ *   - A 0 direct inside a raw cluster is a hole and read as zeros.
+ * Since every write is a read-modify-write of a cluster, writers and readers
+ * of the same file are serialized by i_mutex.
+ */
+
+struct sfs_compr_hdr {
+    __le32 clen;        /* bytes of lz4 data following this header */
+};
+
+/* scratch buffers for one read()/write() */
+struct sfs_compr_ctx {
+    char *cbuf;         /* one cluster, decompressed */
+    char *zbuf;         /* one cluster, compressed(header included) */
+    size_t zsize;       /* size of zbuf */
+    void *wrkmem;       /* lz4 work memory. only needed for compressing */
+};
+
+#define SFS_LZ4_WRKMEM LZ4_MEM_COMPRESS
+#define sfs_lz4_bound(n) lz4_compressbound(n)
+
+static int sfs_lz4_compress(const char *src, size_t slen, char *dst,
+                            size_t *dlen, void *wrkmem) {
+    return lz4_compress((const unsigned char *)src, slen,
+                        (unsigned char *)dst, dlen, wrkmem) ? -E2BIG : 0;
+}
+
+static int sfs_lz4_decompress(const char *src, size_t slen, char *dst,
+                              size_t *dlen) {
+    return lz4_decompress_unknownoutputsize((const unsigned char *)src, slen,
+                                            (unsigned char *)dst, dlen) ?
+           -EIO : 0;
+}
+
+/* first direct slot of cluster `c' and how many slots it has */
+static void sfs_cluster_geom(int c, unsigned int *first, unsigned int *nr) {
+    *first = c * SFS_COMPR_CLUSTER_BLKS;
+    *nr = min(SFS_COMPR_CLUSTER_BLKS, SFS_INO_NDIRECT - (int)*first);
+}
+
+static void sfs_compr_ctx_free(struct sfs_compr_ctx *ctx) {
+    vfree(ctx->cbuf);
+    vfree(ctx->zbuf);
+    vfree(ctx->wrkmem);
+}
+
+static int sfs_compr_ctx_init(struct super_block *sb,
+                              struct sfs_compr_ctx *ctx, int write) {
+    size_t csize = SFS_COMPR_CLUSTER_BLKS * sb->s_blocksize;
+
+    memset(ctx, 0, sizeof(*ctx));
+    /* room for the worst case lz4 output, in whole blks */
+    ctx->zsize = round_up(sizeof(struct sfs_compr_hdr) + sfs_lz4_bound(csize),
+                          sb->s_blocksize);
+    ctx->cbuf = vmalloc(csize);
+    ctx->zbuf = vmalloc(ctx->zsize);
+    if (write)
+        ctx->wrkmem = vmalloc(SFS_LZ4_WRKMEM);
+    if (!ctx->cbuf || !ctx->zbuf || (write && !ctx->wrkmem)) {
+        SFSD(SFS_KERN_LEVEL "FAIL vmalloc() compression buffers\n");
+        sfs_compr_ctx_free(ctx);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* read cluster `c' of the file into ctx->cbuf, decompressing if needed */
+static int sfs_cluster_load(struct super_block *sb, struct sfs_inode_info *sii,
+                            int c, struct sfs_compr_ctx *ctx) {
+    struct sfs_compr_hdr *hdr;
+    struct buffer_head *bh;
+    unsigned int first, nr, i;
+    size_t bs = sb->s_blocksize, clen, dlen;
+    char *dst;
+    int err;
+
+    sfs_cluster_geom(c, &first, &nr);
+    memset(ctx->cbuf, 0, nr * bs);
+    /* a raw cluster go straight into cbuf, a compressed one into zbuf */
+    dst = (sii->i_cmap & (1 << c)) ? ctx->zbuf : ctx->cbuf;
+    for (i = 0; i < nr; i++) {
+        if (!sii->directs[first + i])
+            continue;
+        bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start +
+                          sii->directs[first + i]);
+        if (unlikely(!bh)) {
+            SFSD(SFS_KERN_LEVEL "FAIL sb_bread() !\n");
+            return -EIO;
+        }
+        memcpy(dst + i * bs, bh->b_data, bs);
+        brelse(bh);
+    }
+    if (dst == ctx->cbuf)
+        return 0;
+
+    hdr = (struct sfs_compr_hdr *)ctx->zbuf;
+    clen = le32_to_cpu(hdr->clen);
+    if (unlikely(sizeof(*hdr) + clen > nr * bs)) {
+        printk(SFS_KERN_LEVEL "corrupted compressed cluster [%d] of ino "
+                              "[%lu]: clen [%zu]\n", c, sii->inode_no, clen);
+        return -EIO;
+    }
+    dlen = nr * bs;
+    err = sfs_lz4_decompress(ctx->zbuf + sizeof(*hdr), clen, ctx->cbuf, &dlen);
+    if (err)
+        printk(SFS_KERN_LEVEL "FAIL decompress cluster [%d] of ino [%lu]\n",
+               c, sii->inode_no);
+    return err;
+}
+
+/*
+ * write the first `valid' bytes of ctx->cbuf back as cluster `c'. It is
+ * stored compressed only if that save at least one blk. sii is updated but
+ * not written out, the caller do that.
+ */
+static int sfs_cluster_store(struct inode *inode, int c, size_t valid,
+                             struct sfs_rsv_window *rsv,
+                             struct sfs_compr_ctx *ctx) {
+    struct super_block *sb = inode->i_sb;
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    struct sfs_compr_hdr *hdr = (struct sfs_compr_hdr *)ctx->zbuf;
+    struct buffer_head *bh;
+    unsigned int blks[SFS_COMPR_CLUSTER_BLKS];
+    unsigned int first, nr, need, i;
+    size_t bs = sb->s_blocksize, clen;
+    char *src = ctx->cbuf;
+    int compressed = 0;
+
+    sfs_cluster_geom(c, &first, &nr);
+    need = DIV_ROUND_UP(valid, bs);
+
+    clen = ctx->zsize - sizeof(*hdr);
+    if ((sii->i_flags & SFS_COMPR_FL) &&
+        !sfs_lz4_compress(ctx->cbuf, valid, ctx->zbuf + sizeof(*hdr), &clen,
+                          ctx->wrkmem) &&
+        DIV_ROUND_UP(sizeof(*hdr) + clen, bs) < need) {
+        need = DIV_ROUND_UP(sizeof(*hdr) + clen, bs);
+        hdr->clen = cpu_to_le32(clen);
+        /* do not leak whatever was in zbuf before into the last blk */
+        memset(ctx->zbuf + sizeof(*hdr) + clen, 0,
+               need * bs - sizeof(*hdr) - clen);
+        src = ctx->zbuf;
+        compressed = 1;
+    }
+
+    /*
+     * get all the blks first, so that ENOSPC leave the old cluster intact.
+     * A blk shared with a reflink clone is never written in place, it is
+     * replaced by a new one
+     */
+    for (i = 0; i < need; i++) {
+        blks[i] = sii->directs[first + i];
+        if (blks[i] && !sfs_blk_shared(sb, blks[i]))
+            continue;
+        blks[i] = sfs_new_blk(sb, rsv);
+        if (!blks[i]) {
+            SFSD(SFS_KERN_LEVEL "FAIL sfs_new_blk() !\n");
+            while (i--)
+                if (blks[i] != sii->directs[first + i])
+                    sfs_free_blks(sb, blks[i], 1);
+            return -ENOSPC;
+        }
+    }
+
+    for (i = 0; i < need; i++) {
+        /* the whole blk is overwritten, no need to read it */
+        bh = sb_getblk(sb, SFS_S_INFO(sb)->sfs_blk_start + blks[i]);
+        if (unlikely(!bh)) {
+            SFSD(SFS_KERN_LEVEL "FAIL sb_getblk() !\n");
+            return -EIO;
+        }
+        lock_buffer(bh);
+        memcpy(bh->b_data, src + i * bs, bs);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty_inode(bh, inode);
+        brelse(bh);
+    }
+
+    for (i = 0; i < need; i++) {
+        /* give up our owner of a shared blk we just replaced */
+        if (sii->directs[first + i] && sii->directs[first + i] != blks[i])
+            sfs_free_blks(sb, sii->directs[first + i], 1);
+        sii->directs[first + i] = blks[i];
+    }
+    if (compressed)
+        sii->i_cmap |= 1 << c;
+    else
+        sii->i_cmap &= ~(1 << c);
+
+    /* blks the cluster no longer need(it shrunk when compressed) */
+    for (i = need; i < nr; i++) {
+        if (!sii->directs[first + i])
+            continue;
+        sfs_free_blks(sb, sii->directs[first + i], 1);
+        sii->directs[first + i] = 0;
+    }
+    return 0;
+}
+
+ssize_t sfs_compr_read(struct file *filp, char __user *buf, size_t len,
+                       loff_t *ppos) {
+    struct inode *inode = file_inode(filp);
+    struct super_block *sb = inode->i_sb;
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    struct sfs_compr_ctx ctx;
+    size_t csize = SFS_COMPR_CLUSTER_BLKS * sb->s_blocksize, off, n, done = 0;
+    loff_t pos = *ppos;
+    int c, err;
+
+    err = sfs_compr_ctx_init(sb, &ctx, 0);
+    if (err)
+        return err;
+
+    mutex_lock(&inode->i_mutex);
+    if (pos >= sii->file_size)
+        goto out;
+    len = min_t(size_t, len, sii->file_size - pos);
+    while (done < len) {
+        c = pos / csize;
+        off = pos - (loff_t)c * csize;
+        n = min(len - done, csize - off);
+        err = sfs_cluster_load(sb, sii, c, &ctx);
+        if (err)
+            break;
+        if (copy_to_user(buf + done, ctx.cbuf + off, n)) {
+            err = -EFAULT;
+            break;
+        }
+        done += n;
+        pos += n;
+    }
+out:
+    mutex_unlock(&inode->i_mutex);
+    sfs_compr_ctx_free(&ctx);
+    *ppos = pos;
+    return done ? done : err;
+}
+
+/*
+ * fill `len' bytes at `pos' of the file into the kernel buffer `dst', zeros
+ * past EOF. This is for sfs_readpage(), which can not take i_mutex(a writer
+ * hold it while dropping the page cache). A racing writer may leave us with
+ * a mix of old and new data, but it drop the page right after.
+ */
+int sfs_compr_read_kernel(struct inode *inode, char *dst, loff_t pos,
+                          size_t len) {
+    struct super_block *sb = inode->i_sb;
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    struct sfs_compr_ctx ctx;
+    size_t csize = SFS_COMPR_CLUSTER_BLKS * sb->s_blocksize, off, n, done = 0;
+    loff_t isize = i_size_read(inode);
+    int c, err;
+
+    err = sfs_compr_ctx_init(sb, &ctx, 0);
+    if (err)
+        return err;
+
+    while (done < len && pos < isize) {
+        c = pos / csize;
+        off = pos - (loff_t)c * csize;
+        n = min_t(size_t, min(len - done, csize - off), isize - pos);
+        err = sfs_cluster_load(sb, sii, c, &ctx);
+        if (err)
+            break;
+        memcpy(dst + done, ctx.cbuf + off, n);
+        done += n;
+        pos += n;
+    }
+    if (!err)
+        memset(dst + done, 0, len - done);
+
+    sfs_compr_ctx_free(&ctx);
+    return err;
+}
+
+/* i_mutex held by sfs_write(), which tested SFS_COMPR_FL under it */
+ssize_t sfs_compr_write(struct file *filp, const char __user *buf, size_t len,
+                        loff_t *ppos) {
+    struct inode *inode = file_inode(filp);
+    struct super_block *sb = inode->i_sb;
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    struct sfs_rsv_window *rsv = filp->private_data;
+    struct sfs_compr_ctx ctx;
+    size_t bs = sb->s_blocksize, csize = SFS_COMPR_CLUSTER_BLKS * bs;
+    size_t off, n, done = 0;
+    unsigned int first, nr;
+    loff_t pos = *ppos, cstart, size, newsize;
+    int c, err;
+
+    if (pos + len > (loff_t)SFS_INO_NDIRECT * bs) {
+        SFSD(SFS_KERN_LEVEL "maximum file size exceed when writing!\n");
+        return -EFBIG;
+    }
+    err = sfs_compr_ctx_init(sb, &ctx, 1);
+    if (err)
+        return err;
+
+    size = sii->file_size;
+    while (done < len) {
+        c = pos / csize;
+        cstart = (loff_t)c * csize;
+        off = pos - cstart;
+        sfs_cluster_geom(c, &first, &nr);
+        n = min(len - done, nr * bs - off);
+
+        err = sfs_cluster_load(sb, sii, c, &ctx);
+        if (err)
+            break;
+        if (copy_from_user(ctx.cbuf + off, buf + done, n)) {
+            err = -EFAULT;
+            break;
+        }
+        newsize = max_t(loff_t, size, pos + n);
+        err = sfs_cluster_store(inode, c,
+                                min_t(size_t, nr * bs, newsize - cstart),
+                                rsv, &ctx);
+        if (err)
+            break;
+        size = newsize;
+        done += n;
+        pos += n;
+    }
+
+    /* directs and i_cmap may have changed even if nothing was written */
+    sii->file_size = size;
+    i_size_write(inode, size);
+    /* mtime/ctime were already bumped by sfs_write() */
+    if (sfs_update_inode(inode))
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_update_inode() !\n");
+
+    sfs_compr_ctx_free(&ctx);
+    *ppos = pos;
+    return done ? done : err;
+}
@@ -0,0 +1,137 @@
+/*
+ *  fs/sfs/defrag.c
+ *
+ *  Online defragmentation: move the blks of a file into one contiguous free
+ *  run while it stays open and in use. See also sfs-defrag.c, which drive
+ *  this from user space.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* struct buffer_head, sb_bread() */
+#include <linux/mount.h>    /* mnt_want_write_file() */
+
+#include "sfs.h"
+
+/*
+ * count the blks of a file and the extents(runs of consecutive blks) they
+ * form, in file order. A hole, or an unused tail slot of a compressed
+ * cluster, does not break an extent by itself
+ */
+void sfs_frag_info(struct sfs_inode_info *sii, struct sfs_frag_info *fi) {
+    unsigned int prev = 0;
+    int i;
+
+    fi->blocks = fi->extents = 0;
+    for (i = 0; i < SFS_INO_NDIRECT; i++) {
+        if (!sii->directs[i])
+            continue;
+        if (!prev || sii->directs[i] != prev + 1)
+            fi->extents++;
+        fi->blocks++;
+        prev = sii->directs[i];
+    }
+}
+
+/*
+ * relocate the blks of `inode' into a free run. The new copies are written
+ * and the inode record pointing at them is made durable before the old blks
+ * are freed, so a crash leave the file either all old or all new. i_mutex
+ * keep writers, clones and setflags out meanwhile. A blk shared with a
+ * reflink clone is copied like a COW would, the clone keep the old one.
+ */
+static int sfs_defrag_inode(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    struct buffer_head *obh, *nbh;
+    unsigned int old[SFS_INO_NDIRECT];
+    struct sfs_frag_info fi;
+    unsigned long start, blk;
+    int i, err;
+
+    sfs_frag_info(sii, &fi);
+    if (fi.extents <= 1)
+        return 0;
+
+    start = sfs_new_blk_run(sb, fi.blocks);
+    if (!start) {
+        SFSD(SFS_KERN_LEVEL "no free run of [%u] blks to defrag into\n",
+             fi.blocks);
+        return -ENOSPC;
+    }
+
+    memcpy(old, sii->directs, sizeof(old));
+    blk = start;
+    for (i = 0; i < SFS_INO_NDIRECT; i++) {
+        if (!old[i])
+            continue;
+        obh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + old[i]);
+        nbh = sb_getblk(sb, SFS_S_INFO(sb)->sfs_blk_start + blk);
+        if (unlikely(!obh || !nbh)) {
+            SFSD(SFS_KERN_LEVEL "FAIL read/get blk for defrag !\n");
+            brelse(obh);
+            brelse(nbh);
+            err = -EIO;
+            goto undo;
+        }
+        lock_buffer(nbh);
+        memcpy(nbh->b_data, obh->b_data, sb->s_blocksize);
+        set_buffer_uptodate(nbh);
+        unlock_buffer(nbh);
+        mark_buffer_dirty_inode(nbh, inode);
+        brelse(nbh);
+        brelse(obh);
+        sii->directs[i] = blk++;
+    }
+
+    /* new data, then the record pointing at it, then give the old blks up */
+    err = sync_mapping_buffers(inode->i_mapping);
+    if (!err)
+        err = sfs_update_inode(inode);
+    if (!err)
+        err = sync_inode_metadata(inode, 1);
+    if (err)
+        goto undo;
+    for (i = 0; i < SFS_INO_NDIRECT; i++)
+        if (old[i])
+            sfs_free_blks(sb, old[i], 1);
+    return 0;
+
+undo:
+    memcpy(sii->directs, old, sizeof(old));
+    sfs_update_inode(inode);
+    sfs_free_blks(sb, start, fi.blocks);
+    return err;
+}
+
+/* SFS_IOC_DEFRAG: defragment the file, report its layout afterwards */
+long sfs_ioc_defrag(struct file *filp, struct sfs_frag_info __user *arg) {
+    struct inode *inode = file_inode(filp);
+    struct sfs_frag_info fi;
+    int err;
+
+    if (!S_ISREG(inode->i_mode))
+        return -EINVAL;
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    /* a read-only bind mount too, not only a read-only sb */
+    err = mnt_want_write_file(filp);
+    if (err)
+        return err;
+
+    mutex_lock(&inode->i_mutex);
+    err = sfs_defrag_inode(inode);
+    sfs_frag_info(SFS_I_INFO(inode), &fi);
+    mutex_unlock(&inode->i_mutex);
+    mnt_drop_write_file(filp);
+    if (err)
+        return err;
+    return copy_to_user(arg, &fi, sizeof(fi)) ? -EFAULT : 0;
+}
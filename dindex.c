@@ -0,0 +1,406 @@
+/*
+ *  fs/sfs/dindex.c
+ *
+ *  In-memory name index of large dirs. Without it a lookup the dcache can
+ *  not answer read and strncmp() every dir blk, and so does unlink. The first
+ *  lookup in a dir with at least SFS_DINDEX_MIN_DIRENTS dirent slots read
+ *  its blks once and build a hash table of name -> (ino, dirent slot), then:
+ *    - lookup is a hash probe, no dir blk is read;
+ *    - create add the new name, unlink/rmdir find the blk of the entry from
+ *      it and take the name out;
+ *    - a shrinker drop idle indexes(least recently used first) under memory
+ *      pressure, the dir is scanned again until its next lookup rebuild it.
+ *  Nothing change on disk, so any image benefit.
+ *
+ *  The indexes of a mount hang off sfs_sb_info, hashed by the dir ino. The
+ *  content of an index is protected by the dir's i_mutex(lookup only read
+ *  it), s_dindex_lock protect the hash, the LRU and the busy counts, so
+ *  the shrinker leave indexes in use alone.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* sb_bread() */
+#include <linux/slab.h>
+#include <linux/shrinker.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>        /* roundup_pow_of_two() */
+
+#include "sfs.h"
+
+/* a name in the index, 16 bytes */
+struct sfs_dindex_ent {
+    char name[SFS_DIRENT_NAME_LEN]; /* as on disk. name[0] == '\0': empty */
+    uint16_t ino;
+    uint16_t pos;   /* dirent slot in the dir: blk idx * per blk + idx */
+};
+
+struct sfs_dindex {
+    struct hlist_node hash;     /* in s_dindex_hash */
+    struct list_head lru;       /* on s_dindex_lru */
+    unsigned long ino;          /* of the dir */
+    int busy;                   /* being used, under s_dindex_lock */
+    unsigned int mask;          /* slots in ents - 1, a power of 2 */
+    unsigned int nr;            /* names in ents */
+    struct sfs_dindex_ent *ents;  /* open addressing, linear probing */
+};
+
+static inline int sfs_dindex_namelen(const char *name) {
+    return strnlen(name, SFS_DIRENT_NAME_LEN);
+}
+
+static inline unsigned int sfs_dindex_home(struct sfs_dindex *di,
+                                           const char *name, int len) {
+    return jhash(name, len, 0) & di->mask;
+}
+
+static struct sfs_dindex_ent *sfs_dindex_alloc_ents(unsigned int slots) {
+    /* the index is only a shortcut, don't try too hard */
+    return kcalloc(slots, sizeof(struct sfs_dindex_ent),
+                   GFP_NOFS | __GFP_NOWARN);
+}
+
+static void sfs_dindex_free(struct sfs_dindex *di) {
+    kfree(di->ents);
+    kfree(di);
+}
+
+/* `name'(`len' chars) in `di', or NULL */
+static struct sfs_dindex_ent *__sfs_dindex_find(struct sfs_dindex *di,
+                                                const char *name, int len) {
+    unsigned int i = sfs_dindex_home(di, name, len);
+    struct sfs_dindex_ent *e;
+
+    /* never full(see sfs_dindex_add()), so an empty slot end the probe */
+    for (;; i = (i + 1) & di->mask) {
+        e = &di->ents[i];
+        if (e->name[0] == '\0')
+            return NULL;
+        if (!strncmp(e->name, name, len) &&
+            (len == SFS_DIRENT_NAME_LEN || e->name[len] == '\0'))
+            return e;
+    }
+}
+
+static void __sfs_dindex_put_ent(struct sfs_dindex *di, const char *name,
+                                 int len, unsigned int ino, unsigned int pos) {
+    unsigned int i = sfs_dindex_home(di, name, len);
+    struct sfs_dindex_ent *e;
+
+    while (di->ents[i].name[0] != '\0')
+        i = (i + 1) & di->mask;
+    e = &di->ents[i];
+    memset(e->name, 0, SFS_DIRENT_NAME_LEN);
+    memcpy(e->name, name, len);
+    e->ino = ino;
+    e->pos = pos;
+    di->nr++;
+}
+
+/*
+ * take `e' out. The names after it that probed past its slot are moved
+ * back, so an empty slot still end every probe(no tombstones)
+ */
+static void __sfs_dindex_del_ent(struct sfs_dindex *di,
+                                 struct sfs_dindex_ent *e) {
+    unsigned int hole = e - di->ents, i = hole, home;
+    struct sfs_dindex_ent *f;
+
+    for (;;) {
+        i = (i + 1) & di->mask;
+        f = &di->ents[i];
+        if (f->name[0] == '\0')
+            break;
+        home = sfs_dindex_home(di, f->name, sfs_dindex_namelen(f->name));
+        /* `f' can fill the hole unless its home is in (hole, i] */
+        if (((i - home) & di->mask) >= ((i - hole) & di->mask)) {
+            di->ents[hole] = *f;
+            hole = i;
+        }
+    }
+    di->ents[hole].name[0] = '\0';
+    di->nr--;
+}
+
+/* rehash into twice as many slots. 0, or -ENOMEM with `di' unchanged */
+static int __sfs_dindex_grow(struct sfs_dindex *di) {
+    struct sfs_dindex_ent *old = di->ents, *e;
+    unsigned int slots = di->mask + 1, i;
+
+    di->ents = sfs_dindex_alloc_ents(slots * 2);
+    if (!di->ents) {
+        di->ents = old;
+        return -ENOMEM;
+    }
+    di->mask = slots * 2 - 1;
+    di->nr = 0;
+    for (i = 0; i < slots; i++) {
+        e = &old[i];
+        if (e->name[0] != '\0')
+            __sfs_dindex_put_ent(di, e->name, sfs_dindex_namelen(e->name),
+                                 e->ino, e->pos);
+    }
+    kfree(old);
+    return 0;
+}
+
+/* index of `dir', with a busy count held. NULL if it has none */
+static struct sfs_dindex *sfs_dindex_get(struct inode *dir) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(dir->i_sb);
+    struct sfs_dindex *di;
+
+    spin_lock(&sbi->s_dindex_lock);
+    hash_for_each_possible(sbi->s_dindex_hash, di, hash, dir->i_ino) {
+        if (di->ino == dir->i_ino) {
+            di->busy++;
+            list_move_tail(&di->lru, &sbi->s_dindex_lru);
+            spin_unlock(&sbi->s_dindex_lock);
+            return di;
+        }
+    }
+    spin_unlock(&sbi->s_dindex_lock);
+    return NULL;
+}
+
+static void sfs_dindex_put(struct sfs_sb_info *sbi, struct sfs_dindex *di) {
+    spin_lock(&sbi->s_dindex_lock);
+    di->busy--;
+    spin_unlock(&sbi->s_dindex_lock);
+}
+
+/* dirent slots of the blks `sii' has */
+static unsigned long sfs_dindex_capacity(struct super_block *sb,
+                                         struct sfs_inode_info *sii) {
+    int i;
+
+    for (i = 0; i < SFS_INO_NDIRECT && sii->directs[i]; i++)
+        ;
+    return i * SFS_DIRENTS_PER_BLK(sb);
+}
+
+/* read the dir blks of `dir' into a new index. NULL on I/O or mem error */
+static struct sfs_dindex *sfs_dindex_build(struct inode *dir) {
+    struct super_block *sb = dir->i_sb;
+    struct sfs_inode_info *sii = SFS_I_INFO(dir);
+    unsigned long per_blk = SFS_DIRENTS_PER_BLK(sb);
+    struct sfs_dir_entry *de;
+    struct buffer_head *bh;
+    struct sfs_dindex *di;
+    unsigned int slots;
+    int i, j;
+
+    di = kzalloc(sizeof(*di), GFP_NOFS);
+    if (!di)
+        return NULL;
+    di->ino = dir->i_ino;
+    INIT_LIST_HEAD(&di->lru);
+
+    /* at most half full, so it rarely grow */
+    slots = roundup_pow_of_two(max_t(unsigned long,
+                               sfs_dindex_capacity(sb, sii) / 2, 64));
+    di->ents = sfs_dindex_alloc_ents(slots);
+    if (!di->ents)
+        goto fail;
+    di->mask = slots - 1;
+
+    for (i = 0; i < SFS_INO_NDIRECT && sii->directs[i]; i++) {
+        bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + sii->directs[i]);
+        if (!bh)
+            goto fail;
+        de = (struct sfs_dir_entry *)bh->b_data;
+        for (j = 0; j < per_blk; j++) {
+            if (de[j].name[0] == '\0')
+                continue;
+            if ((di->nr + 1) * 4 > (di->mask + 1) * 3 &&
+                __sfs_dindex_grow(di)) {
+                brelse(bh);
+                goto fail;
+            }
+            __sfs_dindex_put_ent(di, de[j].name,
+                                 sfs_dindex_namelen(de[j].name),
+                                 de[j].inode_no, i * per_blk + j);
+        }
+        brelse(bh);
+    }
+    return di;
+
+fail:
+    sfs_dindex_free(di);
+    return NULL;
+}
+
+/*
+ * look `name' up in the index of `dir', building it first if `dir' is large
+ * enough to be worth one. 1 if the index answered(*ino is 0 when there is no
+ * such name), 0 if it can't, the caller scan the dir blks then
+ */
+int sfs_dindex_lookup(struct inode *dir, const char *name, int len,
+                      unsigned long *ino) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(dir->i_sb);
+    struct sfs_dindex *di, *other;
+    struct sfs_dindex_ent *e;
+
+    di = sfs_dindex_get(dir);
+    if (!di) {
+        if (sfs_dindex_capacity(dir->i_sb, SFS_I_INFO(dir)) <
+            SFS_DINDEX_MIN_DIRENTS)
+            return 0;
+        di = sfs_dindex_build(dir);
+        if (!di)
+            return 0;
+        di->busy = 1;
+        /* lookups may run in parallel(4.7+), another may have won */
+        spin_lock(&sbi->s_dindex_lock);
+        hash_for_each_possible(sbi->s_dindex_hash, other, hash, dir->i_ino) {
+            if (other->ino == dir->i_ino) {
+                spin_unlock(&sbi->s_dindex_lock);
+                sfs_dindex_free(di);
+                return sfs_dindex_lookup(dir, name, len, ino);
+            }
+        }
+        hash_add(sbi->s_dindex_hash, &di->hash, di->ino);
+        list_add_tail(&di->lru, &sbi->s_dindex_lru);
+        sbi->s_dindex_nr++;
+        spin_unlock(&sbi->s_dindex_lock);
+    }
+
+    *ino = 0;
+    if (len <= SFS_DIRENT_NAME_LEN) {
+        e = __sfs_dindex_find(di, name, len);
+        if (e)
+            *ino = e->ino;
+    }
+    sfs_dindex_put(sbi, di);
+    return 1;
+}
+
+/* take `di' out of the hash and the LRU, s_dindex_lock held */
+static void __sfs_dindex_unhash(struct sfs_sb_info *sbi,
+                                struct sfs_dindex *di) {
+    hash_del(&di->hash);
+    list_del(&di->lru);
+    sbi->s_dindex_nr--;
+}
+
+/* forget the index of `dir', if any: it is going away, or can't be trusted */
+void sfs_dindex_drop(struct inode *dir) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(dir->i_sb);
+    struct sfs_dindex *di;
+
+    spin_lock(&sbi->s_dindex_lock);
+    hash_for_each_possible(sbi->s_dindex_hash, di, hash, dir->i_ino) {
+        if (di->ino == dir->i_ino) {
+            __sfs_dindex_unhash(sbi, di);
+            spin_unlock(&sbi->s_dindex_lock);
+            /* the caller hold i_mutex of `dir', or it is being evicted */
+            sfs_dindex_free(di);
+            return;
+        }
+    }
+    spin_unlock(&sbi->s_dindex_lock);
+}
+
+/* `name' was just written to dirent slot `pos' of `dir' */
+void sfs_dindex_add(struct inode *dir, const char *name, unsigned long ino,
+                    unsigned long pos) {
+    struct sfs_dindex *di = sfs_dindex_get(dir);
+    int err = 0;
+
+    if (!di)
+        return;
+    if ((di->nr + 1) * 4 > (di->mask + 1) * 3)
+        err = __sfs_dindex_grow(di);
+    if (!err)
+        __sfs_dindex_put_ent(di, name, strlen(name), ino, pos);
+    sfs_dindex_put(SFS_S_INFO(dir->i_sb), di);
+    /* missing a name would make lookups wrong */
+    if (err)
+        sfs_dindex_drop(dir);
+}
+
+/*
+ * take `name' out of the index of `dir'. Its dirent slot, -1 if `dir' has no
+ * index or the index doesn't know the name
+ */
+long sfs_dindex_del(struct inode *dir, const char *name, int len) {
+    struct sfs_dindex *di = sfs_dindex_get(dir);
+    struct sfs_dindex_ent *e;
+    long pos = -1;
+
+    if (!di)
+        return -1;
+    e = len <= SFS_DIRENT_NAME_LEN ? __sfs_dindex_find(di, name, len) : NULL;
+    if (e) {
+        pos = e->pos;
+        __sfs_dindex_del_ent(di, e);
+    }
+    sfs_dindex_put(SFS_S_INFO(dir->i_sb), di);
+    return pos;
+}
+
+static unsigned long sfs_dindex_shrink_count(struct shrinker *shrink,
+                                             struct shrink_control *sc) {
+    struct sfs_sb_info *sbi = container_of(shrink, struct sfs_sb_info,
+                                           s_dindex_shrinker);
+    return READ_ONCE(sbi->s_dindex_nr);
+}
+
+/* free the least recently used indexes nobody is using right now */
+static unsigned long sfs_dindex_shrink_scan(struct shrinker *shrink,
+                                            struct shrink_control *sc) {
+    struct sfs_sb_info *sbi = container_of(shrink, struct sfs_sb_info,
+                                           s_dindex_shrinker);
+    struct sfs_dindex *di, *tmp;
+    unsigned long freed = 0;
+    LIST_HEAD(dispose);
+
+    spin_lock(&sbi->s_dindex_lock);
+    list_for_each_entry_safe(di, tmp, &sbi->s_dindex_lru, lru) {
+        if (freed >= sc->nr_to_scan)
+            break;
+        if (di->busy)
+            continue;
+        __sfs_dindex_unhash(sbi, di);
+        list_add(&di->lru, &dispose);
+        freed++;
+    }
+    spin_unlock(&sbi->s_dindex_lock);
+
+    list_for_each_entry_safe(di, tmp, &dispose, lru)
+        sfs_dindex_free(di);
+    return freed;
+}
+
+int sfs_dindex_init(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    spin_lock_init(&sbi->s_dindex_lock);
+    hash_init(sbi->s_dindex_hash);
+    INIT_LIST_HEAD(&sbi->s_dindex_lru);
+    sbi->s_dindex_nr = 0;
+
+    sbi->s_dindex_shrinker.count_objects = sfs_dindex_shrink_count;
+    sbi->s_dindex_shrinker.scan_objects = sfs_dindex_shrink_scan;
+    sbi->s_dindex_shrinker.seeks = DEFAULT_SEEKS;
+    return register_shrinker(&sbi->s_dindex_shrinker);
+}
+
+/* at umount(every dir is evicted, so normally nothing is left) */
+void sfs_dindex_destroy(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_dindex *di, *tmp;
+
+    unregister_shrinker(&sbi->s_dindex_shrinker);
+    list_for_each_entry_safe(di, tmp, &sbi->s_dindex_lru, lru) {
+        __sfs_dindex_unhash(sbi, di);
+        sfs_dindex_free(di);
+    }
+}
@@ -0,0 +1,447 @@
+/*
+ *  fs/sfs/fextent.c
+ *
+ *  An in-memory index of the free extents(runs of clear bits) of the blk
+ *  bitmap, so that the allocator can ask for "N contiguous blks near X" or
+ *  "the smallest run of at least N blks" in O(log n) instead of scanning the
+ *  bitmap bit by bit. It is built at mount from the bitmap, and kept in sync
+ *  by sfs_bmap_change(), the only place the bitmap is changed at. Each free
+ *  extent is in two rbtrees:
+ *    - by start, augmented with the longest extent of each subtree, which
+ *      answer "first run of at least N blks after X";
+ *    - by (length, start), which answer best-fit.
+ *  Both are protected by s_bmap_lock, like the bitmap.
+ *  Should we ever fail to allocate a node the index is dropped, and the
+ *  allocator go back to scanning the bitmap until the next mount.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/sched.h>       /* cond_resched() */
+
+#include "sfs.h"
+
+struct sfs_fext {
+    struct rb_node by_start;    /* in s_fext_by_start */
+    struct rb_node by_len;      /* in s_fext_by_len */
+    unsigned long start;
+    unsigned long len;
+    unsigned long max_len;      /* longest extent in its by_start subtree */
+};
+
+static struct kmem_cache *sfs_fext_cachep;
+
+#define fext_of(node) rb_entry(node, struct sfs_fext, by_start)
+#define fext_of_len(node) rb_entry(node, struct sfs_fext, by_len)
+
+static inline unsigned long fext_max(struct rb_node *node) {
+    return node ? fext_of(node)->max_len : 0;
+}
+
+static unsigned long fext_compute_max(struct sfs_fext *e) {
+    return max3(e->len, fext_max(e->by_start.rb_left),
+                fext_max(e->by_start.rb_right));
+}
+
+/*
+ * the callbacks rb_insert_augmented()/rb_erase_augmented() need to keep
+ * max_len right across rotations. Written out rather than with
+ * RB_DECLARE_CALLBACKS, whose arguments changed in 5.x
+ */
+static void fext_propagate(struct rb_node *rb, struct rb_node *stop) {
+    struct sfs_fext *e;
+    unsigned long max;
+
+    while (rb != stop) {
+        e = fext_of(rb);
+        max = fext_compute_max(e);
+        if (e->max_len == max)
+            break;
+        e->max_len = max;
+        rb = rb_parent(&e->by_start);
+    }
+}
+
+static void fext_copy(struct rb_node *rb_old, struct rb_node *rb_new) {
+    fext_of(rb_new)->max_len = fext_of(rb_old)->max_len;
+}
+
+static void fext_rotate(struct rb_node *rb_old, struct rb_node *rb_new) {
+    fext_of(rb_new)->max_len = fext_of(rb_old)->max_len;
+    fext_of(rb_old)->max_len = fext_compute_max(fext_of(rb_old));
+}
+
+static const struct rb_augment_callbacks fext_callbacks = {
+    .propagate = fext_propagate,
+    .copy = fext_copy,
+    .rotate = fext_rotate,
+};
+
+static void fext_insert_start(struct sfs_sb_info *sbi, struct sfs_fext *e) {
+    struct rb_node **p = &sbi->s_fext_by_start.rb_node, *parent = NULL;
+    struct sfs_fext *f;
+
+    while (*p) {
+        parent = *p;
+        f = fext_of(parent);
+        /* `e' is going to be somewhere under `f' */
+        if (f->max_len < e->len)
+            f->max_len = e->len;
+        p = e->start < f->start ? &parent->rb_left : &parent->rb_right;
+    }
+    e->max_len = e->len;
+    rb_link_node(&e->by_start, parent, p);
+    rb_insert_augmented(&e->by_start, &sbi->s_fext_by_start, &fext_callbacks);
+}
+
+static void fext_insert_len(struct sfs_sb_info *sbi, struct sfs_fext *e) {
+    struct rb_node **p = &sbi->s_fext_by_len.rb_node, *parent = NULL;
+    struct sfs_fext *f;
+
+    while (*p) {
+        parent = *p;
+        f = fext_of_len(parent);
+        if (e->len < f->len || (e->len == f->len && e->start < f->start))
+            p = &parent->rb_left;
+        else
+            p = &parent->rb_right;
+    }
+    rb_link_node(&e->by_len, parent, p);
+    rb_insert_color(&e->by_len, &sbi->s_fext_by_len);
+}
+
+static struct sfs_fext *fext_new(struct sfs_sb_info *sbi, unsigned long start,
+                                 unsigned long len) {
+    struct sfs_fext *e = kmem_cache_alloc(sfs_fext_cachep, GFP_NOFS);
+
+    if (unlikely(!e))
+        return NULL;
+    e->start = start;
+    e->len = len;
+    fext_insert_start(sbi, e);
+    fext_insert_len(sbi, e);
+    sbi->s_fext_nr++;
+    return e;
+}
+
+static void fext_erase(struct sfs_sb_info *sbi, struct sfs_fext *e) {
+    rb_erase_augmented(&e->by_start, &sbi->s_fext_by_start, &fext_callbacks);
+    rb_erase(&e->by_len, &sbi->s_fext_by_len);
+    sbi->s_fext_nr--;
+    kmem_cache_free(sfs_fext_cachep, e);
+}
+
+/*
+ * `e' now cover [start, start + len). It must stay between its neighbours,
+ * so its place in by_start is unchanged and only max_len is fixed up
+ */
+static void fext_update(struct sfs_sb_info *sbi, struct sfs_fext *e,
+                        unsigned long start, unsigned long len) {
+    rb_erase(&e->by_len, &sbi->s_fext_by_len);
+    e->start = start;
+    e->len = len;
+    fext_propagate(&e->by_start, NULL);
+    fext_insert_len(sbi, e);
+}
+
+static struct sfs_fext *fext_next(struct sfs_fext *e) {
+    struct rb_node *node = rb_next(&e->by_start);
+
+    return node ? fext_of(node) : NULL;
+}
+
+/* the extent with the highest start <= `blk', NULL if none */
+static struct sfs_fext *fext_lookup(struct sfs_sb_info *sbi,
+                                    unsigned long blk) {
+    struct rb_node *node = sbi->s_fext_by_start.rb_node;
+    struct sfs_fext *e, *found = NULL;
+
+    while (node) {
+        e = fext_of(node);
+        if (e->start <= blk) {
+            found = e;
+            node = node->rb_right;
+        } else {
+            node = node->rb_left;
+        }
+    }
+    return found;
+}
+
+static void fext_free_all(struct sfs_sb_info *sbi) {
+    struct rb_node *node;
+
+    /* nobody look at max_len any more, plain rb_erase() is enough */
+    while ((node = rb_first(&sbi->s_fext_by_start))) {
+        rb_erase(node, &sbi->s_fext_by_start);
+        kmem_cache_free(sfs_fext_cachep, fext_of(node));
+    }
+    sbi->s_fext_by_len = RB_ROOT;
+    sbi->s_fext_nr = 0;
+}
+
+/* out of memory: stop using the index, the bitmap is still right */
+static void fext_invalidate(struct sfs_sb_info *sbi) {
+    printk(SFS_KERN_LEVEL "%s: no memory for the free extent index, "
+           "scanning the blk bitmap from now on\n", sbi->sb->s_id);
+    sbi->s_fext_valid = 0;
+    fext_free_all(sbi);
+}
+
+/* [start, start + len) was cleared in the bitmap. s_bmap_lock held */
+void __sfs_fext_free(struct super_block *sb, unsigned long start,
+                     unsigned long len) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_fext *e, *next;
+    unsigned long end = start + len;
+
+    if (!sbi->s_fext_valid || !len)
+        return;
+    /* merge with the extent right before, if they touch */
+    e = fext_lookup(sbi, start);
+    if (e && e->start + e->len >= start) {
+        next = fext_next(e);
+        start = e->start;
+        end = max(end, e->start + e->len);
+    } else {
+        next = e ? fext_next(e) : NULL;
+        if (!e && !RB_EMPTY_ROOT(&sbi->s_fext_by_start))
+            next = fext_of(rb_first(&sbi->s_fext_by_start));
+        e = NULL;
+    }
+    /* and with those after it */
+    while (next && next->start <= end) {
+        struct sfs_fext *tmp = fext_next(next);
+
+        end = max(end, next->start + next->len);
+        if (!e)
+            e = next;   /* reuse it, moving its start back keep the order */
+        else
+            fext_erase(sbi, next);
+        next = tmp;
+    }
+    if (e) {
+        fext_update(sbi, e, start, end - start);
+        return;
+    }
+    if (!fext_new(sbi, start, end - start))
+        fext_invalidate(sbi);
+}
+
+/* [start, start + len) was set in the bitmap. s_bmap_lock held */
+void __sfs_fext_use(struct super_block *sb, unsigned long start,
+                    unsigned long len) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long end = start + len, e_end;
+    struct sfs_fext *e, *next;
+
+    if (!sbi->s_fext_valid || !len)
+        return;
+    e = fext_lookup(sbi, start);
+    if (!e)
+        e = RB_EMPTY_ROOT(&sbi->s_fext_by_start) ? NULL :
+            fext_of(rb_first(&sbi->s_fext_by_start));
+    else if (e->start + e->len <= start)
+        e = fext_next(e);
+    /* usually a single extent, trimmed or split */
+    while (e && e->start < end) {
+        next = fext_next(e);
+        e_end = e->start + e->len;
+        if (e->start >= start && e_end <= end) {
+            fext_erase(sbi, e);
+        } else if (e->start < start && e_end > end) {
+            fext_update(sbi, e, e->start, start - e->start);
+            if (!fext_new(sbi, end, e_end - end)) {
+                fext_invalidate(sbi);
+                return;
+            }
+        } else if (e->start < start) {
+            fext_update(sbi, e, e->start, start - e->start);
+        } else {
+            fext_update(sbi, e, end, e_end - end);
+        }
+        e = next;
+    }
+}
+
+/* leftmost extent of at least `want' blks in the by_start subtree `node' */
+static struct sfs_fext *fext_first_fit(struct rb_node *node,
+                                       unsigned long want) {
+    while (node) {
+        if (fext_max(node->rb_left) >= want)
+            node = node->rb_left;
+        else if (fext_of(node)->len >= want)
+            return fext_of(node);
+        else if (fext_max(node->rb_right) >= want)
+            node = node->rb_right;
+        else
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * first extent of at least `want' blks starting after `goal'. Walk from the
+ * first extent after `goal' in order, but skip every subtree whose max_len
+ * is too short, so it is one path up and one path down
+ */
+static struct sfs_fext *fext_fit_after(struct sfs_sb_info *sbi,
+                                       unsigned long goal,
+                                       unsigned long want) {
+    struct rb_node *node = sbi->s_fext_by_start.rb_node, *first = NULL;
+    struct rb_node *parent;
+
+    while (node) {
+        if (fext_of(node)->start > goal) {
+            first = node;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    for (node = first; node; node = parent) {
+        if (fext_of(node)->len >= want)
+            return fext_of(node);
+        if (fext_max(node->rb_right) >= want)
+            return fext_first_fit(node->rb_right, want);
+        /* up to the next extent in order: the first left-child ancestor */
+        while ((parent = rb_parent(node)) && node == parent->rb_right)
+            node = parent;
+    }
+    return NULL;
+}
+
+/*
+ * find `want' free blks near `goal': at `goal' if it is free and the run
+ * is long enough, else the first long enough run after it, wrapping around
+ * at the end. If no run is that long, the longest one. Store the start in
+ * `*start' and the length(<= want, 0 if nothing is free) in `*len'.
+ * -ENOENT if the index is not there, s_bmap_lock held
+ */
+int __sfs_fext_find_near(struct super_block *sb, unsigned long goal,
+                         unsigned long want, unsigned long *start,
+                         unsigned long *len) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_fext *e;
+
+    if (!sbi->s_fext_valid)
+        return -ENOENT;
+    e = fext_lookup(sbi, goal);
+    if (e && e->start + e->len >= goal + want) {
+        *start = goal;
+        *len = want;
+        return 0;
+    }
+    e = fext_fit_after(sbi, goal, want);
+    if (!e)
+        e = fext_first_fit(sbi->s_fext_by_start.rb_node, want);
+    if (!e) {
+        /* nothing long enough, the longest is the last by length */
+        struct rb_node *node = rb_last(&sbi->s_fext_by_len);
+
+        *start = node ? fext_of_len(node)->start : 0;
+        *len = node ? fext_of_len(node)->len : 0;
+        return 0;
+    }
+    *start = e->start;
+    *len = want;
+    return 0;
+}
+
+/*
+ * the smallest free run of at least `want' blks(the lowest one of equal
+ * length), so that large runs are kept for large requests. Like
+ * __sfs_fext_find_near() otherwise
+ */
+int __sfs_fext_find_best(struct super_block *sb, unsigned long want,
+                         unsigned long *start, unsigned long *len) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct rb_node *node = sbi->s_fext_by_len.rb_node;
+    struct sfs_fext *e, *best = NULL;
+
+    if (!sbi->s_fext_valid)
+        return -ENOENT;
+    while (node) {
+        e = fext_of_len(node);
+        if (e->len >= want) {
+            best = e;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    if (!best) {
+        node = rb_last(&sbi->s_fext_by_len);
+        *start = node ? fext_of_len(node)->start : 0;
+        *len = node ? fext_of_len(node)->len : 0;
+        return 0;
+    }
+    *start = best->start;
+    *len = want;
+    return 0;
+}
+
+/* lowest free blk, 0 if none. -ENOENT without the index */
+long __sfs_fext_first(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct rb_node *node;
+
+    if (!sbi->s_fext_valid)
+        return -ENOENT;
+    node = rb_first(&sbi->s_fext_by_start);
+    return node ? fext_of(node)->start : 0;
+}
+
+/*
+ * build the index from the bitmap, at mount(after sfs_rsv_init()). A
+ * failure is not fatal, the allocator then scan the bitmap as before
+ */
+void sfs_fext_init(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long blk = 0, end = sbi->s_blocks_count, used;
+
+    sbi->s_fext_by_start = RB_ROOT;
+    sbi->s_fext_by_len = RB_ROOT;
+    sbi->s_fext_nr = 0;
+    sbi->s_fext_valid = 1;
+
+    mutex_lock(&sbi->s_bmap_lock);
+    while (sbi->s_fext_valid &&
+           (blk = sfs_bmap_find(sb, blk, end, 0)) < end) {
+        used = sfs_bmap_find(sb, blk, end, 1);
+        __sfs_fext_free(sb, blk, used - blk);
+        blk = used;
+        cond_resched();
+    }
+    mutex_unlock(&sbi->s_bmap_lock);
+}
+
+void sfs_fext_destroy(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    mutex_lock(&sbi->s_bmap_lock);
+    sbi->s_fext_valid = 0;
+    fext_free_all(sbi);
+    mutex_unlock(&sbi->s_bmap_lock);
+}
+
+int sfs_fext_cache_init(void) {
+    sfs_fext_cachep = kmem_cache_create("sfs_fext_cache",
+                                        sizeof(struct sfs_fext), 0,
+                                        SLAB_RECLAIM_ACCOUNT, NULL);
+    return sfs_fext_cachep ? 0 : -ENOMEM;
+}
+
+void sfs_fext_cache_exit(void) {
+    kmem_cache_destroy(sfs_fext_cachep);
+}
@@ -0,0 +1,1107 @@
+/*
+ *  fsck.sfs.c
+ *
+ *  Check an unmounted sfs and repair it. The inode bitmap, the blk bitmap,
+ *  the inode records, the directory entries, the refcount table and who own
+ *  which blk are cross-checked against each other: leaked inodes and blks,
+ *  blks claimed twice, dangling or duplicated entries are found and fixed.
+ *
+ *  It is meant to be fast on a large image: all of the metadata except the
+ *  directory blks is read in SFS_FSCK_IO_SIZE chunks by several threads at
+ *  once, and the passes over it are split among the threads too. Directory
+ *  blks are read a tree level at a time, in parallel.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>       /* BLKGETSIZE64 */
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "sfs.h"
+
+#define SFS_FSCK_IO_SIZE (4 << 20)  /* bytes read at a time */
+#define SFS_FSCK_MAX_THREADS 64
+#define SFS_FSCK_REFCNT_MAX 255     /* a refcount table entry is one byte */
+
+/* exit codes, the same as e2fsck's */
+#define FSCK_OK         0
+#define FSCK_FIXED      1   /* errors were found and fixed */
+#define FSCK_UNFIXED    4   /* errors were left(-n, or could not fix) */
+#define FSCK_ERROR      8   /* could not check at all */
+
+/* what pass 1 make of an inode record */
+#define INO_FREE    0   /* free in the bitmap, record zeroed */
+#define INO_GOOD    1   /* a dir or regular file */
+#define INO_BAD     2   /* allocated but garbage, or a stale record */
+#define INO_REACHED 0x10    /* found by the directory walk */
+#define INO_ORPHAN  0x20    /* on the orphan list */
+#define INO_LIVE(s) (((s) & 0xf) == INO_GOOD && ((s) & (INO_REACHED | INO_ORPHAN)))
+
+static int dev_fd;
+static unsigned long bs;
+static struct sfs_sb_info sbi;
+static unsigned long data_start;    /* first blk after the change log */
+static unsigned long nr_ino;        /* inodes whose records are zeroed */
+static int nthreads;
+static int repair = 1;
+static int verbose;
+static int io_failed;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long nr_problems, nr_unfixable;
+
+/* print a problem found. Everything is fixed in memory, written if `repair' */
+static void problem(const char *fmt, ...) {
+    va_list ap;
+
+    pthread_mutex_lock(&report_lock);
+    nr_problems++;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(repair ? ". fixed\n" : "\n");
+    pthread_mutex_unlock(&report_lock);
+}
+
+/* a problem we can not repair */
+static void unfixable(const char *fmt, ...) {
+    va_list ap;
+
+    pthread_mutex_lock(&report_lock);
+    nr_problems++;
+    nr_unfixable++;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(". NOT fixed\n");
+    pthread_mutex_unlock(&report_lock);
+}
+
+void usage() {
+    fprintf(stderr, "\nusage: fsck.sfs [-n] [-v] [-j threads] "
+                    "/path/to/device(or file)\n"
+                    "  -n  only check, do not change anything\n"
+                    "  -v  tell what each pass is doing\n"
+                    "  -j  number of threads. default one per cpu\n"
+                    "  the fs must not be mounted\n\n");
+}
+
+static unsigned long div_round_up(unsigned long n, unsigned long d) {
+    return (n + d - 1) / d;
+}
+
+static int pread_all(char *buf, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len) {
+        n = pread(dev_fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int pwrite_all(const char *buf, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len) {
+        n = pwrite(dev_fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/*========================= threads =========================*/
+
+struct pjob {
+    unsigned long next;     /* next index to hand out */
+    unsigned long n;
+    unsigned long batch;    /* indices taken at a time */
+    void (*fn)(unsigned long i, void *arg);
+    void *arg;
+};
+
+static void *pworker(void *p) {
+    struct pjob *job = p;
+    unsigned long i, end;
+
+    for (;;) {
+        i = __atomic_fetch_add(&job->next, job->batch, __ATOMIC_RELAXED);
+        if (i >= job->n)
+            break;
+        end = i + job->batch < job->n ? i + job->batch : job->n;
+        for (; i < end; i++)
+            job->fn(i, job->arg);
+    }
+    return NULL;
+}
+
+/* call fn(i, arg) for i in [0, n) on all threads, `batch' i at a time */
+static void parallel_for(unsigned long n, unsigned long batch,
+                         void (*fn)(unsigned long, void *), void *arg) {
+    struct pjob job = { 0, n, batch, fn, arg };
+    pthread_t tids[SFS_FSCK_MAX_THREADS];
+    int i, t = 0;
+
+    for (i = 1; i < nthreads && (unsigned long)i * batch < n; i++)
+        if (!pthread_create(&tids[t], NULL, pworker, &job))
+            t++;
+    pworker(&job);
+    for (i = 0; i < t; i++)
+        pthread_join(tids[i], NULL);
+}
+
+/*========================= metadata in memory =========================*/
+
+/* a run of metadata blks, read whole, written back where changed */
+struct region {
+    const char *name;
+    unsigned long start, nblks;
+    char *buf;
+    unsigned char *dirty;   /* one flag per blk */
+};
+
+static struct region ibmap, bbmap, itable, refcnts;
+static struct region *regions[] = { &ibmap, &bbmap, &itable, &refcnts };
+#define NR_REGIONS (sizeof(regions) / sizeof(regions[0]))
+
+/* chunk i of all the regions, in order */
+static void read_chunk(unsigned long i, void *arg) {
+    unsigned long per = SFS_FSCK_IO_SIZE / bs, first, n;
+    unsigned int r;
+
+    for (r = 0; r < NR_REGIONS; r++) {
+        n = div_round_up(regions[r]->nblks, per);
+        if (i < n)
+            break;
+        i -= n;
+    }
+    first = i * per;
+    n = regions[r]->nblks - first < per ? regions[r]->nblks - first : per;
+    if (pread_all(regions[r]->buf + first * bs, n * bs,
+                  (off_t)(regions[r]->start + first) * bs)) {
+        fprintf(stderr, "cannot read %s blks [%lu, +%lu]: %s\n",
+                regions[r]->name, regions[r]->start + first, n,
+                strerror(errno));
+        io_failed = 1;
+    }
+}
+
+static int load_regions(void) {
+    unsigned long per = SFS_FSCK_IO_SIZE / bs, chunks = 0;
+    unsigned int r;
+
+    ibmap = (struct region){ "inode bitmap", sbi.sfs_ino_bitmap, 1 };
+    bbmap = (struct region){ "blk bitmap", sbi.sfs_blk_bitmap,
+                             sbi.s_bmap_blocks };
+    itable = (struct region){ "inode table", sbi.sfs_ino_start,
+                              sbi.s_itable_zeroed };
+    refcnts = (struct region){ "refcount table", sbi.sfs_refcnt_start,
+                               sbi.s_refcnt_blocks };
+    for (r = 0; r < NR_REGIONS; r++) {
+        regions[r]->buf = malloc(regions[r]->nblks * bs);
+        regions[r]->dirty = calloc(regions[r]->nblks, 1);
+        if (!regions[r]->buf || !regions[r]->dirty) {
+            perror("Cannot alloc metadata buffers");
+            return -1;
+        }
+        chunks += div_round_up(regions[r]->nblks, per);
+    }
+    parallel_for(chunks, 1, read_chunk, NULL);
+    return io_failed ? -1 : 0;
+}
+
+/* the byte at `p' inside region `r' changed */
+static void mark_dirty(struct region *r, const void *p) {
+    r->dirty[((const char *)p - r->buf) / bs] = 1;
+}
+
+/* write the changed blks of `r' back, a run of them at a time */
+static int flush_region(struct region *r) {
+    unsigned long i = 0, n, max = SFS_FSCK_IO_SIZE / bs;
+
+    while (i < r->nblks) {
+        if (!r->dirty[i]) {
+            i++;
+            continue;
+        }
+        for (n = 1; i + n < r->nblks && r->dirty[i + n] && n < max; n++)
+            ;
+        if (pwrite_all(r->buf + i * bs, n * bs, (off_t)(r->start + i) * bs)) {
+            fprintf(stderr, "cannot write %s: %s\n", r->name, strerror(errno));
+            return -1;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+static int test_bit(struct region *r, unsigned long nr) {
+    return (r->buf[nr / 8] >> (nr % 8)) & 1;
+}
+
+/* bits of one byte may be changed by different threads, hence atomics */
+static void change_bit(struct region *r, unsigned long nr, int set) {
+    unsigned char *p = (unsigned char *)r->buf + nr / 8, mask = 1 << (nr % 8);
+
+    if (set)
+        __atomic_fetch_or(p, mask, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and(p, (unsigned char)~mask, __ATOMIC_RELAXED);
+    mark_dirty(r, p);
+}
+
+/* records do not straddle blks, the tail of each table blk is unused */
+static struct sfs_inode_info *irec(unsigned long ino) {
+    unsigned long per_blk = SFS_INODES_PER_BLK(bs);
+
+    return (struct sfs_inode_info *)(itable.buf + ino / per_blk * bs) +
+           ino % per_blk;
+}
+
+static int rec_zeroed(struct sfs_inode_info *rec) {
+    static const struct sfs_inode_info zero;
+
+    return !memcmp(rec, &zero, sizeof(zero));
+}
+
+/*========================= pass 1: inode records =========================*/
+
+static unsigned char *ino_state;
+
+static void classify_inode(unsigned long ino, void *arg) {
+    struct sfs_inode_info *rec = irec(ino);
+    int used = test_bit(&ibmap, ino);
+
+    if (!used && rec_zeroed(rec))
+        ino_state[ino] = INO_FREE;
+    else if (S_ISDIR(rec->mode) || S_ISREG(rec->mode))
+        /* a record of a free inode is still good if an entry point at it */
+        ino_state[ino] = INO_GOOD;
+    else
+        ino_state[ino] = INO_BAD;
+}
+
+/*========================= pass 2: directories =========================*/
+
+/* a blk that can hold file data or dir entries */
+static int data_blk(unsigned long blk) {
+    return blk >= data_start && blk < sbi.s_blocks_count;
+}
+
+struct dir_read {
+    unsigned long ino;
+    char *blks;             /* its valid directs, in order */
+    unsigned long nr;
+};
+
+static void read_dir(unsigned long i, void *arg) {
+    struct dir_read *d = (struct dir_read *)arg + i;
+    struct sfs_inode_info *rec = irec(d->ino);
+    unsigned long run;
+    int k, n;
+
+    d->blks = malloc(SFS_INO_NDIRECT * bs);
+    d->nr = 0;
+    if (!d->blks) {
+        io_failed = 1;
+        return;
+    }
+    /* consecutive blks(the usual case) are read with one pread() */
+    for (k = 0; k < SFS_INO_NDIRECT; k += n) {
+        n = 1;
+        if (!data_blk(rec->directs[k]))
+            continue;
+        for (run = 1; k + run < SFS_INO_NDIRECT &&
+                      rec->directs[k + run] == rec->directs[k] + run &&
+                      data_blk(rec->directs[k + run]); run++)
+            ;
+        if (pread_all(d->blks + d->nr * bs, run * bs,
+                      (off_t)rec->directs[k] * bs)) {
+            fprintf(stderr, "cannot read dir [%lu] blk [%u]: %s\n", d->ino,
+                    rec->directs[k], strerror(errno));
+            io_failed = 1;
+            return;
+        }
+        d->nr += run;
+        n = run;
+    }
+}
+
+/* a dir entry to be cleared when writing back */
+struct dirent_fix {
+    unsigned long blk, idx;
+};
+
+static struct dirent_fix *dfixes;
+static unsigned long nr_dfixes, max_dfixes;
+static unsigned char *dir_blk_seen;     /* bitmap: blk already some dir's */
+
+static void add_dirent_fix(unsigned long blk, unsigned long idx) {
+    if (nr_dfixes == max_dfixes) {
+        max_dfixes = max_dfixes ? max_dfixes * 2 : 64;
+        dfixes = realloc(dfixes, max_dfixes * sizeof(*dfixes));
+        if (!dfixes) {
+            perror("Cannot alloc fix list");
+            exit(FSCK_ERROR);
+        }
+    }
+    dfixes[nr_dfixes].blk = blk;
+    dfixes[nr_dfixes].idx = idx;
+    nr_dfixes++;
+}
+
+struct ent {
+    struct sfs_dir_entry *de;
+    unsigned long pos;      /* index among the dir's entries */
+    unsigned long blk, idx;
+    int dup;
+};
+
+static int cmp_ent_name(const void *a, const void *b) {
+    const struct ent *x = a, *y = b;
+    int c = strncmp(x->de->name, y->de->name, SFS_DIRENT_NAME_LEN);
+
+    if (c)
+        return c;
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+static int cmp_ent_pos(const void *a, const void *b) {
+    const struct ent *x = a, *y = b;
+
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/*
+ * check the entries of one dir, in order. Every inode may be linked from
+ * one entry only: sfs has no hard links. Subdirs found go to `next'
+ */
+static void scan_dir(struct dir_read *d, unsigned long **next,
+                     unsigned long *nr_next, unsigned long *max_next) {
+    struct sfs_inode_info *rec = irec(d->ino);
+    unsigned long per = bs / sizeof(struct sfs_dir_entry), b, j, n = 0, ino;
+    struct sfs_dir_entry *de;
+    const char *bad;
+    struct ent *ents;
+    int k;
+
+    /* a dir blk another dir took first is dropped from this one */
+    for (k = 0, b = 0; k < SFS_INO_NDIRECT; k++) {
+        if (!data_blk(rec->directs[k]))
+            continue;
+        if (dir_blk_seen[rec->directs[k] / 8] & (1 << (rec->directs[k] % 8))) {
+            problem("dir [%lu]: blk [%u] belongs to another dir", d->ino,
+                    rec->directs[k]);
+            rec->directs[k] = 0;
+            mark_dirty(&itable, rec);
+            /* the buffer keep it, skip it there by moving the rest down */
+            memmove(d->blks + b * bs, d->blks + (b + 1) * bs,
+                    (d->nr - b - 1) * bs);
+            d->nr--;
+            continue;
+        }
+        dir_blk_seen[rec->directs[k] / 8] |= 1 << (rec->directs[k] % 8);
+        b++;
+    }
+
+    ents = malloc(d->nr * per * sizeof(*ents));
+    if (!ents && d->nr) {
+        perror("Cannot alloc dir entries");
+        exit(FSCK_ERROR);
+    }
+    for (k = 0, b = 0; k < SFS_INO_NDIRECT; k++) {
+        if (!data_blk(rec->directs[k]))
+            continue;
+        de = (struct sfs_dir_entry *)(d->blks + b * bs);
+        for (j = 0; j < per; j++)
+            if (de[j].name[0]) {
+                ents[n].de = &de[j];
+                ents[n].pos = n;
+                ents[n].blk = rec->directs[k];
+                ents[n].idx = j;
+                ents[n].dup = 0;
+                n++;
+            }
+        b++;
+    }
+
+    /* the same name twice: the first one win */
+    qsort(ents, n, sizeof(*ents), cmp_ent_name);
+    for (j = 1; j < n; j++)
+        if (!strncmp(ents[j].de->name, ents[j - 1].de->name,
+                     SFS_DIRENT_NAME_LEN))
+            ents[j].dup = 1;
+    qsort(ents, n, sizeof(*ents), cmp_ent_pos);
+
+    for (j = 0; j < n; j++) {
+        de = ents[j].de;
+        ino = de->inode_no;
+        bad = NULL;
+        if (memchr(de->name, '/', strnlen(de->name, SFS_DIRENT_NAME_LEN)))
+            bad = "bad name";
+        else if (ents[j].dup)
+            bad = "duplicate name";
+        else if (ino == SFS_ROOTINO || ino >= nr_ino ||
+                 (ino_state[ino] & 0xf) != INO_GOOD)
+            bad = "no such inode";
+        else if (ino_state[ino] & INO_REACHED)
+            bad = "inode linked twice";
+        if (bad) {
+            problem("dir [%lu]: entry '%.*s' -> [%lu]: %s", d->ino,
+                    SFS_DIRENT_NAME_LEN, de->name, ino, bad);
+            add_dirent_fix(ents[j].blk, ents[j].idx);
+            continue;
+        }
+        ino_state[ino] |= INO_REACHED;
+        if (!S_ISDIR(irec(ino)->mode))
+            continue;
+        if (*nr_next == *max_next) {
+            *max_next = *max_next ? *max_next * 2 : 64;
+            *next = realloc(*next, *max_next * sizeof(**next));
+            if (!*next) {
+                perror("Cannot alloc dir list");
+                exit(FSCK_ERROR);
+            }
+        }
+        (*next)[(*nr_next)++] = ino;
+    }
+    free(ents);
+}
+
+/* walk the tree from the root, a level at a time */
+static int walk_tree(void) {
+    unsigned long *level, *next = NULL, nr_level = 1, nr_next = 0;
+    unsigned long max_next = 0, i, depth = 0;
+    struct dir_read *reads;
+
+    dir_blk_seen = calloc(div_round_up(sbi.s_blocks_count, 8), 1);
+    level = malloc(sizeof(*level));
+    if (!dir_blk_seen || !level) {
+        perror("Cannot alloc");
+        return -1;
+    }
+    level[0] = SFS_ROOTINO;
+    ino_state[SFS_ROOTINO] |= INO_REACHED;
+
+    while (nr_level) {
+        reads = calloc(nr_level, sizeof(*reads));
+        if (!reads) {
+            perror("Cannot alloc");
+            return -1;
+        }
+        for (i = 0; i < nr_level; i++)
+            reads[i].ino = level[i];
+        parallel_for(nr_level, 1, read_dir, reads);
+        if (io_failed)
+            return -1;
+        /* in order, so which of two entries win does not depend on timing */
+        for (i = 0; i < nr_level; i++) {
+            scan_dir(&reads[i], &next, &nr_next, &max_next);
+            free(reads[i].blks);
+        }
+        free(reads);
+        free(level);
+        level = next;
+        nr_level = nr_next;
+        next = NULL;
+        nr_next = max_next = 0;
+        depth++;
+    }
+    free(level);
+    free(dir_blk_seen);
+    if (verbose)
+        printf("directory tree is [%lu] levels deep\n", depth);
+    return 0;
+}
+
+/*
+ * the orphan list: inodes unlinked while open, freed by the kernel at the
+ * next mount(see orphan.c). They are live until then. The list is cut where
+ * it stop making sense
+ */
+static void check_orphans(void) {
+    unsigned long ino = sbi.s_last_orphan, prev = 0, n = 0;
+    const char *bad;
+
+    while (ino) {
+        bad = NULL;
+        if (ino >= nr_ino || (ino_state[ino] & 0xf) != INO_GOOD ||
+            !test_bit(&ibmap, ino))
+            bad = "not an allocated inode";
+        else if (ino_state[ino] & INO_REACHED)
+            bad = "still linked from a dir";
+        else if (ino_state[ino] & INO_ORPHAN || n++ >= nr_ino)
+            bad = "loop";
+        if (bad) {
+            problem("orphan list: [%lu]: %s, list cut", ino, bad);
+            if (prev) {
+                irec(prev)->i_next_orphan = 0;
+                mark_dirty(&itable, irec(prev));
+            } else {
+                sbi.s_last_orphan = 0;
+            }
+            break;
+        }
+        ino_state[ino] |= INO_ORPHAN;
+        prev = ino;
+        ino = irec(ino)->i_next_orphan;
+    }
+    if (verbose)
+        printf("[%lu] inodes on the orphan list\n", n);
+}
+
+/*========================= pass 3: fix records, count owners ============*/
+
+static uint16_t *owners;    /* live inodes pointing at each blk */
+static unsigned long nr_live;
+
+static void own(unsigned long blk) {
+    uint16_t o = __atomic_load_n(&owners[blk], __ATOMIC_RELAXED);
+
+    while (o < UINT16_MAX &&
+           !__atomic_compare_exchange_n(&owners[blk], &o, o + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void fix_inode(unsigned long ino, void *arg) {
+    struct sfs_inode_info *rec = irec(ino), old = *rec;
+    unsigned long max_size = bs * SFS_INO_NDIRECT;
+    unsigned int directs[SFS_INO_NDIRECT];
+    int k, n, live = INO_LIVE(ino_state[ino]);
+
+    if (!live) {
+        if (test_bit(&ibmap, ino)) {
+            problem("inode [%lu]: %s", ino,
+                    (ino_state[ino] & 0xf) == INO_BAD ? "bad record"
+                                                      : "not linked anywhere");
+            change_bit(&ibmap, ino, 0);
+        } else if (!rec_zeroed(rec)) {
+            problem("inode [%lu]: stale record of a free inode", ino);
+        }
+        if (!rec_zeroed(rec)) {
+            memset(rec, 0, sizeof(*rec));
+            mark_dirty(&itable, rec);
+        }
+        return;
+    }
+
+    __atomic_fetch_add(&nr_live, 1, __ATOMIC_RELAXED);
+    if (!test_bit(&ibmap, ino)) {
+        problem("inode [%lu]: in use but free in the inode bitmap", ino);
+        change_bit(&ibmap, ino, 1);
+    }
+    if (rec->inode_no != ino || rec->slot_nr != ino) {
+        problem("inode [%lu]: record say it is [%lu]", ino, rec->inode_no);
+        rec->inode_no = rec->slot_nr = ino;
+    }
+    for (k = 0; k < SFS_INO_NDIRECT; k++)
+        if (rec->directs[k] && !data_blk(rec->directs[k])) {
+            problem("inode [%lu]: blk [%u] out of the data area", ino,
+                    rec->directs[k]);
+            rec->directs[k] = 0;
+        }
+    if (rec->indirect) {
+        problem("inode [%lu]: indirect blk set, sfs has none", ino);
+        rec->indirect = 0;
+    }
+    if (rec->i_flags & ~SFS_COMPR_FL || (S_ISDIR(rec->mode) && rec->i_cmap) ||
+        rec->i_cmap >> div_round_up(SFS_INO_NDIRECT, SFS_COMPR_CLUSTER_BLKS)) {
+        problem("inode [%lu]: bad flags [0x%x] or cluster map [0x%x]", ino,
+                rec->i_flags, rec->i_cmap);
+        rec->i_flags &= SFS_COMPR_FL;
+        rec->i_cmap &= (1 << div_round_up(SFS_INO_NDIRECT,
+                                          SFS_COMPR_CLUSTER_BLKS)) - 1;
+        if (S_ISDIR(rec->mode))
+            rec->i_cmap = 0;
+    }
+    if (rec->file_size > max_size) {
+        problem("inode [%lu]: size [%lu] past [%lu]", ino, rec->file_size,
+                max_size);
+        rec->file_size = max_size;
+    }
+    if (S_ISDIR(rec->mode)) {
+        /* the kernel stop at the first 0 direct of a dir */
+        for (k = 0, n = 0; k < SFS_INO_NDIRECT; k++)
+            if (rec->directs[k])
+                directs[n++] = rec->directs[k];
+        memset(directs + n, 0, (SFS_INO_NDIRECT - n) * sizeof(directs[0]));
+        if (memcmp(directs, rec->directs, sizeof(directs))) {
+            problem("dir [%lu]: hole among its blks", ino);
+            memcpy(rec->directs, directs, sizeof(directs));
+        }
+    }
+    if (memcmp(&old, rec, sizeof(old)))
+        mark_dirty(&itable, rec);
+
+    for (k = 0; k < SFS_INO_NDIRECT; k++)
+        if (rec->directs[k])
+            own(rec->directs[k]);
+}
+
+/* inode nrs past the zeroed part of the table can not be in use yet */
+static void check_ino_tail(void) {
+    unsigned long ino;
+
+    for (ino = nr_ino; ino < sbi.s_inodes_count; ino++)
+        if (test_bit(&ibmap, ino)) {
+            problem("inode [%lu]: allocated past the zeroed inode table", ino);
+            change_bit(&ibmap, ino, 0);
+        }
+}
+
+/*========================= pass 4: shared blks =========================*/
+
+struct claim {
+    unsigned long blk, ino;
+    int slot;
+};
+
+static struct claim *claims;
+static unsigned long nr_claims, max_claims;
+static pthread_mutex_t claims_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long alloc_next;
+
+static void collect_claims(unsigned long ino, void *arg) {
+    struct sfs_inode_info *rec = irec(ino);
+    int k;
+
+    if (!INO_LIVE(ino_state[ino]))
+        return;
+    for (k = 0; k < SFS_INO_NDIRECT; k++) {
+        if (!rec->directs[k] || owners[rec->directs[k]] < 2)
+            continue;
+        pthread_mutex_lock(&claims_lock);
+        if (nr_claims == max_claims) {
+            max_claims = max_claims ? max_claims * 2 : 64;
+            claims = realloc(claims, max_claims * sizeof(*claims));
+            if (!claims) {
+                perror("Cannot alloc claim list");
+                exit(FSCK_ERROR);
+            }
+        }
+        claims[nr_claims++] = (struct claim){ rec->directs[k], ino, k };
+        pthread_mutex_unlock(&claims_lock);
+    }
+}
+
+static int cmp_claim(const void *a, const void *b) {
+    const struct claim *x = a, *y = b;
+
+    if (x->blk != y->blk)
+        return x->blk < y->blk ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return x->slot - y->slot;
+}
+
+/* give slot `c->slot' of `c->ino' a copy of its blk of its own */
+static void clone_blk(struct claim *c, char *buf) {
+    struct sfs_inode_info *rec = irec(c->ino);
+    unsigned long blk;
+
+    for (blk = alloc_next; blk < sbi.s_blocks_count && owners[blk]; blk++)
+        ;
+    alloc_next = blk + 1;
+    if (blk >= sbi.s_blocks_count) {
+        unfixable("inode [%lu]: no free blk to copy blk [%lu] to", c->ino,
+                  c->blk);
+        return;
+    }
+    if (repair && (pread_all(buf, bs, (off_t)c->blk * bs) ||
+                   pwrite_all(buf, bs, (off_t)blk * bs))) {
+        unfixable("inode [%lu]: cannot copy blk [%lu]: %s", c->ino, c->blk,
+                  strerror(errno));
+        return;
+    }
+    owners[blk] = 1;
+    owners[c->blk]--;
+    rec->directs[c->slot] = blk;
+    mark_dirty(&itable, rec);
+}
+
+/*
+ * a blk more than one inode point at. Regular files may share blks through
+ * reflink if the refcount table say so. Otherwise it is a double allocation
+ * and every owner but one get a copy. A dir always keep the blk
+ */
+static void resolve_shared(void) {
+    unsigned long i, j, k, keep;
+    char *buf;
+    int shared;
+
+    parallel_for(nr_ino, 256, collect_claims, NULL);
+    if (!nr_claims)
+        return;
+    qsort(claims, nr_claims, sizeof(*claims), cmp_claim);
+    buf = malloc(bs);
+    if (!buf) {
+        perror("Cannot alloc");
+        exit(FSCK_ERROR);
+    }
+    alloc_next = data_start;
+    for (i = 0; i < nr_claims; i = j) {
+        for (j = i + 1; j < nr_claims && claims[j].blk == claims[i].blk; j++)
+            ;
+        keep = i;
+        shared = ((unsigned char *)refcnts.buf)[claims[i].blk] != 0;
+        for (k = i; k < j; k++)
+            if (S_ISDIR(irec(claims[k].ino)->mode)) {
+                keep = k;
+                shared = 0;
+                break;
+            }
+        if (shared) {
+            /* beyond what the one byte refcount can count, copy */
+            for (k = i + SFS_FSCK_REFCNT_MAX + 1; k < j; k++)
+                clone_blk(&claims[k], buf);
+            continue;
+        }
+        problem("blk [%lu]: claimed by [%lu] inodes, kept by [%lu]",
+                claims[i].blk, j - i, claims[keep].ino);
+        for (k = i; k < j; k++)
+            if (k != keep)
+                clone_blk(&claims[k], buf);
+    }
+    free(buf);
+    free(claims);
+}
+
+/*========================= pass 5: blk bitmap, refcounts ================*/
+
+#define BMAP_BATCH (1UL << 16)  /* blks checked at a time, a multiple of 8 */
+
+static unsigned long nr_used, nr_unmarked, nr_leaked, nr_bad_refcnt;
+
+static void check_blks(unsigned long i, void *arg) {
+    unsigned long blk = i * BMAP_BATCH, end = blk + BMAP_BATCH;
+    unsigned long max = sbi.s_bmap_blocks * bs * 8;
+    unsigned long used = 0, unmarked = 0, leaked = 0, bad_refcnt = 0;
+    unsigned char *rc;
+    int want, have, want_rc;
+
+    if (end > max)
+        end = max;
+    for (; blk < end; blk++) {
+        want = blk < sbi.s_blocks_count && (blk < data_start || owners[blk]);
+        have = test_bit(&bbmap, blk);
+        used += want;
+        if (want && !have)
+            unmarked++;
+        if (!want && have)
+            leaked++;
+        if (want != have)
+            change_bit(&bbmap, blk, want);
+        if (blk >= sbi.s_blocks_count)
+            continue;
+        rc = (unsigned char *)refcnts.buf + blk;
+        want_rc = owners[blk] > 1 ? owners[blk] - 1 : 0;
+        if (want_rc > SFS_FSCK_REFCNT_MAX)
+            want_rc = SFS_FSCK_REFCNT_MAX;
+        if (*rc != want_rc) {
+            bad_refcnt++;
+            *rc = want_rc;
+            mark_dirty(&refcnts, rc);
+        }
+    }
+    __atomic_fetch_add(&nr_used, used, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&nr_unmarked, unmarked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&nr_leaked, leaked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&nr_bad_refcnt, bad_refcnt, __ATOMIC_RELAXED);
+}
+
+/*========================= write back =========================*/
+
+static int apply_dirent_fixes(void) {
+    struct sfs_dir_entry *de;
+    unsigned long i, cur = 0;
+    char *buf = malloc(bs);
+
+    if (!buf)
+        return -1;
+    /* the fixes of one blk are next to each other */
+    for (i = 0; i < nr_dfixes; i++) {
+        if (dfixes[i].blk != cur) {
+            if (cur && pwrite_all(buf, bs, (off_t)cur * bs))
+                goto fail;
+            cur = dfixes[i].blk;
+            if (pread_all(buf, bs, (off_t)cur * bs))
+                goto fail;
+        }
+        de = (struct sfs_dir_entry *)buf + dfixes[i].idx;
+        memset(de, 0, sizeof(*de));
+    }
+    if (cur && pwrite_all(buf, bs, (off_t)cur * bs))
+        goto fail;
+    free(buf);
+    return 0;
+
+fail:
+    fprintf(stderr, "cannot fix dir blk [%lu]: %s\n", cur, strerror(errno));
+    free(buf);
+    return -1;
+}
+
+static int write_super(void) {
+    char *buf = calloc(1, bs);
+    int ret;
+
+    if (!buf)
+        return -1;
+    memcpy(buf, &sbi, sizeof(sbi));
+    ret = pwrite_all(buf, bs, (off_t)SFS_SB_START_NR * bs);
+    free(buf);
+    return ret;
+}
+
+/*========================= main =========================*/
+
+/* find the super block: blk 1, at whatever blk size it was made with */
+static int load_super(void) {
+    struct sfs_sb_info *dsbi;
+    unsigned long try;
+    char buf[sizeof(struct sfs_sb_info)];
+
+    for (try = SFS_MIN_BLK_SIZE; try <= SFS_MAX_BLK_SIZE; try <<= 1) {
+        if (pread_all(buf, sizeof(buf), (off_t)try * SFS_SB_START_NR))
+            break;
+        dsbi = (struct sfs_sb_info *)buf;
+        if (dsbi->magic == SFS_MAGIC_NUMBER && dsbi->blk_size == try) {
+            memcpy(&sbi, dsbi, sizeof(sbi));
+            return 0;
+        }
+    }
+    fprintf(stderr, "no sfs super block found\n");
+    return -1;
+}
+
+/* what fsck can not work without. The same checks as sfs_fill_sb() */
+static int check_super(uint64_t dev_size) {
+    if (sbi.version != SFS_VERSION) {
+        fprintf(stderr, "version [%lu], we know [%d]\n", sbi.version,
+                SFS_VERSION);
+        return -1;
+    }
+    if (!sbi.s_blocks_count || sbi.s_blocks_count > UINT32_MAX ||
+        sbi.s_blocks_count > sbi.s_bmap_blocks * sbi.blk_size * 8 ||
+        sbi.sfs_blk_bitmap + sbi.s_bmap_blocks > sbi.s_blocks_count ||
+        sbi.s_blocks_count > dev_size / sbi.blk_size ||
+        !sbi.s_inodes_count || sbi.s_inodes_count > sbi.blk_size * 8 ||
+        sbi.s_inodes_count > SFS_MAX_INODES ||
+        sbi.s_inodes_count > sbi.s_itable_blocks *
+                             SFS_INODES_PER_BLK(sbi.blk_size) ||
+        !sbi.s_itable_zeroed || sbi.s_itable_zeroed > sbi.s_itable_blocks ||
+        sbi.sfs_ino_start + sbi.s_itable_blocks > sbi.s_blocks_count ||
+        sbi.s_refcnt_blocks * sbi.blk_size < sbi.s_blocks_count ||
+        (sbi.s_chlog_blocks && sbi.s_chlog_start !=
+            sbi.sfs_refcnt_start + sbi.s_refcnt_blocks) ||
+        SFS_DATA_START(&sbi) > sbi.s_blocks_count) {
+        fprintf(stderr, "bad geometry in the super block: blocks[%lu] "
+                        "inodes[%lu]\n", sbi.s_blocks_count, sbi.s_inodes_count);
+        return -1;
+    }
+    return 0;
+}
+
+static double elapsed(struct timespec *t0) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - t0->tv_sec) + (t.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long free_blocks, free_inodes, per_blk;
+    uint64_t dev_size = 0;
+    struct timespec t0;
+    struct stat st;
+    unsigned int r;
+    int opt, was_clean, err = 0;
+    char *end;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "nvj:")) != -1) {
+        switch (opt) {
+        case 'n':
+            repair = 0;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'j':
+            nthreads = strtol(optarg, &end, 0);
+            if (*end != '\0' || nthreads < 1) {
+                fprintf(stderr, "invalid number of threads: %s\n", optarg);
+                usage();
+                return FSCK_ERROR;
+            }
+            break;
+        default:
+            usage();
+            return FSCK_ERROR;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return FSCK_ERROR;
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > SFS_FSCK_MAX_THREADS)
+        nthreads = SFS_FSCK_MAX_THREADS;
+
+    /* O_EXCL on a block device fail if it is mounted */
+    dev_fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+    if (dev_fd < 0 || fstat(dev_fd, &st)) {
+        perror("Cannot open file");
+        return FSCK_ERROR;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        close(dev_fd);
+        dev_fd = open(argv[optind], (repair ? O_RDWR : O_RDONLY) | O_EXCL);
+        if (dev_fd < 0 || ioctl(dev_fd, BLKGETSIZE64, &dev_size)) {
+            perror("Cannot open device(mounted?)");
+            return FSCK_ERROR;
+        }
+    } else {
+        dev_size = st.st_size;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (load_super() || check_super(dev_size))
+        return FSCK_ERROR;
+    bs = sbi.blk_size;
+    data_start = SFS_DATA_START(&sbi);
+    per_blk = SFS_INODES_PER_BLK(bs);
+    nr_ino = sbi.s_itable_zeroed * per_blk;
+    if (nr_ino > sbi.s_inodes_count)
+        nr_ino = sbi.s_inodes_count;
+    was_clean = sbi.s_state & SFS_STATE_CLEAN;
+    if (verbose)
+        printf("blk size [%lu], [%lu] blks, [%lu] inodes, [%d] threads, %s\n",
+               bs, sbi.s_blocks_count, sbi.s_inodes_count, nthreads,
+               was_clean ? "clean" : "not cleanly umounted");
+
+    if (load_regions())
+        return FSCK_ERROR;
+    if (verbose)
+        printf("pass 0: metadata read in %.3fs\n", elapsed(&t0));
+
+    ino_state = calloc(nr_ino, 1);
+    owners = calloc(sbi.s_blocks_count, sizeof(*owners));
+    if (!ino_state || !owners) {
+        perror("Cannot alloc");
+        return FSCK_ERROR;
+    }
+    parallel_for(nr_ino, 256, classify_inode, NULL);
+    if ((ino_state[SFS_ROOTINO] & 0xf) != INO_GOOD ||
+        !S_ISDIR(irec(SFS_ROOTINO)->mode)) {
+        unfixable("root inode is not a directory");
+        return FSCK_UNFIXED;
+    }
+    if (verbose)
+        printf("pass 1: inode records classified at %.3fs\n", elapsed(&t0));
+
+    if (walk_tree())
+        return FSCK_ERROR;
+    check_orphans();
+    if (verbose)
+        printf("pass 2: directory tree walked at %.3fs\n", elapsed(&t0));
+
+    parallel_for(nr_ino, 256, fix_inode, NULL);
+    check_ino_tail();
+    if (verbose)
+        printf("pass 3: inodes checked at %.3fs\n", elapsed(&t0));
+
+    resolve_shared();
+    if (verbose)
+        printf("pass 4: shared blks checked at %.3fs\n", elapsed(&t0));
+
+    parallel_for(div_round_up(sbi.s_bmap_blocks * bs * 8, BMAP_BATCH), 1,
+                 check_blks, NULL);
+    if (nr_unmarked)
+        problem("[%lu] blks in use but free in the blk bitmap", nr_unmarked);
+    if (nr_leaked)
+        problem("[%lu] blks marked used but owned by nobody", nr_leaked);
+    if (nr_bad_refcnt)
+        problem("[%lu] wrong refcount table entries", nr_bad_refcnt);
+    if (verbose)
+        printf("pass 5: blk bitmap and refcounts checked at %.3fs\n",
+               elapsed(&t0));
+
+    free_blocks = sbi.s_blocks_count - nr_used;
+    free_inodes = sbi.s_inodes_count - nr_live;
+    /* the counts on disk are only kept up to date by a clean umount */
+    if (was_clean && (sbi.s_free_blocks != free_blocks ||
+                      sbi.s_free_inodes != free_inodes))
+        problem("free counts [%lu] blks [%lu] inodes, should be [%lu] [%lu]",
+                sbi.s_free_blocks, sbi.s_free_inodes, free_blocks,
+                free_inodes);
+    sbi.s_free_blocks = free_blocks;
+    sbi.s_free_inodes = free_inodes;
+
+    if (repair && (nr_problems || !was_clean)) {
+        err = apply_dirent_fixes();
+        for (r = 0; r < NR_REGIONS && !err; r++)
+            err = flush_region(regions[r]);
+        /* counts are exact now, the kernel need not recount at mount */
+        if (!err && !nr_unfixable)
+            sbi.s_state |= SFS_STATE_CLEAN;
+        /*
+         * neither the repairs nor what the crash cut short made it into the
+         * change log, have the kernel tell its readers(see chlog.c)
+         */
+        if (sbi.s_chlog_blocks)
+            sbi.s_state |= SFS_STATE_CHLOG_GAP;
+        if (!err)
+            err = write_super();
+        if (!err && fsync(dev_fd))
+            err = -1;
+        if (err) {
+            fprintf(stderr, "FAIL writing the repairs: %s\n", strerror(errno));
+            return FSCK_ERROR;
+        }
+    }
+    close(dev_fd);
+
+    printf("%s: [%lu] problems%s, [%lu/%lu] inodes, [%lu/%lu] blks used, "
+           "%.3fs\n", argv[optind], nr_problems,
+           !nr_problems ? "" : repair && !nr_unfixable ? " fixed" : " left",
+           nr_live, sbi.s_inodes_count, nr_used, sbi.s_blocks_count,
+           elapsed(&t0));
+    if (!nr_problems)
+        return FSCK_OK;
+    return repair && !nr_unfixable ? FSCK_FIXED : FSCK_UNFIXED;
+}
@@ -0,0 +1,170 @@
+/*
+ *  fs/sfs/ioctl.c
+ *
+ *  ioctl()s understood by sfs files and dirs.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/file.h>     /* fdget() */
+#include <linux/mount.h>    /* mnt_want_write_file() */
+#include <linux/version.h>
+#include <asm/uaccess.h>
+
+#include "sfs.h"
+
+/* sfs i_flags <-> the generic FS_*_FL used by chattr/lsattr */
+static unsigned int sfs_flags_to_fs(uint16_t flags) {
+    return (flags & SFS_COMPR_FL) ? FS_COMPR_FL : 0;
+}
+
+static uint16_t sfs_flags_from_fs(unsigned int flags) {
+    return (flags & FS_COMPR_FL) ? SFS_COMPR_FL : 0;
+}
+
+/*
+ * chattr +c on a dir only affect files created under it later. On a regular
+ * file the flag can only be flipped while the file is empty, so that a file
+ * is either read/written entirely through compression.c or not at all.
+ */
+static int sfs_ioc_setflags(struct file *filp, unsigned int __user *arg) {
+    struct inode *inode = file_inode(filp);
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    unsigned int flags;
+    uint16_t nflags;
+    int err = 0;
+
+    if (!inode_owner_or_capable(inode))
+        return -EACCES;
+    if (get_user(flags, arg))
+        return -EFAULT;
+    if (flags & ~FS_COMPR_FL)
+        return -EOPNOTSUPP;
+    nflags = sfs_flags_from_fs(flags);
+
+    /* a read-only bind mount too, not only a read-only sb */
+    err = mnt_want_write_file(filp);
+    if (err)
+        return err;
+    mutex_lock(&inode->i_mutex);
+    if (nflags == sii->i_flags)
+        goto out;
+    if (S_ISREG(inode->i_mode) && sii->file_size) {
+        SFSD(SFS_KERN_LEVEL "can only change compression of an empty file\n");
+        err = -EINVAL;
+        goto out;
+    }
+    sii->i_flags = nflags;
+    inode->i_ctime = CURRENT_TIME;
+    err = sfs_update_inode(inode);
+out:
+    mutex_unlock(&inode->i_mutex);
+    mnt_drop_write_file(filp);
+    return err;
+}
+
+/* FITRIM: discard free blks, see sfs_trim_fs() */
+static int sfs_ioc_fitrim(struct file *filp, struct fstrim_range __user *arg) {
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct fstrim_range range;
+    int err;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (copy_from_user(&range, arg, sizeof(range)))
+        return -EFAULT;
+    err = sfs_trim_fs(sb, &range);
+    if (err)
+        return err;
+    if (copy_to_user(arg, &range, sizeof(range)))
+        return -EFAULT;
+    return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+/*
+ * before 4.5 the VFS know nothing about reflink, so we take the ioctls
+ * ourselves. Same numbers and layout as <linux/fs.h> of newer kernels
+ */
+#ifndef FICLONE
+struct file_clone_range {
+    __s64 src_fd;
+    __u64 src_offset;
+    __u64 src_length;
+    __u64 dest_offset;
+};
+#define FICLONE         _IOW(0x94, 9, int)
+#define FICLONERANGE    _IOW(0x94, 13, struct file_clone_range)
+#endif
+
+static long sfs_ioc_clone(struct file *dst_file, int srcfd, u64 off,
+                          u64 len, u64 destoff) {
+    struct fd src = fdget(srcfd);
+    long ret;
+
+    if (!src.file)
+        return -EBADF;
+    ret = -EXDEV;
+    if (src.file->f_path.mnt != dst_file->f_path.mnt)
+        goto out;
+    ret = -EBADF;
+    if (!(src.file->f_mode & FMODE_READ) ||
+        !(dst_file->f_mode & FMODE_WRITE) || (dst_file->f_flags & O_APPEND))
+        goto out;
+    ret = sfs_clone_range(src.file, off, dst_file, destoff, len);
+    if (ret > 0)
+        ret = 0;
+out:
+    fdput(src);
+    return ret;
+}
+#endif
+
+long sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct sfs_inode_info *sii = SFS_I_INFO(file_inode(filp));
+
+    switch (cmd) {
+    case FS_IOC_GETFLAGS:
+        return put_user(sfs_flags_to_fs(sii->i_flags),
+                        (unsigned int __user *)arg);
+    case FS_IOC_SETFLAGS:
+        return sfs_ioc_setflags(filp, (unsigned int __user *)arg);
+    case FITRIM:
+        return sfs_ioc_fitrim(filp, (struct fstrim_range __user *)arg);
+    case SFS_IOC_GETFRAG: {
+        struct sfs_frag_info fi;
+
+        sfs_frag_info(sii, &fi);
+        return copy_to_user((void __user *)arg, &fi, sizeof(fi)) ? -EFAULT : 0;
+    }
+    case SFS_IOC_DEFRAG:
+        return sfs_ioc_defrag(filp, (struct sfs_frag_info __user *)arg);
+    case SFS_IOC_GROW:
+        return sfs_ioc_grow(filp, (struct sfs_grow_info __user *)arg);
+    case SFS_IOC_GETRSTAT:
+        return sfs_ioc_getrstat(filp, (struct sfs_rstat_info __user *)arg);
+    case SFS_IOC_GETCHANGES:
+        return sfs_ioc_getchanges(filp, (struct sfs_chlog_req __user *)arg);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+    case FICLONE:
+        return sfs_ioc_clone(filp, arg, 0, 0, 0);
+    case FICLONERANGE: {
+        struct file_clone_range args;
+
+        if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
+            return -EFAULT;
+        return sfs_ioc_clone(filp, args.src_fd, args.src_offset,
+                             args.src_length, args.dest_offset);
+    }
+#endif
+    default:
+        return -ENOTTY;
+    }
+}
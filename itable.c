@@ -0,0 +1,184 @@
+/*
+ *  fs/sfs/itable.c
+ *
+ *  The inode table: finding the record of an inode, and zeroing the table
+ *  lazily. mkfs.sfs only write the first table blk(the root's), the rest is
+ *  zeroed here in the background after mount, a batch at a time, so making
+ *  a large sfs does not have to write the whole table up front.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* struct buffer_head, sb_bread() */
+#include <linux/workqueue.h>
+
+#include "sfs.h"
+
+/*
+ * read the table blk holding the record of `ino' and point `rec' at it. The
+ * caller brelse() the returned buffer. NULL on failure
+ */
+struct buffer_head *sfs_inode_blk(struct super_block *sb, unsigned long ino,
+                                  struct sfs_inode_info **rec) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long per_blk = SFS_INODES_PER_BLK(sb->s_blocksize);
+    struct buffer_head *bh;
+
+    if (ino >= sbi->s_inodes_count) {
+        printk(SFS_KERN_LEVEL "bad inode nr: [%lu]\n", ino);
+        return NULL;
+    }
+    bh = sb_bread(sb, sbi->sfs_ino_start + ino / per_blk);
+    if (unlikely(!bh)) {
+        SFSD(SFS_KERN_LEVEL "FAIL sb_bread() inode table !!\n");
+        return NULL;
+    }
+    *rec = (struct sfs_inode_info *)bh->b_data + ino % per_blk;
+    return bh;
+}
+
+/*
+ * number of inodes whose records lie in the zeroed part of the table. Only
+ * these may be handed out or read, the others may hold garbage on disk
+ */
+unsigned long sfs_itable_inodes(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long zeroed = sbi->s_itable_zeroed;
+
+    smp_rmb();  /* pair with smp_wmb() in __sfs_itable_zero() */
+    return min_t(unsigned long, sbi->s_inodes_count,
+                 zeroed * SFS_INODES_PER_BLK(sb->s_blocksize));
+}
+
+/*
+ * zero the next(at most SFS_ITABLE_INIT_BATCH) table blks that are not yet,
+ * wait for them to hit the disk, then move s_itable_zeroed past them. The
+ * writes are all issued before waiting on any, so the device see one large
+ * run. Under s_itable_lock. Return the number of blks zeroed, <0 on error
+ */
+static long __sfs_itable_zero(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct buffer_head *bhs[SFS_ITABLE_INIT_BATCH];
+    unsigned long start = sbi->s_itable_zeroed, nr, i;
+    int err = 0;
+
+    nr = min_t(unsigned long, SFS_ITABLE_INIT_BATCH,
+               sbi->s_itable_blocks - start);
+    for (i = 0; i < nr; i++) {
+        bhs[i] = sb_getblk(sb, sbi->sfs_ino_start + start + i);
+        if (unlikely(!bhs[i])) {
+            err = -ENOMEM;
+            break;
+        }
+        lock_buffer(bhs[i]);
+        memset(bhs[i]->b_data, 0, sb->s_blocksize);
+        set_buffer_uptodate(bhs[i]);
+        unlock_buffer(bhs[i]);
+        mark_buffer_dirty(bhs[i]);
+        write_dirty_buffer(bhs[i], WRITE);
+    }
+    nr = i;
+    for (i = 0; i < nr; i++) {
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i]) && !err)
+            err = -EIO;
+        brelse(bhs[i]);
+    }
+    if (err)
+        return err;
+
+    smp_wmb();  /* the zeroed blks before the count that let them be used */
+    sbi->s_itable_zeroed = start + nr;
+    return nr;
+}
+
+/*
+ * the ino allocator found no free inode among the zeroed records. Zero the
+ * next batch right now rather than fail with ENOSPC. 0 if there are more
+ * records to allocate from now
+ */
+int sfs_itable_grow(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    long ret = -ENOSPC;
+
+    mutex_lock(&sbi->s_itable_lock);
+    if (sbi->s_itable_zeroed < sbi->s_itable_blocks)
+        ret = __sfs_itable_zero(sb);
+    mutex_unlock(&sbi->s_itable_lock);
+    if (ret < 0)
+        return ret;
+    sfs_commit_super(sb, 0);
+    return 0;
+}
+
+/*
+ * zero one batch, then sleep SFS_ITABLE_INIT_WAIT_MULT times as long as
+ * that took, so that we use only a small share of the device meanwhile
+ */
+static void sfs_itable_work(struct work_struct *work) {
+    struct sfs_sb_info *sbi = container_of(to_delayed_work(work),
+                                           struct sfs_sb_info, s_itable_work);
+    unsigned long start = jiffies;
+    long ret = 0;
+    int done;
+
+    /* remounted read-only, sfs_itable_start() pick it up again */
+    if (sbi->sb->s_flags & MS_RDONLY)
+        return;
+    mutex_lock(&sbi->s_itable_lock);
+    if (sbi->s_itable_zeroed < sbi->s_itable_blocks)
+        ret = __sfs_itable_zero(sbi->sb);
+    done = sbi->s_itable_zeroed == sbi->s_itable_blocks;
+    mutex_unlock(&sbi->s_itable_lock);
+
+    if (ret < 0) {
+        /* sfs_itable_grow() still zero blks when they are needed */
+        printk(SFS_KERN_LEVEL "FAIL zeroing inode table: [%ld], "
+                              "stop zeroing it in the background\n", ret);
+        return;
+    }
+    if (ret)
+        sfs_commit_super(sbi->sb, 0);
+    if (done) {
+        printk(SFS_KERN_LEVEL "inode table zeroed\n");
+        return;
+    }
+    schedule_delayed_work(&sbi->s_itable_work,
+                          max_t(unsigned long, 1, (jiffies - start) *
+                                                  SFS_ITABLE_INIT_WAIT_MULT));
+}
+
+/* at mount */
+void sfs_itable_init(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    mutex_init(&sbi->s_itable_lock);
+    INIT_DELAYED_WORK(&sbi->s_itable_work, sfs_itable_work);
+    sfs_itable_start(sb);
+}
+
+/*
+ * at mount or remount read-write. Start zeroing the rest of the table if
+ * there is any
+ */
+void sfs_itable_start(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    if (sb->s_flags & MS_RDONLY || sbi->s_itable_zeroed >= sbi->s_itable_blocks)
+        return;
+    printk(SFS_KERN_LEVEL "[%lu] of [%lu] inode table blks to be zeroed\n",
+           sbi->s_itable_blocks - sbi->s_itable_zeroed, sbi->s_itable_blocks);
+    schedule_delayed_work(&sbi->s_itable_work, SFS_ITABLE_INIT_DELAY);
+}
+
+/* at umount or remount read-only. What is left is zeroed at the next mount */
+void sfs_itable_stop(struct super_block *sb) {
+    cancel_delayed_work_sync(&SFS_S_INFO(sb)->s_itable_work);
+}
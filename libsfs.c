@@ -0,0 +1,309 @@
+/*
+ *  libsfs.c
+ *
+ *  Read an sfs image from userspace through a read-only mmap(), see
+ *  libsfs.h. The checks on the super block are the same as sfs_fill_sb()'s,
+ *  and everything read from the image after that(blk nrs in inodes, inode
+ *  nrs in dir entries) is checked against its geometry before it is used, so
+ *  a corrupted image give errors, never a crash.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>       /* BLKGETSIZE64 */
+
+#include "libsfs.h"
+
+#define SFS_DIRENTS_PER_BLK(img) \
+    ((img)->blk_size / sizeof(struct sfs_dir_entry))
+
+/* find the super block: blk 1, at whatever blk size it was made with */
+static const struct sfs_sb_info *find_super(const char *map, size_t size) {
+    const struct sfs_sb_info *sbi;
+    unsigned long try;
+
+    for (try = SFS_MIN_BLK_SIZE; try <= SFS_MAX_BLK_SIZE; try <<= 1) {
+        if ((try * SFS_SB_START_NR) + sizeof(*sbi) > size)
+            break;
+        sbi = (const struct sfs_sb_info *)(map + try * SFS_SB_START_NR);
+        if (sbi->magic == SFS_MAGIC_NUMBER && sbi->blk_size == try)
+            return sbi;
+    }
+    return NULL;
+}
+
+/* the same checks as sfs_fill_sb() */
+static int check_super(const struct sfs_sb_info *sbi, size_t size) {
+    if (sbi->version != SFS_VERSION)
+        return -EPROTO;
+    if (!sbi->s_blocks_count || sbi->s_blocks_count > UINT32_MAX ||
+        sbi->s_blocks_count > sbi->s_bmap_blocks * sbi->blk_size * 8 ||
+        sbi->sfs_blk_bitmap + sbi->s_bmap_blocks > sbi->s_blocks_count ||
+        sbi->s_blocks_count > size / sbi->blk_size ||
+        sbi->sfs_ino_bitmap >= sbi->s_blocks_count ||
+        !sbi->s_inodes_count || sbi->s_inodes_count > sbi->blk_size * 8 ||
+        sbi->s_inodes_count > SFS_MAX_INODES ||
+        sbi->s_inodes_count > sbi->s_itable_blocks *
+                              SFS_INODES_PER_BLK(sbi->blk_size) ||
+        !sbi->s_itable_zeroed || sbi->s_itable_zeroed > sbi->s_itable_blocks ||
+        sbi->sfs_ino_start + sbi->s_itable_blocks > sbi->s_blocks_count ||
+        sbi->s_refcnt_blocks * sbi->blk_size < sbi->s_blocks_count ||
+        (sbi->s_chlog_blocks && sbi->s_chlog_start !=
+            sbi->sfs_refcnt_start + sbi->s_refcnt_blocks) ||
+        SFS_DATA_START(sbi) > sbi->s_blocks_count)
+        return -EUCLEAN;
+    return 0;
+}
+
+int sfs_open(struct sfs_image *img, const char *path) {
+    const struct sfs_sb_info *sbi;
+    uint64_t dev_size;
+    struct stat st;
+    void *map;
+    int fd, err;
+
+    memset(img, 0, sizeof(*img));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st)) {
+        err = -errno;
+        goto close_fd;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &dev_size)) {
+            err = -errno;
+            goto close_fd;
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        dev_size = st.st_size;
+    } else {
+        err = -EINVAL;
+        goto close_fd;
+    }
+    if (dev_size < SFS_MIN_BLK_SIZE * (SFS_SB_START_NR + 1) ||
+        dev_size != (size_t)dev_size) {
+        err = -EINVAL;
+        goto close_fd;
+    }
+
+    map = mmap(NULL, dev_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        err = -errno;
+        goto close_fd;
+    }
+    /* the mapping stay valid without the fd */
+    close(fd);
+
+    err = -EINVAL;
+    sbi = find_super(map, dev_size);
+    if (!sbi)
+        goto unmap;
+    err = check_super(sbi, dev_size);
+    if (err)
+        goto unmap;
+
+    img->map = map;
+    img->size = dev_size;
+    img->sb = sbi;
+    img->blk_size = sbi->blk_size;
+    img->per_blk = SFS_INODES_PER_BLK(sbi->blk_size);
+    /* the table beyond s_itable_zeroed may still be garbage */
+    img->nr_inodes = sbi->s_itable_zeroed * img->per_blk;
+    if (img->nr_inodes > sbi->s_inodes_count)
+        img->nr_inodes = sbi->s_inodes_count;
+    img->ibmap = (const unsigned char *)sfs_blk(img, sbi->sfs_ino_bitmap);
+    return 0;
+
+unmap:
+    munmap(map, dev_size);
+    return err;
+close_fd:
+    close(fd);
+    return err;
+}
+
+void sfs_close(struct sfs_image *img) {
+    if (img->map)
+        munmap((void *)img->map, img->size);
+    memset(img, 0, sizeof(*img));
+}
+
+const char *sfs_blk(const struct sfs_image *img, unsigned long blk) {
+    if (blk >= img->sb->s_blocks_count)
+        return NULL;
+    return img->map + blk * img->blk_size;
+}
+
+int sfs_inode_used(const struct sfs_image *img, unsigned long ino) {
+    if (ino >= img->nr_inodes)
+        return 0;
+    return (img->ibmap[ino / 8] >> (ino % 8)) & 1;
+}
+
+/* records never straddle two blks, the tail of each table blk is unused */
+static const struct sfs_inode_info *
+inode_rec(const struct sfs_image *img, unsigned long ino) {
+    const char *blk = sfs_blk(img, img->sb->sfs_ino_start + ino / img->per_blk);
+
+    return (const struct sfs_inode_info *)blk + ino % img->per_blk;
+}
+
+const struct sfs_inode_info *sfs_inode(const struct sfs_image *img,
+                                       unsigned long ino) {
+    if (!sfs_inode_used(img, ino))
+        return NULL;
+    return inode_rec(img, ino);
+}
+
+void sfs_inode_iter_init(struct sfs_inode_iter *it,
+                         const struct sfs_image *img) {
+    it->img = img;
+    it->next = 0;
+}
+
+const struct sfs_inode_info *sfs_inode_next(struct sfs_inode_iter *it) {
+    const struct sfs_image *img = it->img;
+    unsigned long ino = it->next;
+
+    while (ino < img->nr_inodes) {
+        /* skip a whole byte of free inodes at once */
+        if (!(ino % 8) && !img->ibmap[ino / 8]) {
+            ino += 8;
+            continue;
+        }
+        if (sfs_inode_used(img, ino)) {
+            it->next = ino + 1;
+            return inode_rec(img, ino);
+        }
+        ino++;
+    }
+    it->next = img->nr_inodes;
+    return NULL;
+}
+
+int sfs_dirent_iter_init(struct sfs_dirent_iter *it,
+                         const struct sfs_image *img,
+                         const struct sfs_inode_info *dir) {
+    memset(it, 0, sizeof(*it));
+    if (!dir || !S_ISDIR(dir->mode))
+        return -ENOTDIR;
+    it->img = img;
+    it->dir = dir;
+    return 0;
+}
+
+const struct sfs_dir_entry *sfs_dirent_next(struct sfs_dirent_iter *it) {
+    const struct sfs_dir_entry *de;
+    const char *blk;
+
+    if (!it->dir)
+        return NULL;
+    /* a dir's blks are contiguous in directs[], the first 0 end them */
+    for (; it->slot < SFS_INO_NDIRECT && it->dir->directs[it->slot];
+         it->slot++, it->idx = 0) {
+        blk = sfs_blk(it->img, it->dir->directs[it->slot]);
+        if (!blk)
+            continue;
+        de = (const struct sfs_dir_entry *)blk;
+        while (it->idx < SFS_DIRENTS_PER_BLK(it->img)) {
+            if (de[it->idx].name[0] != '\0')
+                return &de[it->idx++];
+            it->idx++;
+        }
+    }
+    return NULL;
+}
+
+size_t sfs_dirent_namelen(const struct sfs_dir_entry *de) {
+    return strnlen(de->name, SFS_DIRENT_NAME_LEN);
+}
+
+void sfs_run_iter_init(struct sfs_run_iter *it, const struct sfs_image *img,
+                       const struct sfs_inode_info *inode) {
+    it->img = img;
+    it->inode = inode;
+    it->slot = 0;
+}
+
+/* a blk nr the file may own: within the image and past the metadata */
+static int data_blk(const struct sfs_image *img, unsigned long blk) {
+    return blk >= SFS_DATA_START(img->sb) &&
+           blk < img->sb->s_blocks_count;
+}
+
+int sfs_run_next(struct sfs_run_iter *it, struct sfs_run *run) {
+    const unsigned int *d = it->inode ? it->inode->directs : NULL;
+    unsigned long i = it->slot;
+
+    if (!d)
+        return 0;
+    while (i < SFS_INO_NDIRECT && !data_blk(it->img, d[i]))
+        i++;
+    if (i >= SFS_INO_NDIRECT) {
+        it->slot = i;
+        return 0;
+    }
+    run->logical = i;
+    run->blk = d[i];
+    run->len = 1;
+    run->data = sfs_blk(it->img, d[i]);
+    for (i++; i < SFS_INO_NDIRECT && d[i] == run->blk + run->len &&
+              data_blk(it->img, d[i]); i++)
+        run->len++;
+    it->slot = i;
+    return 1;
+}
+
+long sfs_lookup(const struct sfs_image *img, const char *path) {
+    const struct sfs_inode_info *dir = sfs_inode(img, SFS_ROOTINO);
+    const struct sfs_dir_entry *de;
+    struct sfs_dirent_iter it;
+    unsigned long ino = SFS_ROOTINO;
+    size_t len;
+    int err;
+
+    if (!dir)
+        return -EUCLEAN;
+    while (*path) {
+        while (*path == '/')
+            path++;
+        len = strcspn(path, "/");
+        if (!len)
+            break;
+        if (len > SFS_DIRENT_NAME_LEN)
+            return -ENAMETOOLONG;
+        err = sfs_dirent_iter_init(&it, img, dir);
+        if (err)
+            return err;
+        while ((de = sfs_dirent_next(&it))) {
+            if (sfs_dirent_namelen(de) == len &&
+                !memcmp(de->name, path, len))
+                break;
+        }
+        if (!de)
+            return -ENOENT;
+        ino = de->inode_no;
+        dir = sfs_inode(img, ino);
+        if (!dir)
+            return -EUCLEAN;
+        path += len;
+    }
+    return ino;
+}
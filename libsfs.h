@@ -0,0 +1,114 @@
+/*
+ *  libsfs.h
+ *
+ *  A small userspace library to read an sfs image(or device) without the
+ *  kernel module. The image is mmap()ed read-only and everything handed out
+ *  points straight into the mapping: inode records, dir entries and the data
+ *  of block runs are never copied. So nothing returned is valid after
+ *  sfs_close(), and the image must not be changed(mounted read-write, or
+ *  fsck'ed) while it is open.
+ *
+ *      struct sfs_image img;
+ *      struct sfs_dirent_iter it;
+ *      const struct sfs_dir_entry *de;
+ *
+ *      sfs_open(&img, "./image");
+ *      sfs_dirent_iter_init(&it, &img, sfs_inode(&img, SFS_ROOTINO));
+ *      while ((de = sfs_dirent_next(&it)))
+ *          printf("%.*s\n", (int)sfs_dirent_namelen(de), de->name);
+ *      sfs_close(&img);
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef LIBSFS_H
+#define LIBSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sfs.h"
+
+struct sfs_image {
+    const char *map;                /* the whole image, read-only */
+    size_t size;                    /* bytes mapped */
+    const struct sfs_sb_info *sb;   /* the super block, in the map */
+    unsigned long blk_size;
+    unsigned long per_blk;          /* inode records per table blk */
+    unsigned long nr_inodes;        /* inodes with a readable record */
+    const unsigned char *ibmap;     /* the inode bitmap, in the map */
+};
+
+/* a run of contiguous blks of a file, in file order */
+struct sfs_run {
+    unsigned long logical;      /* its first blk within the file */
+    unsigned long blk;          /* first blk nr in the image */
+    unsigned long len;          /* in blks */
+    const char *data;           /* len * blk_size bytes, in the map */
+};
+
+struct sfs_inode_iter {
+    const struct sfs_image *img;
+    unsigned long next;
+};
+
+struct sfs_dirent_iter {
+    const struct sfs_image *img;
+    const struct sfs_inode_info *dir;
+    unsigned long slot;         /* which of dir->directs */
+    unsigned long idx;          /* entry within that blk */
+};
+
+struct sfs_run_iter {
+    const struct sfs_image *img;
+    const struct sfs_inode_info *inode;
+    unsigned long slot;
+};
+
+/* map the image at `path' and check its super block. 0 or -errno */
+int sfs_open(struct sfs_image *img, const char *path);
+void sfs_close(struct sfs_image *img);
+
+/* blk `blk' of the image, NULL past its end */
+const char *sfs_blk(const struct sfs_image *img, unsigned long blk);
+
+/* the record of `ino', NULL if it is out of range or not in use */
+const struct sfs_inode_info *sfs_inode(const struct sfs_image *img,
+                                       unsigned long ino);
+/* is `ino' set in the inode bitmap */
+int sfs_inode_used(const struct sfs_image *img, unsigned long ino);
+
+/* every inode in use, by inode nr */
+void sfs_inode_iter_init(struct sfs_inode_iter *it,
+                         const struct sfs_image *img);
+const struct sfs_inode_info *sfs_inode_next(struct sfs_inode_iter *it);
+
+/* the entries of a dir, holes skipped. -ENOTDIR if `dir' is not one */
+int sfs_dirent_iter_init(struct sfs_dirent_iter *it,
+                         const struct sfs_image *img,
+                         const struct sfs_inode_info *dir);
+const struct sfs_dir_entry *sfs_dirent_next(struct sfs_dirent_iter *it);
+/* an entry's name is not '\0' terminated when it use all the bytes */
+size_t sfs_dirent_namelen(const struct sfs_dir_entry *de);
+
+/*
+ * the blks of a file(or dir) as runs of contiguous blks. Holes are not
+ * returned, see sfs_run.logical. sfs_run_next() return 1 with `run' filled
+ * in, 0 at the end. The data of a compressed file(SFS_COMPR_FL) is handed
+ * out as it is on disk
+ */
+void sfs_run_iter_init(struct sfs_run_iter *it, const struct sfs_image *img,
+                       const struct sfs_inode_info *inode);
+int sfs_run_next(struct sfs_run_iter *it, struct sfs_run *run);
+
+/* look up a '/' separated path from the root. The ino, or -errno */
+long sfs_lookup(const struct sfs_image *img, const char *path);
+
+#endif /* LIBSFS_H */
@@ -11,115 +11,425 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
  */
    
+#define _GNU_SOURCE         /* fallocate() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>       /* BLKGETSIZE64, BLKDISCARD, BLKZEROOUT */
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 #include "sfs.h"
 
+/* a new or empty image file get this many blks, unless told otherwise */
+#define SFS_DEFAULT_BLKS 105
+#define SFS_DEFAULT_INODE_RATIO 16384   /* bytes of fs per inode */
+#define SFS_IO_SIZE (1 << 20)           /* bytes written at a time */
+#define SFS_DEFAULT_GROW 16             /* room to grow to 16 times the size */
+#define SFS_GROW_ITABLE_SHARE 64        /* of the fs, at most, for that room */
+
 void usage() {
-    fprintf(stderr, "\nusage: mkfs.sfs /path/to/device(or file\n\n");
+    fprintf(stderr, "\nusage: mkfs.sfs [-b blocksize] [-N inodes | -i bytes-per-inode] "
+                    "[-G max-blocks] [-C log-blocks] [-K] /path/to/device(or file) "
+                    "[blocks]\n"
+                    "  -b  blk size in bytes, a power of 2 in [%d, %d]. "
+                    "default %d\n"
+                    "  -N  number of inodes\n"
+                    "  -i  one inode per this many bytes of fs. default %d\n"
+                    "  -G  leave room in the bitmaps and tables to grow "
+                    "online(resize.sfs) up to this many blks. default %d "
+                    "times the size, 0 for none\n"
+                    "  -C  keep a change log of this many blks(see "
+                    "sfs-changes). default 0, none\n"
+                    "  -K  do not discard the device before formatting\n"
+                    "  blocks  size of the fs in blks. default the whole "
+                    "device(or file, %d blks for a new one)\n\n",
+            SFS_MIN_BLK_SIZE, SFS_MAX_BLK_SIZE, SFS_BLK_SIZE,
+            SFS_DEFAULT_INODE_RATIO, SFS_DEFAULT_GROW, SFS_DEFAULT_BLKS);
 }
 
 /* 
  * NOTE: we haven't consider any endianess thing yet !
  */
 
+static unsigned long div_round_up(unsigned long n, unsigned long d) {
+    return (n + d - 1) / d;
+}
+
+/* pwrite() all of `len' bytes. 0 on success */
+static int write_all(int fd, const char *buf, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len) {
+        n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/*
+ * write blks [start, start + count) of a bitmap whose first `nset' bits are
+ * set and the rest clear. SFS_IO_SIZE at a time, blk aligned
+ */
+static int write_bitmap(int fd, unsigned long blk_size, unsigned long start,
+                        unsigned long count, unsigned long nset) {
+    unsigned long chunk = SFS_IO_SIZE / blk_size, n, i, bit, first;
+    char *buf;
+    int ret = 0;
+
+    buf = malloc(chunk * blk_size);
+    if (!buf)
+        return -1;
+    for (i = 0; i < count && !ret; i += n) {
+        n = count - i < chunk ? count - i : chunk;
+        memset(buf, 0, n * blk_size);
+        first = i * blk_size * 8;
+        for (bit = first; bit < nset && bit < first + n * blk_size * 8; bit++)
+            buf[(bit - first) / 8] |= 1 << (bit % 8);
+        ret = write_all(fd, buf, n * blk_size, (off_t)(start + i) * blk_size);
+    }
+    free(buf);
+    return ret;
+}
+
+/* zero blks [start, start + count), in one ioctl if the device can do it */
+static int zero_blks(int fd, int is_bdev, unsigned long blk_size,
+                     unsigned long start, unsigned long count) {
+    unsigned long chunk = SFS_IO_SIZE / blk_size, n, i;
+    uint64_t range[2] = {(uint64_t)start * blk_size,
+                         (uint64_t)count * blk_size};
+    char *buf;
+    int ret = 0;
+
+    if (is_bdev && ioctl(fd, BLKZEROOUT, range) == 0)
+        return 0;
+    buf = calloc(chunk, blk_size);
+    if (!buf)
+        return -1;
+    for (i = 0; i < count && !ret; i += n) {
+        n = count - i < chunk ? count - i : chunk;
+        ret = write_all(fd, buf, n * blk_size, (off_t)(start + i) * blk_size);
+    }
+    free(buf);
+    return ret;
+}
+
+/*
+ * discard the whole fs: BLKDISCARD on a device, punch a hole in a file.
+ * Return 1 if everything now read back as zeros(only known for a file)
+ */
+static int discard_all(int fd, int is_bdev, uint64_t bytes) {
+    uint64_t range[2] = {0, bytes};
+
+    if (is_bdev) {
+        if (ioctl(fd, BLKDISCARD, range))
+            fprintf(stderr, "discard not done: %s\n", strerror(errno));
+        return 0;
+    }
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, bytes)) {
+        fprintf(stderr, "discard not done: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
+    unsigned long blk_size = SFS_BLK_SIZE, blocks = 0, inodes = 0;
+    unsigned long ratio = SFS_DEFAULT_INODE_RATIO, max_inodes, per_blk;
+    unsigned long bmap_blks, itable_blks, refcnt_blks, data_start;
+    unsigned long grow = 0, grow_inodes, chlog_blks = 0;
+    int grow_set = 0;
+    uint64_t dev_size = 0;
+    int opt, fd, is_bdev, nodiscard = 0, zeroed = 0;
+    struct stat st;
+    char *buffer, *end;
+
+    while ((opt = getopt(argc, argv, "b:N:i:G:C:K")) != -1) {
+        switch (opt) {
+        case 'b':
+            blk_size = strtoul(optarg, &end, 0);
+            if (*end != '\0' || blk_size < SFS_MIN_BLK_SIZE ||
+                blk_size > SFS_MAX_BLK_SIZE || (blk_size & (blk_size - 1))) {
+                fprintf(stderr, "invalid blk size: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'N':
+            inodes = strtoul(optarg, &end, 0);
+            if (*end != '\0' || !inodes) {
+                fprintf(stderr, "invalid inode count: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'i':
+            ratio = strtoul(optarg, &end, 0);
+            if (*end != '\0' || ratio < SFS_MIN_BLK_SIZE) {
+                fprintf(stderr, "invalid bytes-per-inode: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'G':
+            grow = strtoul(optarg, &end, 0);
+            if (*end != '\0') {
+                fprintf(stderr, "invalid max blocks: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            grow_set = 1;
+            break;
+        case 'C':
+            chlog_blks = strtoul(optarg, &end, 0);
+            if (*end != '\0') {
+                fprintf(stderr, "invalid change log blocks: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'K':
+            nodiscard = 1;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage();
+        return -1;
+    }
+    if (optind == argc - 2) {
+        blocks = strtoul(argv[optind + 1], &end, 0);
+        if (*end != '\0' || !blocks) {
+            fprintf(stderr, "invalid blocks count: %s\n", argv[optind + 1]);
+            usage();
+            return -1;
+        }
+    }
+
+    fd = open(argv[optind], O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st)) {
+        perror("Cannot open file");
+        return -1;
+    }
+    is_bdev = S_ISBLK(st.st_mode);
+    if (is_bdev) {
+        if (ioctl(fd, BLKGETSIZE64, &dev_size)) {
+            perror("Cannot get device size");
+            return -1;
+        }
+    } else {
+        dev_size = st.st_size;
+        /* a new file is all zeros already */
+        zeroed = !dev_size;
+    }
+
+    /*
+     * plan the layout. Everything but the blk bitmap is sized from the
+     * number of blks, and the bitmap only depend on that too
+     */
+    if (!blocks)
+        blocks = dev_size ? dev_size / blk_size : SFS_DEFAULT_BLKS;
+    if (dev_size && (uint64_t)blocks * blk_size > dev_size) {
+        fprintf(stderr, "[%lu] blks do not fit in the device(%llu bytes)\n",
+                blocks, (unsigned long long)dev_size);
+        return -1;
+    }
+    /* blk nrs are 32 bits in inode records */
+    if (blocks > UINT32_MAX)
+        blocks = UINT32_MAX;
+
+    per_blk = SFS_INODES_PER_BLK(blk_size);
+    max_inodes = blk_size * 8 < SFS_MAX_INODES ? blk_size * 8 : SFS_MAX_INODES;
+    if (inodes > max_inodes) {
+        fprintf(stderr, "[%lu] inodes is too many, using [%lu]\n",
+                inodes, max_inodes);
+        inodes = max_inodes;
+    }
+    if (!inodes)
+        inodes = (uint64_t)blocks * blk_size / ratio;
+    if (inodes > max_inodes)
+        inodes = max_inodes;
+    /* a partly used inode table blk is a waste, fill it up */
+    inodes = div_round_up(inodes ? inodes : 1, per_blk) * per_blk;
+    if (inodes > max_inodes)
+        inodes = max_inodes;
+
+    /*
+     * the bitmaps and tables can not be extended after mkfs, so size the
+     * blk bitmap, the refcount table and the inode table for the largest
+     * the fs may grow to. The inodes grow in proportion to the blks
+     */
+    if (!grow_set)
+        grow = blocks > UINT32_MAX / SFS_DEFAULT_GROW ?
+               UINT32_MAX : blocks * SFS_DEFAULT_GROW;
+    if (grow < blocks) {
+        if (grow) {
+            fprintf(stderr, "max blocks [%lu] is less than the fs [%lu]\n",
+                    grow, blocks);
+            return -1;
+        }
+        grow = blocks;
+    }
+    if (grow > UINT32_MAX)
+        grow = UINT32_MAX;
+    grow_inodes = (uint64_t)inodes * grow / blocks;
+    if (grow_inodes > max_inodes)
+        grow_inodes = max_inodes;
+    itable_blks = div_round_up(grow_inodes, per_blk);
+    /* the table is the costly part of the room, keep it within 1/64 */
+    if (itable_blks > blocks / SFS_GROW_ITABLE_SHARE)
+        itable_blks = blocks / SFS_GROW_ITABLE_SHARE;
+    if (itable_blks < div_round_up(inodes, per_blk))
+        itable_blks = div_round_up(inodes, per_blk);
+
+    bmap_blks = div_round_up(grow, blk_size * 8);
+    refcnt_blks = div_round_up(grow, blk_size);
+    data_start = SFS_SB_START_NR + 2 + bmap_blks + itable_blks + refcnt_blks +
+                 chlog_blks;
+    if (data_start >= blocks) {
+        fprintf(stderr, "[%lu] blks is too small, the metadata alone "
+                        "need [%lu]%s\n", blocks, data_start,
+                grow > blocks ? ", try a smaller -G" : "");
+        return -1;
+    }
+
     struct sfs_sb_info si = {
         .magic          = SFS_MAGIC_NUMBER,
-        .version        = 0x1,
-        .blk_size       = SFS_BLK_SIZE,
+        .version        = SFS_VERSION,
+        .blk_size       = blk_size,
         .sfs_ino_bitmap = SFS_SB_START_NR+1,
         .sfs_blk_bitmap = SFS_SB_START_NR+2,
-        .sfs_ino_start  = SFS_SB_START_NR+3,
+        .sfs_ino_start  = SFS_SB_START_NR+2 + bmap_blks,
         /* this sfs_blk_start refer to all the blk(including the boot sector) */
         .sfs_blk_start  = 0,
+        .s_blocks_count = blocks,
+        .s_inodes_count = inodes,
+        .s_free_blocks  = blocks - data_start,
+        .s_free_inodes  = inodes - 1,
+        .s_state        = SFS_STATE_CLEAN,
+        .sfs_refcnt_start = SFS_SB_START_NR+2 + bmap_blks + itable_blks,
+        .s_refcnt_blocks  = refcnt_blks,
+        .s_itable_blocks  = itable_blks,
+        .s_itable_zeroed  = 1,
+        .s_bmap_blocks    = bmap_blks,
+        .s_chlog_start    = chlog_blks ? SFS_SB_START_NR+2 + bmap_blks +
+                                         itable_blks + refcnt_blks : 0,
+        .s_chlog_blocks   = chlog_blks,
     };
 
+    time_t now = time(NULL);
     struct sfs_inode_info ri = {
-        .mode            = S_IFDIR,
+        .mode            = S_IFDIR | 0755,
         .inode_no        = SFS_ROOTINO,
         .slot_nr         = SFS_ROOT_SLOT_NR,
         .directs         = {0},
         .indirect        = 0,
-        .file_size        = SFS_BLK_SIZE,
+        .file_size        = blk_size,
+        .i_atime          = now,
+        .i_mtime          = now,
+        .i_ctime          = now,
     };
 
-    char buffer[SFS_BLK_SIZE * 200] = {'\0'};
-    int nbyte;
-    FILE *fh;
-
-    if (argc != 2) {
-        usage();
+    if (!nodiscard && !zeroed)
+        zeroed = discard_all(fd, is_bdev, (uint64_t)blocks * blk_size);
+    /* an image file has to be as large as the fs, sparse is fine */
+    if (!is_bdev && (uint64_t)st.st_size < (uint64_t)blocks * blk_size &&
+        ftruncate(fd, (off_t)blocks * blk_size)) {
+        perror("Cannot extend image file");
         return -1;
     }
+    /* on zeros there is no inode table left to zero after mount */
+    if (zeroed)
+        si.s_itable_zeroed = itable_blks;
 
-    fh = fopen(argv[1], "w+");
-    if (!fh) {
-        perror("Cannot open file");
+    buffer = calloc(1, blk_size);
+    if (!buffer) {
+        perror("Cannot alloc buffer");
         return -1;
     }
 
-    fseek(fh, 0, SEEK_SET);
-    nbyte = fwrite(buffer, 1, SFS_BLK_SIZE, fh);
-    if (nbyte != SFS_BLK_SIZE) {
+    /*
+     * only the metadata the kernel can not make up by itself is written: the
+     * data blks are zeroed when they are allocated, the rest of the inode
+     * table after mount
+     */
+    if (write_all(fd, buffer, blk_size, 0)) {
         fprintf(stderr, "fail to write boot sector \n");
         return -1;
     }
 
-    fseek(fh, SFS_BLK_SIZE, SEEK_SET);
-    nbyte = fwrite(&si, 1, sizeof(struct sfs_sb_info), fh);
-    if (nbyte != sizeof(struct sfs_sb_info)) {
-        fprintf(stderr,
-             "fail to completely write super block!! nbyte:[%d]\n", nbyte);
+    memcpy(buffer, &si, sizeof(struct sfs_sb_info));
+    if (write_all(fd, buffer, blk_size, SFS_SB_START_NR * blk_size)) {
+        fprintf(stderr, "fail to completely write super block!!\n");
+        return -1;
+    }
+    memset(buffer, 0, blk_size);
+
+    if (write_bitmap(fd, blk_size, si.sfs_ino_bitmap, 1, 1)) {
+        fprintf(stderr, "fail to completely write inode_bitmap block!!\n");
         return -1;
     }
 
-    fseek(fh, SFS_BLK_SIZE*2, SEEK_SET);
-    buffer[0] = 0x1;
-    nbyte = fwrite(buffer, 1, 1, fh);
-    if (nbyte != 1) {
-        fprintf(stderr,
-          "fail to completely write inode_bitmap block!! nbyte:[%d]\n", nbyte);
+    if (write_bitmap(fd, blk_size, si.sfs_blk_bitmap, bmap_blks, data_start)) {
+        fprintf(stderr, "fail to completely write blk_bitmap blocks!!\n");
         return -1;
     }
 
-    fseek(fh, SFS_BLK_SIZE*3, SEEK_SET);
-    buffer[0]=63;
-    nbyte = fwrite(buffer, 1, 1, fh);
-    if (nbyte != 1) {
-        fprintf(stderr, 
-           "fail to completely write blk_bitmap block!! nbyte:[%d]\n", nbyte);
+    memcpy(buffer, &ri, sizeof(struct sfs_inode_info));
+    if (write_all(fd, buffer, blk_size, (off_t)si.sfs_ino_start * blk_size)) {
+        fprintf(stderr, "fail to completely write inode table block!!\n");
         return -1;
     }
-    buffer[0]=0;
 
-    fseek(fh, SFS_BLK_SIZE*4, SEEK_SET);
-    /* preallocate one block for all inode, and 100 block to hold data */
-    nbyte = fwrite(buffer, 1, SFS_BLK_SIZE * 101, fh);
-    if (nbyte != SFS_BLK_SIZE * 101) {
-        fprintf(stderr,
-             "fail to prealloc blocks! nbyte:[%d]\n", nbyte);
+    if (!zeroed && zero_blks(fd, is_bdev, blk_size, si.sfs_refcnt_start,
+                             refcnt_blks)) {
+        fprintf(stderr, "fail to write refcount table!!\n");
         return -1;
     }
 
-    fseek(fh, SFS_BLK_SIZE*4, SEEK_SET);
-    nbyte = fwrite(&ri, 1, sizeof(struct sfs_inode_info), fh);
-    if (nbyte != sizeof(struct sfs_inode_info)) {
-        fprintf(stderr,
-             "fail to completely write prealloc inode block!! nbyte:[%d]\n", nbyte);
+    /* an empty log is all zeros(seq 0) */
+    if (chlog_blks && !zeroed && zero_blks(fd, is_bdev, blk_size,
+                                           si.s_chlog_start, chlog_blks)) {
+        fprintf(stderr, "fail to write change log!!\n");
         return -1;
     }
 
+    if (fsync(fd)) {
+        perror("Cannot sync");
+        return -1;
+    }
+    close(fd);
+    free(buffer);
 
     printf("\nsuccessfully written all thing.");
-    printf("magic number:[0x%lx], blk_size:[0x%lx] sfs version:[%ld]\n\n",
+    printf("magic number:[0x%lx], blk_size:[0x%lx] sfs version:[%ld]\n",
            si.magic, si.blk_size, si.version);
+    printf("blocks:[%lu] (free:[%lu]), inodes:[%lu] (free:[%lu])\n",
+           si.s_blocks_count, si.s_free_blocks,
+           si.s_inodes_count, si.s_free_inodes);
+    printf("can grow online to:[%lu] blocks\n", grow);
+    printf("blk bitmap:[%lu, +%lu] inode table:[%lu, +%lu] "
+           "refcount table:[%lu, +%lu] ",
+           si.sfs_blk_bitmap, bmap_blks, si.sfs_ino_start, itable_blks,
+           si.sfs_refcnt_start, refcnt_blks);
+    if (chlog_blks)
+        printf("change log:[%lu, +%lu] ", si.s_chlog_start, chlog_blks);
+    printf("data:[%lu, ...)\n\n", data_start);
     return 0;
 }
@@ -0,0 +1,215 @@
+/*
+ *  fs/sfs/orphan.c
+ *
+ *  Deferred deletion. unlink()/rmdir() only drop the dir entry and put the
+ *  inode on the on-disk orphan list. Its blks and inode nr are given back
+ *  later, by a work item, once the last user of the inode is gone. The list
+ *  is replayed at mount, so a crash in between leak nothing.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* struct buffer_head, sb_bread() */
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "sfs.h"
+
+/*
+ * The on-disk list: sfs_sb_info->s_last_orphan is the first orphan's ino,
+ * each orphan's inode record link to the next one with i_next_orphan. Ino 0
+ * is the root, which is never an orphan, so 0 end the list. Links are only
+ * ever changed here, in the inode table buffers, under s_orphan_lock. The
+ * in-memory sii may be written back until the link count drop to 0, so
+ * sfs_update_prealloc_inodes() keep the i_next_orphan of the buffer, under
+ * the same lock.
+ */
+
+/* an evicted orphan waiting for the work item */
+struct sfs_orphan {
+    struct list_head list;      /* on sfs_sb_info->s_orphan_pending */
+    unsigned long ino;
+    /* from the in-memory sii: blks allocated after unlink are only there */
+    unsigned int directs[SFS_INO_NDIRECT];
+};
+
+/* put `inode' on the orphan list. Called before its last link go away */
+int sfs_orphan_add(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct buffer_head *bh;
+    struct sfs_inode_info *rec;
+
+    bh = sfs_inode_blk(sb, inode->i_ino, &rec);
+    if (unlikely(!bh))
+        return -EIO;
+    mutex_lock(&sbi->s_orphan_lock);
+    rec->i_next_orphan = sbi->s_last_orphan;
+    mark_buffer_dirty(bh);
+    sbi->s_last_orphan = inode->i_ino;
+    mutex_unlock(&sbi->s_orphan_lock);
+    brelse(bh);
+    sfs_commit_super(sb, 0);
+    return 0;
+}
+
+/*
+ * give back the blks and the inode nr of orphan `ino', then unlink it from
+ * the orphan list. The blks are not zeroed, see sfs_zero_blk()
+ */
+static void sfs_orphan_free(struct super_block *sb, unsigned long ino,
+                            unsigned int *directs) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct buffer_head *bh, *dbh, *pbh;
+    struct sfs_inode_info *rec, *prec;
+    unsigned long p, next;
+    int i;
+
+    for (i = 0; i < SFS_INO_NDIRECT; i++) {
+        if (!directs[i])
+            continue;
+        /* dirty buffers of blks only we own need not hit the disk at all */
+        if (!sfs_blk_shared(sb, directs[i])) {
+            dbh = sb_find_get_block(sb, sbi->sfs_blk_start + directs[i]);
+            if (dbh)
+                bforget(dbh);
+        }
+        sfs_free_blks(sb, directs[i], 1);
+    }
+
+    /* stay on the list if this fail, the next mount try again */
+    bh = sfs_inode_blk(sb, ino, &rec);
+    if (unlikely(!bh))
+        return;
+    mutex_lock(&sbi->s_orphan_lock);
+    if (sbi->s_last_orphan == ino) {
+        sbi->s_last_orphan = rec->i_next_orphan;
+    } else {
+        /* the list may cross inode table blks, read each one in turn */
+        for (p = sbi->s_last_orphan; p; p = next) {
+            pbh = sfs_inode_blk(sb, p, &prec);
+            if (!pbh) {
+                printk(SFS_KERN_LEVEL "orphan list corrupted at [%lu]\n", p);
+                break;
+            }
+            next = prec->i_next_orphan;
+            if (next == ino) {
+                prec->i_next_orphan = rec->i_next_orphan;
+                mark_buffer_dirty(pbh);
+                brelse(pbh);
+                break;
+            }
+            brelse(pbh);
+        }
+    }
+    memset(rec, 0, sizeof(struct sfs_inode_info));
+    mark_buffer_dirty(bh);
+    mutex_unlock(&sbi->s_orphan_lock);
+    brelse(bh);
+
+    sfs_free_inode_nr(sb, ino);
+    sfs_commit_super(sb, 0);
+}
+
+static void sfs_orphan_work(struct work_struct *work) {
+    struct sfs_sb_info *sbi = container_of(work, struct sfs_sb_info,
+                                           s_orphan_work);
+    struct sfs_orphan *o, *tmp;
+    LIST_HEAD(batch);
+
+    mutex_lock(&sbi->s_orphan_lock);
+    list_splice_init(&sbi->s_orphan_pending, &batch);
+    mutex_unlock(&sbi->s_orphan_lock);
+
+    list_for_each_entry_safe(o, tmp, &batch, list) {
+        sfs_orphan_free(sbi->sb, o->ino, o->directs);
+        kfree(o);
+    }
+}
+
+/*
+ * the last reference to an unlinked inode is gone(sfs_evict_inode()). Hand
+ * it to the work item, or free it right here if we are short of memory
+ */
+void sfs_orphan_queue(struct inode *inode) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(inode->i_sb);
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    struct sfs_orphan *o;
+
+    o = kmalloc(sizeof(struct sfs_orphan), GFP_NOFS);
+    if (unlikely(!o)) {
+        sfs_orphan_free(inode->i_sb, inode->i_ino, sii->directs);
+        return;
+    }
+    o->ino = inode->i_ino;
+    memcpy(o->directs, sii->directs, sizeof(o->directs));
+
+    mutex_lock(&sbi->s_orphan_lock);
+    list_add_tail(&o->list, &sbi->s_orphan_pending);
+    mutex_unlock(&sbi->s_orphan_lock);
+    schedule_work(&sbi->s_orphan_work);
+}
+
+/* wait until every queued orphan is freed. sync(2) and umount do this */
+void sfs_orphan_flush(struct super_block *sb) {
+    flush_work(&SFS_S_INFO(sb)->s_orphan_work);
+}
+
+void sfs_orphan_init(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    mutex_init(&sbi->s_orphan_lock);
+    INIT_LIST_HEAD(&sbi->s_orphan_pending);
+    INIT_WORK(&sbi->s_orphan_work, sfs_orphan_work);
+}
+
+/*
+ * at mount(or remount read-write): whatever is still on the orphan list was
+ * unlinked but not freed when we went down, free it now. Blks such a file got
+ * after its unlink were never recorded on disk, they stay marked in the
+ * bitmap. On a remount an orphan may still be open, it is freed when evicted
+ */
+void sfs_orphan_replay(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct buffer_head *bh;
+    struct sfs_inode_info *rec;
+    struct inode *live;
+    unsigned int directs[SFS_INO_NDIRECT];
+    unsigned long ino, next, n = 0, seen = 0, skipped = 0;
+
+    for (ino = sbi->s_last_orphan; ino; ino = next) {
+        if (ino >= sbi->s_inodes_count || seen++ >= sbi->s_inodes_count) {
+            printk(SFS_KERN_LEVEL "orphan list corrupted at [%lu]%s\n", ino,
+                   skipped ? "" : ", dropped");
+            if (!skipped) {
+                sbi->s_last_orphan = 0;
+                sfs_commit_super(sb, 1);
+            }
+            break;
+        }
+        bh = sfs_inode_blk(sb, ino, &rec);
+        if (unlikely(!bh))
+            break;
+        memcpy(directs, rec->directs, sizeof(directs));
+        next = rec->i_next_orphan;
+        brelse(bh);
+
+        live = ilookup(sb, ino);
+        if (live) {
+            iput(live);
+            skipped++;
+            continue;
+        }
+        sfs_orphan_free(sb, ino, directs);
+        n++;
+    }
+    if (n)
+        printk(SFS_KERN_LEVEL "freed [%lu] orphan inodes\n", n);
+}
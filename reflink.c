@@ -0,0 +1,249 @@
+/*
+ *  fs/sfs/reflink.c
+ *
+ *  reflink(FICLONE/FICLONERANGE): a clone share the data blks of its source
+ *  until one of them write, see the blk refcount table in balloc.c. Also
+ *  copy_file_range(), which reflink whatever it can.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* struct buffer_head, sb_bread() */
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <asm/uaccess.h>       /* get_fs()/set_fs() */
+
+#include "sfs.h"
+
+/*
+ * Before a file write into directs[slot], call this. If that blk is shared
+ * with a clone, the file get its own copy of it and give up its owner of the
+ * shared one. sii is updated but not written out, the caller do that.
+ */
+int sfs_cow_blk(struct inode *inode, int slot, struct sfs_rsv_window *rsv) {
+    struct super_block *sb = inode->i_sb;
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    struct buffer_head *obh, *nbh;
+    unsigned int old = sii->directs[slot], new;
+
+    if (!old || !sfs_blk_shared(sb, old))
+        return 0;
+
+    new = sfs_new_blk(sb, rsv);
+    if (!new) {
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_new_blk() for cow !\n");
+        return -ENOSPC;
+    }
+    obh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + old);
+    nbh = sb_getblk(sb, SFS_S_INFO(sb)->sfs_blk_start + new);
+    if (unlikely(!obh || !nbh)) {
+        SFSD(SFS_KERN_LEVEL "FAIL read/get blk for cow !\n");
+        brelse(obh);
+        brelse(nbh);
+        sfs_free_blks(sb, new, 1);
+        return -EIO;
+    }
+    lock_buffer(nbh);
+    memcpy(nbh->b_data, obh->b_data, sb->s_blocksize);
+    set_buffer_uptodate(nbh);
+    unlock_buffer(nbh);
+    mark_buffer_dirty_inode(nbh, inode);
+    brelse(nbh);
+    brelse(obh);
+
+    sii->directs[slot] = new;
+    sfs_free_blks(sb, old, 1);
+    return 0;
+}
+
+/*
+ * make [destoff, destoff + len) of `dsii' share the blks of [off, off + len)
+ * of `ssii'. Both inodes locked, range already checked. Blks are cloned a
+ * group at a time: a whole cluster for compressed files(a compressed cluster
+ * is only meaningful as a whole), one blk otherwise. Return the number of
+ * bytes cloned, or an error if nothing was.
+ */
+static loff_t __sfs_clone_range(struct super_block *sb,
+                                struct sfs_inode_info *ssii, loff_t off,
+                                struct sfs_inode_info *dsii, loff_t destoff,
+                                loff_t len) {
+    size_t bs = sb->s_blocksize;
+    unsigned int sslot = off / bs, dslot = destoff / bs, n, g, m, i, j, c;
+    unsigned int blk, old;
+    int err = 0;
+
+    n = DIV_ROUND_UP(len, bs);
+    g = 1;
+    if (ssii->i_flags & SFS_COMPR_FL) {
+        /* sslot == dslot here, round up to the end of the last cluster */
+        g = SFS_COMPR_CLUSTER_BLKS;
+        n = min_t(unsigned int, round_up(sslot + n, g), SFS_INO_NDIRECT) -
+            sslot;
+    }
+
+    for (i = 0; i < n; i += m) {
+        m = min(g, n - i);
+        /* take the new owners first, so that a failure change nothing */
+        for (j = 0; j < m; j++) {
+            blk = ssii->directs[sslot + i + j];
+            if (blk && (err = sfs_blk_ref(sb, blk)))
+                break;
+        }
+        if (err) {
+            while (j--)
+                if (ssii->directs[sslot + i + j])
+                    sfs_free_blks(sb, ssii->directs[sslot + i + j], 1);
+            break;
+        }
+        for (j = 0; j < m; j++) {
+            old = dsii->directs[dslot + i + j];
+            dsii->directs[dslot + i + j] = ssii->directs[sslot + i + j];
+            if (old)
+                sfs_free_blks(sb, old, 1);
+        }
+        if (g > 1) {
+            c = (sslot + i) / g;
+            dsii->i_cmap = (dsii->i_cmap & ~(1 << c)) | (ssii->i_cmap & (1 << c));
+        }
+    }
+
+    if (!i)
+        return err;
+    return min_t(loff_t, len, (loff_t)i * bs);
+}
+
+/*
+ * clone `len' bytes at `off' of `src_file' into `dst_file' at `destoff'.
+ * len == 0 means up to the end of the source. Offsets must be blk aligned
+ * (cluster aligned and equal for compressed files) and len too, unless the
+ * range end at the source's EOF and reach past the destination's EOF.
+ * Return the number of bytes cloned or an error.
+ */
+loff_t sfs_clone_range(struct file *src_file, loff_t off,
+                       struct file *dst_file, loff_t destoff, loff_t len) {
+    struct inode *src = file_inode(src_file), *dst = file_inode(dst_file);
+    struct super_block *sb = src->i_sb;
+    struct sfs_inode_info *ssii = SFS_I_INFO(src), *dsii = SFS_I_INFO(dst);
+    loff_t unit = sb->s_blocksize, ret;
+
+    if (dst->i_sb != sb)
+        return -EXDEV;
+    if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+        return -EINVAL;
+    if (off < 0 || destoff < 0 || len < 0)
+        return -EINVAL;
+
+    if (src == dst)
+        mutex_lock(&src->i_mutex);
+    else
+        lock_two_nondirectories(src, dst);
+
+    ret = -EINVAL;
+    if (off > ssii->file_size)
+        goto out;
+    if (!len)
+        len = ssii->file_size - off;
+    if (off + len > ssii->file_size)
+        goto out;
+    if ((ssii->i_flags ^ dsii->i_flags) & SFS_COMPR_FL) {
+        SFSD(SFS_KERN_LEVEL "can not clone between compressed and plain file\n");
+        goto out;
+    }
+    if (ssii->i_flags & SFS_COMPR_FL) {
+        if (off != destoff)
+            goto out;
+        unit *= SFS_COMPR_CLUSTER_BLKS;
+    }
+    if (off % unit || destoff % unit)
+        goto out;
+    /* a partial last blk is ok only if it does not cover dst's data */
+    if (len % unit && (off + len != ssii->file_size ||
+                       destoff + len < dsii->file_size))
+        goto out;
+    if (src == dst && off < destoff + len && destoff < off + len)
+        goto out;
+    ret = -EFBIG;
+    if (destoff + len > (loff_t)SFS_INO_NDIRECT * sb->s_blocksize)
+        goto out;
+    ret = 0;
+    if (!len)
+        goto out;
+
+    ret = __sfs_clone_range(sb, ssii, off, dsii, destoff, len);
+    if (ret > 0) {
+        if (destoff + ret > dsii->file_size) {
+            dsii->file_size = destoff + ret;
+            i_size_write(dst, dsii->file_size);
+        }
+        dst->i_mtime = dst->i_ctime = CURRENT_TIME;
+        if (sfs_update_inode(dst))
+            SFSD(SFS_KERN_LEVEL "FAIL sfs_update_inode() !\n");
+        sfs_drop_page_cache(dst, destoff, ret);
+        sfs_chlog_add(sb, dst->i_ino, 0, SFS_CHLOG_WRITE);
+    }
+out:
+    if (src == dst)
+        mutex_unlock(&src->i_mutex);
+    else
+        unlock_two_nondirectories(src, dst);
+    return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+/*
+ * copy_file_range() within one sfs. A blk aligned range is simply reflinked,
+ * anything else is copied blk by blk through a kernel buffer, never going
+ * out to user memory.
+ */
+ssize_t sfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                            struct file *file_out, loff_t pos_out,
+                            size_t len, unsigned int flags) {
+    struct super_block *sb = file_inode(file_in)->i_sb;
+    size_t bs = sb->s_blocksize, n;
+    ssize_t ret = 0, done = 0;
+    mm_segment_t old_fs;
+    char *buf;
+
+    if (file_inode(file_out)->i_sb != sb)
+        return -EXDEV;
+    if (!len)
+        return 0;
+
+    if (!(pos_in % bs) && !(pos_out % bs)) {
+        ret = sfs_clone_range(file_in, pos_in, file_out, pos_out, len);
+        if (ret > 0)
+            return ret;
+        /* e.g. compressed vs plain, or a short tail inside dst: copy */
+    }
+
+    buf = kmalloc(bs, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    while (done < len) {
+        /* never cross a blk boundary of the source in one read */
+        n = min(len - done, bs - (size_t)(pos_in % bs));
+        ret = sfs_read(file_in, (char __user *)buf, n, &pos_in);
+        if (ret <= 0)
+            break;
+        n = ret;
+        ret = sfs_write(file_out, (const char __user *)buf, n, &pos_out);
+        if (ret <= 0)
+            break;
+        done += ret;
+        if (ret < n)
+            break;
+    }
+    set_fs(old_fs);
+    kfree(buf);
+    return done ? done : ret;
+}
+#endif
@@ -0,0 +1,206 @@
+/*
+ *  fs/sfs/resize.c
+ *
+ *  Online grow: after the device(or the loop file under it) grew, extend a
+ *  mounted sfs into the new space. The layout is fixed at mkfs time, the
+ *  bitmap, the inode table and the refcount table sit back to back, so none
+ *  of them can be extended later. Instead mkfs.sfs size them for the largest
+ *  size the fs may ever grow to(`-G'), and growing only move s_blocks_count
+ *  and s_inodes_count forward within that:
+ *    - the blk bitmap bits and refcount entries past s_blocks_count are
+ *      still zero as mkfs.sfs left them, so the new blks are free already;
+ *    - the inodes grow in proportion to the blks, their table blks are
+ *      zeroed lazily(itable.c) like any other.
+ *  Nothing on disk but the super block change, so a crash either see the
+ *  old size or the new one.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* struct buffer_head, sb_bread() */
+#include <linux/bitops.h>      /* find_next_bit_le() */
+#include <linux/capability.h>
+#include <linux/math64.h>
+#include <linux/percpu_counter.h>
+#include <linux/mutex.h>
+#include <asm/uaccess.h>
+
+#include "sfs.h"
+
+/* one grow at a time, they are rare enough to share a lock */
+static DEFINE_MUTEX(sfs_grow_mutex);
+
+/* most blks the blk bitmap and the refcount table can cover */
+static unsigned long sfs_grow_limit(struct sfs_sb_info *sbi) {
+    unsigned long lim = sbi->s_bmap_blocks * sbi->blk_size * 8;
+
+    lim = min(lim, sbi->s_refcnt_blocks * sbi->blk_size);
+    return min_t(unsigned long, lim, UINT_MAX);
+}
+
+/*
+ * inodes for `blocks' blks: as many per blk as now, in whole table blks,
+ * within the table and the(one blk) inode bitmap
+ */
+static unsigned long sfs_grow_inodes(struct sfs_sb_info *sbi,
+                                     unsigned long blocks) {
+    unsigned long per_blk = SFS_INODES_PER_BLK(sbi->blk_size), lim;
+    u64 inodes;
+
+    inodes = div64_u64((u64)sbi->s_inodes_count * blocks,
+                       sbi->s_blocks_count);
+    inodes = roundup(inodes, per_blk);
+    lim = min3(sbi->s_itable_blocks * per_blk, sbi->blk_size * 8,
+               (unsigned long)SFS_MAX_INODES);
+    if (inodes > lim)
+        inodes = lim;
+    return max_t(unsigned long, inodes, sbi->s_inodes_count);
+}
+
+/* are all bits of [start, end) in `bitmap' clear */
+static int sfs_bits_clear(void *bitmap, unsigned long start,
+                          unsigned long end) {
+    return find_next_bit_le(bitmap, end, start) >= end;
+}
+
+/* the blk bitmap past the old end must be as mkfs.sfs left it */
+static int sfs_grow_check_bmap(struct super_block *sb, unsigned long start,
+                               unsigned long end) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long per_blk = sb->s_blocksize << 3, base, lim;
+    struct buffer_head *bh;
+    int ok;
+
+    while (start < end) {
+        base = round_down(start, per_blk);
+        lim = min(end - base, per_blk);
+        bh = sb_bread(sb, sbi->sfs_blk_bitmap + start / per_blk);
+        if (unlikely(!bh))
+            return -EIO;
+        ok = sfs_bits_clear(bh->b_data, start - base, lim);
+        brelse(bh);
+        if (!ok)
+            return -EUCLEAN;
+        start = base + lim;
+    }
+    return 0;
+}
+
+static int sfs_grow_fs(struct super_block *sb, struct sfs_grow_info *gi) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long old_blocks, new_blocks, old_inodes, new_inodes;
+    struct buffer_head *bh;
+    int err;
+
+    gi->dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+    gi->max_blocks = sfs_grow_limit(sbi);
+
+    mutex_lock(&sfs_grow_mutex);
+    new_blocks = old_blocks = sbi->s_blocks_count;
+    new_inodes = old_inodes = sbi->s_inodes_count;
+    if (gi->blocks) {
+        err = -EINVAL;
+        if (gi->blocks < old_blocks || gi->blocks > gi->dev_blocks) {
+            SFSD(SFS_KERN_LEVEL "can not grow from [%lu] to [%llu] blks, "
+                 "device has [%llu]\n", old_blocks, gi->blocks,
+                 gi->dev_blocks);
+            goto out;
+        }
+        err = -ENOSPC;
+        if (gi->blocks > gi->max_blocks) {
+            SFSD(SFS_KERN_LEVEL "[%llu] blks is more than mkfs.sfs reserved "
+                 "bitmap/refcnt space for [%llu]\n", gi->blocks,
+                 gi->max_blocks);
+            goto out;
+        }
+        new_blocks = gi->blocks;
+    } else {
+        new_blocks = min(gi->dev_blocks, gi->max_blocks);
+        if (new_blocks < old_blocks)
+            new_blocks = old_blocks;
+    }
+    new_inodes = new_blocks > old_blocks ?
+                 sfs_grow_inodes(sbi, new_blocks) : old_inodes;
+
+    err = 0;
+    if ((gi->flags & SFS_GROW_DRY_RUN) || new_blocks == old_blocks)
+        goto out;
+    err = -EROFS;
+    if (sb->s_flags & MS_RDONLY)
+        goto out;
+
+    err = sfs_grow_check_bmap(sb, old_blocks, new_blocks);
+    if (err) {
+        printk(SFS_KERN_LEVEL "blk bitmap past [%lu] not clear, run "
+               "fsck.sfs\n", old_blocks);
+        goto out;
+    }
+
+    /*
+     * the blk count and the free count move together under the allocator's
+     * lock, so nobody see the new blks without them being counted free
+     */
+    mutex_lock(&sbi->s_bmap_lock);
+    sbi->s_blocks_count = new_blocks;
+    percpu_counter_add(&sbi->s_freeblks_counter, new_blocks - old_blocks);
+    __sfs_fext_free(sb, old_blocks, new_blocks - old_blocks);
+    mutex_unlock(&sbi->s_bmap_lock);
+
+    if (new_inodes > old_inodes) {
+        mutex_lock(&sbi->s_ibmap_lock);
+        bh = sb_bread(sb, sbi->sfs_ino_bitmap);
+        if (unlikely(!bh)) {
+            mutex_unlock(&sbi->s_ibmap_lock);
+            /* the blks are in, just no new inodes */
+            new_inodes = old_inodes;
+            goto commit;
+        }
+        if (sfs_bits_clear(bh->b_data, old_inodes, new_inodes)) {
+            sbi->s_inodes_count = new_inodes;
+            percpu_counter_add(&sbi->s_freeinodes_counter,
+                               new_inodes - old_inodes);
+        } else {
+            printk(SFS_KERN_LEVEL "inode bitmap past [%lu] not clear, "
+                   "inodes not grown\n", old_inodes);
+            new_inodes = old_inodes;
+        }
+        brelse(bh);
+        mutex_unlock(&sbi->s_ibmap_lock);
+    }
+
+commit:
+    /* the only write: the super block, with both counts at once */
+    sfs_commit_super(sb, 1);
+    printk(SFS_KERN_LEVEL "%s grown from [%lu] to [%lu] blks, [%lu] inodes\n",
+           sb->s_id, old_blocks, new_blocks, new_inodes);
+out:
+    gi->blocks = new_blocks;
+    gi->inodes = new_inodes;
+    mutex_unlock(&sfs_grow_mutex);
+    return err;
+}
+
+/* SFS_IOC_GROW: see sfs_grow_info */
+long sfs_ioc_grow(struct file *filp, struct sfs_grow_info __user *arg) {
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct sfs_grow_info gi;
+    int err;
+
+    if (!capable(CAP_SYS_RESOURCE))
+        return -EPERM;
+    if (copy_from_user(&gi, arg, sizeof(gi)))
+        return -EFAULT;
+    if (gi.flags & ~SFS_GROW_DRY_RUN)
+        return -EINVAL;
+    err = sfs_grow_fs(sb, &gi);
+    if (err)
+        return err;
+    return copy_to_user(arg, &gi, sizeof(gi)) ? -EFAULT : 0;
+}
@@ -0,0 +1,136 @@
+/*
+ *  resize.sfs.c
+ *
+ *  Grow a mounted sfs after its device(or loop file) grew, see resize.c. A
+ *  loop device is told to pick up the new size of its file first, so
+ *      truncate -s 2G ./image && resize.sfs ./dir
+ *  is all it take.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>  /* major(), minor() */
+#include <linux/loop.h>     /* LOOP_SET_CAPACITY */
+#include <linux/major.h>    /* LOOP_MAJOR */
+#include <stdint.h>
+#include <string.h>
+
+#include "sfs.h"
+
+void usage() {
+    fprintf(stderr, "\nusage: resize.sfs [-n] /mount/point [blocks]\n"
+                    "  -n  only show what it would grow to\n"
+                    "  blocks  new size of the fs in blks. default as large "
+                    "as the device, within what mkfs.sfs left room for\n\n");
+}
+
+/* make the loop device under `dev' see the current size of its file */
+static void loop_refresh(dev_t dev) {
+    char path[64];
+    int fd;
+
+    if (major(dev) != LOOP_MAJOR)
+        return;
+    snprintf(path, sizeof(path), "/dev/block/%u:%u", major(dev), minor(dev));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(path, sizeof(path), "/dev/loop%u", minor(dev));
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0 || ioctl(fd, LOOP_SET_CAPACITY, 0))
+        fprintf(stderr, "cannot refresh the size of %s: %s\n", path,
+                strerror(errno));
+    if (fd >= 0)
+        close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sfs_grow_info gi;
+    unsigned long old_blocks;
+    struct statfs sfs;
+    struct stat st;
+    int opt, fd, dry_run = 0;
+    char *end;
+
+    memset(&gi, 0, sizeof(gi));
+    while ((opt = getopt(argc, argv, "n")) != -1) {
+        switch (opt) {
+        case 'n':
+            dry_run = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage();
+        return 1;
+    }
+    if (optind == argc - 2) {
+        gi.blocks = strtoull(argv[optind + 1], &end, 0);
+        if (*end != '\0' || !gi.blocks) {
+            fprintf(stderr, "invalid blocks count: %s\n", argv[optind + 1]);
+            usage();
+            return 1;
+        }
+    }
+
+    fd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fstat(fd, &st) || fstatfs(fd, &sfs)) {
+        perror("Cannot open mount point");
+        return 1;
+    }
+    if (sfs.f_type != SFS_MAGIC_NUMBER) {
+        fprintf(stderr, "%s is not a mounted sfs\n", argv[optind]);
+        return 1;
+    }
+    old_blocks = sfs.f_blocks;
+    loop_refresh(st.st_dev);
+
+    /* always ask first, to tell what is going to happen */
+    gi.flags = SFS_GROW_DRY_RUN;
+    if (ioctl(fd, SFS_IOC_GROW, &gi)) {
+        fprintf(stderr, "cannot grow: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("device: [%llu] blks, room for at most [%llu] blks\n",
+           (unsigned long long)gi.dev_blocks,
+           (unsigned long long)gi.max_blocks);
+    if (gi.blocks == old_blocks) {
+        printf("nothing to do, the fs already has [%lu] blks\n", old_blocks);
+        return 0;
+    }
+    printf("%s [%lu] to [%llu] blks, [%llu] inodes\n",
+           dry_run ? "would grow from" : "growing from", old_blocks,
+           (unsigned long long)gi.blocks, (unsigned long long)gi.inodes);
+    if (dry_run)
+        return 0;
+
+    gi.flags = 0;
+    if (ioctl(fd, SFS_IOC_GROW, &gi)) {
+        fprintf(stderr, "cannot grow: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("done: [%llu] blks, [%llu] inodes\n",
+           (unsigned long long)gi.blocks, (unsigned long long)gi.inodes);
+    close(fd);
+    return 0;
+}
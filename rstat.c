@@ -0,0 +1,312 @@
+/*
+ *  fs/sfs/rstat.c
+ *
+ *  Recursive usage of dirs(bytes, blks and inodes of everything under a
+ *  dir), answered in O(1) by SFS_IOC_GETRSTAT instead of a `du' walk. The
+ *  counts are kept in memory, in a table indexed by ino:
+ *    - the first SFS_IOC_GETRSTAT on a mount build it, walking the tree from
+ *      the root once(the inode records and the dir blks, no inode is read
+ *      into the icache);
+ *    - after that every change is pushed up the parent chain as it happen:
+ *      __sfs_write_inode() for size/blk changes, create and remove for the
+ *      names.
+ *  An inode has one name in sfs(no hard links, no rename), so its parent is
+ *  remembered at build/create time. Nothing is kept on disk: there is no
+ *  room in the inode record, and a table rebuilt at mount can't go stale
+ *  after a crash. Blks shared by reflink clones count once per owner.
+ *
+ *  s_rstat_lock serialize the build and the updates. Updates only take it
+ *  once a table exist. A hook is always called after the change it report
+ *  is visible(in the inode table buffer or the dir blk), so a build running
+ *  meanwhile either see the change, or is finished before the hook run.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h> /* sb_bread() */
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <asm/uaccess.h>
+
+#include "sfs.h"
+
+struct sfs_rstat {
+    u64 bytes;          /* recursive, itself included */
+    u64 blocks;
+    u64 inodes;
+    u64 own_bytes;      /* what itself add to the above */
+    u32 own_blocks;
+    u16 parent;         /* ino of the dir holding its name */
+    u8 linked;          /* counted in its parent */
+};
+
+/* bytes and blks of one inode record */
+static void sfs_rstat_own(struct sfs_inode_info *sii, u64 *bytes,
+                          u32 *blocks) {
+    int i;
+
+    *bytes = S_ISREG(sii->mode) ? sii->file_size : 0;
+    *blocks = sii->indirect ? 1 : 0;
+    for (i = 0; i < SFS_INO_NDIRECT; i++)
+        if (sii->directs[i])
+            (*blocks)++;
+}
+
+/* add the deltas to `ino' and every dir above it, s_rstat_lock held */
+static void __sfs_rstat_add(struct sfs_sb_info *sbi, unsigned long ino,
+                            s64 bytes, s64 blocks, s64 inodes) {
+    struct sfs_rstat *r;
+
+    for (;;) {
+        r = &sbi->s_rstat[ino];
+        r->bytes += bytes;
+        r->blocks += blocks;
+        r->inodes += inodes;
+        /* the subtree of a removed dir is not counted anywhere else */
+        if (ino == SFS_ROOTINO || !r->linked)
+            break;
+        ino = r->parent;
+    }
+}
+
+/* most inodes this mount may ever have, grown or not */
+static unsigned long sfs_rstat_max(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    return min3(sbi->s_itable_blocks * SFS_INODES_PER_BLK(sb->s_blocksize),
+                sb->s_blocksize * 8, (unsigned long)SFS_MAX_INODES);
+}
+
+/* walk the tree from the root, s_rstat_lock held */
+static int __sfs_rstat_build(struct super_block *sb, struct sfs_rstat *rs) {
+    unsigned long per_blk = SFS_DIRENTS_PER_BLK(sb), nr_inodes;
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_inode_info *rec;
+    struct sfs_dir_entry *de;
+    struct buffer_head *bh;
+    unsigned int directs[SFS_INO_NDIRECT];
+    unsigned long ino, child, head, tail = 0;
+    u16 *queue;
+    mode_t mode;
+    int i, j, err = 0;
+
+    nr_inodes = sfs_itable_inodes(sb);
+    queue = vmalloc(nr_inodes * sizeof(*queue));
+    if (!queue)
+        return -ENOMEM;
+
+    /* breadth first, so that a dir always come before what is in it */
+    queue[tail++] = SFS_ROOTINO;
+    rs[SFS_ROOTINO].linked = 1;
+    for (head = 0; head < tail; head++) {
+        ino = queue[head];
+        bh = sfs_inode_blk(sb, ino, &rec);
+        if (unlikely(!bh)) {
+            err = -EIO;
+            goto out;
+        }
+        sfs_rstat_own(rec, &rs[ino].own_bytes, &rs[ino].own_blocks);
+        mode = rec->mode;
+        memcpy(directs, rec->directs, sizeof(directs));
+        brelse(bh);
+        if (!S_ISDIR(mode))
+            continue;
+
+        for (i = 0; i < SFS_INO_NDIRECT && directs[i]; i++) {
+            bh = sb_bread(sb, sbi->sfs_blk_start + directs[i]);
+            if (unlikely(!bh)) {
+                err = -EIO;
+                goto out;
+            }
+            de = (struct sfs_dir_entry *)bh->b_data;
+            for (j = 0; j < per_blk; j++) {
+                if (de[j].name[0] == '\0')
+                    continue;
+                child = de[j].inode_no;
+                /* a second name, or a loop: fsck.sfs's business */
+                if (child >= nr_inodes || rs[child].linked)
+                    continue;
+                rs[child].linked = 1;
+                rs[child].parent = ino;
+                queue[tail++] = child;
+            }
+            brelse(bh);
+            cond_resched();
+        }
+    }
+
+    /* then up from the leaves */
+    while (tail--) {
+        ino = queue[tail];
+        rs[ino].bytes += rs[ino].own_bytes;
+        rs[ino].blocks += rs[ino].own_blocks;
+        rs[ino].inodes++;
+        if (ino == SFS_ROOTINO)
+            continue;
+        child = ino;
+        ino = rs[child].parent;
+        rs[ino].bytes += rs[child].bytes;
+        rs[ino].blocks += rs[child].blocks;
+        rs[ino].inodes += rs[child].inodes;
+    }
+out:
+    vfree(queue);
+    return err;
+}
+
+static int sfs_rstat_build(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_rstat *rs;
+    int err = 0;
+
+    mutex_lock(&sbi->s_rstat_lock);
+    if (sbi->s_rstat)
+        goto out;
+    sbi->s_rstat_max = sfs_rstat_max(sb);
+    rs = vzalloc(sbi->s_rstat_max * sizeof(*rs));
+    err = -ENOMEM;
+    if (!rs)
+        goto out;
+    /* from now on the hooks wait for us, see the top of this file */
+    WRITE_ONCE(sbi->s_rstat, rs);
+    err = __sfs_rstat_build(sb, rs);
+    if (err) {
+        printk(SFS_KERN_LEVEL "%s: FAIL building the dir usage table: %d\n",
+               sb->s_id, err);
+        WRITE_ONCE(sbi->s_rstat, NULL);
+        vfree(rs);
+    }
+out:
+    mutex_unlock(&sbi->s_rstat_lock);
+    return err;
+}
+
+/* the size or blks of `inode' may have changed */
+void sfs_rstat_update(struct inode *inode) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(inode->i_sb);
+    struct sfs_rstat *r;
+    u64 bytes;
+    u32 blocks;
+
+    if (!READ_ONCE(sbi->s_rstat))
+        return;
+    mutex_lock(&sbi->s_rstat_lock);
+    if (!sbi->s_rstat || inode->i_ino >= sbi->s_rstat_max)
+        goto out;
+    r = &sbi->s_rstat[inode->i_ino];
+    if (!r->linked && inode->i_ino != SFS_ROOTINO)
+        goto out;
+    sfs_rstat_own(SFS_I_INFO(inode), &bytes, &blocks);
+    __sfs_rstat_add(sbi, inode->i_ino, (s64)(bytes - r->own_bytes),
+                    (s64)blocks - r->own_blocks, 0);
+    r->own_bytes = bytes;
+    r->own_blocks = blocks;
+out:
+    mutex_unlock(&sbi->s_rstat_lock);
+}
+
+/* `inode' just got its name in `dir' */
+void sfs_rstat_link(struct inode *dir, struct inode *inode) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(dir->i_sb);
+    struct sfs_rstat *r;
+
+    if (!READ_ONCE(sbi->s_rstat))
+        return;
+    mutex_lock(&sbi->s_rstat_lock);
+    if (!sbi->s_rstat || inode->i_ino >= sbi->s_rstat_max)
+        goto out;
+    r = &sbi->s_rstat[inode->i_ino];
+    /* the build found the name already */
+    if (r->linked) {
+        mutex_unlock(&sbi->s_rstat_lock);
+        sfs_rstat_update(inode);
+        return;
+    }
+    memset(r, 0, sizeof(*r));
+    sfs_rstat_own(SFS_I_INFO(inode), &r->own_bytes, &r->own_blocks);
+    r->bytes = r->own_bytes;
+    r->blocks = r->own_blocks;
+    r->inodes = 1;
+    r->parent = dir->i_ino;
+    r->linked = 1;
+    __sfs_rstat_add(sbi, dir->i_ino, r->bytes, r->blocks, 1);
+out:
+    mutex_unlock(&sbi->s_rstat_lock);
+}
+
+/* the name of `inode' in `dir' is gone, and so is all under it */
+void sfs_rstat_unlink(struct inode *dir, struct inode *inode) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(dir->i_sb);
+    struct sfs_rstat *r;
+
+    if (!READ_ONCE(sbi->s_rstat))
+        return;
+    mutex_lock(&sbi->s_rstat_lock);
+    if (!sbi->s_rstat || inode->i_ino >= sbi->s_rstat_max)
+        goto out;
+    r = &sbi->s_rstat[inode->i_ino];
+    if (!r->linked)
+        goto out;
+    r->linked = 0;
+    __sfs_rstat_add(sbi, r->parent, -(s64)r->bytes, -(s64)r->blocks,
+                    -(s64)r->inodes);
+out:
+    mutex_unlock(&sbi->s_rstat_lock);
+}
+
+/* SFS_IOC_GETRSTAT: see sfs_rstat_info */
+long sfs_ioc_getrstat(struct file *filp, struct sfs_rstat_info __user *arg) {
+    struct inode *inode = file_inode(filp);
+    struct sfs_sb_info *sbi = SFS_S_INFO(inode->i_sb);
+    struct sfs_rstat_info ri;
+    struct sfs_rstat *r;
+    u64 bytes;
+    u32 blocks;
+    int err;
+
+    memset(&ri, 0, sizeof(ri));
+    if (!S_ISDIR(inode->i_mode)) {
+        /* a file is all by itself, no need for the table */
+        sfs_rstat_own(SFS_I_INFO(inode), &bytes, &blocks);
+        ri.bytes = bytes;
+        ri.blocks = blocks;
+        ri.inodes = 1;
+        goto copy;
+    }
+
+    err = sfs_rstat_build(inode->i_sb);
+    if (err)
+        return err;
+    mutex_lock(&sbi->s_rstat_lock);
+    if (inode->i_ino < sbi->s_rstat_max) {
+        r = &sbi->s_rstat[inode->i_ino];
+        ri.bytes = r->bytes;
+        ri.blocks = r->blocks;
+        ri.inodes = r->inodes;
+    }
+    mutex_unlock(&sbi->s_rstat_lock);
+copy:
+    return copy_to_user(arg, &ri, sizeof(ri)) ? -EFAULT : 0;
+}
+
+void sfs_rstat_init(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    mutex_init(&sbi->s_rstat_lock);
+    sbi->s_rstat = NULL;
+    sbi->s_rstat_max = 0;
+}
+
+void sfs_rstat_destroy(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    vfree(sbi->s_rstat);
+    sbi->s_rstat = NULL;
+}
@@ -0,0 +1,637 @@
+/*
+ *  sfs-bench.c
+ *
+ *  Fixed metadata and data path workloads, run in a directory of a mounted
+ *  sfs(or of any other fs, to compare against). Every workload run with one
+ *  process and with several at once, each in its own subdir. The result is
+ *  ops/sec and the p50/p99 latency of each, as JSON, so runs of different
+ *  commits can be compared. `make bench' make a fresh image and run it.
+ *
+ *  Runs are reproducible: the random workloads use a fixed seed(-s), and
+ *  the sizes are fixed unless told otherwise.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "sfs.h"
+
+#define SFS_BENCH_FILES 1000    /* files per process, fit in one sfs dir */
+#define SFS_BENCH_DEPTH 32      /* of the lookup-deep chain */
+#define SFS_BENCH_REPEAT 100    /* readdir passes */
+#define SFS_BENCH_DATA_FILES 64 /* files the data workloads work on */
+
+static unsigned long nfiles = SFS_BENCH_FILES;
+static unsigned long depth = SFS_BENCH_DEPTH;
+static unsigned long repeat = SFS_BENCH_REPEAT;
+static unsigned long data_files = SFS_BENCH_DATA_FILES;
+static unsigned long file_size;     /* largest file sfs can hold */
+static unsigned int seed = 1;
+static int drop_caches;
+
+/* what one process of a workload work with */
+struct ctx {
+    char dir[PATH_MAX];     /* its own subdir */
+    unsigned long io_size;
+    unsigned int rand;      /* rand_r() state */
+    char *buf;
+    uint64_t *lat;          /* latency of each op, ns */
+    unsigned long nops;
+};
+
+struct workload {
+    const char *name;
+    int is_data;            /* run once per io size */
+    /* make what the timed ops need. Not timed */
+    int (*setup)(struct ctx *c);
+    /* number of timed ops */
+    unsigned long (*nops)(struct ctx *c);
+    /* timed op i. 0 on success */
+    int (*op)(struct ctx *c, unsigned long i);
+};
+
+void usage() {
+    fprintf(stderr, "\nusage: sfs-bench [-n files] [-d depth] [-r repeat] "
+                    "[-p procs,...] [-b size,...] [-w workload,...]\n"
+                    "                 [-s seed] [-t tag] [-o out.json] [-C] "
+                    "dir\n"
+                    "  -n  files per process for the metadata workloads. "
+                    "default %d\n"
+                    "  -d  depth of the lookup-deep chain. default %d\n"
+                    "  -r  readdir passes. default %d\n"
+                    "  -p  process counts to run each workload with. "
+                    "default 1,4\n"
+                    "  -b  io sizes of the data workloads. default "
+                    "512,4096,whole file\n"
+                    "  -w  workloads to run. default all\n"
+                    "  -s  random seed. default 1\n"
+                    "  -t  tag recorded in the result, e.g. a commit id\n"
+                    "  -o  write the JSON there instead of stdout\n"
+                    "  -C  drop the page/dentry/inode caches before the "
+                    "timed part(need root)\n\n",
+            SFS_BENCH_FILES, SFS_BENCH_DEPTH, SFS_BENCH_REPEAT);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void path_of(struct ctx *c, char *path, const char *fmt,
+                    unsigned long i) {
+    int n = snprintf(path, PATH_MAX, "%s/", c->dir);
+
+    snprintf(path + n, PATH_MAX - n, fmt, i);
+}
+
+static int create_files(struct ctx *c, unsigned long n) {
+    char path[PATH_MAX];
+    unsigned long i;
+    int fd;
+
+    for (i = 0; i < n; i++) {
+        path_of(c, path, "f%06lu", i);
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+/* ---- create/stat/unlink storms ---- */
+
+static unsigned long nops_files(struct ctx *c) {
+    return nfiles;
+}
+
+static int op_create(struct ctx *c, unsigned long i) {
+    char path[PATH_MAX];
+    int fd;
+
+    path_of(c, path, "f%06lu", i);
+    fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0)
+        return -1;
+    return close(fd);
+}
+
+static int setup_files(struct ctx *c) {
+    return create_files(c, nfiles);
+}
+
+static int op_stat(struct ctx *c, unsigned long i) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    path_of(c, path, "f%06lu", i);
+    return stat(path, &st);
+}
+
+static int op_unlink(struct ctx *c, unsigned long i) {
+    char path[PATH_MAX];
+
+    path_of(c, path, "f%06lu", i);
+    return unlink(path);
+}
+
+/* ---- lookups ---- */
+
+static int setup_deep(struct ctx *c) {
+    char path[PATH_MAX];
+    size_t n = strlen(c->dir);
+    unsigned long i;
+    int fd;
+
+    if (n + depth * 2 + 3 > PATH_MAX) {
+        fprintf(stderr, "lookup-deep: depth [%lu] too large\n", depth);
+        return -1;
+    }
+    memcpy(path, c->dir, n + 1);
+    for (i = 0; i < depth; i++) {
+        memcpy(path + n, "/d", 3);
+        n += 2;
+        if (mkdir(path, 0755)) {
+            perror(path);
+            return -1;
+        }
+    }
+    /* the file at the bottom is what every op look up */
+    memcpy(path + n, "/f", 3);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static int op_deep(struct ctx *c, unsigned long i) {
+    char path[PATH_MAX];
+    size_t n = strlen(c->dir);
+    struct stat st;
+    unsigned long k;
+
+    memcpy(path, c->dir, n);
+    for (k = 0; k < depth; k++, n += 2)
+        memcpy(path + n, "/d", 2);
+    memcpy(path + n, "/f", 3);
+    return stat(path, &st);
+}
+
+/* random names of a wide dir, half of them not there */
+static int op_wide(struct ctx *c, unsigned long i) {
+    char path[PATH_MAX];
+    struct stat st;
+    unsigned long k = rand_r(&c->rand) % (nfiles * 2);
+
+    if (k < nfiles)
+        return op_stat(c, k);
+    path_of(c, path, "x%06lu", k);
+    if (!stat(path, &st) || errno != ENOENT)
+        return -1;
+    return 0;
+}
+
+static unsigned long nops_repeat(struct ctx *c) {
+    return repeat;
+}
+
+/* one full pass over a dir of -n files */
+static int op_readdir(struct ctx *c, unsigned long i) {
+    DIR *d = opendir(c->dir);
+    unsigned long n = 0;
+
+    if (!d)
+        return -1;
+    while (readdir(d))
+        n++;
+    closedir(d);
+    /* sfs list no "." and "..", other fs do */
+    return n >= nfiles ? 0 : -1;
+}
+
+/* ---- data path ---- */
+
+static int setup_data_files(struct ctx *c) {
+    char path[PATH_MAX];
+    unsigned long i, off;
+    int fd;
+
+    memset(c->buf, 0x5a, file_size);
+    for (i = 0; i < data_files; i++) {
+        path_of(c, path, "f%06lu", i);
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+        for (off = 0; off < file_size; off += 4096)
+            if (pwrite(fd, c->buf + off, file_size - off < 4096 ?
+                                         file_size - off : 4096, off) < 0) {
+                perror(path);
+                close(fd);
+                return -1;
+            }
+        close(fd);
+    }
+    return 0;
+}
+
+static int setup_empty_files(struct ctx *c) {
+    return create_files(c, data_files);
+}
+
+static unsigned long nops_data(struct ctx *c) {
+    return data_files * (file_size / c->io_size);
+}
+
+/* op i is chunk i % chunks of file i / chunks. Open/close are timed too */
+static int data_op(struct ctx *c, unsigned long i, int rw, int random) {
+    unsigned long chunks = file_size / c->io_size, file, off;
+    char path[PATH_MAX];
+    ssize_t n;
+    int fd;
+
+    file = i / chunks;
+    off = (i % chunks) * c->io_size;
+    if (random) {
+        file = rand_r(&c->rand) % data_files;
+        off = (rand_r(&c->rand) % chunks) * c->io_size;
+    }
+    path_of(c, path, "f%06lu", file);
+    fd = open(path, rw ? O_WRONLY : O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (rw)
+        n = pwrite(fd, c->buf, c->io_size, off);
+    else
+        n = pread(fd, c->buf, c->io_size, off);
+    close(fd);
+    return n == (ssize_t)c->io_size ? 0 : -1;
+}
+
+static int op_seq_write(struct ctx *c, unsigned long i) {
+    return data_op(c, i, 1, 0);
+}
+
+static int op_seq_read(struct ctx *c, unsigned long i) {
+    return data_op(c, i, 0, 0);
+}
+
+static int op_rand_write(struct ctx *c, unsigned long i) {
+    return data_op(c, i, 1, 1);
+}
+
+static int op_rand_read(struct ctx *c, unsigned long i) {
+    return data_op(c, i, 0, 1);
+}
+
+static struct workload workloads[] = {
+    { "create",      0, NULL,              nops_files,  op_create },
+    { "stat",        0, setup_files,       nops_files,  op_stat },
+    { "unlink",      0, setup_files,       nops_files,  op_unlink },
+    { "lookup-deep", 0, setup_deep,        nops_files,  op_deep },
+    { "lookup-wide", 0, setup_files,       nops_files,  op_wide },
+    { "readdir",     0, setup_files,       nops_repeat, op_readdir },
+    { "seq-write",   1, setup_empty_files, nops_data,   op_seq_write },
+    { "seq-read",    1, setup_data_files,  nops_data,   op_seq_read },
+    { "rand-write",  1, setup_data_files,  nops_data,   op_rand_write },
+    { "rand-read",   1, setup_data_files,  nops_data,   op_rand_read },
+};
+#define NR_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+/* ---- running ---- */
+
+/* what a process report back through the shared mapping */
+struct proc_result {
+    uint64_t start, end;
+    int failed;
+};
+
+/* remove what a workload left in `dir', and `dir' itself */
+static void cleanup(const char *dir) {
+    char path[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *d = opendir(dir);
+
+    if (d) {
+        while ((de = readdir(d))) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                continue;
+            snprintf(path, PATH_MAX, "%s/%s", dir, de->d_name);
+            if (!lstat(path, &st) && S_ISDIR(st.st_mode))
+                cleanup(path);
+            else
+                unlink(path);
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static void sync_and_drop(void) {
+    int fd;
+
+    sync();
+    if (!drop_caches)
+        return;
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "3", 1) != 1)
+        fprintf(stderr, "cannot drop caches: %s\n", strerror(errno));
+    if (fd >= 0)
+        close(fd);
+}
+
+/*
+ * process `k' of a run: setup, wait for everybody, the timed ops, then
+ * report. `go' is closed by the parent when all are set up
+ */
+static void run_proc(struct workload *w, struct ctx *c, int ready, int go,
+                     struct proc_result *res) {
+    unsigned long i;
+    uint64_t t;
+    char b;
+
+    if (mkdir(c->dir, 0755) || (w->setup && w->setup(c))) {
+        res->failed = 1;
+        close(ready);
+        _exit(1);
+    }
+    close(ready);
+    /* EOF once every process is set up(and the caches dropped) */
+    if (read(go, &b, 1) < 0)
+        _exit(1);
+
+    res->start = now_ns();
+    for (i = 0; i < c->nops; i++) {
+        t = now_ns();
+        if (w->op(c, i)) {
+            fprintf(stderr, "%s: op [%lu] in %s: %s\n", w->name, i, c->dir,
+                    strerror(errno));
+            res->failed = 1;
+            break;
+        }
+        c->lat[i] = now_ns() - t;
+    }
+    res->end = now_ns();
+    _exit(res->failed);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static FILE *out;
+static int nr_results;
+
+/* run `w' with `procs' processes at once. Print its JSON record */
+static int run(const char *base, struct workload *w, int procs,
+               unsigned long io_size) {
+    struct proc_result *res;
+    int ready[2], go[2], k, status, failed = 0;
+    char b;
+    uint64_t *lat, start = UINT64_MAX, end = 0;
+    unsigned long nops, total, i;
+    struct ctx c;
+    size_t map_len;
+    pid_t pid;
+    double secs;
+    char *map;
+
+    memset(&c, 0, sizeof(c));
+    c.io_size = io_size;
+    nops = w->nops(&c);
+    total = nops * procs;
+    map_len = procs * sizeof(*res) + total * sizeof(*lat);
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED || pipe(ready) || pipe(go)) {
+        perror("Cannot set up the run");
+        return -1;
+    }
+    res = (struct proc_result *)map;
+    lat = (uint64_t *)(res + procs);
+
+    for (k = 0; k < procs; k++) {
+        snprintf(c.dir, PATH_MAX, "%s/%s.%d", base, "b", k);
+        c.rand = seed + k;
+        c.nops = nops;
+        c.lat = lat + k * nops;
+        pid = fork();
+        if (pid < 0) {
+            perror("Cannot fork");
+            return -1;
+        }
+        if (pid == 0) {
+            close(ready[0]);
+            close(go[1]);
+            c.buf = malloc(file_size);
+            if (!c.buf)
+                _exit(1);
+            run_proc(w, &c, ready[1], go[0], &res[k]);
+        }
+    }
+    close(ready[1]);
+    close(go[0]);
+    /* EOF on `ready' once all have closed their end, i.e. are set up */
+    while (read(ready[0], &b, 1) > 0)
+        ;
+    close(ready[0]);
+    sync_and_drop();
+    close(go[1]);
+
+    while ((pid = wait(&status)) > 0)
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            failed = 1;
+    for (k = 0; k < procs; k++) {
+        if (res[k].failed)
+            failed = 1;
+        if (res[k].start < start)
+            start = res[k].start;
+        if (res[k].end > end)
+            end = res[k].end;
+        snprintf(c.dir, PATH_MAX, "%s/%s.%d", base, "b", k);
+        cleanup(c.dir);
+    }
+
+    if (!failed) {
+        qsort(lat, total, sizeof(*lat), cmp_u64);
+        secs = (end - start) / 1e9;
+        fprintf(out, "%s    {\"workload\": \"%s\", \"procs\": %d, "
+                     "\"io_size\": %lu, \"ops\": %lu, \"secs\": %.6f, "
+                     "\"ops_per_sec\": %.1f, \"p50_us\": %.3f, "
+                     "\"p99_us\": %.3f}",
+                nr_results++ ? ",\n" : "", w->name, procs, io_size, total,
+                secs, secs > 0 ? total / secs : 0.0, lat[total / 2] / 1e3,
+                lat[(total * 99) / 100 < total ? (total * 99) / 100
+                                                : total - 1] / 1e3);
+        i = total ? lat[total / 2] : 0;
+        fprintf(stderr, "%-12s procs %-3d size %-6lu %10.1f ops/s  "
+                        "p50 %8.3fus\n", w->name, procs, io_size,
+                secs > 0 ? total / secs : 0.0, i / 1e3);
+    }
+    munmap(map, map_len);
+    return failed ? -1 : 0;
+}
+
+/* is `name' one of the comma separated `list'. Everything if no list */
+static int selected(const char *list, const char *name) {
+    size_t n = strlen(name);
+    const char *p;
+
+    if (!list)
+        return 1;
+    for (p = list; (p = strstr(p, name)) != NULL; p += n)
+        if ((p == list || p[-1] == ',') && (p[n] == ',' || p[n] == '\0'))
+            return 1;
+    return 0;
+}
+
+/* parse "a,b,c" into `v'. Return the count, -1 on error */
+static int parse_list(char *s, unsigned long *v, int max) {
+    char *tok, *end;
+    int n = 0;
+
+    for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+        if (n == max)
+            return -1;
+        v[n] = strtoul(tok, &end, 0);
+        if (*end != '\0' || !v[n])
+            return -1;
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long procs[16] = {1, 4}, sizes[16] = {512, 4096, 0};
+    int nprocs = 2, nsizes = 3, opt, p, s, ret = 0;
+    const char *tag = "", *only = NULL;
+    struct statvfs vfs;
+    unsigned int w;
+    char *end;
+
+    out = stdout;
+    while ((opt = getopt(argc, argv, "n:d:r:p:b:w:s:t:o:C")) != -1) {
+        switch (opt) {
+        case 'n':
+            nfiles = strtoul(optarg, &end, 0);
+            if (*end != '\0' || !nfiles)
+                goto bad;
+            break;
+        case 'd':
+            depth = strtoul(optarg, &end, 0);
+            if (*end != '\0' || !depth)
+                goto bad;
+            break;
+        case 'r':
+            repeat = strtoul(optarg, &end, 0);
+            if (*end != '\0' || !repeat)
+                goto bad;
+            break;
+        case 'p':
+            nprocs = parse_list(optarg, procs, 16);
+            if (nprocs <= 0)
+                goto bad;
+            break;
+        case 'b':
+            nsizes = parse_list(optarg, sizes, 16);
+            if (nsizes <= 0)
+                goto bad;
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        case 's':
+            seed = strtoul(optarg, &end, 0);
+            if (*end != '\0')
+                goto bad;
+            break;
+        case 't':
+            tag = optarg;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (!out) {
+                perror(optarg);
+                return -1;
+            }
+            break;
+        case 'C':
+            drop_caches = 1;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return -1;
+    }
+    if (statvfs(argv[optind], &vfs)) {
+        perror(argv[optind]);
+        return -1;
+    }
+    /* the data workloads use files as large as sfs allow */
+    file_size = vfs.f_bsize * SFS_INO_NDIRECT;
+
+    fprintf(out, "{\n  \"tag\": \"%s\", \"dir\": \"%s\", \"blk_size\": %lu, "
+                 "\"seed\": %u, \"files\": %lu,\n  \"results\": [\n",
+            tag, argv[optind], (unsigned long)vfs.f_bsize, seed, nfiles);
+    for (w = 0; w < NR_WORKLOADS; w++) {
+        if (!selected(only, workloads[w].name))
+            continue;
+        for (p = 0; p < nprocs; p++)
+            for (s = 0; s < (workloads[w].is_data ? nsizes : 1); s++) {
+                unsigned long size = sizes[s] ? sizes[s] : file_size;
+
+                if (workloads[w].is_data && size > file_size)
+                    continue;
+                if (run(argv[optind], &workloads[w], procs[p],
+                        workloads[w].is_data ? size : 0))
+                    ret = -1;
+            }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    return ret;
+
+bad:
+    fprintf(stderr, "invalid argument: -%c %s\n", opt, optarg);
+    usage();
+    return -1;
+}
@@ -0,0 +1,131 @@
+/*
+ *  sfs-cat.c
+ *
+ *  Write files of an sfs image to stdout without mounting it(see libsfs.h).
+ *  The data go straight from the mapping of the image to write(2). A
+ *  compressed file is refused: lz4 is only in the kernel.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libsfs.h"
+
+static const char zeros[SFS_MAX_BLK_SIZE];
+
+void usage() {
+    fprintf(stderr, "\nusage: sfs-cat /path/to/image(or device) path...\n\n");
+}
+
+static int write_all(const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len) {
+        n = write(STDOUT_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* `len' bytes of a hole */
+static int write_zeros(size_t len) {
+    size_t n;
+    int err;
+
+    while (len) {
+        n = len < sizeof(zeros) ? len : sizeof(zeros);
+        err = write_all(zeros, n);
+        if (err)
+            return err;
+        len -= n;
+    }
+    return 0;
+}
+
+static int cat_inode(const struct sfs_image *img,
+                     const struct sfs_inode_info *sii) {
+    unsigned long bs = img->blk_size, size = sii->file_size, pos = 0, end;
+    struct sfs_run_iter it;
+    struct sfs_run run;
+    int err;
+
+    if (S_ISDIR(sii->mode))
+        return -EISDIR;
+    if (sii->i_flags & SFS_COMPR_FL)
+        return -EOPNOTSUPP;
+    if (size > SFS_INO_NDIRECT * bs)
+        return -EUCLEAN;
+
+    sfs_run_iter_init(&it, img, sii);
+    while (pos < size && sfs_run_next(&it, &run)) {
+        if (run.logical * bs >= size)
+            break;
+        err = write_zeros(run.logical * bs - pos);
+        if (err)
+            return err;
+        end = (run.logical + run.len) * bs;
+        if (end > size)
+            end = size;
+        err = write_all(run.data, end - run.logical * bs);
+        if (err)
+            return err;
+        pos = end;
+    }
+    /* a hole at the end */
+    return write_zeros(size - pos);
+}
+
+int main(int argc, char *argv[])
+{
+    const struct sfs_inode_info *sii;
+    struct sfs_image img;
+    int i, err, ret = 0;
+    long ino;
+
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+    err = sfs_open(&img, argv[1]);
+    if (err) {
+        fprintf(stderr, "cannot open %s: %s\n", argv[1], strerror(-err));
+        return 1;
+    }
+    for (i = 2; i < argc; i++) {
+        ino = sfs_lookup(&img, argv[i]);
+        if (ino < 0) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(-ino));
+            ret = 1;
+            continue;
+        }
+        sii = sfs_inode(&img, ino);
+        err = cat_inode(&img, sii);
+        if (err) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(-err));
+            ret = 1;
+            if (err == -EPIPE)
+                break;
+        }
+    }
+    sfs_close(&img);
+    return ret;
+}
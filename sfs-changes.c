@@ -0,0 +1,117 @@
+/*
+ *  sfs-changes.c
+ *
+ *  What changed on a mounted sfs since last time, from its change log(see
+ *  chlog.c, mkfs.sfs -C). An incremental backup or sync keep the cursor
+ *  printed at the end and pass it back next time:
+ *      sfs-changes -c 1234 ./dir
+ *  print one "seq op ino dir" line per change after seq 1234, then
+ *  "cursor N". Exit code 2 mean changes after the cursor were lost(the log
+ *  wrapped, or the fs crashed): the caller should do a full scan instead.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sfs.h"
+
+#define SFS_CHANGES_BATCH 1024      /* records asked for at a time */
+
+static const char *op_names[] = {
+    [SFS_CHLOG_CREATE] = "create",
+    [SFS_CHLOG_WRITE]  = "write",
+    [SFS_CHLOG_UNLINK] = "unlink",
+    [SFS_CHLOG_MKDIR]  = "mkdir",
+    [SFS_CHLOG_RMDIR]  = "rmdir",
+    [SFS_CHLOG_GAP]    = "gap",
+};
+
+void usage() {
+    fprintf(stderr, "\nusage: sfs-changes [-c cursor] [-q] path\n"
+                    "  -c  only the changes after this seq. default 0, all "
+                    "still in the log\n"
+                    "  -q  only print the cursor\n"
+                    "  path  any file or dir on the mounted sfs\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct sfs_chlog_rec recs[SFS_CHANGES_BATCH];
+    struct sfs_chlog_req req;
+    unsigned long long cursor = 0;
+    int opt, fd, quiet = 0, lost = 0;
+    uint32_t i;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "c:q")) != -1) {
+        switch (opt) {
+        case 'c':
+            cursor = strtoull(optarg, &end, 0);
+            if (*end != '\0') {
+                fprintf(stderr, "invalid cursor: %s\n", optarg);
+                usage();
+                return 1;
+            }
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    do {
+        memset(&req, 0, sizeof(req));
+        req.cursor = cursor;
+        req.recs = (uintptr_t)recs;
+        req.nr = SFS_CHANGES_BATCH;
+        if (ioctl(fd, SFS_IOC_GETCHANGES, &req) < 0) {
+            /* EOPNOTSUPP: made without -C */
+            fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+            close(fd);
+            return 1;
+        }
+        if (req.flags & SFS_CHLOG_LOST)
+            lost = 1;
+        for (i = 0; i < req.nr && !quiet; i++)
+            printf("%llu %s %u %u\n", (unsigned long long)recs[i].seq,
+                   recs[i].op < sizeof(op_names) / sizeof(op_names[0]) &&
+                   op_names[recs[i].op] ? op_names[recs[i].op] : "?",
+                   recs[i].ino, recs[i].dir);
+        cursor = req.cursor;
+    } while (cursor < req.last);
+    close(fd);
+
+    if (lost)
+        fprintf(stderr, "changes after the given cursor are lost, "
+                        "do a full scan\n");
+    printf("cursor %llu\n", cursor);
+    return lost ? 2 : 0;
+}
@@ -0,0 +1,172 @@
+/*
+ *  sfs-defrag.c
+ *
+ *  Report how fragmented the files of a mounted sfs are, and defragment the
+ *  worst of them online(see defrag.c).
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _XOPEN_SOURCE 700   /* nftw() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sfs.h"
+
+struct frag_file {
+    char *path;
+    struct sfs_frag_info fi;
+};
+
+static struct frag_file *files;
+static size_t nr_files, max_files;
+
+void usage() {
+    fprintf(stderr, "\nusage: sfs-defrag [-n] [-c count] path...\n"
+                    "  -n  only report, do not defragment\n"
+                    "  -c  defragment at most `count' files, the most "
+                    "fragmented first. default all\n\n");
+}
+
+static int collect(const char *path, const struct stat *st, int type,
+                   struct FTW *ftw) {
+    struct sfs_frag_info fi;
+    int fd;
+
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    if (ioctl(fd, SFS_IOC_GETFRAG, &fi) < 0) {
+        /* e.g. not on sfs */
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    if (nr_files == max_files) {
+        max_files = max_files ? max_files * 2 : 64;
+        files = realloc(files, max_files * sizeof(*files));
+        if (!files) {
+            perror("Cannot alloc file list");
+            return -1;
+        }
+    }
+    files[nr_files].path = strdup(path);
+    files[nr_files].fi = fi;
+    nr_files++;
+    return 0;
+}
+
+/* most fragmented first, then the larger one */
+static int cmp_frag(const void *a, const void *b) {
+    const struct frag_file *x = a, *y = b;
+
+    if (x->fi.extents != y->fi.extents)
+        return x->fi.extents < y->fi.extents ? 1 : -1;
+    if (x->fi.blocks != y->fi.blocks)
+        return x->fi.blocks < y->fi.blocks ? 1 : -1;
+    return 0;
+}
+
+static int defrag(struct frag_file *f) {
+    struct sfs_frag_info fi;
+    int fd, ret;
+
+    fd = open(f->path, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", f->path, strerror(errno));
+        return -1;
+    }
+    ret = ioctl(fd, SFS_IOC_DEFRAG, &fi);
+    close(fd);
+    if (ret < 0) {
+        fprintf(stderr, "cannot defrag %s: %s\n", f->path, strerror(errno));
+        return -1;
+    }
+    printf("%s: %u -> %u extents\n", f->path, f->fi.extents, fi.extents);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long count = (unsigned long)-1, nfrag = 0, done = 0, extents = 0;
+    int report_only = 0, opt, i, ret = 0;
+    char *end;
+    size_t k;
+
+    while ((opt = getopt(argc, argv, "nc:")) != -1) {
+        switch (opt) {
+        case 'n':
+            report_only = 1;
+            break;
+        case 'c':
+            count = strtoul(optarg, &end, 0);
+            if (*end != '\0') {
+                fprintf(stderr, "invalid count: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (optind == argc) {
+        usage();
+        return -1;
+    }
+
+    for (i = optind; i < argc; i++)
+        if (nftw(argv[i], collect, 16, FTW_PHYS | FTW_MOUNT) < 0) {
+            fprintf(stderr, "cannot walk %s: %s\n", argv[i], strerror(errno));
+            ret = -1;
+        }
+    qsort(files, nr_files, sizeof(*files), cmp_frag);
+
+    printf("%8s %8s  %s\n", "extents", "blocks", "file");
+    for (k = 0; k < nr_files; k++) {
+        printf("%8u %8u  %s\n", files[k].fi.extents, files[k].fi.blocks,
+               files[k].path);
+        extents += files[k].fi.extents;
+        if (files[k].fi.extents > 1)
+            nfrag++;
+    }
+    printf("\n%zu files, %lu fragmented, %.2f extents per file\n", nr_files,
+           nfrag, nr_files ? (double)extents / nr_files : 0.0);
+
+    if (!report_only) {
+        for (k = 0; k < nr_files && done < count; k++) {
+            if (files[k].fi.extents <= 1)
+                break;
+            if (defrag(&files[k]))
+                ret = -1;
+            done++;
+        }
+    }
+
+    for (k = 0; k < nr_files; k++)
+        free(files[k].path);
+    free(files);
+    return ret;
+}
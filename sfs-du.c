@@ -0,0 +1,78 @@
+/*
+ *  sfs-du.c
+ *
+ *  `du' for a mounted sfs without walking the tree: the kernel keep the
+ *  recursive usage of every dir(see rstat.c), this only ask for it.
+ *      sfs-du ./dir/a ./dir/b
+ *  print bytes, blks and inodes under each of them.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sfs.h"
+
+void usage() {
+    fprintf(stderr, "\nusage: sfs-du [-b] path...\n"
+                    "  -b  only print the bytes\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct sfs_rstat_info ri;
+    int opt, fd, i, bytes_only = 0, ret = 0;
+
+    while ((opt = getopt(argc, argv, "b")) != -1) {
+        switch (opt) {
+        case 'b':
+            bytes_only = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        usage();
+        return 1;
+    }
+
+    if (!bytes_only)
+        printf("%16s %12s %10s  %s\n", "bytes", "blocks", "inodes", "path");
+    for (i = optind; i < argc; i++) {
+        fd = open(argv[i], O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "cannot open %s: %s\n", argv[i], strerror(errno));
+            ret = 1;
+            continue;
+        }
+        if (ioctl(fd, SFS_IOC_GETRSTAT, &ri) < 0) {
+            /* e.g. not on sfs */
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            ret = 1;
+        } else if (bytes_only) {
+            printf("%llu\t%s\n", (unsigned long long)ri.bytes, argv[i]);
+        } else {
+            printf("%16llu %12llu %10llu  %s\n", (unsigned long long)ri.bytes,
+                   (unsigned long long)ri.blocks,
+                   (unsigned long long)ri.inodes, argv[i]);
+        }
+        close(fd);
+    }
+    return ret;
+}
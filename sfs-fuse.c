@@ -0,0 +1,1553 @@
+/*
+ *  sfs-fuse.c
+ *
+ *  sfs in user space: a FUSE daemon that read and write an sfs image(or
+ *  device) in the very same on-disk format as the kernel module, so it can
+ *  be mounted without root, insmod or a loop device.
+ *
+ *  Requests are served by libfuse's multithreaded loop. All blks go through
+ *  one block cache shared by the threads, with LRU eviction. Lookups and
+ *  reads take the fs lock shared, anything that change the fs take it
+ *  exclusive. File data that is clean on disk is not copied at all: read
+ *  hand libfuse the image fd and offset, and libfuse splice it to the kernel.
+ *
+ *  Not supported: compressed files(SFS_COMPR_FL, their data I/O fail with
+ *  EOPNOTSUPP), and atime, which is never updated.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "sfs.h"
+
+#define SFS_FUSE_CACHE_BLKS 4096    /* default size of the block cache */
+#define SFS_FUSE_FLUSH_SECS 5       /* write dirty blks back this often */
+#define SFS_FUSE_ITABLE_BATCH 16    /* inode table blks zeroed at a time */
+
+/*========================= block cache =========================*/
+
+struct cblk {
+    unsigned long nr;
+    struct cblk *hnext;         /* hash chain */
+    struct cblk *prev, *next;   /* LRU list, most recently used first */
+    int dirty;
+    int refs;                   /* users holding it, never evicted then */
+    char data[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct cblk **hash;
+    unsigned long hmask;
+    struct cblk *head, *tail;
+    unsigned long nr, max;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int dev_fd;
+static unsigned long blk_size;
+
+static int pread_all(char *buf, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len) {
+        n = pread(dev_fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -EIO;
+        if (n == 0) {
+            /* past the end of a short image: zeros */
+            memset(buf, 0, len);
+            return 0;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int pwrite_all(const char *buf, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len) {
+        n = pwrite(dev_fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -EIO;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static void lru_unlink(struct cblk *b) {
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        cache.head = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        cache.tail = b->prev;
+}
+
+static void lru_push(struct cblk *b) {
+    b->prev = NULL;
+    b->next = cache.head;
+    if (cache.head)
+        cache.head->prev = b;
+    cache.head = b;
+    if (!cache.tail)
+        cache.tail = b;
+}
+
+static struct cblk *cache_find(unsigned long nr) {
+    struct cblk *b;
+
+    for (b = cache.hash[nr & cache.hmask]; b; b = b->hnext)
+        if (b->nr == nr)
+            return b;
+    return NULL;
+}
+
+static void cache_unhash(struct cblk *b) {
+    struct cblk **p = &cache.hash[b->nr & cache.hmask];
+
+    while (*p != b)
+        p = &(*p)->hnext;
+    *p = b->hnext;
+}
+
+/*
+ * make room for one more blk: evict the least recently used unpinned blks,
+ * writing them back if dirty. If every blk is pinned we simply grow past
+ * cache.max for a while. Under cache.lock
+ */
+static void cache_shrink(void) {
+    struct cblk *b, *prev;
+
+    for (b = cache.tail; b && cache.nr >= cache.max; b = prev) {
+        prev = b->prev;
+        if (b->refs)
+            continue;
+        if (b->dirty && pwrite_all(b->data, blk_size, (off_t)b->nr * blk_size))
+            continue;   /* keep it, maybe the next try work */
+        lru_unlink(b);
+        cache_unhash(b);
+        free(b);
+        cache.nr--;
+    }
+}
+
+/*
+ * get blk `nr' pinned in the cache. It is read from disk unless `zero' is
+ * set, then it is zero-filled instead(a newly allocated blk). NULL on error
+ */
+static struct cblk *__bget(unsigned long nr, int zero) {
+    struct cblk *b;
+
+    pthread_mutex_lock(&cache.lock);
+    b = cache_find(nr);
+    if (b) {
+        lru_unlink(b);
+        lru_push(b);
+        b->refs++;
+        if (zero)
+            memset(b->data, 0, blk_size);
+        pthread_mutex_unlock(&cache.lock);
+        return b;
+    }
+    cache_shrink();
+    b = malloc(sizeof(struct cblk) + blk_size);
+    if (!b) {
+        pthread_mutex_unlock(&cache.lock);
+        return NULL;
+    }
+    b->nr = nr;
+    b->dirty = 0;
+    b->refs = 1;
+    /* read under the lock, so nobody else can add the same blk meanwhile */
+    if (zero)
+        memset(b->data, 0, blk_size);
+    else if (pread_all(b->data, blk_size, (off_t)nr * blk_size)) {
+        pthread_mutex_unlock(&cache.lock);
+        free(b);
+        return NULL;
+    }
+    b->hnext = cache.hash[nr & cache.hmask];
+    cache.hash[nr & cache.hmask] = b;
+    lru_push(b);
+    cache.nr++;
+    pthread_mutex_unlock(&cache.lock);
+    return b;
+}
+
+static struct cblk *bread(unsigned long nr) {
+    return __bget(nr, 0);
+}
+
+static struct cblk *bzero_get(unsigned long nr) {
+    return __bget(nr, 1);
+}
+
+static void brelse(struct cblk *b) {
+    if (!b)
+        return;
+    pthread_mutex_lock(&cache.lock);
+    b->refs--;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* only under the exclusive fs lock, so no reader can see it half-changed */
+static void bdirty(struct cblk *b) {
+    b->dirty = 1;
+}
+
+/*
+ * copy blk `nr' into `buf' if the cache has a version of it that is not on
+ * disk yet. 0 if it does not, the caller can read the disk then
+ */
+static int bcopy_dirty(unsigned long nr, char *buf) {
+    struct cblk *b;
+    int ret = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    b = cache_find(nr);
+    if (b && b->dirty) {
+        memcpy(buf, b->data, blk_size);
+        ret = 1;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return ret;
+}
+
+/* write back every dirty blk. Caller keep writers out(fs lock) */
+static int cache_flush(void) {
+    struct cblk *b;
+    int err = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    for (b = cache.head; b; b = b->next) {
+        if (!b->dirty)
+            continue;
+        if (pwrite_all(b->data, blk_size, (off_t)b->nr * blk_size))
+            err = -EIO;
+        else
+            b->dirty = 0;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return err;
+}
+
+static int cache_init(unsigned long max) {
+    unsigned long n = 1;
+
+    while (n < max)
+        n <<= 1;
+    cache.hash = calloc(n, sizeof(struct cblk *));
+    if (!cache.hash)
+        return -ENOMEM;
+    cache.hmask = n - 1;
+    cache.max = max;
+    return 0;
+}
+
+/*========================= the filesystem =========================*/
+
+static struct sfs_sb_info sbi;
+/* shared: lookups and reads. exclusive: anything that change the fs */
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned long alloc_goal;    /* next blk search begin here */
+
+/* open handles per ino. An unlinked inode is freed on its last release */
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int *open_count;
+static unsigned char *unlinked;
+
+static uid_t fs_uid;
+static gid_t fs_gid;
+
+#define SFS_DIRENTS_PER_BLK (blk_size / sizeof(struct sfs_dir_entry))
+
+static void now(int64_t *sec, uint32_t *nsec) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *sec = ts.tv_sec;
+    *nsec = ts.tv_nsec;
+}
+
+static int write_super(int clean) {
+    char *buf = calloc(1, blk_size);
+    int err;
+
+    if (!buf)
+        return -ENOMEM;
+    if (clean)
+        sbi.s_state |= SFS_STATE_CLEAN;
+    else
+        sbi.s_state &= ~SFS_STATE_CLEAN;
+    memcpy(buf, &sbi, sizeof(sbi));
+    err = pwrite_all(buf, blk_size, (off_t)SFS_SB_START_NR * blk_size);
+    free(buf);
+    return err;
+}
+
+/* everything dirty to disk, the super block last */
+static int sync_all(int clean) {
+    int err = cache_flush();
+
+    if (!err)
+        err = write_super(clean);
+    if (!err && fsync(dev_fd))
+        err = -errno;
+    return err;
+}
+
+/* bit `nr' of the bitmap starting at blk `start', set to `val' if >= 0 */
+static int bitmap_bit(unsigned long start, unsigned long nr, int val) {
+    struct cblk *b = bread(start + nr / (blk_size * 8));
+    unsigned char *p, mask = 1 << (nr % 8);
+    int old;
+
+    if (!b)
+        return -EIO;
+    p = (unsigned char *)b->data + (nr % (blk_size * 8)) / 8;
+    old = !!(*p & mask);
+    if (val >= 0 && val != old) {
+        *p ^= mask;
+        bdirty(b);
+    }
+    brelse(b);
+    return old;
+}
+
+static int read_inode(unsigned long ino, struct sfs_inode_info *sii) {
+    unsigned long per_blk = SFS_INODES_PER_BLK(blk_size);
+    struct cblk *b;
+
+    if (ino >= sbi.s_inodes_count)
+        return -EIO;
+    b = bread(sbi.sfs_ino_start + ino / per_blk);
+    if (!b)
+        return -EIO;
+    memcpy(sii, (struct sfs_inode_info *)b->data + ino % per_blk,
+           sizeof(*sii));
+    brelse(b);
+    return 0;
+}
+
+static int write_inode(const struct sfs_inode_info *sii) {
+    unsigned long per_blk = SFS_INODES_PER_BLK(blk_size);
+    struct cblk *b;
+
+    b = bread(sbi.sfs_ino_start + sii->inode_no / per_blk);
+    if (!b)
+        return -EIO;
+    memcpy((struct sfs_inode_info *)b->data + sii->inode_no % per_blk, sii,
+           sizeof(*sii));
+    bdirty(b);
+    brelse(b);
+    return 0;
+}
+
+/* refcount table entry of `blk'(extra owners), set to `val' if >= 0 */
+static int refcnt(unsigned long blk, int val) {
+    struct cblk *b = bread(sbi.sfs_refcnt_start + blk / blk_size);
+    unsigned char *p;
+    int old;
+
+    if (!b)
+        return -EIO;
+    p = (unsigned char *)b->data + blk % blk_size;
+    old = *p;
+    if (val >= 0 && val != old) {
+        *p = val;
+        bdirty(b);
+    }
+    brelse(b);
+    return old;
+}
+
+/* next fit from where the last allocation ended. 0 if the fs is full */
+static unsigned long alloc_blk(void) {
+    unsigned long i, blk;
+
+    for (i = 0; i < sbi.s_blocks_count; i++) {
+        blk = (alloc_goal + i) % sbi.s_blocks_count;
+        if (bitmap_bit(sbi.sfs_blk_bitmap, blk, -1) == 0) {
+            bitmap_bit(sbi.sfs_blk_bitmap, blk, 1);
+            sbi.s_free_blocks--;
+            alloc_goal = blk + 1;
+            return blk;
+        }
+    }
+    return 0;
+}
+
+/* a file give up `blk'. A blk shared with a reflink clone just lose an owner */
+static void free_blk(unsigned long blk) {
+    int n = refcnt(blk, -1);
+
+    if (n > 0) {
+        refcnt(blk, n - 1);
+        return;
+    }
+    if (n == 0 && bitmap_bit(sbi.sfs_blk_bitmap, blk, 0) == 1)
+        sbi.s_free_blocks++;
+}
+
+/* zero the next batch of the lazily initialized inode table(see itable.c) */
+static int itable_grow(void) {
+    unsigned long n = sbi.s_itable_blocks - sbi.s_itable_zeroed, i;
+    struct cblk *b;
+
+    if (!n)
+        return -ENOSPC;
+    if (n > SFS_FUSE_ITABLE_BATCH)
+        n = SFS_FUSE_ITABLE_BATCH;
+    for (i = 0; i < n; i++) {
+        b = bzero_get(sbi.sfs_ino_start + sbi.s_itable_zeroed + i);
+        if (!b)
+            return -EIO;
+        bdirty(b);
+        brelse(b);
+    }
+    /* the super block is written after the dirty blks, see sync_all() */
+    sbi.s_itable_zeroed += n;
+    return 0;
+}
+
+static long alloc_inode(void) {
+    unsigned long per_blk = SFS_INODES_PER_BLK(blk_size), lim, ino;
+
+    for (;;) {
+        lim = sbi.s_itable_zeroed * per_blk;
+        if (lim > sbi.s_inodes_count)
+            lim = sbi.s_inodes_count;
+        for (ino = 0; ino < lim; ino++)
+            if (bitmap_bit(sbi.sfs_ino_bitmap, ino, -1) == 0) {
+                bitmap_bit(sbi.sfs_ino_bitmap, ino, 1);
+                sbi.s_free_inodes--;
+                return ino;
+            }
+        if (itable_grow())
+            return -ENOSPC;
+    }
+}
+
+/* give back the blks and the inode nr of `sii', wipe its record */
+static void free_inode(struct sfs_inode_info *sii) {
+    unsigned long ino = sii->inode_no;
+    int i;
+
+    for (i = 0; i < SFS_INO_NDIRECT; i++)
+        if (sii->directs[i])
+            free_blk(sii->directs[i]);
+    memset(sii, 0, sizeof(*sii));
+    sii->inode_no = ino;
+    write_inode(sii);
+    if (bitmap_bit(sbi.sfs_ino_bitmap, ino, 0) == 1)
+        sbi.s_free_inodes++;
+}
+
+/* unlink `ino' from the on-disk orphan list(see orphan.c) */
+static void orphan_del(unsigned long ino) {
+    struct sfs_inode_info rec, prev;
+    unsigned long p, n = 0;
+
+    if (read_inode(ino, &rec))
+        return;
+    if (sbi.s_last_orphan == ino) {
+        sbi.s_last_orphan = rec.i_next_orphan;
+        return;
+    }
+    for (p = sbi.s_last_orphan; p && n++ < sbi.s_inodes_count;
+         p = prev.i_next_orphan) {
+        if (read_inode(p, &prev))
+            return;
+        if (prev.i_next_orphan == ino) {
+            prev.i_next_orphan = rec.i_next_orphan;
+            write_inode(&prev);
+            return;
+        }
+    }
+}
+
+/* free whatever a crash left on the orphan list */
+static void orphan_replay(void) {
+    struct sfs_inode_info rec;
+    unsigned long ino, n = 0;
+
+    while ((ino = sbi.s_last_orphan) != 0) {
+        if (n++ >= sbi.s_inodes_count || read_inode(ino, &rec)) {
+            fprintf(stderr, "orphan list corrupted at [%lu], dropped\n", ino);
+            sbi.s_last_orphan = 0;
+            break;
+        }
+        sbi.s_last_orphan = rec.i_next_orphan;
+        free_inode(&rec);
+    }
+    if (n)
+        fprintf(stderr, "freed [%lu] orphan inodes\n", n);
+}
+
+static int dirent_match(struct sfs_dir_entry *de, const char *name) {
+    size_t len = strlen(name);
+
+    if (len > SFS_DIRENT_NAME_LEN || strncmp(de->name, name, len))
+        return 0;
+    return len == SFS_DIRENT_NAME_LEN || de->name[len] == '\0';
+}
+
+/*
+ * find `name' in dir `dir'. Return its ino, and where the entry is in
+ * `*blk'/`*idx' if they are not NULL. -ENOENT if there is no such entry
+ */
+static long dir_find(struct sfs_inode_info *dir, const char *name,
+                     unsigned long *blk, unsigned long *idx) {
+    struct sfs_dir_entry *de;
+    struct cblk *b;
+    unsigned long j;
+    long ino;
+    int i;
+
+    for (i = 0; i < SFS_INO_NDIRECT && dir->directs[i]; i++) {
+        b = bread(dir->directs[i]);
+        if (!b)
+            return -EIO;
+        de = (struct sfs_dir_entry *)b->data;
+        for (j = 0; j < SFS_DIRENTS_PER_BLK; j++)
+            if (de[j].name[0] && dirent_match(&de[j], name)) {
+                ino = de[j].inode_no;
+                if (blk)
+                    *blk = dir->directs[i];
+                if (idx)
+                    *idx = j;
+                brelse(b);
+                return ino;
+            }
+        brelse(b);
+    }
+    return -ENOENT;
+}
+
+static int dir_empty(struct sfs_inode_info *dir) {
+    struct sfs_dir_entry *de;
+    struct cblk *b;
+    unsigned long j;
+    int i, empty = 1;
+
+    for (i = 0; i < SFS_INO_NDIRECT && dir->directs[i] && empty; i++) {
+        b = bread(dir->directs[i]);
+        if (!b)
+            return 0;
+        de = (struct sfs_dir_entry *)b->data;
+        for (j = 0; j < SFS_DIRENTS_PER_BLK; j++)
+            if (de[j].name[0]) {
+                empty = 0;
+                break;
+            }
+        brelse(b);
+    }
+    return empty;
+}
+
+/* add entry `name' -> `ino' to `dir'. The dir record is written too */
+static int dir_add(struct sfs_inode_info *dir, const char *name,
+                   unsigned long ino) {
+    struct sfs_dir_entry *de;
+    struct cblk *b;
+    unsigned long j, blk;
+    int i;
+
+    for (i = 0; i < SFS_INO_NDIRECT; i++) {
+        if (!dir->directs[i]) {
+            /* every dir blk is full, take a new one */
+            blk = alloc_blk();
+            if (!blk)
+                return -ENOSPC;
+            b = bzero_get(blk);
+            if (!b) {
+                free_blk(blk);
+                return -EIO;
+            }
+            dir->directs[i] = blk;
+        } else {
+            b = bread(dir->directs[i]);
+            if (!b)
+                return -EIO;
+        }
+        de = (struct sfs_dir_entry *)b->data;
+        for (j = 0; j < SFS_DIRENTS_PER_BLK; j++)
+            if (!de[j].name[0])
+                break;
+        if (j < SFS_DIRENTS_PER_BLK) {
+            memset(&de[j], 0, sizeof(*de));
+            memcpy(de[j].name, name, strlen(name));
+            de[j].inode_no = ino;
+            bdirty(b);
+            brelse(b);
+            now(&dir->i_mtime, &dir->i_mtime_nsec);
+            dir->i_ctime = dir->i_mtime;
+            dir->i_ctime_nsec = dir->i_mtime_nsec;
+            return write_inode(dir);
+        }
+        brelse(b);
+    }
+    return -ENOSPC;
+}
+
+static int dir_del(struct sfs_inode_info *dir, const char *name) {
+    struct sfs_dir_entry *de;
+    unsigned long blk, idx;
+    struct cblk *b;
+    long ino;
+
+    ino = dir_find(dir, name, &blk, &idx);
+    if (ino < 0)
+        return ino;
+    b = bread(blk);
+    if (!b)
+        return -EIO;
+    de = (struct sfs_dir_entry *)b->data;
+    memset(&de[idx], 0, sizeof(*de));
+    bdirty(b);
+    brelse(b);
+    now(&dir->i_mtime, &dir->i_mtime_nsec);
+    dir->i_ctime = dir->i_mtime;
+    dir->i_ctime_nsec = dir->i_mtime_nsec;
+    return write_inode(dir);
+}
+
+/* walk `path' from the root. The record of the last component in `sii' */
+static int resolve(const char *path, struct sfs_inode_info *sii) {
+    char name[SFS_DIRENT_NAME_LEN + 1];
+    const char *p = path, *end;
+    long ino;
+    int err;
+
+    err = read_inode(SFS_ROOTINO, sii);
+    while (!err) {
+        while (*p == '/')
+            p++;
+        if (!*p)
+            break;
+        end = strchrnul(p, '/');
+        if (end - p > SFS_DIRENT_NAME_LEN)
+            return -ENAMETOOLONG;
+        if (!S_ISDIR(sii->mode))
+            return -ENOTDIR;
+        memcpy(name, p, end - p);
+        name[end - p] = '\0';
+        ino = dir_find(sii, name, NULL, NULL);
+        if (ino < 0)
+            return ino;
+        err = read_inode(ino, sii);
+        p = end;
+    }
+    return err;
+}
+
+/* split `path' into its parent dir(record in `dir') and last component */
+static int resolve_parent(const char *path, struct sfs_inode_info *dir,
+                          char *name) {
+    const char *slash = strrchr(path, '/');
+    char *parent;
+    int err;
+
+    if (!slash || !slash[1])
+        return -EINVAL;
+    if (strlen(slash + 1) > SFS_DIRENT_NAME_LEN)
+        return -ENAMETOOLONG;
+    strcpy(name, slash + 1);
+    parent = strndup(path, slash - path);
+    if (!parent)
+        return -ENOMEM;
+    err = resolve(parent, dir);
+    free(parent);
+    if (!err && !S_ISDIR(dir->mode))
+        err = -ENOTDIR;
+    return err;
+}
+
+/* the record of an open file, by handle, or by path when there is none */
+static int get_inode(const char *path, struct fuse_file_info *fi,
+                     struct sfs_inode_info *sii) {
+    if (fi)
+        return read_inode(fi->fh, sii);
+    return resolve(path, sii);
+}
+
+/*
+ * make directs[slot] of `sii' a blk the file own alone, allocating it if it
+ * is a hole. `*fresh' tell the caller whether it hold no data yet
+ */
+static struct cblk *writable_blk(struct sfs_inode_info *sii, int slot,
+                                 int *fresh) {
+    unsigned long old = sii->directs[slot], blk;
+    struct cblk *ob, *b;
+    int n;
+
+    *fresh = 0;
+    if (old) {
+        n = refcnt(old, -1);
+        if (n < 0)
+            return NULL;
+        if (n == 0)
+            return bread(old);
+    }
+    blk = alloc_blk();
+    if (!blk)
+        return NULL;
+    b = bzero_get(blk);
+    if (!b) {
+        free_blk(blk);
+        return NULL;
+    }
+    if (old) {
+        /* shared with a clone: copy on write, the clone keep the old blk */
+        ob = bread(old);
+        if (!ob) {
+            brelse(b);
+            free_blk(blk);
+            return NULL;
+        }
+        memcpy(b->data, ob->data, blk_size);
+        brelse(ob);
+        free_blk(old);
+    } else {
+        *fresh = 1;
+    }
+    bdirty(b);
+    sii->directs[slot] = blk;
+    return b;
+}
+
+/* cut or extend a file to `size' bytes. Caller hold the fs lock exclusive */
+static int do_truncate(struct sfs_inode_info *sii, off_t size) {
+    unsigned long keep = (size + blk_size - 1) / blk_size;
+    struct cblk *b;
+    int i, fresh;
+
+    if (!S_ISREG(sii->mode))
+        return -EISDIR;
+    if (sii->i_flags & SFS_COMPR_FL)
+        return -EOPNOTSUPP;
+    if (size < 0 || size > (off_t)blk_size * SFS_INO_NDIRECT)
+        return -EFBIG;
+    for (i = keep; i < SFS_INO_NDIRECT; i++)
+        if (sii->directs[i]) {
+            free_blk(sii->directs[i]);
+            sii->directs[i] = 0;
+        }
+    /* stale bytes past the new EOF must not come back if the file grow */
+    if (size % blk_size && (unsigned long)size < sii->file_size &&
+        sii->directs[keep - 1]) {
+        b = writable_blk(sii, keep - 1, &fresh);
+        if (!b)
+            return -ENOSPC;
+        memset(b->data + size % blk_size, 0, blk_size - size % blk_size);
+        bdirty(b);
+        brelse(b);
+    }
+    sii->file_size = size;
+    now(&sii->i_mtime, &sii->i_mtime_nsec);
+    sii->i_ctime = sii->i_mtime;
+    sii->i_ctime_nsec = sii->i_mtime_nsec;
+    return write_inode(sii);
+}
+
+/*========================= fuse operations =========================*/
+
+static void fill_stat(struct sfs_inode_info *sii, struct stat *st) {
+    int i;
+
+    memset(st, 0, sizeof(*st));
+    st->st_ino = sii->inode_no;
+    st->st_mode = sii->mode;
+    st->st_nlink = S_ISDIR(sii->mode) ? 2 : 1;
+    st->st_uid = fs_uid;
+    st->st_gid = fs_gid;
+    st->st_size = sii->file_size;
+    st->st_blksize = blk_size;
+    for (i = 0; i < SFS_INO_NDIRECT; i++)
+        if (sii->directs[i])
+            st->st_blocks += blk_size >> 9;
+    st->st_atim.tv_sec = sii->i_atime;
+    st->st_atim.tv_nsec = sii->i_atime_nsec;
+    st->st_mtim.tv_sec = sii->i_mtime;
+    st->st_mtim.tv_nsec = sii->i_mtime_nsec;
+    st->st_ctim.tv_sec = sii->i_ctime;
+    st->st_ctim.tv_nsec = sii->i_ctime_nsec;
+}
+
+static int sfs_getattr(const char *path, struct stat *st,
+                       struct fuse_file_info *fi) {
+    struct sfs_inode_info sii;
+    int err;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    err = get_inode(path, fi, &sii);
+    pthread_rwlock_unlock(&fs_lock);
+    if (!err)
+        fill_stat(&sii, st);
+    return err;
+}
+
+static int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                       off_t off, struct fuse_file_info *fi,
+                       enum fuse_readdir_flags flags) {
+    char name[SFS_DIRENT_NAME_LEN + 1];
+    struct sfs_inode_info dir;
+    struct sfs_dir_entry *de;
+    struct cblk *b;
+    unsigned long j;
+    int i, err;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    err = resolve(path, &dir);
+    if (!err && !S_ISDIR(dir.mode))
+        err = -ENOTDIR;
+    if (err)
+        goto out;
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    for (i = 0; i < SFS_INO_NDIRECT && dir.directs[i]; i++) {
+        b = bread(dir.directs[i]);
+        if (!b) {
+            err = -EIO;
+            break;
+        }
+        de = (struct sfs_dir_entry *)b->data;
+        for (j = 0; j < SFS_DIRENTS_PER_BLK; j++) {
+            if (!de[j].name[0])
+                continue;
+            memcpy(name, de[j].name, SFS_DIRENT_NAME_LEN);
+            name[SFS_DIRENT_NAME_LEN] = '\0';
+            filler(buf, name, NULL, 0, 0);
+        }
+        brelse(b);
+    }
+out:
+    pthread_rwlock_unlock(&fs_lock);
+    return err;
+}
+
+/* create a file or dir `path'. Its ino in `*inop' */
+static int make_node(const char *path, mode_t mode, unsigned long *inop) {
+    char name[SFS_DIRENT_NAME_LEN + 1];
+    struct sfs_inode_info dir, sii;
+    long ino;
+    int err;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    err = resolve_parent(path, &dir, name);
+    if (err)
+        goto out;
+    if (dir_find(&dir, name, NULL, NULL) >= 0) {
+        err = -EEXIST;
+        goto out;
+    }
+    ino = alloc_inode();
+    if (ino < 0) {
+        err = ino;
+        goto out;
+    }
+    memset(&sii, 0, sizeof(sii));
+    sii.mode = mode;
+    sii.inode_no = sii.slot_nr = ino;
+    now(&sii.i_mtime, &sii.i_mtime_nsec);
+    sii.i_atime = sii.i_ctime = sii.i_mtime;
+    sii.i_atime_nsec = sii.i_ctime_nsec = sii.i_mtime_nsec;
+    if (S_ISDIR(mode)) {
+        /* like the kernel, a dir start with one(zeroed) entry blk */
+        sii.file_size = blk_size;
+        sii.directs[0] = alloc_blk();
+        if (sii.directs[0]) {
+            struct cblk *b = bzero_get(sii.directs[0]);
+
+            if (b) {
+                bdirty(b);
+                brelse(b);
+            }
+        }
+    }
+    if (S_ISDIR(mode) && !sii.directs[0]) {
+        err = -ENOSPC;
+    } else {
+        err = write_inode(&sii);
+        if (!err)
+            err = dir_add(&dir, name, ino);
+    }
+    if (err)
+        free_inode(&sii);
+    else if (inop)
+        *inop = ino;
+out:
+    pthread_rwlock_unlock(&fs_lock);
+    return err;
+}
+
+static int sfs_mkdir(const char *path, mode_t mode) {
+    return make_node(path, S_IFDIR | (mode & 07777), NULL);
+}
+
+static int sfs_open_ino(unsigned long ino) {
+    pthread_mutex_lock(&open_lock);
+    open_count[ino]++;
+    pthread_mutex_unlock(&open_lock);
+    return 0;
+}
+
+static int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    unsigned long ino;
+    int err;
+
+    err = make_node(path, S_IFREG | (mode & 07777), &ino);
+    if (err)
+        return err;
+    fi->fh = ino;
+    return sfs_open_ino(ino);
+}
+
+static int sfs_open(const char *path, struct fuse_file_info *fi) {
+    struct sfs_inode_info sii;
+    int err;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    err = resolve(path, &sii);
+    if (!err)
+        sfs_open_ino(sii.inode_no);
+    pthread_rwlock_unlock(&fs_lock);
+    if (err)
+        return err;
+    fi->fh = sii.inode_no;
+    if (fi->flags & O_TRUNC && S_ISREG(sii.mode)) {
+        pthread_rwlock_wrlock(&fs_lock);
+        if (!read_inode(fi->fh, &sii))
+            do_truncate(&sii, 0);
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    return 0;
+}
+
+/* the last handle of an unlinked file is gone: free it now */
+static int sfs_release(const char *path, struct fuse_file_info *fi) {
+    struct sfs_inode_info sii;
+    int last;
+
+    pthread_mutex_lock(&open_lock);
+    last = !--open_count[fi->fh] && unlinked[fi->fh];
+    if (last)
+        unlinked[fi->fh] = 0;
+    pthread_mutex_unlock(&open_lock);
+    if (!last)
+        return 0;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    if (!read_inode(fi->fh, &sii)) {
+        orphan_del(fi->fh);
+        free_inode(&sii);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return 0;
+}
+
+static int remove_node(const char *path, int is_dir) {
+    char name[SFS_DIRENT_NAME_LEN + 1];
+    struct sfs_inode_info dir, sii;
+    long ino;
+    int err, busy;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    err = resolve_parent(path, &dir, name);
+    if (err)
+        goto out;
+    ino = dir_find(&dir, name, NULL, NULL);
+    if (ino < 0) {
+        err = ino;
+        goto out;
+    }
+    err = read_inode(ino, &sii);
+    if (err)
+        goto out;
+    if (is_dir && !S_ISDIR(sii.mode)) {
+        err = -ENOTDIR;
+        goto out;
+    }
+    if (!is_dir && S_ISDIR(sii.mode)) {
+        err = -EISDIR;
+        goto out;
+    }
+    if (is_dir && !dir_empty(&sii)) {
+        err = -ENOTEMPTY;
+        goto out;
+    }
+    err = dir_del(&dir, name);
+    if (err)
+        goto out;
+
+    pthread_mutex_lock(&open_lock);
+    busy = open_count[ino] != 0;
+    if (busy)
+        unlinked[ino] = 1;
+    pthread_mutex_unlock(&open_lock);
+    if (busy) {
+        /* still open: put it on the orphan list, freed on its last release */
+        sii.i_next_orphan = sbi.s_last_orphan;
+        sbi.s_last_orphan = ino;
+        err = write_inode(&sii);
+    } else {
+        free_inode(&sii);
+    }
+out:
+    pthread_rwlock_unlock(&fs_lock);
+    return err;
+}
+
+static int sfs_unlink(const char *path) {
+    return remove_node(path, 0);
+}
+
+static int sfs_rmdir(const char *path) {
+    return remove_node(path, 1);
+}
+
+static int sfs_rename(const char *from, const char *to, unsigned int flags) {
+    char fname[SFS_DIRENT_NAME_LEN + 1], tname[SFS_DIRENT_NAME_LEN + 1];
+    struct sfs_inode_info fdir, tdir, sii, old;
+    long ino, oino;
+    int err;
+
+    if (flags)
+        return -EINVAL;
+    /* a dir can not go below itself */
+    if (!strncmp(to, from, strlen(from)) && to[strlen(from)] == '/')
+        return -EINVAL;
+
+    /* replacing an existing file: remove it first, like unlink() would */
+    pthread_rwlock_rdlock(&fs_lock);
+    err = resolve(to, &old);
+    pthread_rwlock_unlock(&fs_lock);
+    if (!err && !strcmp(from, to))
+        return 0;
+    if (!err) {
+        pthread_rwlock_rdlock(&fs_lock);
+        err = resolve(from, &sii);
+        pthread_rwlock_unlock(&fs_lock);
+        if (err)
+            return err;
+        if (S_ISDIR(sii.mode) != S_ISDIR(old.mode))
+            return S_ISDIR(old.mode) ? -EISDIR : -ENOTDIR;
+        err = remove_node(to, S_ISDIR(old.mode));
+        if (err)
+            return err;
+    }
+
+    pthread_rwlock_wrlock(&fs_lock);
+    err = resolve_parent(from, &fdir, fname);
+    if (!err)
+        err = resolve_parent(to, &tdir, tname);
+    if (err)
+        goto out;
+    ino = dir_find(&fdir, fname, NULL, NULL);
+    if (ino < 0) {
+        err = ino;
+        goto out;
+    }
+    oino = dir_find(&tdir, tname, NULL, NULL);
+    if (oino >= 0) {
+        /* somebody recreated it meanwhile */
+        err = -EEXIST;
+        goto out;
+    }
+    err = dir_add(&tdir, tname, ino);
+    if (err)
+        goto out;
+    /* same dir: dir_add() changed the record we hold for it too */
+    if (fdir.inode_no == tdir.inode_no)
+        fdir = tdir;
+    err = dir_del(&fdir, fname);
+    if (!err && !read_inode(ino, &sii)) {
+        now(&sii.i_ctime, &sii.i_ctime_nsec);
+        err = write_inode(&sii);
+    }
+out:
+    pthread_rwlock_unlock(&fs_lock);
+    return err;
+}
+
+static int sfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    struct sfs_inode_info sii;
+    int err;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    err = get_inode(path, fi, &sii);
+    if (!err) {
+        sii.mode = (sii.mode & S_IFMT) | (mode & 07777);
+        now(&sii.i_ctime, &sii.i_ctime_nsec);
+        err = write_inode(&sii);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return err;
+}
+
+static int sfs_truncate(const char *path, off_t size,
+                        struct fuse_file_info *fi) {
+    struct sfs_inode_info sii;
+    int err;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    err = get_inode(path, fi, &sii);
+    if (!err)
+        err = do_truncate(&sii, size);
+    pthread_rwlock_unlock(&fs_lock);
+    return err;
+}
+
+static int sfs_utimens(const char *path, const struct timespec tv[2],
+                       struct fuse_file_info *fi) {
+    struct sfs_inode_info sii;
+    struct timespec ts[2];
+    int err, i;
+
+    for (i = 0; i < 2; i++) {
+        ts[i] = tv[i];
+        if (ts[i].tv_nsec == UTIME_NOW)
+            clock_gettime(CLOCK_REALTIME, &ts[i]);
+    }
+    pthread_rwlock_wrlock(&fs_lock);
+    err = get_inode(path, fi, &sii);
+    if (!err) {
+        if (ts[0].tv_nsec != UTIME_OMIT) {
+            sii.i_atime = ts[0].tv_sec;
+            sii.i_atime_nsec = ts[0].tv_nsec;
+        }
+        if (ts[1].tv_nsec != UTIME_OMIT) {
+            sii.i_mtime = ts[1].tv_sec;
+            sii.i_mtime_nsec = ts[1].tv_nsec;
+        }
+        now(&sii.i_ctime, &sii.i_ctime_nsec);
+        err = write_inode(&sii);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return err;
+}
+
+/*
+ * read without copying where we can: every run of consecutive blks that are
+ * on disk as they are becomes one fd buffer, which libfuse splice from the
+ * image straight into /dev/fuse. Holes and blks only the cache has up to
+ * date are handed over in memory. libfuse read the fd after we dropped the
+ * fs lock, so a read racing a write to the same range may see either data
+ */
+static int sfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                        size_t size, off_t off, struct fuse_file_info *fi) {
+    struct sfs_inode_info sii;
+    struct fuse_bufvec *bv;
+    struct fuse_buf *fb;
+    unsigned long slot, boff, n, done = 0, blk;
+    char *mem;
+    int err;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    err = read_inode(fi->fh, &sii);
+    if (!err && sii.i_flags & SFS_COMPR_FL)
+        err = -EOPNOTSUPP;
+    if (err)
+        goto unlock;
+    if ((unsigned long)off >= sii.file_size)
+        size = 0;
+    else if (off + size > sii.file_size)
+        size = sii.file_size - off;
+
+    /* at most one buffer per blk, plus one if the range is not aligned */
+    bv = calloc(1, sizeof(*bv) +
+                   (size / blk_size + 2) * sizeof(struct fuse_buf));
+    if (!bv) {
+        err = -ENOMEM;
+        goto unlock;
+    }
+    *bv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(0);
+    bv->count = 0;
+    fb = NULL;
+    while (done < size) {
+        slot = (off + done) / blk_size;
+        boff = (off + done) % blk_size;
+        n = blk_size - boff;
+        if (n > size - done)
+            n = size - done;
+        blk = slot < SFS_INO_NDIRECT ? sii.directs[slot] : 0;
+        mem = NULL;
+        if (!blk) {
+            mem = calloc(1, n);
+            if (!mem) {
+                err = -ENOMEM;
+                break;
+            }
+        } else {
+            mem = malloc(blk_size);
+            if (mem && bcopy_dirty(blk, mem)) {
+                memmove(mem, mem + boff, n);
+            } else {
+                /* on disk as it is(or no memory to copy it anyway) */
+                free(mem);
+                mem = NULL;
+            }
+        }
+        if (mem) {
+            fb = &bv->buf[bv->count++];
+            fb->mem = mem;
+            fb->size = n;
+            fb->flags = 0;
+            fb = NULL;  /* never merged with an fd run */
+            done += n;
+            continue;
+        }
+        if (fb && fb->pos + fb->size == (off_t)blk * blk_size + boff) {
+            fb->size += n;
+        } else {
+            fb = &bv->buf[bv->count++];
+            fb->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            fb->fd = dev_fd;
+            fb->pos = (off_t)blk * blk_size + boff;
+            fb->size = n;
+        }
+        done += n;
+    }
+    if (err) {
+        for (n = 0; n < bv->count; n++)
+            if (!(bv->buf[n].flags & FUSE_BUF_IS_FD))
+                free(bv->buf[n].mem);
+        free(bv);
+        goto unlock;
+    }
+    *bufp = bv;
+unlock:
+    pthread_rwlock_unlock(&fs_lock);
+    return err;
+}
+
+static int sfs_write(const char *path, const char *buf, size_t size,
+                     off_t off, struct fuse_file_info *fi) {
+    unsigned long slot, boff, n, done = 0, max;
+    struct sfs_inode_info sii;
+    struct cblk *b;
+    int err, fresh;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    err = read_inode(fi->fh, &sii);
+    if (!err && sii.i_flags & SFS_COMPR_FL)
+        err = -EOPNOTSUPP;
+    if (err)
+        goto out;
+    if (fi->flags & O_APPEND)
+        off = sii.file_size;
+    max = blk_size * SFS_INO_NDIRECT;
+    if ((unsigned long)off >= max) {
+        err = -EFBIG;
+        goto out;
+    }
+    if (off + size > max)
+        size = max - off;
+
+    while (done < size) {
+        slot = (off + done) / blk_size;
+        boff = (off + done) % blk_size;
+        n = blk_size - boff;
+        if (n > size - done)
+            n = size - done;
+        b = writable_blk(&sii, slot, &fresh);
+        if (!b) {
+            err = -ENOSPC;
+            break;
+        }
+        memcpy(b->data + boff, buf + done, n);
+        bdirty(b);
+        brelse(b);
+        done += n;
+    }
+    if (done) {
+        if (off + done > sii.file_size)
+            sii.file_size = off + done;
+        now(&sii.i_mtime, &sii.i_mtime_nsec);
+        sii.i_ctime = sii.i_mtime;
+        sii.i_ctime_nsec = sii.i_mtime_nsec;
+        write_inode(&sii);
+        err = 0;
+    }
+out:
+    pthread_rwlock_unlock(&fs_lock);
+    return err ? err : (int)done;
+}
+
+static int sfs_statfs(const char *path, struct statvfs *st) {
+    memset(st, 0, sizeof(*st));
+    pthread_rwlock_rdlock(&fs_lock);
+    st->f_bsize = st->f_frsize = blk_size;
+    st->f_blocks = sbi.s_blocks_count;
+    st->f_bfree = st->f_bavail = sbi.s_free_blocks;
+    st->f_files = sbi.s_inodes_count;
+    st->f_ffree = st->f_favail = sbi.s_free_inodes;
+    st->f_namemax = SFS_DIRENT_NAME_LEN;
+    pthread_rwlock_unlock(&fs_lock);
+    return 0;
+}
+
+/* no journal: fsync() of anything write out everything dirty */
+static int sfs_fsync(const char *path, int datasync,
+                     struct fuse_file_info *fi) {
+    int err;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    err = sync_all(0);
+    pthread_rwlock_unlock(&fs_lock);
+    return err;
+}
+
+static volatile int flusher_stop;
+static pthread_t flusher;
+
+/* like the kernel's writeback: dirty blks do not stay in memory for long */
+static void *flusher_thread(void *arg) {
+    int i;
+
+    while (!flusher_stop) {
+        for (i = 0; i < SFS_FUSE_FLUSH_SECS && !flusher_stop; i++)
+            sleep(1);
+        pthread_rwlock_rdlock(&fs_lock);
+        if (sync_all(0))
+            fprintf(stderr, "sfs-fuse: FAIL writing back dirty blks\n");
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    return NULL;
+}
+
+static void *sfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    /* sfs has no room for ".fuse_hidden*" names, free unlinked files itself */
+    cfg->hard_remove = 1;
+    cfg->nullpath_ok = 1;
+    cfg->use_ino = 1;
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+    if (pthread_create(&flusher, NULL, flusher_thread, NULL))
+        fprintf(stderr, "sfs-fuse: no writeback thread, sync by hand\n");
+    return NULL;
+}
+
+/* umount: like the kernel's put_super */
+static void sfs_destroy(void *data) {
+    flusher_stop = 1;
+    pthread_join(flusher, NULL);
+    pthread_rwlock_wrlock(&fs_lock);
+    if (sync_all(1))
+        fprintf(stderr, "sfs-fuse: FAIL writing back, run fsck\n");
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+static const struct fuse_operations sfs_ops = {
+    .init       = sfs_init,
+    .destroy    = sfs_destroy,
+    .getattr    = sfs_getattr,
+    .readdir    = sfs_readdir,
+    .mkdir      = sfs_mkdir,
+    .create     = sfs_create,
+    .open       = sfs_open,
+    .release    = sfs_release,
+    .unlink     = sfs_unlink,
+    .rmdir      = sfs_rmdir,
+    .rename     = sfs_rename,
+    .chmod      = sfs_chmod,
+    .truncate   = sfs_truncate,
+    .utimens    = sfs_utimens,
+    .read_buf   = sfs_read_buf,
+    .write      = sfs_write,
+    .statfs     = sfs_statfs,
+    .fsync      = sfs_fsync,
+};
+
+/*========================= mount =========================*/
+
+/* find the super block: blk 1, at whatever blk size it was made with */
+static int load_super(void) {
+    struct sfs_sb_info *dsbi;
+    unsigned long bs;
+    char *buf;
+
+    buf = malloc(SFS_MAX_BLK_SIZE * 2);
+    if (!buf)
+        return -ENOMEM;
+    for (bs = SFS_MIN_BLK_SIZE; bs <= SFS_MAX_BLK_SIZE; bs <<= 1) {
+        if (pread_all(buf, sizeof(*dsbi), (off_t)bs * SFS_SB_START_NR))
+            break;
+        dsbi = (struct sfs_sb_info *)buf;
+        if (dsbi->magic == SFS_MAGIC_NUMBER && dsbi->blk_size == bs) {
+            memcpy(&sbi, dsbi, sizeof(sbi));
+            free(buf);
+            return 0;
+        }
+    }
+    free(buf);
+    fprintf(stderr, "FAIL find a sfs super block !!\n");
+    return -EINVAL;
+}
+
+/* the same checks as sfs_fill_sb() */
+static int check_super(off_t dev_size) {
+    if (sbi.version != SFS_VERSION) {
+        fprintf(stderr, "FAIL check version: [%lu], we know [%d]. "
+                        "re-run mkfs.sfs !!\n", sbi.version, SFS_VERSION);
+        return -EINVAL;
+    }
+    if (!sbi.s_blocks_count || sbi.s_blocks_count > UINT32_MAX ||
+        sbi.s_blocks_count > sbi.s_bmap_blocks * sbi.blk_size * 8 ||
+        sbi.sfs_blk_bitmap + sbi.s_bmap_blocks > sbi.s_blocks_count ||
+        (dev_size && sbi.s_blocks_count > dev_size / sbi.blk_size) ||
+        !sbi.s_inodes_count || sbi.s_inodes_count > sbi.blk_size * 8 ||
+        sbi.s_inodes_count > SFS_MAX_INODES ||
+        sbi.s_inodes_count > sbi.s_itable_blocks *
+                             SFS_INODES_PER_BLK(sbi.blk_size) ||
+        !sbi.s_itable_zeroed || sbi.s_itable_zeroed > sbi.s_itable_blocks ||
+        sbi.sfs_ino_start + sbi.s_itable_blocks > sbi.s_blocks_count ||
+        sbi.s_refcnt_blocks * sbi.blk_size < sbi.s_blocks_count ||
+        (sbi.s_chlog_blocks && sbi.s_chlog_start !=
+            sbi.sfs_refcnt_start + sbi.s_refcnt_blocks) ||
+        SFS_DATA_START(&sbi) > sbi.s_blocks_count) {
+        fprintf(stderr, "FAIL check geometry: blocks[%lu] inodes[%lu]\n",
+                sbi.s_blocks_count, sbi.s_inodes_count);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* recount the free blks/inodes after an unclean umount */
+static void count_free(void) {
+    unsigned long i;
+
+    sbi.s_free_blocks = sbi.s_free_inodes = 0;
+    for (i = 0; i < sbi.s_blocks_count; i++)
+        if (bitmap_bit(sbi.sfs_blk_bitmap, i, -1) == 0)
+            sbi.s_free_blocks++;
+    for (i = 0; i < sbi.s_inodes_count; i++)
+        if (bitmap_bit(sbi.sfs_ino_bitmap, i, -1) == 0)
+            sbi.s_free_inodes++;
+}
+
+static struct options {
+    const char *image;
+    unsigned long cache_blks;
+    int show_help;
+} options;
+
+#define OPTION(t, p) { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+    OPTION("cache=%lu", cache_blks),
+    OPTION("-h", show_help),
+    OPTION("--help", show_help),
+    FUSE_OPT_END
+};
+
+/* the first non-option argument is the image, the rest go to libfuse */
+static int opt_proc(void *data, const char *arg, int key,
+                    struct fuse_args *outargs) {
+    if (key == FUSE_OPT_KEY_NONOPT && !options.image) {
+        options.image = strdup(arg);
+        return 0;
+    }
+    return 1;
+}
+
+void usage() {
+    fprintf(stderr, "\nusage: sfs-fuse [options] image mountpoint\n"
+                    "  -o cache=N  blks in the block cache. default %d\n"
+                    "  -s          single threaded\n"
+                    "  -f          stay in the foreground\n\n",
+            SFS_FUSE_CACHE_BLKS);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct stat st;
+    off_t dev_size = 0;
+    int ret;
+
+    options.cache_blks = SFS_FUSE_CACHE_BLKS;
+    if (fuse_opt_parse(&args, &options, option_spec, opt_proc) == -1)
+        return 1;
+    if (options.show_help || !options.image) {
+        usage();
+        if (options.show_help)
+            fuse_opt_add_arg(&args, "--help");
+        else
+            return 1;
+    } else {
+        dev_fd = open(options.image, O_RDWR);
+        if (dev_fd < 0 || fstat(dev_fd, &st)) {
+            perror("Cannot open image");
+            return 1;
+        }
+        if (S_ISREG(st.st_mode))
+            dev_size = st.st_size;
+        if (load_super() || check_super(dev_size))
+            return 1;
+        blk_size = sbi.blk_size;
+        if (cache_init(options.cache_blks < 16 ? 16 : options.cache_blks))
+            return 1;
+        open_count = calloc(sbi.s_inodes_count, sizeof(*open_count));
+        unlinked = calloc(sbi.s_inodes_count, 1);
+        if (!open_count || !unlinked)
+            return 1;
+        fs_uid = getuid();
+        fs_gid = getgid();
+        alloc_goal = SFS_DATA_START(&sbi);
+
+        if (!(sbi.s_state & SFS_STATE_CLEAN)) {
+            fprintf(stderr, "sfs not cleanly umounted, counting bitmaps\n");
+            count_free();
+        }
+        orphan_replay();
+        /*
+         * we keep no change log, so its readers have to be told that the
+         * next kernel mount come after unlogged changes(see chlog.c)
+         */
+        if (sbi.s_chlog_blocks)
+            sbi.s_state |= SFS_STATE_CHLOG_GAP;
+        /* until a clean umount, the free counts on disk are not trusted */
+        if (sync_all(0))
+            return 1;
+    }
+
+    ret = fuse_main(args.argc, args.argv, &sfs_ops, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
+}
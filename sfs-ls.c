@@ -0,0 +1,160 @@
+/*
+ *  sfs-ls.c
+ *
+ *  List a directory of an sfs image without mounting it(see libsfs.h).
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libsfs.h"
+
+static struct sfs_image img;
+static int long_fmt, recursive;
+
+void usage() {
+    fprintf(stderr, "\nusage: sfs-ls [-l] [-R] /path/to/image(or device) "
+                    "[path]\n"
+                    "  -l  long listing: ino, mode, size, mtime\n"
+                    "  -R  list subdirs too\n\n");
+}
+
+static void mode_str(mode_t mode, char *s) {
+    const char *rwx = "rwxrwxrwx";
+    int i;
+
+    s[0] = S_ISDIR(mode) ? 'd' : S_ISREG(mode) ? '-' : '?';
+    for (i = 0; i < 9; i++)
+        s[i + 1] = (mode & (0400 >> i)) ? rwx[i] : '-';
+    s[10] = '\0';
+}
+
+static void print_entry(const struct sfs_dir_entry *de, int len) {
+    const struct sfs_inode_info *sii = sfs_inode(&img, de->inode_no);
+    char mode[11], date[32];
+    time_t t;
+
+    if (!long_fmt) {
+        printf("%.*s\n", len, de->name);
+        return;
+    }
+    if (!sii) {
+        printf("%5u ?????????? %10s %16s %.*s\n", de->inode_no, "?", "?",
+               len, de->name);
+        return;
+    }
+    mode_str(sii->mode, mode);
+    t = sii->i_mtime;
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&t));
+    printf("%5u %s %10lu %16s %.*s%s\n", de->inode_no, mode, sii->file_size,
+           date, len, de->name, (sii->i_flags & SFS_COMPR_FL) ? " [c]" : "");
+}
+
+/* `path' is how the user named `dir', for -R headers */
+static int list_dir(const struct sfs_inode_info *dir, const char *path,
+                    int depth) {
+    const struct sfs_inode_info *sii;
+    const struct sfs_dir_entry *de;
+    struct sfs_dirent_iter it;
+    char *sub;
+    int err, len;
+
+    if (recursive)
+        printf("%s%s:\n", depth ? "\n" : "", path);
+    err = sfs_dirent_iter_init(&it, &img, dir);
+    if (err)
+        return err;
+    while ((de = sfs_dirent_next(&it)))
+        print_entry(de, sfs_dirent_namelen(de));
+    if (!recursive)
+        return 0;
+
+    /* sfs has no hard links to dirs, so this can not loop forever */
+    sfs_dirent_iter_init(&it, &img, dir);
+    while ((de = sfs_dirent_next(&it))) {
+        sii = sfs_inode(&img, de->inode_no);
+        if (!sii || !S_ISDIR(sii->mode) || depth > (int)img.nr_inodes)
+            continue;
+        len = sfs_dirent_namelen(de);
+        if (asprintf(&sub, "%s%s%.*s", path,
+                     path[strlen(path) - 1] == '/' ? "" : "/", len,
+                     de->name) < 0)
+            return -ENOMEM;
+        err = list_dir(sii, sub, depth + 1);
+        free(sub);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct sfs_inode_info *sii;
+    const char *path = "/", *name;
+    struct sfs_dir_entry de;
+    long ino;
+    int opt, err;
+
+    while ((opt = getopt(argc, argv, "lR")) != -1) {
+        switch (opt) {
+        case 'l':
+            long_fmt = 1;
+            break;
+        case 'R':
+            recursive = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage();
+        return 1;
+    }
+    if (optind == argc - 2)
+        path = argv[optind + 1];
+
+    err = sfs_open(&img, argv[optind]);
+    if (err) {
+        fprintf(stderr, "cannot open %s: %s\n", argv[optind], strerror(-err));
+        return 1;
+    }
+    ino = sfs_lookup(&img, path);
+    if (ino < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(-ino));
+        err = (int)ino;
+        goto out;
+    }
+    sii = sfs_inode(&img, ino);
+    if (!S_ISDIR(sii->mode)) {
+        /* like ls, a file list itself */
+        name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        memset(&de, 0, sizeof(de));
+        memcpy(de.name, name, strnlen(name, SFS_DIRENT_NAME_LEN));
+        de.inode_no = ino;
+        print_entry(&de, sfs_dirent_namelen(&de));
+        goto out;
+    }
+    err = list_dir(sii, path, 0);
+    if (err)
+        fprintf(stderr, "%s: %s\n", path, strerror(-err));
+out:
+    sfs_close(&img);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,745 @@
+/*
+ *  sfs-pack.c
+ *
+ *  Build a populated sfs image straight from a directory tree, without the
+ *  kernel module(like `mke2fs -d' or mksquashfs). The tree is walked
+ *  breadth-first and everything is laid out as it is met:
+ *    - inode nrs are given out in that order, so the records of a dir's
+ *      children sit next to each other in the inode table
+ *    - a dir's entries are packed densely(sorted by name, no holes) into
+ *      contiguous blks, followed by the data of its files, each file's blks
+ *      contiguous too
+ *  So the data area is written front to back in one streaming pass, in
+ *  large sequential writes, and the inode table, the bitmaps and the super
+ *  block go out in bulk at the end. A first pass over the tree only stat()
+ *  things, to size the image and to refuse what sfs can not hold before
+ *  anything is written.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>       /* BLKGETSIZE64, BLKZEROOUT */
+#include <stdint.h>
+#include <string.h>
+
+#include "sfs.h"
+
+#define SFS_DEFAULT_INODE_RATIO 16384   /* bytes of fs per inode, as mkfs */
+#define SFS_IO_SIZE (4 << 20)           /* bytes written at a time */
+
+/* one entry of a source dir */
+struct pack_ent {
+    char name[SFS_DIRENT_NAME_LEN + 1];
+    struct stat st;
+};
+
+/* a source dir waiting to be packed */
+struct pack_dir {
+    char *path;
+    unsigned long ino;
+    struct stat st;
+};
+
+/* the data area is written through this, front to back */
+struct pack_out {
+    int fd;
+    unsigned long blk_size;
+    char *buf;
+    unsigned long cap;      /* blks the buffer hold */
+    unsigned long start;    /* blk nr of buf[0] */
+    unsigned long n;        /* blks in the buffer */
+    unsigned long limit;    /* one past the last blk of the fs */
+};
+
+static unsigned long blk_size = SFS_BLK_SIZE;
+static unsigned long dirents_per_blk;
+
+void usage() {
+    fprintf(stderr, "\nusage: sfs-pack [-b blocksize] [-N inodes | -i bytes-per-inode] "
+                    "[-m free-blocks] /source/dir /path/to/image(or device) "
+                    "[blocks]\n"
+                    "  -b  blk size in bytes, a power of 2 in [%d, %d]. "
+                    "default %d\n"
+                    "  -N  number of inodes. default just enough for the tree\n"
+                    "  -i  one inode per this many bytes of fs\n"
+                    "  -m  leave this many free blks in an image file. "
+                    "default 0\n"
+                    "  blocks  size of the fs in blks. default the whole "
+                    "device, or just enough for an image file\n"
+                    "Only regular files and dirs are packed, hard links are "
+                    "copied\n\n",
+            SFS_MIN_BLK_SIZE, SFS_MAX_BLK_SIZE, SFS_BLK_SIZE);
+}
+
+static unsigned long div_round_up(unsigned long n, unsigned long d) {
+    return (n + d - 1) / d;
+}
+
+/* pwrite() all of `len' bytes. 0 on success */
+static int write_all(int fd, const char *buf, size_t len, off_t off) {
+    ssize_t n;
+
+    while (len) {
+        n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* read() up to `len' bytes, less only at EOF. -1 on error */
+static ssize_t read_full(int fd, char *buf, size_t len) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * write blks [start, start + count) of a bitmap whose first `nset' bits are
+ * set and the rest clear. SFS_IO_SIZE at a time, blk aligned
+ */
+static int write_bitmap(int fd, unsigned long start, unsigned long count,
+                        unsigned long nset) {
+    unsigned long chunk = SFS_IO_SIZE / blk_size, n, i, bit, first;
+    char *buf;
+    int ret = 0;
+
+    buf = malloc(chunk * blk_size);
+    if (!buf)
+        return -1;
+    for (i = 0; i < count && !ret; i += n) {
+        n = count - i < chunk ? count - i : chunk;
+        first = i * blk_size * 8;
+        memset(buf, 0, n * blk_size);
+        /* whole bytes first, the bit loop is only for the last one */
+        if (nset > first) {
+            bit = nset - first < n * blk_size * 8 ? nset - first
+                                                  : n * blk_size * 8;
+            memset(buf, 0xff, bit / 8);
+            for (bit = bit / 8 * 8; first + bit < nset &&
+                                    bit < n * blk_size * 8; bit++)
+                buf[bit / 8] |= 1 << (bit % 8);
+        }
+        ret = write_all(fd, buf, n * blk_size, (off_t)(start + i) * blk_size);
+    }
+    free(buf);
+    return ret;
+}
+
+/* zero blks [start, start + count), in one ioctl if the device can do it */
+static int zero_blks(int fd, int is_bdev, unsigned long start,
+                     unsigned long count) {
+    unsigned long chunk = SFS_IO_SIZE / blk_size, n, i;
+    uint64_t range[2] = {(uint64_t)start * blk_size,
+                         (uint64_t)count * blk_size};
+    char *buf;
+    int ret = 0;
+
+    if (is_bdev && ioctl(fd, BLKZEROOUT, range) == 0)
+        return 0;
+    buf = calloc(chunk, blk_size);
+    if (!buf)
+        return -1;
+    for (i = 0; i < count && !ret; i += n) {
+        n = count - i < chunk ? count - i : chunk;
+        ret = write_all(fd, buf, n * blk_size, (off_t)(start + i) * blk_size);
+    }
+    free(buf);
+    return ret;
+}
+
+static int ent_cmp(const void *a, const void *b) {
+    return strcmp(((const struct pack_ent *)a)->name,
+                  ((const struct pack_ent *)b)->name);
+}
+
+static char *path_join(const char *dir, const char *name) {
+    char *p = malloc(strlen(dir) + strlen(name) + 2);
+
+    if (p)
+        sprintf(p, "%s/%s", dir, name);
+    return p;
+}
+
+/*
+ * the regular files and dirs of `path', sorted by name. What sfs can not
+ * hold is an error, other file types are skipped(told about if `warn').
+ * Return the number of entries, -1 on error
+ */
+static long list_dir(const char *path, struct pack_ent **out, int warn) {
+    struct pack_ent *ents = NULL, *tmp;
+    long n = 0, max = 0;
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+
+    d = opendir(path);
+    if (!d) {
+        fprintf(stderr, "cannot open dir %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            fprintf(stderr, "cannot stat %s/%s: %s\n", path, de->d_name,
+                    strerror(errno));
+            goto fail;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            if (warn)
+                fprintf(stderr, "%s/%s: not a regular file or dir, "
+                                "skipped\n", path, de->d_name);
+            continue;
+        }
+        if (strlen(de->d_name) > SFS_DIRENT_NAME_LEN) {
+            fprintf(stderr, "%s/%s: name longer than %d chars\n", path,
+                    de->d_name, SFS_DIRENT_NAME_LEN);
+            goto fail;
+        }
+        if (S_ISREG(st.st_mode) &&
+            (uint64_t)st.st_size > (uint64_t)blk_size * SFS_INO_NDIRECT) {
+            fprintf(stderr, "%s/%s: larger than %lu bytes\n", path,
+                    de->d_name, blk_size * SFS_INO_NDIRECT);
+            goto fail;
+        }
+        if (n == max) {
+            max = max ? max * 2 : 64;
+            tmp = realloc(ents, max * sizeof(struct pack_ent));
+            if (!tmp) {
+                perror("Cannot alloc dir entries");
+                goto fail;
+            }
+            ents = tmp;
+        }
+        strcpy(ents[n].name, de->d_name);
+        ents[n].st = st;
+        n++;
+    }
+    closedir(d);
+    if (n > (long)(dirents_per_blk * SFS_INO_NDIRECT)) {
+        fprintf(stderr, "%s: more than %lu entries\n", path,
+                dirents_per_blk * SFS_INO_NDIRECT);
+        free(ents);
+        return -1;
+    }
+    qsort(ents, n, sizeof(struct pack_ent), ent_cmp);
+    *out = ents;
+    return n;
+
+fail:
+    closedir(d);
+    free(ents);
+    return -1;
+}
+
+/* a FIFO of dirs, for the breadth-first walk */
+static struct pack_dir *queue;
+static size_t queue_head, queue_tail, queue_max;
+
+static int queue_push(const char *path, unsigned long ino,
+                      const struct stat *st) {
+    struct pack_dir *tmp;
+
+    if (queue_tail == queue_max) {
+        queue_max = queue_max ? queue_max * 2 : 256;
+        tmp = realloc(queue, queue_max * sizeof(struct pack_dir));
+        if (!tmp)
+            return -1;
+        queue = tmp;
+    }
+    queue[queue_tail].path = strdup(path);
+    if (!queue[queue_tail].path)
+        return -1;
+    queue[queue_tail].ino = ino;
+    queue[queue_tail].st = *st;
+    queue_tail++;
+    return 0;
+}
+
+static void queue_reset(void) {
+    while (queue_head < queue_tail)
+        free(queue[queue_head++].path);
+    queue_head = queue_tail = 0;
+}
+
+/* how many inodes and data blks the tree under `root' need. 0 on success */
+static int scan_tree(const char *root, const struct stat *rst,
+                     unsigned long *inodes, unsigned long *blks) {
+    struct pack_ent *ents;
+    struct pack_dir *dir;
+    char *path;
+    long n, i;
+    int err = 0;
+
+    *inodes = 1;
+    *blks = 0;
+    if (queue_push(root, 0, rst))
+        return -1;
+    while (!err && queue_head < queue_tail) {
+        dir = &queue[queue_head];
+        n = list_dir(dir->path, &ents, 1);
+        if (n < 0) {
+            err = -1;
+            break;
+        }
+        *inodes += n;
+        *blks += div_round_up(n, dirents_per_blk);
+        for (i = 0; i < n && !err; i++) {
+            if (S_ISREG(ents[i].st.st_mode)) {
+                *blks += div_round_up(ents[i].st.st_size, blk_size);
+                continue;
+            }
+            path = path_join(queue[queue_head].path, ents[i].name);
+            if (!path || queue_push(path, 0, &ents[i].st))
+                err = -1;
+            free(path);
+        }
+        free(ents);
+        free(queue[queue_head++].path);
+    }
+    queue_reset();
+    return err;
+}
+
+/* room for at least one more blk in the buffer, `limit' permitting */
+static unsigned long out_space(struct pack_out *o) {
+    if (o->n == o->cap) {
+        if (write_all(o->fd, o->buf, o->n * o->blk_size,
+                      (off_t)o->start * o->blk_size))
+            return 0;
+        o->start += o->n;
+        o->n = 0;
+    }
+    if (o->start + o->cap > o->limit)
+        return o->limit - o->start - o->n;
+    return o->cap - o->n;
+}
+
+static int out_flush(struct pack_out *o) {
+    if (o->n && write_all(o->fd, o->buf, o->n * o->blk_size,
+                          (off_t)o->start * o->blk_size))
+        return -1;
+    o->start += o->n;
+    o->n = 0;
+    return 0;
+}
+
+static unsigned long out_cursor(struct pack_out *o) {
+    return o->start + o->n;
+}
+
+/* fill in the inode record of `ino' */
+static void set_inode(char *itable, unsigned long ino, const struct stat *st,
+                      unsigned long first, unsigned long nblks,
+                      unsigned long size) {
+    struct sfs_inode_info *rec = (struct sfs_inode_info *)
+        (itable + ino / SFS_INODES_PER_BLK(blk_size) * blk_size) +
+        ino % SFS_INODES_PER_BLK(blk_size);
+    unsigned long i;
+
+    memset(rec, 0, sizeof(struct sfs_inode_info));
+    rec->mode = st->st_mode & (S_IFMT | 07777);
+    rec->inode_no = ino;
+    rec->slot_nr = ino;
+    for (i = 0; i < nblks; i++)
+        rec->directs[i] = first + i;
+    rec->file_size = size;
+    rec->i_atime = st->st_atim.tv_sec;
+    rec->i_atime_nsec = st->st_atim.tv_nsec;
+    rec->i_mtime = st->st_mtim.tv_sec;
+    rec->i_mtime_nsec = st->st_mtim.tv_nsec;
+    rec->i_ctime = st->st_ctim.tv_sec;
+    rec->i_ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/* stream the data of regular file `path' to `o'. Return its first blk */
+static long pack_file(struct pack_out *o, const char *path,
+                      const struct stat *st) {
+    unsigned long first = out_cursor(o), left, space, n;
+    ssize_t got;
+    int fd;
+
+    left = div_round_up(st->st_size, blk_size);
+    if (!left)
+        return 0;
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (left) {
+        space = out_space(o);
+        if (!space) {
+            fprintf(stderr, "%s: out of space(did the tree change?)\n", path);
+            close(fd);
+            return -1;
+        }
+        n = left < space ? left : space;
+        /* straight into the output buffer, a file that shrank read zeros */
+        got = read_full(fd, o->buf + o->n * blk_size, n * blk_size);
+        if (got < 0) {
+            fprintf(stderr, "cannot read %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        memset(o->buf + o->n * blk_size + got, 0, n * blk_size - got);
+        o->n += n;
+        left -= n;
+    }
+    close(fd);
+    return first;
+}
+
+/*
+ * the streaming pass: walk the tree again, write dir blks and file data
+ * through `o', and fill in the inode table. `*nr_inodes' come back as the
+ * number of inode nrs used
+ */
+static int pack_tree(const char *root, const struct stat *rst,
+                     struct pack_out *o, char *itable, unsigned long inodes,
+                     unsigned long *nr_inodes) {
+    struct sfs_dir_entry *de;
+    struct pack_ent *ents;
+    struct pack_dir dir;
+    unsigned long next_ino = 1, first, nblks, i;
+    char *path;
+    long n, blk;
+    int err = 0;
+
+    if (queue_push(root, SFS_ROOTINO, rst))
+        return -1;
+    while (!err && queue_head < queue_tail) {
+        dir = queue[queue_head++];
+        n = list_dir(dir.path, &ents, 0);
+        if (n < 0) {
+            free(dir.path);
+            err = -1;
+            break;
+        }
+        if (next_ino + n > inodes) {
+            fprintf(stderr, "out of inodes(did the tree change?)\n");
+            free(ents);
+            free(dir.path);
+            err = -1;
+            break;
+        }
+
+        /* the entries, densely, in as few blks as they fit */
+        first = out_cursor(o);
+        nblks = div_round_up(n, dirents_per_blk);
+        for (i = 0; i < (unsigned long)n; i++) {
+            if (i % dirents_per_blk == 0) {
+                if (!out_space(o)) {
+                    fprintf(stderr, "out of space(did the tree change?)\n");
+                    err = -1;
+                    break;
+                }
+                memset(o->buf + o->n * blk_size, 0, blk_size);
+                o->n++;
+            }
+            de = (struct sfs_dir_entry *)(o->buf + (o->n - 1) * blk_size) +
+                 i % dirents_per_blk;
+            /* not '\0' terminated when it use all the bytes */
+            memcpy(de->name, ents[i].name, strlen(ents[i].name));
+            de->inode_no = next_ino + i;
+        }
+        /* a dir's size is always one blk, as the kernel make them */
+        set_inode(itable, dir.ino, &dir.st, first, err ? 0 : nblks, blk_size);
+
+        /* then the data of its files, and its subdirs go to the queue */
+        for (i = 0; i < (unsigned long)n && !err; i++) {
+            path = path_join(dir.path, ents[i].name);
+            if (!path) {
+                err = -1;
+                break;
+            }
+            if (S_ISDIR(ents[i].st.st_mode)) {
+                err = queue_push(path, next_ino + i, &ents[i].st);
+            } else {
+                blk = pack_file(o, path, &ents[i].st);
+                if (blk < 0)
+                    err = -1;
+                else
+                    set_inode(itable, next_ino + i, &ents[i].st, blk,
+                              div_round_up(ents[i].st.st_size, blk_size),
+                              ents[i].st.st_size);
+            }
+            free(path);
+        }
+        next_ino += n;
+        free(ents);
+        free(dir.path);
+    }
+    queue_reset();
+    if (!err)
+        err = out_flush(o);
+    *nr_inodes = next_ino;
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long blocks = 0, inodes = 0, ratio = 0, extra = 0;
+    unsigned long max_inodes, per_blk, need_inodes, need_blks, nr_inodes;
+    unsigned long bmap_blks = 0, itable_blks = 0, refcnt_blks = 0;
+    unsigned long data_start = 0, prev, i;
+    uint64_t dev_size = 0;
+    int opt, fd, is_bdev;
+    struct pack_out out;
+    struct stat st, rst;
+    char *buffer, *itable, *end;
+
+    while ((opt = getopt(argc, argv, "b:N:i:m:")) != -1) {
+        switch (opt) {
+        case 'b':
+            blk_size = strtoul(optarg, &end, 0);
+            if (*end != '\0' || blk_size < SFS_MIN_BLK_SIZE ||
+                blk_size > SFS_MAX_BLK_SIZE || (blk_size & (blk_size - 1))) {
+                fprintf(stderr, "invalid blk size: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'N':
+            inodes = strtoul(optarg, &end, 0);
+            if (*end != '\0' || !inodes) {
+                fprintf(stderr, "invalid inode count: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'i':
+            ratio = strtoul(optarg, &end, 0);
+            if (*end != '\0' || ratio < SFS_MIN_BLK_SIZE) {
+                fprintf(stderr, "invalid bytes-per-inode: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'm':
+            extra = strtoul(optarg, &end, 0);
+            if (*end != '\0') {
+                fprintf(stderr, "invalid free blks: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (optind != argc - 2 && optind != argc - 3) {
+        usage();
+        return -1;
+    }
+    if (optind == argc - 3) {
+        blocks = strtoul(argv[optind + 2], &end, 0);
+        if (*end != '\0' || !blocks) {
+            fprintf(stderr, "invalid blocks count: %s\n", argv[optind + 2]);
+            usage();
+            return -1;
+        }
+    }
+    dirents_per_blk = blk_size / sizeof(struct sfs_dir_entry);
+    per_blk = SFS_INODES_PER_BLK(blk_size);
+    max_inodes = blk_size * 8 < SFS_MAX_INODES ? blk_size * 8 : SFS_MAX_INODES;
+
+    if (stat(argv[optind], &rst) || !S_ISDIR(rst.st_mode)) {
+        fprintf(stderr, "%s: not a dir\n", argv[optind]);
+        return -1;
+    }
+    if (scan_tree(argv[optind], &rst, &need_inodes, &need_blks))
+        return -1;
+    if (need_inodes > max_inodes) {
+        fprintf(stderr, "[%lu] files and dirs, at most [%lu] fit with blk "
+                        "size [%lu]\n", need_inodes, max_inodes, blk_size);
+        return -1;
+    }
+
+    fd = open(argv[optind + 1], O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st)) {
+        perror("Cannot open image");
+        return -1;
+    }
+    is_bdev = S_ISBLK(st.st_mode);
+    if (is_bdev && ioctl(fd, BLKGETSIZE64, &dev_size)) {
+        perror("Cannot get device size");
+        return -1;
+    }
+    if (!blocks && is_bdev)
+        blocks = dev_size / blk_size;
+
+    /*
+     * plan the layout as mkfs.sfs do. For an image file sized to fit, the
+     * metadata size and the fs size depend on each other, go around until
+     * they agree(it only ever grow, so this end quickly)
+     */
+    prev = 0;
+    for (i = 0; i < 64; i++) {
+        unsigned long b = blocks ? blocks : prev;
+
+        if (inodes)
+            nr_inodes = inodes;
+        else if (ratio)
+            nr_inodes = (uint64_t)b * blk_size / ratio;
+        else if (blocks)
+            nr_inodes = (uint64_t)b * blk_size / SFS_DEFAULT_INODE_RATIO;
+        else
+            nr_inodes = need_inodes;
+        if (nr_inodes < need_inodes)
+            nr_inodes = need_inodes;
+        if (nr_inodes > max_inodes)
+            nr_inodes = max_inodes;
+        itable_blks = div_round_up(nr_inodes, per_blk);
+        nr_inodes = itable_blks * per_blk;
+        if (nr_inodes > max_inodes)
+            nr_inodes = max_inodes;
+
+        bmap_blks = div_round_up(b ? b : 1, blk_size * 8);
+        refcnt_blks = div_round_up(b ? b : 1, blk_size);
+        data_start = SFS_SB_START_NR + 2 + bmap_blks + itable_blks +
+                     refcnt_blks;
+        if (blocks)
+            break;
+        if (data_start + need_blks + extra <= prev)
+            break;
+        prev = data_start + need_blks + extra;
+    }
+    if (!blocks)
+        blocks = prev;
+    if (blocks > UINT32_MAX || data_start + need_blks > blocks) {
+        fprintf(stderr, "the tree need [%lu] data blks, [%lu] blks can "
+                        "only hold [%lu]\n", need_blks, blocks,
+                blocks > data_start ? blocks - data_start : 0);
+        return -1;
+    }
+    if (is_bdev && (uint64_t)blocks * blk_size > dev_size) {
+        fprintf(stderr, "[%lu] blks do not fit in the device(%llu bytes)\n",
+                blocks, (unsigned long long)dev_size);
+        return -1;
+    }
+    /* an image file start over from all zeros, sparse */
+    if (!is_bdev && (ftruncate(fd, 0) ||
+                     ftruncate(fd, (off_t)blocks * blk_size))) {
+        perror("Cannot size image file");
+        return -1;
+    }
+
+    itable = calloc(itable_blks, blk_size);
+    buffer = calloc(1, blk_size);
+    out.buf = malloc(SFS_IO_SIZE);
+    if (!itable || !buffer || !out.buf) {
+        perror("Cannot alloc buffers");
+        return -1;
+    }
+    out.fd = fd;
+    out.blk_size = blk_size;
+    out.cap = SFS_IO_SIZE / blk_size;
+    out.start = data_start;
+    out.n = 0;
+    out.limit = blocks;
+
+    if (pack_tree(argv[optind], &rst, &out, itable, nr_inodes, &need_inodes))
+        return -1;
+
+    struct sfs_sb_info si = {
+        .magic          = SFS_MAGIC_NUMBER,
+        .version        = SFS_VERSION,
+        .blk_size       = blk_size,
+        .sfs_ino_bitmap = SFS_SB_START_NR+1,
+        .sfs_blk_bitmap = SFS_SB_START_NR+2,
+        .sfs_ino_start  = SFS_SB_START_NR+2 + bmap_blks,
+        .sfs_blk_start  = 0,
+        .s_blocks_count = blocks,
+        .s_inodes_count = nr_inodes,
+        .s_free_blocks  = blocks - out.start,
+        .s_free_inodes  = nr_inodes - need_inodes,
+        .s_state        = SFS_STATE_CLEAN,
+        .sfs_refcnt_start = SFS_SB_START_NR+2 + bmap_blks + itable_blks,
+        .s_refcnt_blocks  = refcnt_blks,
+        .s_itable_blocks  = itable_blks,
+        /* all of it is written below */
+        .s_itable_zeroed  = itable_blks,
+        .s_bmap_blocks    = bmap_blks,
+    };
+
+    /* the metadata in bulk. The super block last, so a half-made image
+     * does not mount */
+    if (write_all(fd, itable, itable_blks * blk_size,
+                  (off_t)si.sfs_ino_start * blk_size)) {
+        fprintf(stderr, "fail to write inode table!!\n");
+        return -1;
+    }
+    if (write_bitmap(fd, si.sfs_ino_bitmap, 1, need_inodes)) {
+        fprintf(stderr, "fail to write inode_bitmap block!!\n");
+        return -1;
+    }
+    if (write_bitmap(fd, si.sfs_blk_bitmap, bmap_blks, out.start)) {
+        fprintf(stderr, "fail to write blk_bitmap blocks!!\n");
+        return -1;
+    }
+    if (is_bdev && zero_blks(fd, is_bdev, si.sfs_refcnt_start, refcnt_blks)) {
+        fprintf(stderr, "fail to write refcount table!!\n");
+        return -1;
+    }
+    if (write_all(fd, buffer, blk_size, 0)) {
+        fprintf(stderr, "fail to write boot sector \n");
+        return -1;
+    }
+    if (fsync(fd)) {
+        perror("Cannot sync");
+        return -1;
+    }
+    memcpy(buffer, &si, sizeof(struct sfs_sb_info));
+    if (write_all(fd, buffer, blk_size, SFS_SB_START_NR * blk_size) ||
+        fsync(fd)) {
+        fprintf(stderr, "fail to write super block!!\n");
+        return -1;
+    }
+    close(fd);
+    free(buffer);
+    free(itable);
+    free(out.buf);
+
+    printf("packed [%lu] files and dirs into [%lu] data blks\n",
+           need_inodes, out.start - data_start);
+    printf("blocks:[%lu] (free:[%lu]), inodes:[%lu] (free:[%lu])\n",
+           si.s_blocks_count, si.s_free_blocks,
+           si.s_inodes_count, si.s_free_inodes);
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ *  sfs-stat.c
+ *
+ *  Show the super block of an sfs image, or the inodes of some paths in it,
+ *  without mounting it(see libsfs.h).
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libsfs.h"
+
+void usage() {
+    fprintf(stderr, "\nusage: sfs-stat /path/to/image(or device) [path...]\n"
+                    "  without a path, show the super block\n\n");
+}
+
+static void print_time(const char *what, int64_t sec, uint32_t nsec) {
+    char date[64];
+    time_t t = sec;
+
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("  %s: %s.%09u\n", what, date, nsec);
+}
+
+static void stat_super(const struct sfs_image *img) {
+    const struct sfs_sb_info *sbi = img->sb;
+    struct sfs_inode_iter it;
+    unsigned long used = 0;
+
+    /* the counts in the sb are only written back at umount and commit */
+    sfs_inode_iter_init(&it, img);
+    while (sfs_inode_next(&it))
+        used++;
+
+    printf("version:        %lu\n", sbi->version);
+    printf("state:          %s\n",
+           (sbi->s_state & SFS_STATE_CLEAN) ? "clean" : "not clean");
+    printf("blk size:       %lu\n", sbi->blk_size);
+    printf("blocks:         %lu, %lu free\n", sbi->s_blocks_count,
+           sbi->s_free_blocks);
+    printf("inodes:         %lu, %lu free, %lu in use\n", sbi->s_inodes_count,
+           sbi->s_free_inodes, used);
+    printf("inode bitmap:   blk %lu\n", sbi->sfs_ino_bitmap);
+    printf("blk bitmap:     blk %lu, %lu blks\n", sbi->sfs_blk_bitmap,
+           sbi->s_bmap_blocks);
+    printf("inode table:    blk %lu, %lu blks, %lu zeroed, %lu per blk\n",
+           sbi->sfs_ino_start, sbi->s_itable_blocks, sbi->s_itable_zeroed,
+           img->per_blk);
+    printf("refcount table: blk %lu, %lu blks\n", sbi->sfs_refcnt_start,
+           sbi->s_refcnt_blocks);
+    if (sbi->s_chlog_blocks)
+        printf("change log:     blk %lu, %lu blks, %lu records\n",
+               sbi->s_chlog_start, sbi->s_chlog_blocks,
+               sbi->s_chlog_blocks * SFS_CHLOG_RECS_PER_BLK(sbi->blk_size));
+    printf("data:           blk %lu\n", SFS_DATA_START(sbi));
+    if (sbi->s_last_orphan)
+        printf("orphans:        first ino %lu\n", sbi->s_last_orphan);
+}
+
+static void stat_inode(const struct sfs_image *img, const char *path,
+                       unsigned long ino, const struct sfs_inode_info *sii) {
+    struct sfs_run_iter it;
+    struct sfs_run run;
+    unsigned long blks = 0, runs = 0;
+
+    printf("%s:\n", path);
+    printf("  ino: %lu  type: %s  mode: %04o  size: %lu\n", ino,
+           S_ISDIR(sii->mode) ? "dir" : S_ISREG(sii->mode) ? "file" : "?",
+           sii->mode & 07777, sii->file_size);
+    if (sii->i_flags & SFS_COMPR_FL)
+        printf("  flags: compressed  cluster map: %#x\n", sii->i_cmap);
+    print_time("atime", sii->i_atime, sii->i_atime_nsec);
+    print_time("mtime", sii->i_mtime, sii->i_mtime_nsec);
+    print_time("ctime", sii->i_ctime, sii->i_ctime_nsec);
+
+    sfs_run_iter_init(&it, img, sii);
+    printf("  blks:");
+    while (sfs_run_next(&it, &run)) {
+        if (run.len == 1)
+            printf(" %lu:%lu", run.logical, run.blk);
+        else
+            printf(" %lu-%lu:%lu-%lu", run.logical, run.logical + run.len - 1,
+                   run.blk, run.blk + run.len - 1);
+        blks += run.len;
+        runs++;
+    }
+    printf("\n  %lu blks in %lu extents\n", blks, runs);
+}
+
+int main(int argc, char *argv[])
+{
+    const struct sfs_inode_info *sii;
+    struct sfs_image img;
+    int i, err, ret = 0;
+    long ino;
+
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+    err = sfs_open(&img, argv[1]);
+    if (err) {
+        fprintf(stderr, "cannot open %s: %s\n", argv[1], strerror(-err));
+        return 1;
+    }
+    if (argc == 2)
+        stat_super(&img);
+    for (i = 2; i < argc; i++) {
+        ino = sfs_lookup(&img, argv[i]);
+        if (ino < 0) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(-ino));
+            ret = 1;
+            continue;
+        }
+        sii = sfs_inode(&img, ino);
+        stat_inode(&img, argv[i], ino, sii);
+    }
+    sfs_close(&img);
+    return ret;
+}
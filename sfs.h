@@ -15,16 +15,32 @@
 #ifndef SILVER_FILESYSTEM_H
 #define SILVER_FILESYSTEM_H
 
+#ifdef __KERNEL__
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/shrinker.h>
+#include <linux/percpu_counter.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/rbtree.h>
+#include <linux/hashtable.h>
+#endif
+
 /*
  * sfs try to act as the original old and simple unix filesystem(not the ufs in
  * current linux kernel). Layout of sfs looks like this: 
- *  +--------+----+----------+----------+-------------------+------------+
- *  |boot sec| sb |ino_bitmap|blk_bitmap|preallocated inodes|data blks...|
- *  +--------+---------------+----------+-------------------+------------+
+ *  +--------+----+----------+----------+-------------------+------+------------+
+ *  |boot sec| sb |ino_bitmap|blk_bitmap...|inode table...|refcnt...|data blks..|
+ *  +--------+---------------+-------------+--------------+---------+-----------+
  *
- *  Note that currently we use one block for superblock, inode bitmap, blk
- *  bitmap and preallocated inodes(which means that there is very few inodes.I
- *  know), so the filesystem is very limited...
+ *  mkfs.sfs size the blk bitmap, the inode table and the refcount table from
+ *  the size of the device. The superblock and the inode bitmap are one blk
+ *  each, which limit the inodes to blk size * 8. Only the first blk of the
+ *  inode table is written by mkfs.sfs, see itable.c
  *  And also, for simplicity, we leave an entire block for boot sector
  */
 
@@ -35,17 +51,25 @@
 #endif
 
 #define SFS_MAGIC_NUMBER 0x19451001
+#define SFS_VERSION 8       /* bumped whenever the on-disk format change */
 #define SFS_BLK_SIZE 4096    /* default sfs logical block size */
+#define SFS_MIN_BLK_SIZE 1024   /* blk size is chosen at mkfs time, */
+#define SFS_MAX_BLK_SIZE 65536  /* within these bounds(power of 2) */
 #define SFS_SB_START_NR 1       /* where sb begin. default after boot sector */
 #define SFS_MAX_LINK 1000   /* maxinum number of links */
 #define SFS_FNAME_MAX 14
 
+/* sfs_sb_info->s_state */
+#define SFS_STATE_CLEAN 0x1     /* cleanly umounted, free counts are valid */
+#define SFS_STATE_CHLOG_GAP 0x2 /* changed without logging(sfs-fuse), chlog.c */
+
 #define SFS_ROOTINO 0
 #define SFS_ROOT_SLOT_NR 0
 #define MAX_INODE (SFS_BLK_SIZE * 8)
 #define SFS_INO_NDIRECT 10
 #define SFS_INODE_WITHIN_RANGE(ino) \
     ( ino >= 0 && ino <= MAX_INODE)
+#define SFS_MAX_INODES 65536    /* sfs_dir_entry->inode_no is 16 bits */
 
 /* on-memory/disk structure of sfs super block */
 struct sfs_sb_info {
@@ -56,13 +80,115 @@ struct sfs_sb_info {
     unsigned long sfs_blk_bitmap;         /* address of block bitmap */
     unsigned long sfs_ino_start;
     unsigned long sfs_blk_start;    /* now it should be sfs_ino_start+1 */
+    unsigned long s_blocks_count;   /* total blks, including boot sector */
+    unsigned long s_inodes_count;   /* slots in the inode table */
+    /*
+     * free counts. While mounted the truth is in the per-cpu counters, they
+     * are written back here on sync and umount. Only trusted at mount time
+     * when SFS_STATE_CLEAN is set, otherwise we rescan the bitmaps
+     */
+    unsigned long s_free_blocks;
+    unsigned long s_free_inodes;
+    unsigned long s_state;
+    /*
+     * blk refcount table: one byte per blk, holding how many *extra* owners
+     * (reflink clones) the blk has. 0 means the usual single owner.
+     */
+    unsigned long sfs_refcnt_start;
+    unsigned long s_refcnt_blocks;
+    /*
+     * first inode of the orphan list(unlinked, blks not freed yet), 0 if
+     * none. See orphan.c. Older images have 0 here already
+     */
+    unsigned long s_last_orphan;
+    /*
+     * the inode table is s_itable_blocks blks from sfs_ino_start. Only the
+     * first s_itable_zeroed of them are known to be zeroed, the rest is
+     * zeroed after mount(see itable.c)
+     */
+    unsigned long s_itable_blocks;
+    unsigned long s_itable_zeroed;
+    unsigned long s_bmap_blocks;    /* blk bitmap length, in blks */
+    /*
+     * the change log(see chlog.c), right after the refcount table. 0 blks
+     * when mkfs.sfs was not asked for one
+     */
+    unsigned long s_chlog_start;
+    unsigned long s_chlog_blocks;
 
     /*
-     * we don't include this now, since mkfs.sfs.c will use
-     * this header and it is NOT compiled against the kernel
-     * headers, i.e., it don't know that `struct super_block' is
+     * mkfs.sfs.c will use this header and it is NOT compiled against the
+     * kernel headers, i.e., it don't know what `struct super_block' is. So
+     * the in-memory only fields are hidden from it. They never hit the disk,
+     * use SFS_SB_DISK_SIZE when copying the on-disk part around.
      */
-    /*struct super_block *sb;*/
+#ifdef __KERNEL__
+    struct super_block *sb;
+    struct percpu_counter s_freeblks_counter;
+    struct percpu_counter s_freeinodes_counter;
+    struct mutex s_ibmap_lock;        /* serialize ino bitmap search/update */
+    struct mutex s_bmap_lock;         /* serialize blk bitmap search/update */
+    struct list_head s_rsv_list;      /* reservation windows of open files */
+    unsigned long s_rsv_nr;           /* number of windows in s_rsv_list */
+    unsigned long s_rsv_goal;         /* where next window search begin */
+    struct shrinker s_rsv_shrinker;   /* give back windows on mem pressure */
+    unsigned long s_mount_opt;        /* SFS_MOUNT_* */
+    struct list_head s_discard_list;  /* freed runs waiting for discard */
+    unsigned long s_discard_blks;     /* blks on s_discard_list */
+    struct mutex s_orphan_lock;       /* orphan list, on disk and pending */
+    struct list_head s_orphan_pending;  /* evicted orphans to be freed */
+    struct work_struct s_orphan_work; /* free them in the background */
+    struct mutex s_itable_lock;       /* serialize inode table zeroing */
+    struct delayed_work s_itable_work;  /* zero it in the background */
+    struct sfs_lat_hist __percpu *s_lat;  /* per-op latencies, stats.c */
+    struct dentry *s_debugfs;         /* our dir in debugfs, or NULL */
+    /* tunables, from the mount options and /sys/fs/sfs/<dev>/ */
+    unsigned long s_commit_interval;  /* secs, 0 for only at sync/umount */
+    unsigned long s_ra_blks;          /* read ahead this many blks */
+    unsigned long s_rsv_blks;         /* reservation window size, 0 for none */
+    unsigned long s_rsv_max;          /* open files with a window at most */
+    unsigned long s_discard_batch;    /* see SFS_DISCARD_BATCH_BLKS */
+    struct delayed_work s_commit_work;  /* see sfs_commit_schedule() */
+    struct kobject s_kobj;            /* /sys/fs/sfs/<dev> */
+    struct completion s_kobj_unregister;
+    /* free extents of the blk bitmap, see fextent.c. Under s_bmap_lock */
+    struct rb_root s_fext_by_start;
+    struct rb_root s_fext_by_len;
+    unsigned long s_fext_nr;          /* extents in them */
+    int s_fext_valid;                 /* 0: scan the bitmap instead */
+    /* name indexes of large dirs, see dindex.c */
+    spinlock_t s_dindex_lock;         /* the hash, the LRU, busy counts */
+    DECLARE_HASHTABLE(s_dindex_hash, 6);  /* by dir ino */
+    struct list_head s_dindex_lru;    /* least recently used first */
+    unsigned long s_dindex_nr;        /* indexes in the hash */
+    struct shrinker s_dindex_shrinker;  /* drop idle ones on mem pressure */
+    /* recursive dir usage, see rstat.c. NULL until first asked for */
+    struct mutex s_rstat_lock;
+    struct sfs_rstat *s_rstat;        /* indexed by ino */
+    unsigned long s_rstat_max;        /* entries in s_rstat */
+    /* the change log, see chlog.c. All under s_chlog_lock */
+    struct mutex s_chlog_lock;
+    unsigned long s_chlog_nr;         /* record slots, 0 for no log */
+    u64 s_chlog_first;                /* oldest seq a reader can still get */
+    u64 s_chlog_last;                 /* newest seq written */
+    u64 s_chlog_read;                 /* newest seq handed to a reader */
+    u64 *s_chlog_wseq;                /* by ino: seq of its last write rec */
+#endif
+};
+
+/* first blk after the metadata, where sfs_blk_start's blks may begin */
+#define SFS_DATA_START(sbi) \
+    ((sbi)->sfs_refcnt_start + (sbi)->s_refcnt_blocks + (sbi)->s_chlog_blocks)
+
+/*
+ * on-disk directory entry. A dir blk is an array of these, an entry whose
+ * name begin with '\0' is free. NOTE the name is NOT '\0' terminated when it
+ * use all SFS_DIRENT_NAME_LEN bytes.
+ */
+#define SFS_DIRENT_NAME_LEN (SFS_FNAME_MAX - 2)
+struct sfs_dir_entry {
+    char name[SFS_DIRENT_NAME_LEN];
+    uint16_t inode_no;     /* we use only two byte to store ino_nr */
 };
 
 /* on-memory/disk structure of sfs inode */
@@ -80,9 +206,339 @@ struct sfs_inode_info {
     unsigned long slot_nr;   /* which slot in prealloc inodes blk */
     unsigned int directs[SFS_INO_NDIRECT];   /* now it indicate blk. NOT inode nr */
     unsigned int indirect;
+    /*
+     * these two live in what used to be padding, so older images simply
+     * read them as 0
+     */
+    uint16_t i_flags;   /* SFS_*_FL below */
+    uint16_t i_cmap;    /* bit c set: cluster c is stored compressed */
     unsigned long file_size;
+    /* seconds since the epoch, plus nanoseconds */
+    int64_t i_atime;
+    int64_t i_mtime;
+    int64_t i_ctime;
+    uint32_t i_atime_nsec;
+    uint32_t i_mtime_nsec;
+    uint32_t i_ctime_nsec;
+    uint32_t i_next_orphan; /* next ino on the orphan list, 0 ends it */
 };
 
+/* inode records in an inode table blk */
+#define SFS_INODES_PER_BLK(blk_size) \
+    ((blk_size) / sizeof(struct sfs_inode_info))
+
+/* sfs_inode_info->i_flags */
+#define SFS_COMPR_FL 0x1    /* store file data lz4-compressed(see compression.c)*/
+
+/* compression work on clusters of this many blks(the last one may be short) */
+#define SFS_COMPR_CLUSTER_BLKS 4
+
+/*
+ * sfs specific ioctls, shared with the user space tools(which have to
+ * include <sys/ioctl.h> before this header)
+ */
+#define SFS_IOC_MAGIC 0xF5
+
+/* layout of a file's blks */
+struct sfs_frag_info {
+    uint32_t blocks;    /* blks allocated */
+    uint32_t extents;   /* runs of consecutive blks, 1 means contiguous */
+};
+
+#define SFS_IOC_GETFRAG _IOR(SFS_IOC_MAGIC, 1, struct sfs_frag_info)
+/* move a file's blks into one free run. Report the new layout */
+#define SFS_IOC_DEFRAG  _IOR(SFS_IOC_MAGIC, 2, struct sfs_frag_info)
+
+/* grow a mounted sfs into a device that grew, see resize.c */
+struct sfs_grow_info {
+    uint64_t blocks;        /* in: new blk count, 0 for the most possible.
+                               out: the blk count now */
+    uint64_t inodes;        /* out: the inode count now */
+    uint64_t max_blocks;    /* out: most blks the bitmap/refcnt table cover */
+    uint64_t dev_blocks;    /* out: blks in the device */
+    uint32_t flags;         /* SFS_GROW_* */
+    uint32_t pad;
+};
+
+#define SFS_GROW_DRY_RUN 0x1    /* only fill in what it would grow to */
+
+#define SFS_IOC_GROW    _IOWR(SFS_IOC_MAGIC, 3, struct sfs_grow_info)
+
+/*
+ * recursive usage of a dir: everything under it, itself included, see
+ * rstat.c. On a file, just the file
+ */
+struct sfs_rstat_info {
+    uint64_t bytes;         /* sizes of the regular files */
+    uint64_t blocks;        /* fs blks used by files and dirs */
+    uint64_t inodes;
+};
+
+#define SFS_IOC_GETRSTAT _IOR(SFS_IOC_MAGIC, 4, struct sfs_rstat_info)
+
+/*
+ * a change log record. Record seq s live in slot s % slots of the log, a
+ * seq of 0 is an unused slot
+ */
+struct sfs_chlog_rec {
+    uint64_t seq;
+    uint16_t ino;
+    uint16_t dir;           /* the parent, for create/unlink/mkdir/rmdir */
+    uint16_t op;            /* SFS_CHLOG_* */
+    uint16_t pad;
+};
+
+#define SFS_CHLOG_CREATE 1
+#define SFS_CHLOG_WRITE  2  /* data or size changed(writes are coalesced) */
+#define SFS_CHLOG_UNLINK 3
+#define SFS_CHLOG_MKDIR  4
+#define SFS_CHLOG_RMDIR  5
+#define SFS_CHLOG_GAP    6  /* changes right before this one were not logged */
+
+#define SFS_CHLOG_RECS_PER_BLK(blk_size) \
+    ((blk_size) / sizeof(struct sfs_chlog_rec))
+
+/* the records after a cursor, oldest first */
+struct sfs_chlog_req {
+    uint64_t cursor;        /* in: last seq seen, 0 for none.
+                               out: pass it back for the next records */
+    uint64_t first;         /* out: oldest seq still in the log */
+    uint64_t last;          /* out: newest seq */
+    uint64_t recs;          /* in: user pointer to nr sfs_chlog_rec */
+    uint32_t nr;            /* in: room in recs. out: records copied */
+    uint32_t flags;         /* out: SFS_CHLOG_LOST */
+};
+
+/* records after the cursor are gone, do a full scan before using these */
+#define SFS_CHLOG_LOST 0x1
+
+#define SFS_IOC_GETCHANGES _IOWR(SFS_IOC_MAGIC, 5, struct sfs_chlog_req)
+
+
+#ifdef __KERNEL__
+
+#define SFS_SB_DISK_SIZE offsetof(struct sfs_sb_info, sb)
+
+#define SFS_RSV_WINDOW_BLKS 8   /* default blks reserved for an open file */
+
+#define SFS_REFCNT_MAX 255      /* a refcount table entry is one byte */
+
+/* sfs_sb_info->s_mount_opt */
+#define SFS_MOUNT_DISCARD 0x1   /* discard blks freed by files */
+#define SFS_MOUNT_SYNC_META 0x2 /* metadata changes written before returning */
+
+/* defaults and limits of the tunables */
+#define SFS_DISCARD_BATCH_BLKS 1024 /* flush queued discards beyond this */
+#define SFS_MAX_RSV_BLKS 1024
+#define SFS_DEFAULT_RSV_MAX 4096
+#define SFS_MAX_COMMIT_INTERVAL 3600
+
+/* lazy inode table zeroing, see itable.c */
+#define SFS_ITABLE_INIT_BATCH 16    /* blks zeroed at a time */
+#define SFS_ITABLE_INIT_WAIT_MULT 10 /* sleep this many times the zeroing */
+#define SFS_ITABLE_INIT_DELAY HZ    /* before the first batch after mount */
+
+/* number of dir entries in a dir blk */
+#define SFS_DIRENTS_PER_BLK(sb) \
+    ((sb)->s_blocksize / sizeof(struct sfs_dir_entry))
+
+/* dirs with at least this many dirent slots get a name index, see dindex.c */
+#define SFS_DINDEX_MIN_DIRENTS 512
+
+/* operations whose latency is counted, see stats.c */
+enum {
+    SFS_OP_CREATE,
+    SFS_OP_LOOKUP,
+    SFS_OP_ITERATE,
+    SFS_OP_READ,
+    SFS_OP_WRITE,
+    SFS_OP_REMOVE,
+    SFS_OP_NEW_BLK,
+    SFS_OP_NEW_BLK_RUN,
+    SFS_OP_FREE_BLKS,
+    SFS_OP_NEW_INO,
+    SFS_NR_OPS
+};
+
+/* bucket n count the ops that took [2^(n-1), 2^n) ns, the last one the rest */
+#define SFS_LAT_BUCKETS 32
+
+/* one per cpu */
+struct sfs_lat_hist {
+    u64 count[SFS_NR_OPS];
+    u64 total_ns[SFS_NR_OPS];
+    u64 buckets[SFS_NR_OPS][SFS_LAT_BUCKETS];
+};
+
+/*
+ * A window of contiguous blks reserved for one open file. The blks in
+ * [next, end) are already marked in the on-disk blk bitmap, so handing them
+ * out only take the window's own lock, not the global s_bmap_lock.
+ */
+struct sfs_rsv_window {
+    struct list_head list;      /* on sfs_sb_info->s_rsv_list */
+    spinlock_t lock;            /* protect next/end */
+    unsigned long next;         /* next blk to hand out */
+    unsigned long end;          /* one past the last reserved blk */
+};
+
+/* get sfs_sb_info out of a *sb */
+static inline struct sfs_sb_info *SFS_S_INFO(struct super_block *sb) {
+    return sb->s_fs_info;
+}
+
+/* get sfs_inode_info out from a *inode */
+static inline struct sfs_inode_info *SFS_I_INFO(struct inode *inode) {
+    return inode->i_private;
+}
+
+/*
+ * file data is read/written through blk buffers, the page cache of a file
+ * only serve splice(see sfs_readpage()). Whoever change the data of
+ * [pos, pos + len) call this so that no stale page is left behind. Whole
+ * pages are dropped, truncate_inode_pages_range() would zero partial ones.
+ */
+static inline void sfs_drop_page_cache(struct inode *inode, loff_t pos,
+                                       loff_t len) {
+    truncate_inode_pages_range(inode->i_mapping, round_down(pos, PAGE_SIZE),
+                               round_up(pos + len, PAGE_SIZE) - 1);
+}
+
+/* super.c */
+int sfs_update_prealloc_inodes(struct super_block *sb,
+                               struct sfs_inode_info *sii, int sync);
+int sfs_update_inode(struct inode *inode);
+void sfs_commit_super(struct super_block *sb, int wait);
+void sfs_free_inode_nr(struct super_block *sb, uint64_t ino_nr);
+void sfs_commit_schedule(struct super_block *sb);
+ssize_t sfs_read(struct file *filp, char __user *buf, size_t len,
+                 loff_t *ppos);
+ssize_t sfs_write(struct file *filp, const char __user *buf, size_t len,
+                  loff_t *ppos);
+
+/* balloc.c */
+unsigned long sfs_bitmap_count_free(void *bitmap, unsigned long nbits);
+unsigned long sfs_bmap_count_free(struct super_block *sb);
+unsigned long sfs_bmap_find(struct super_block *sb, unsigned long start,
+                            unsigned long end, int set);
+unsigned int __sfs_get_unused_blk(struct super_block *sb);
+int sfs_update_blk_bmp_bit(struct super_block *sb, uint64_t blk_nr);
+unsigned int sfs_new_blk(struct super_block *sb, struct sfs_rsv_window *rsv);
+void sfs_free_blks(struct super_block *sb, unsigned long blk_nr,
+                   unsigned long count);
+int sfs_blk_shared(struct super_block *sb, unsigned long blk_nr);
+int sfs_blk_ref(struct super_block *sb, unsigned long blk_nr);
+struct sfs_rsv_window *sfs_rsv_alloc(struct super_block *sb);
+void sfs_rsv_release(struct super_block *sb, struct sfs_rsv_window *rsv);
+int sfs_rsv_init(struct super_block *sb);
+void sfs_rsv_destroy(struct super_block *sb);
+int sfs_zero_blk(struct super_block *sb, unsigned int blk_nr,
+                 struct inode *inode);
+void sfs_discard_check(struct super_block *sb);
+void sfs_flush_discards(struct super_block *sb);
+unsigned long sfs_new_blk_run(struct super_block *sb, unsigned long want);
+unsigned long sfs_rsv_reserved(struct super_block *sb);
+int sfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+/* compression.c */
+ssize_t sfs_compr_read(struct file *filp, char __user *buf, size_t len,
+                       loff_t *ppos);
+ssize_t sfs_compr_write(struct file *filp, const char __user *buf, size_t len,
+                        loff_t *ppos);
+int sfs_compr_read_kernel(struct inode *inode, char *dst, loff_t pos,
+                          size_t len);
+
+/* reflink.c */
+int sfs_cow_blk(struct inode *inode, int slot, struct sfs_rsv_window *rsv);
+loff_t sfs_clone_range(struct file *src_file, loff_t off,
+                       struct file *dst_file, loff_t destoff, loff_t len);
+ssize_t sfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                            struct file *file_out, loff_t pos_out,
+                            size_t len, unsigned int flags);
+
+/* ioctl.c */
+long sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+/* orphan.c */
+int sfs_orphan_add(struct inode *inode);
+void sfs_orphan_queue(struct inode *inode);
+void sfs_orphan_flush(struct super_block *sb);
+void sfs_orphan_init(struct super_block *sb);
+void sfs_orphan_replay(struct super_block *sb);
+
+/* itable.c */
+struct buffer_head *sfs_inode_blk(struct super_block *sb, unsigned long ino,
+                                  struct sfs_inode_info **rec);
+unsigned long sfs_itable_inodes(struct super_block *sb);
+int sfs_itable_grow(struct super_block *sb);
+void sfs_itable_init(struct super_block *sb);
+void sfs_itable_start(struct super_block *sb);
+void sfs_itable_stop(struct super_block *sb);
+
+/* defrag.c */
+void sfs_frag_info(struct sfs_inode_info *sii, struct sfs_frag_info *fi);
+long sfs_ioc_defrag(struct file *filp, struct sfs_frag_info __user *arg);
+
+/* fextent.c */
+void __sfs_fext_free(struct super_block *sb, unsigned long start,
+                     unsigned long len);
+void __sfs_fext_use(struct super_block *sb, unsigned long start,
+                    unsigned long len);
+int __sfs_fext_find_near(struct super_block *sb, unsigned long goal,
+                         unsigned long want, unsigned long *start,
+                         unsigned long *len);
+int __sfs_fext_find_best(struct super_block *sb, unsigned long want,
+                         unsigned long *start, unsigned long *len);
+long __sfs_fext_first(struct super_block *sb);
+void sfs_fext_init(struct super_block *sb);
+void sfs_fext_destroy(struct super_block *sb);
+int sfs_fext_cache_init(void);
+void sfs_fext_cache_exit(void);
+
+/* dindex.c */
+int sfs_dindex_lookup(struct inode *dir, const char *name, int len,
+                      unsigned long *ino);
+void sfs_dindex_add(struct inode *dir, const char *name, unsigned long ino,
+                    unsigned long pos);
+long sfs_dindex_del(struct inode *dir, const char *name, int len);
+void sfs_dindex_drop(struct inode *dir);
+int sfs_dindex_init(struct super_block *sb);
+void sfs_dindex_destroy(struct super_block *sb);
+
+/* rstat.c */
+void sfs_rstat_update(struct inode *inode);
+void sfs_rstat_link(struct inode *dir, struct inode *inode);
+void sfs_rstat_unlink(struct inode *dir, struct inode *inode);
+long sfs_ioc_getrstat(struct file *filp, struct sfs_rstat_info __user *arg);
+void sfs_rstat_init(struct super_block *sb);
+void sfs_rstat_destroy(struct super_block *sb);
+
+/* chlog.c */
+void sfs_chlog_add(struct super_block *sb, unsigned long ino,
+                   unsigned long dir, int op);
+long sfs_ioc_getchanges(struct file *filp, struct sfs_chlog_req __user *arg);
+int sfs_chlog_init(struct super_block *sb);
+void sfs_chlog_start(struct super_block *sb);
+void sfs_chlog_destroy(struct super_block *sb);
+
+/* resize.c */
+long sfs_ioc_grow(struct file *filp, struct sfs_grow_info __user *arg);
+
+/* stats.c */
+u64 sfs_lat_start(void);
+void sfs_lat_account(struct super_block *sb, int op, u64 start);
+int sfs_stats_init(struct super_block *sb);
+void sfs_stats_destroy(struct super_block *sb);
+void sfs_debugfs_init(void);
+void sfs_debugfs_exit(void);
+
+/* sysfs.c */
+int sfs_sysfs_register(struct super_block *sb);
+void sfs_sysfs_unregister(struct super_block *sb);
+int sfs_sysfs_init(void);
+void sfs_sysfs_exit(void);
+
+#endif /* __KERNEL__ */
 
 /*
  * Debug utils
@@ -0,0 +1,213 @@
+/*
+ *  fs/sfs/sfs_trace.h
+ *
+ *  Tracepoints of sfs. Turn them on with
+ *      echo 1 > /sys/kernel/debug/tracing/events/sfs/enable
+ *  Each operation has an _enter and an _exit event, the latter carry the
+ *  return value, so a trace show where a slow or failing op spent its time.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sfs
+
+#if !defined(_SFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SFS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+/* create/lookup/remove: a name in dir */
+DECLARE_EVENT_CLASS(sfs_name_enter,
+    TP_PROTO(struct inode *dir, struct dentry *dentry),
+    TP_ARGS(dir, dentry),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __array(char, name, 16)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        strlcpy(__entry->name, dentry->d_name.name, sizeof(__entry->name));
+    ),
+    TP_printk("dev %d,%d dir %lu name %s", MAJOR(__entry->dev),
+              MINOR(__entry->dev), __entry->dir, __entry->name)
+);
+
+DECLARE_EVENT_CLASS(sfs_name_exit,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+    TP_ARGS(dir, dentry, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(unsigned long, ino)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = dentry->d_inode ? dentry->d_inode->i_ino : 0;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d dir %lu ino %lu ret %d", MAJOR(__entry->dev),
+              MINOR(__entry->dev), __entry->dir, __entry->ino, __entry->ret)
+);
+
+DEFINE_EVENT(sfs_name_enter, sfs_create_enter,
+    TP_PROTO(struct inode *dir, struct dentry *dentry),
+    TP_ARGS(dir, dentry));
+DEFINE_EVENT(sfs_name_exit, sfs_create_exit,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+    TP_ARGS(dir, dentry, ret));
+DEFINE_EVENT(sfs_name_enter, sfs_lookup_enter,
+    TP_PROTO(struct inode *dir, struct dentry *dentry),
+    TP_ARGS(dir, dentry));
+DEFINE_EVENT(sfs_name_exit, sfs_lookup_exit,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+    TP_ARGS(dir, dentry, ret));
+DEFINE_EVENT(sfs_name_enter, sfs_remove_enter,
+    TP_PROTO(struct inode *dir, struct dentry *dentry),
+    TP_ARGS(dir, dentry));
+DEFINE_EVENT(sfs_name_exit, sfs_remove_exit,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+    TP_ARGS(dir, dentry, ret));
+
+/* iterate/read/write: `len' bytes at `pos' of inode */
+DECLARE_EVENT_CLASS(sfs_io_enter,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+    TP_ARGS(inode, pos, len),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(size_t, len)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->len = len;
+    ),
+    TP_printk("dev %d,%d ino %lu pos %lld len %zu", MAJOR(__entry->dev),
+              MINOR(__entry->dev), __entry->ino, __entry->pos, __entry->len)
+);
+
+DECLARE_EVENT_CLASS(sfs_io_exit,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d ino %lu pos %lld ret %zd", MAJOR(__entry->dev),
+              MINOR(__entry->dev), __entry->ino, __entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(sfs_io_enter, sfs_iterate_enter,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+    TP_ARGS(inode, pos, len));
+DEFINE_EVENT(sfs_io_exit, sfs_iterate_exit,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret));
+DEFINE_EVENT(sfs_io_enter, sfs_read_enter,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+    TP_ARGS(inode, pos, len));
+DEFINE_EVENT(sfs_io_exit, sfs_read_exit,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret));
+DEFINE_EVENT(sfs_io_enter, sfs_write_enter,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+    TP_ARGS(inode, pos, len));
+DEFINE_EVENT(sfs_io_exit, sfs_write_exit,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret));
+
+/*
+ * allocators. `want' blks asked for, the run [blk, blk + count) handed out
+ * or given back. blk 0 means the allocation failed
+ */
+DECLARE_EVENT_CLASS(sfs_alloc_enter,
+    TP_PROTO(struct super_block *sb, unsigned long want),
+    TP_ARGS(sb, want),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, want)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->want = want;
+    ),
+    TP_printk("dev %d,%d want %lu", MAJOR(__entry->dev),
+              MINOR(__entry->dev), __entry->want)
+);
+
+DECLARE_EVENT_CLASS(sfs_alloc_exit,
+    TP_PROTO(struct super_block *sb, unsigned long blk, unsigned long count),
+    TP_ARGS(sb, blk, count),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, blk)
+        __field(unsigned long, count)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->blk = blk;
+        __entry->count = count;
+    ),
+    TP_printk("dev %d,%d blk %lu count %lu", MAJOR(__entry->dev),
+              MINOR(__entry->dev), __entry->blk, __entry->count)
+);
+
+DEFINE_EVENT(sfs_alloc_enter, sfs_new_blk_enter,
+    TP_PROTO(struct super_block *sb, unsigned long want),
+    TP_ARGS(sb, want));
+DEFINE_EVENT(sfs_alloc_exit, sfs_new_blk_exit,
+    TP_PROTO(struct super_block *sb, unsigned long blk, unsigned long count),
+    TP_ARGS(sb, blk, count));
+DEFINE_EVENT(sfs_alloc_enter, sfs_new_blk_run_enter,
+    TP_PROTO(struct super_block *sb, unsigned long want),
+    TP_ARGS(sb, want));
+DEFINE_EVENT(sfs_alloc_exit, sfs_new_blk_run_exit,
+    TP_PROTO(struct super_block *sb, unsigned long blk, unsigned long count),
+    TP_ARGS(sb, blk, count));
+DEFINE_EVENT(sfs_alloc_enter, sfs_free_blks_enter,
+    TP_PROTO(struct super_block *sb, unsigned long want),
+    TP_ARGS(sb, want));
+DEFINE_EVENT(sfs_alloc_exit, sfs_free_blks_exit,
+    TP_PROTO(struct super_block *sb, unsigned long blk, unsigned long count),
+    TP_ARGS(sb, blk, count));
+/* for inode nrs `blk' is the ino */
+DEFINE_EVENT(sfs_alloc_enter, sfs_new_ino_enter,
+    TP_PROTO(struct super_block *sb, unsigned long want),
+    TP_ARGS(sb, want));
+DEFINE_EVENT(sfs_alloc_exit, sfs_new_ino_exit,
+    TP_PROTO(struct super_block *sb, unsigned long blk, unsigned long count),
+    TP_ARGS(sb, blk, count));
+DEFINE_EVENT(sfs_alloc_exit, sfs_free_ino,
+    TP_PROTO(struct super_block *sb, unsigned long blk, unsigned long count),
+    TP_ARGS(sb, blk, count));
+
+#endif /* _SFS_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sfs_trace
+#include <trace/define_trace.h>
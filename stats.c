@@ -0,0 +1,162 @@
+/*
+ *  fs/sfs/stats.c
+ *
+ *  Per-operation latency histograms, always on, and the tracepoints(see
+ *  sfs_trace.h). Each mounted sfs get /sys/kernel/debug/sfs/<dev>/latency,
+ *  which show, for every operation, how many calls took [2^(n-1), 2^n) ns.
+ *  Writing anything to it reset the counts.
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>      /* fls64() */
+#include <linux/sched.h>       /* local_clock() */
+
+#include "sfs.h"
+
+#define CREATE_TRACE_POINTS
+#include "sfs_trace.h"
+
+static const char *sfs_op_names[SFS_NR_OPS] = {
+    [SFS_OP_CREATE] = "create",
+    [SFS_OP_LOOKUP] = "lookup",
+    [SFS_OP_ITERATE] = "iterate",
+    [SFS_OP_READ] = "read",
+    [SFS_OP_WRITE] = "write",
+    [SFS_OP_REMOVE] = "remove",
+    [SFS_OP_NEW_BLK] = "new_blk",
+    [SFS_OP_NEW_BLK_RUN] = "new_blk_run",
+    [SFS_OP_FREE_BLKS] = "free_blks",
+    [SFS_OP_NEW_INO] = "new_ino",
+};
+
+/* "sfs" in debugfs, a dir per mounted sfs go under it */
+static struct dentry *sfs_debugfs_root;
+
+/* timestamp to hand to sfs_lat_account() when the op is done */
+u64 sfs_lat_start(void) {
+    return local_clock();
+}
+
+/*
+ * count one `op' that began at `start'. Only touch this cpu's copy, so
+ * concurrent ops never bounce a cacheline
+ */
+void sfs_lat_account(struct super_block *sb, int op, u64 start) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    u64 ns = local_clock() - start;
+    int b = min(fls64(ns), SFS_LAT_BUCKETS - 1);
+
+    this_cpu_inc(sbi->s_lat->count[op]);
+    this_cpu_add(sbi->s_lat->total_ns[op], ns);
+    this_cpu_inc(sbi->s_lat->buckets[op][b]);
+}
+
+static int sfs_lat_show(struct seq_file *m, void *v) {
+    struct super_block *sb = m->private;
+    struct sfs_lat_hist *h;
+    u64 count, total, buckets[SFS_LAT_BUCKETS];
+    int op, b, cpu;
+
+    for (op = 0; op < SFS_NR_OPS; op++) {
+        count = total = 0;
+        memset(buckets, 0, sizeof(buckets));
+        for_each_possible_cpu(cpu) {
+            h = per_cpu_ptr(SFS_S_INFO(sb)->s_lat, cpu);
+            count += h->count[op];
+            total += h->total_ns[op];
+            for (b = 0; b < SFS_LAT_BUCKETS; b++)
+                buckets[b] += h->buckets[op][b];
+        }
+        seq_printf(m, "%s: count %llu avg_ns %llu\n", sfs_op_names[op],
+                   count, count ? div64_u64(total, count) : 0);
+        for (b = 0; b < SFS_LAT_BUCKETS; b++) {
+            if (!buckets[b])
+                continue;
+            if (b == SFS_LAT_BUCKETS - 1)
+                seq_printf(m, "  >= %llu ns: %llu\n", 1ULL << (b - 1),
+                           buckets[b]);
+            else
+                seq_printf(m, "  < %llu ns: %llu\n", 1ULL << b, buckets[b]);
+        }
+    }
+    return 0;
+}
+
+static int sfs_lat_open(struct inode *inode, struct file *file) {
+    return single_open(file, sfs_lat_show, inode->i_private);
+}
+
+/* any write reset the histograms */
+static ssize_t sfs_lat_write(struct file *file, const char __user *buf,
+                             size_t len, loff_t *ppos) {
+    struct super_block *sb = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(SFS_S_INFO(sb)->s_lat, cpu), 0,
+               sizeof(struct sfs_lat_hist));
+    return len;
+}
+
+static const struct file_operations sfs_lat_fops = {
+    .owner = THIS_MODULE,
+    .open = sfs_lat_open,
+    .read = seq_read,
+    .write = sfs_lat_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/*
+ * set up the histograms of a new mount. Without debugfs they are still
+ * counted, just not shown
+ */
+int sfs_stats_init(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    sbi->s_lat = alloc_percpu(struct sfs_lat_hist);
+    if (!sbi->s_lat)
+        return -ENOMEM;
+
+    sbi->s_debugfs = NULL;
+    if (IS_ERR_OR_NULL(sfs_debugfs_root))
+        return 0;
+    sbi->s_debugfs = debugfs_create_dir(sb->s_id, sfs_debugfs_root);
+    if (IS_ERR_OR_NULL(sbi->s_debugfs)) {
+        printk(SFS_KERN_LEVEL "FAIL creating debugfs dir for %s\n", sb->s_id);
+        sbi->s_debugfs = NULL;
+        return 0;
+    }
+    debugfs_create_file("latency", 0644, sbi->s_debugfs, sb, &sfs_lat_fops);
+    return 0;
+}
+
+void sfs_stats_destroy(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    /* no reader of the latency file is left after this */
+    debugfs_remove_recursive(sbi->s_debugfs);
+    sbi->s_debugfs = NULL;
+    free_percpu(sbi->s_lat);
+    sbi->s_lat = NULL;
+}
+
+void sfs_debugfs_init(void) {
+    sfs_debugfs_root = debugfs_create_dir("sfs", NULL);
+}
+
+void sfs_debugfs_exit(void) {
+    debugfs_remove_recursive(sfs_debugfs_root);
+    sfs_debugfs_root = NULL;
+}
@@ -23,8 +23,15 @@
 #include <linux/statfs.h>      /* struct kstatfs */
 #include <linux/mount.h>       /* struct vfsmount */
 #include <linux/version.h>
+#include <linux/percpu_counter.h>
+#include <linux/kdev_t.h>      /* huge_encode_dev() */
+#include <linux/pagemap.h>     /* page cache, for splice */
+#include <linux/highmem.h>     /* kmap() */
+#include <linux/parser.h>      /* match_token() */
+#include <linux/seq_file.h>
 
 #include "sfs.h"
+#include "sfs_trace.h"
 
 static struct kmem_cache *sfs_inode_cachep;
 
@@ -34,145 +41,147 @@ static struct kmem_cache *sfs_inode_cachep;
 
 /*============= helper function =====================*/
 
-/* get sfs_sb_info out of a *sb */
-static inline struct sfs_sb_info *SFS_S_INFO(struct super_block *sb) {
-    return sb->s_fs_info;
-}
-
-/* get sfs_inode_info out from a *inode */
-static inline struct sfs_inode_info *SFS_I_INFO(struct inode *inode) {
-    return inode->i_private;
-}
-
 /* you have to update the inode bit map yourself */
 int __sfs_get_next_inode_nr(struct super_block *sb) {
     struct buffer_head *bh;
-    char *raw_data;
-    int i, j, ret = -EINVAL;
+    unsigned long nbits, ino_nr;
+    int ret = -ENOSPC;
 
     bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_ino_bitmap);
     if (unlikely(!bh)) {
         SFSD(SFS_KERN_LEVEL "FAIL sb_read() 2 !!\n");
         return -ENOMEM;
     }
-    raw_data = bh->b_data;
-    for (i = 0; i < bh->b_size; i++) {
-        for (j = 0; j < 8; j++) {
-            if (!(*(raw_data + i) & (1 << j)))
-                goto found_bit;
-        }
-    }
-found_bit:
-    if (!(i == bh->b_size && j == 8)) {
-        printk(SFS_KERN_LEVEL "find inode:[%d]\n", 8 * i + j);
-        ret = 8 * i + j;
-    }
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
-    return ret;
-}
-
-/* you have to update the blk bit map yourself */
-unsigned int __sfs_get_unused_blk(struct super_block *sb) {
-    struct buffer_head *bh;
-    char *raw_data;
-    int i, j, ret = 0;
-
-    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_bitmap);
-    if (unlikely(!bh)) {
-        SFSD(SFS_KERN_LEVEL "FAIL sb_read() 3 !\n");
-        return 0;
-    }
-    raw_data = bh->b_data;
-    for (i = 0; i < bh->b_size; i++) {
-        for (j = 0; j < 8; j++) {
-            if (!(*(raw_data + i) & (1 << j)))
-                goto found_bit;
-        }
-    }
-found_bit:
-    if (!(i == bh->b_size && j == 8)) {
-        printk(SFS_KERN_LEVEL "find unused blk:[%d]\n", 8 * i + j);
-        ret = 8 * i + j;
-    }
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    /*
+     * there are more bits in the bitmap than slots in the inode table, and
+     * only the zeroed part of the table can be handed out
+     */
+    nbits = min_t(unsigned long, bh->b_size * 8, sfs_itable_inodes(sb));
+    ino_nr = find_next_zero_bit_le(bh->b_data, nbits, 0);
+    if (ino_nr < nbits)
+        ret = ino_nr;
     brelse(bh);
     return ret;
 }
 
+/* copy sii into the inode table. Written out now only if `sync' is set */
 int sfs_update_prealloc_inodes(struct super_block *sb,
-                               struct sfs_inode_info *sii) {
+                               struct sfs_inode_info *sii, int sync) {
     struct buffer_head *bh;
     struct sfs_inode_info *tmp_sii;
-
-    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_ino_start);
-    if (unlikely(!bh)) {
-        SFSD(SFS_KERN_LEVEL "fail sb_bread()!!\n");
-        return -ENOMEM;
-    }
-
-    tmp_sii = (struct sfs_inode_info *)bh->b_data;
-    tmp_sii += sii->inode_no;
+    uint32_t next_orphan;
+
+    bh = sfs_inode_blk(sb, sii->inode_no, &tmp_sii);
+    if (unlikely(!bh))
+        return -EIO;
+    /* the orphan link is only kept in the buffer, see orphan.c */
+    mutex_lock(&SFS_S_INFO(sb)->s_orphan_lock);
+    next_orphan = tmp_sii->i_next_orphan;
     memcpy(tmp_sii, sii, sizeof(struct sfs_inode_info));
+    tmp_sii->i_next_orphan = next_orphan;
+    mutex_unlock(&SFS_S_INFO(sb)->s_orphan_lock);
 
     mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    if (sync)
+        sync_dirty_buffer(bh);
     brelse(bh);
     return 0;
 }
 
 struct sfs_inode_info *sfs_get_inode(struct super_block *sb, uint64_t ino) {
     struct buffer_head *bh;
-    struct sfs_inode_info *sii;
+    struct sfs_inode_info *sii, *rec;
 
-    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_ino_start);
-    if (unlikely(!bh)) {
-        SFSD(SFS_KERN_LEVEL "FAIL sb_bread()\n");
+    bh = sfs_inode_blk(sb, ino, &rec);
+    if (unlikely(!bh))
         return NULL;
-    }
 
     sii = (struct sfs_inode_info *)kmem_cache_alloc(sfs_inode_cachep, GFP_KERNEL);
     if (!sii) {
         SFSD(SFS_KERN_LEVEL "FAIL kmem_cache_alloc()!\n");
+        brelse(bh);
         return NULL;
     }
-    memcpy(sii, &(((struct sfs_inode_info *)(bh->b_data))[ino]),
-           sizeof(struct sfs_inode_info));
+    memcpy(sii, rec, sizeof(struct sfs_inode_info));
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
     brelse(bh);
     return sii;
 }
 
+/* in-memory timestamps -> on-disk inode record(not written out yet) */
+static void sfs_times_to_disk(struct inode *inode, struct sfs_inode_info *sii) {
+    sii->i_atime = inode->i_atime.tv_sec;
+    sii->i_atime_nsec = inode->i_atime.tv_nsec;
+    sii->i_mtime = inode->i_mtime.tv_sec;
+    sii->i_mtime_nsec = inode->i_mtime.tv_nsec;
+    sii->i_ctime = inode->i_ctime.tv_sec;
+    sii->i_ctime_nsec = inode->i_ctime.tv_nsec;
+}
+
+static void sfs_times_from_disk(struct inode *inode,
+                                struct sfs_inode_info *sii) {
+    inode->i_atime.tv_sec = sii->i_atime;
+    inode->i_atime.tv_nsec = sii->i_atime_nsec;
+    inode->i_mtime.tv_sec = sii->i_mtime;
+    inode->i_mtime.tv_nsec = sii->i_mtime_nsec;
+    inode->i_ctime.tv_sec = sii->i_ctime;
+    inode->i_ctime.tv_nsec = sii->i_ctime_nsec;
+}
+
+static int __sfs_write_inode(struct inode *inode, int sync) {
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    int err;
+
+    /* an unlinked inode's record is already wiped, don't bring it back */
+    if (!inode->i_nlink)
+        return 0;
+    sfs_times_to_disk(inode, sii);
+    err = sfs_update_prealloc_inodes(inode->i_sb, sii, sync);
+    if (!err)
+        sfs_rstat_update(inode);
+    return err;
+}
+
+/*
+ * put the inode record of `inode', timestamps included, into the inode table
+ * after its size or blks changed. It reach the disk with writeback, or with
+ * the next fsync()/fdatasync() of the file(the inode is marked dirty for
+ * that). Timestamp-only changes(atime on read, or anything under lazytime)
+ * only dirty the inode and wait for sfs_write_inode() or the next call here,
+ * which pick them up for free.
+ */
+int sfs_update_inode(struct inode *inode) {
+    int err = __sfs_write_inode(inode, 0);
+
+    if (!err && inode->i_nlink)
+        mark_inode_dirty(inode);
+    return err;
+}
+
 /* test whether a bit is set. result should be 0 or 1. otherwise error */
 int sfs_test_blk_bmp_bit(struct super_block *sb, uint64_t blk_nr) {
     struct buffer_head *bh;
     char *raw_data;
     int err = -EINVAL;
 
-    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_bitmap);
+    if (blk_nr >= SFS_S_INFO(sb)->s_blocks_count) {
+        printk(SFS_KERN_LEVEL "too large blk_nr to test:[%llu]. aborted.\n",
+                blk_nr);
+        return err;
+    }
+    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_bitmap +
+                      blk_nr / (sb->s_blocksize * 8));
     if (unlikely(!bh)) {
         SFSD(SFS_KERN_LEVEL "FAIL sb_bread() !!!\n");
         goto release;
     }
 
     raw_data = bh->b_data;
-    if (blk_nr / 8 >= bh->b_size) {
-        printk(SFS_KERN_LEVEL "too large blk_nr to test:[%llu]. aborted.\n",
-                blk_nr);
-        goto release;
-    }
+    blk_nr %= sb->s_blocksize * 8;
     raw_data += blk_nr / 8;
-    if (*raw_data & 1 << (blk_nr % 8)) {
-        SFSD(SFS_KERN_LEVEL "SUCCESS blk_nr test !!!\n");
+    if (*raw_data & 1 << (blk_nr % 8))
         err = 0;
-    }
 release:
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
     brelse(bh);
     return err;
 }
@@ -201,105 +210,125 @@ int sfs_test_ino_bmp_bit(struct super_block *sb, uint64_t ino_nr) {
         err = 0;
     }
 release:
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
     brelse(bh);
     return err;
 }
 
 /* update bitmap. 0 on success */
-int sfs_update_blk_bmp_bit(struct super_block *sb, uint64_t blk_nr) {
+int sfs_update_ino_bmp_bit(struct super_block *sb, uint64_t ino_nr) {
     struct buffer_head *bh;
     char *raw_data;
     int err = -EINVAL;
 
-    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_bitmap);
+    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_ino_bitmap);
     if (unlikely(!bh)) {
-        SFSD(SFS_KERN_LEVEL "FAIL sb_bread() !!\n");
+        SFSD(SFS_KERN_LEVEL "FAIL sb_bread()!!\n");
         goto release;
     }
 
     raw_data = bh->b_data;
-    if (blk_nr / 8 >= bh->b_size) {
-        printk(SFS_KERN_LEVEL "Too large blk_nr to test:[%llu]. aborted.\n",
-               blk_nr);
+    if (ino_nr / 8 >= bh->b_size) {
+        printk(SFS_KERN_LEVEL "Too large ino_nr to test:[%llu]. aborted.\n", 
+               ino_nr);
         goto release;
     }
-    raw_data += blk_nr / 8;
-    *raw_data |= 1 << (blk_nr % 8);
+    raw_data += ino_nr / 8;
+    *raw_data |= 1 << (ino_nr % 8);
 
     err = 0;
 release:
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    if (!err)
+        mark_buffer_dirty(bh);
     brelse(bh);
     return err;
 }
 
-/* update bitmap. 0 on success */
-int sfs_update_ino_bmp_bit(struct super_block *sb, uint64_t ino_nr) {
+/* allocate an inode nr and mark it in the ino bitmap. <0 on fail */
+int sfs_new_inode_nr(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    u64 start = sfs_lat_start();
+    int ino_nr, err;
+
+    trace_sfs_new_ino_enter(sb, 1);
+    mutex_lock(&sbi->s_ibmap_lock);
+    ino_nr = __sfs_get_next_inode_nr(sb);
+    /* no free slot among the zeroed records: zero some more */
+    while (ino_nr == -ENOSPC && !sfs_itable_grow(sb))
+        ino_nr = __sfs_get_next_inode_nr(sb);
+    if (ino_nr >= 0) {
+        err = sfs_update_ino_bmp_bit(sb, ino_nr);
+        if (err)
+            ino_nr = err;
+        else
+            percpu_counter_dec(&sbi->s_freeinodes_counter);
+    }
+    mutex_unlock(&sbi->s_ibmap_lock);
+    trace_sfs_new_ino_exit(sb, ino_nr >= 0 ? ino_nr : 0, ino_nr >= 0);
+    sfs_lat_account(sb, SFS_OP_NEW_INO, start);
+    return ino_nr;
+}
+
+/* clear an inode nr in the ino bitmap */
+void sfs_free_inode_nr(struct super_block *sb, uint64_t ino_nr) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
     struct buffer_head *bh;
-    char *raw_data;
-    int err = -EINVAL;
 
-    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_ino_bitmap);
+    trace_sfs_free_ino(sb, ino_nr, 1);
+    mutex_lock(&sbi->s_ibmap_lock);
+    bh = sb_bread(sb, sbi->sfs_ino_bitmap);
     if (unlikely(!bh)) {
         SFSD(SFS_KERN_LEVEL "FAIL sb_bread()!!\n");
-        goto release;
+        goto unlock;
     }
-
-    raw_data = bh->b_data;
-    if (ino_nr / 8 >= bh->b_size) {
-        printk(SFS_KERN_LEVEL "Too large ino_nr to test:[%llu]. aborted.\n", 
+    if (ino_nr >= sbi->s_inodes_count) {
+        printk(SFS_KERN_LEVEL "Too large ino_nr to free:[%llu]. aborted.\n",
                ino_nr);
-        goto release;
+        brelse(bh);
+        goto unlock;
     }
-    raw_data += ino_nr / 8;
-    *raw_data |= 1 << (ino_nr % 8);
-
-    err = 0;
-release:
+    __clear_bit_le(ino_nr, bh->b_data);
     mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
     brelse(bh);
-    return err;
+    percpu_counter_inc(&sbi->s_freeinodes_counter);
+unlock:
+    mutex_unlock(&sbi->s_ibmap_lock);
+}
+
+/* does dir entry `de' hold `name'(`len' chars long) ? */
+static inline int sfs_dirent_match(struct sfs_dir_entry *de, const char *name,
+                                   int len) {
+    if (len > SFS_DIRENT_NAME_LEN || strncmp(de->name, name, len))
+        return 0;
+    return len == SFS_DIRENT_NAME_LEN || de->name[len] == '\0';
 }
 
 /* search for a entry. inode number on sucess, 0 on fail(0 is the root ino) */
 unsigned long __sfs_search_dir_blk(struct super_block *sb, unsigned int blk_nr,
                                    const char *name) {
     struct buffer_head *bh;
-    char *data;
-    int i;
+    struct sfs_dir_entry *de;
+    int i, len;
     unsigned int ino = 0;
 
     bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + blk_nr);
-    BUG_ON(!bh);
     if (!bh) {
         SFSD(SFS_KERN_LEVEL "FAIL sb_bread()\n");
-        goto final;
+        return 0;
     }
 
-    data = bh->b_data;
-
-    if (!SFS_BLK_SIZE / SFS_FNAME_MAX) {
-        SFSD(SFS_KERN_LEVEL "modulus error\n");
-        goto final;
-    }
-    /* sfs have max 14 bytes name */
-    for (i = 0; i < SFS_BLK_SIZE / SFS_FNAME_MAX; i++)
-        if (0 == strncmp(&data[i * SFS_FNAME_MAX], name, SFS_FNAME_MAX))
+    de = (struct sfs_dir_entry *)bh->b_data;
+    len = strlen(name);
+    /* sfs have max 12 bytes name */
+    for (i = 0; i < SFS_DIRENTS_PER_BLK(sb); i++)
+        if (sfs_dirent_match(&de[i], name, len))
             break;
-    if (i == SFS_BLK_SIZE / SFS_FNAME_MAX) {
+    if (i == SFS_DIRENTS_PER_BLK(sb)) {
         SFSD(SFS_KERN_LEVEL "cannot find name in this block\n");
         goto final;
     }
-    /* we use only two byte(uint16_t) to store ino_nr */
-    ino = (unsigned int)(*((uint16_t *)(&data[i * SFS_FNAME_MAX + 14])));
+    ino = de[i].inode_no;
 
 final:
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
     brelse(bh);
     return (unsigned long)ino;
 }
@@ -329,7 +358,6 @@ unsigned long sfs_search_for_ino(struct super_block *sb,
             break;
         }
     }
-    printk(SFS_KERN_LEVEL "sfs_search_for_ino() cannot find child\n");
     return 0;
 }
 
@@ -342,16 +370,29 @@ int __sfs_copy_single_blk_data(struct super_block *sb, char *dest, unsigned int
         return -ENOMEM;
     }
 
-    memcpy(dest, bh->b_data, SFS_BLK_SIZE);
+    memcpy(dest, bh->b_data, sb->s_blocksize);
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
     brelse(bh);
     return 0;
 }
 
+/*
+ * start reading the blks of `sii' from `slot' on, s_ra_blks of them, so that
+ * they are in the buffer cache by the time we get there
+ */
+static void sfs_readahead(struct super_block *sb, struct sfs_inode_info *sii,
+                          int slot) {
+    unsigned long i, ra = READ_ONCE(SFS_S_INFO(sb)->s_ra_blks);
+
+    for (i = slot; i < SFS_INO_NDIRECT && i < slot + ra; i++)
+        if (sii->directs[i])
+            sb_breadahead(sb, SFS_S_INFO(sb)->sfs_blk_start + sii->directs[i]);
+}
+
 /* ============= end helper function ==================*/
 
+static int sfs_meta_sync(struct inode *dir, struct inode *inode);
+
 /*
  * TheVFS calls this function from the creat() and open() system calls
  * to create a new inode associated with the given dentry object with the
@@ -390,6 +431,13 @@ static int sfs_rmdir(struct inode *dir, struct dentry *dentry);
  */
 static int sfs_iterate(struct file *filp, struct dir_context *ctx);
 
+/*
+ * called by stat(2) and friends. Timestamps come from the in-memory inode,
+ * which may be newer than what is on disk yet
+ */
+static int sfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
+                       struct kstat *stat);
+
 /* 
  * Reads len bytes from the given file at position offset into buf.
  * The file pointer is then updated.This function is called by the read() 
@@ -406,14 +454,70 @@ ssize_t sfs_read(struct file *filp, char __user *buf, size_t len,
 ssize_t sfs_write(struct file *filp, const char __user *buf, size_t len,
                   loff_t *ppos);
 
+/*
+ * Fill a page cache page of a file. read()/write() do not use the page
+ * cache, it is only there so that splice()/sendfile() can hand pages to a
+ * pipe without copying them again. Data come from the same blk buffers
+ * read()/write() use, and writes drop the pages they overwrite(see
+ * sfs_drop_page_cache()), so the two views agree.
+ */
+static int sfs_readpage(struct file *filp, struct page *page);
+
+static const struct address_space_operations sfs_aops = {
+    .readpage = sfs_readpage,
+};
+
+/*
+ * Called by the VFS when a file is opened. Writers get a blk reservation
+ * window here(see balloc.c)
+ */
+static int sfs_file_open(struct inode *inode, struct file *filp);
+
+/*
+ * Called when the last reference to an open file is closed. Blks left in the
+ * reservation window go back to the blk bitmap
+ */
+static int sfs_file_release(struct inode *inode, struct file *filp);
+
+/*
+ * fsync()/fdatasync(): write out only what this file dirtied, then flush the
+ * disk cache once
+ */
+static int sfs_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
+
+/*
+ * reflink. On 4.5+ the VFS handle FICLONE/FICLONERANGE itself and call us
+ * here(older kernels pass them to sfs_ioctl())
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+static int sfs_clone_file_range(struct file *src_file, loff_t off,
+                                struct file *dst_file, loff_t destoff,
+                                u64 len) {
+    loff_t ret = sfs_clone_range(src_file, off, dst_file, destoff, len);
+
+    return ret < 0 ? ret : 0;
+}
+#endif
+
 static struct file_operations sfs_file_ops = {
+    .open = sfs_file_open,
+    .release = sfs_file_release,
     .read = sfs_read,
     .write = sfs_write,
+    .splice_read = generic_file_splice_read,
+    .fsync = sfs_fsync,
+    .unlocked_ioctl = sfs_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+    .copy_file_range = sfs_copy_file_range,
+    .clone_file_range = sfs_clone_file_range,
+#endif
 };
 
 static struct file_operations sfs_dir_ops = {
     .owner = THIS_MODULE,
     .iterate = sfs_iterate,
+    .fsync = sfs_fsync,
+    .unlocked_ioctl = sfs_ioctl,
 };
 
 static struct inode_operations sfs_inode_ops = {
@@ -422,15 +526,67 @@ static struct inode_operations sfs_inode_ops = {
     .mkdir = sfs_mkdir,
     .unlink = sfs_unlink,
     .rmdir = sfs_rmdir,
+    .getattr = sfs_getattr,
 };
 
+/*
+ * get the in-memory inode of `ino', reading it from disk only if it is not
+ * in the inode cache already. So a file looked up twice is the same inode,
+ * with the same (possibly not yet written) timestamps
+ */
+static struct inode *sfs_iget(struct super_block *sb, unsigned long ino) {
+    struct inode *inode;
+    struct sfs_inode_info *sii;
+    int err = -EIO;
+
+    /* nothing valid can live in the part of the table not zeroed yet */
+    if (ino >= sfs_itable_inodes(sb)) {
+        printk(SFS_KERN_LEVEL "bad inode nr: [%lu]\n", ino);
+        return ERR_PTR(-EIO);
+    }
+    inode = iget_locked(sb, ino);
+    if (!inode)
+        return ERR_PTR(-ENOMEM);
+    if (!(inode->i_state & I_NEW))
+        return inode;
+
+    sii = sfs_get_inode(sb, ino);
+    if (!sii) {
+        err = -ENOMEM;
+        goto fail;
+    }
+    inode->i_private = sii;
+    inode_init_owner(inode, NULL, sii->mode);
+    set_nlink(inode, 1);
+    inode->i_op = &sfs_inode_ops;
+    if (S_ISDIR(sii->mode)) {
+        inode->i_fop = &sfs_dir_ops;
+    } else if (S_ISREG(sii->mode)) {
+        inode->i_fop = &sfs_file_ops;
+        inode->i_mapping->a_ops = &sfs_aops;
+    } else {
+        SFSD(SFS_KERN_LEVEL "unknown inode type!(neither dir or regular "
+                             "file. mode: [0x%x]\n", (unsigned)sii->mode);
+        goto fail;
+    }
+    inode->i_size = sii->file_size;
+    sfs_times_from_disk(inode, sii);
+    unlock_new_inode(inode);
+    return inode;
+
+fail:
+    /* sfs_evict_inode() free sii, if any */
+    iget_failed(inode);
+    return ERR_PTR(err);
+}
+
 /*
  * the last argument, excl, means that this file have to be created
  * "exclusively", i.e., it can't exist before creating. we ignore this flag
  * for simplicity 
  */
-static int sfs_create(struct inode *dir, struct dentry *dentry,
-                      umode_t mode, bool excl) {
+static int __sfs_create(struct inode *dir, struct dentry *dentry,
+                        umode_t mode, bool excl) {
     struct super_block *sb;
     struct inode *inode;
     struct sfs_inode_info *sii, *parent_sii, *tmp_sii;
@@ -438,33 +594,34 @@ static int sfs_create(struct inode *dir, struct dentry *dentry,
     uint32_t directs[SFS_INO_NDIRECT];
     uint32_t indirect;
     int ino_nr, err, i, j, k;
-    char *raw_data;
+    struct sfs_dir_entry *de;
     const char *filename;
 
     filename = dentry->d_name.name;
-    if (unlikely(strlen(filename) > SFS_FNAME_MAX - 2)) {
+    if (unlikely(strlen(filename) > SFS_DIRENT_NAME_LEN)) {
         SFSD(SFS_KERN_LEVEL "length of filename exceed SFS_FNAME_MAX!\n");
         return -EINVAL;
     }
 
     sb = dir->i_sb;
 
-    ino_nr = __sfs_get_next_inode_nr(sb);
-    if (ino_nr < 0) {
-        printk(SFS_KERN_LEVEL "inode bitmap full !!!\n");
-        return -ENOMEM;
-    }
-    printk(SFS_KERN_LEVEL "next inode nr: [%d]\n", ino_nr);
-
     if (!S_ISDIR(mode) && !S_ISREG(mode)) {
         SFSD(SFS_KERN_LEVEL "creation request neither a file or directory."
                              "NOT SUPPORTED YET.\n");
         return -EINVAL;
     }
 
+    /* this also mark the ino bitmap */
+    ino_nr = sfs_new_inode_nr(sb);
+    if (ino_nr < 0) {
+        printk(SFS_KERN_LEVEL "inode bitmap full !!!\n");
+        return -ENOSPC;
+    }
+
     inode = new_inode(sb);
     if (!inode) {
         SFSD(SFS_KERN_LEVEL "FAIL new_inode() !!\n");
+        sfs_free_inode_nr(sb, ino_nr);
         return -ENOMEM;
     }
     inode->i_sb = sb;
@@ -475,7 +632,7 @@ static int sfs_create(struct inode *dir, struct dentry *dentry,
     atomic_set(&inode->i_count, 1); /* i_count: reference counter */
     set_nlink(inode, 1);            /* i_nlink: number of hard links */
 
-    sii = kmem_cache_alloc(sfs_inode_cachep, GFP_KERNEL);
+    sii = kmem_cache_zalloc(sfs_inode_cachep, GFP_KERNEL);
     if (unlikely(!sii)) {
         SFSD(SFS_KERN_LEVEL "FAIL kmem_cache_alloc() !\n");
         return -ENOMEM;
@@ -483,62 +640,44 @@ static int sfs_create(struct inode *dir, struct dentry *dentry,
     sii->inode_no = inode->i_ino;
     sii->slot_nr = ino_nr;
     inode->i_private = sii;
+    insert_inode_hash(inode);   /* so that sfs_iget() find it */
     sii->mode = mode;
+    /* chattr +c on a dir is inherited by everything created under it */
+    sii->i_flags = SFS_I_INFO(dir)->i_flags & SFS_COMPR_FL;
 
     if (S_ISDIR(mode)) {
-        printk(SFS_KERN_LEVEL "New directory creation request. name:[%s]\n",
-               filename);
-        inode->i_size = (loff_t)SFS_BLK_SIZE;
-        sii->file_size = (unsigned long)SFS_BLK_SIZE;
-        sii->directs[0] = __sfs_get_unused_blk(sb);
+        inode->i_size = (loff_t)sb->s_blocksize;
+        sii->file_size = sb->s_blocksize;
+        sii->directs[0] = sfs_new_blk(sb, NULL);
         if (!sii->directs[0]) { /* we are running out of block */
-            SFSD(SFS_KERN_LEVEL "FAIL __sfs_get_unused_blk() \n");
-            sii->directs[0] = 0;
-        }
-        err = sfs_update_blk_bmp_bit(sb, sii->directs[0]);
-        if (err) {
-            SFSD(SFS_KERN_LEVEL "FAIL sfs_update_blk_bmp_bit()!|n");
-            return -ENOMEM;
+            SFSD(SFS_KERN_LEVEL "FAIL sfs_new_blk() \n");
+            return -ENOSPC;
         }
+        /* no stale dir entries */
+        sfs_zero_blk(sb, sii->directs[0], inode);
         inode->i_fop = &sfs_dir_ops;
     } else if (S_ISREG(mode)) {
-        printk(SFS_KERN_LEVEL "New file creation request name:[%s]\n",
-               filename);
         sii->file_size = 0;
         inode->i_size = 0;
         inode->i_fop = &sfs_file_ops;
+        inode->i_mapping->a_ops = &sfs_aops;
     } else {
         printk(SFS_KERN_LEVEL "DONT know this new file creation request\n");
         return -EINVAL;
     }
 
     /* update child data */
-    err = sfs_update_ino_bmp_bit(sb, ino_nr);
+    err = sfs_update_inode(inode);
     if (!(0 == err)) {
-        SFSD(SFS_KERN_LEVEL "FAIL sfs_update_ino_bmp_bit(). abort\n");
-        return err;
-    }
-    err = sfs_update_prealloc_inodes(sb, sii);
-    if (!(0 == err)) {
-        SFSD(SFS_KERN_LEVEL "FAIL sfs_update_prealloc_inodes(). abort\n");
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_update_inode(). abort\n");
         return err;
     }
 
     /* update parent dir meta-data(make a new entry) */
     parent_sii = SFS_I_INFO(dir);
-    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_ino_start);
-    /* search for the sii. I know this would be slow(maybe use ino_nr later*/
-    tmp_sii = (struct sfs_inode_info *)bh->b_data;
-    for (i = 0; i < bh->b_size / sizeof(struct sfs_inode_info); i++)
-        if (parent_sii->inode_no == (tmp_sii + i)->inode_no)
-            break;
-    if (i == bh->b_size / sizeof(struct sfs_inode_info)) {
-        printk(SFS_KERN_LEVEL "search through all slot in preallocated inodes blk"
-                          "but cannot find the same dir inode.\n");
-        err = -EINVAL;
-        goto release_bh;
-    }
-    tmp_sii = tmp_sii + i;
+    bh = sfs_inode_blk(sb, parent_sii->inode_no, &tmp_sii);
+    if (unlikely(!bh))
+        return -EIO;
 
     /* to get where the dir data is placed */
     memcpy(directs, tmp_sii->directs, sizeof(uint32_t) * SFS_INO_NDIRECT);
@@ -554,19 +693,17 @@ static int sfs_create(struct inode *dir, struct dentry *dentry,
     }
 
     i = i == 0 ? 1 : i;
-    printk(SFS_KERN_LEVEL "going to update dir entry. i:[%d], directs[i-1]:[%d]\n",
-           i, directs[i - 1]);
     for (k = i - 1; k <= i && k != SFS_INO_NDIRECT; k++) {
         if (directs[k] == 0) {
-            directs[k] = __sfs_get_unused_blk(sb);
+            directs[k] = sfs_new_blk(sb, NULL);
             if (directs[k] == 0) {
-                SFSD(SFS_KERN_LEVEL "FAIL __sfs_get_unused_blk() !\n");
+                SFSD(SFS_KERN_LEVEL "FAIL sfs_new_blk() !\n");
+                err = -ENOSPC;
                 goto release_bh;
             }
-            printk(SFS_KERN_LEVEL "__sfs_get_unused_blk:[%d]\n", directs[k]);
+            sfs_zero_blk(sb, directs[k], dir);
             /* update new blk info */
             parent_sii->directs[k] = tmp_sii->directs[k] = directs[k];
-            sfs_update_blk_bmp_bit(sb, directs[k]);
         }
         /* to see whether the last filled block have some space left */
         bh2 = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + directs[k]);
@@ -575,54 +712,78 @@ static int sfs_create(struct inode *dir, struct dentry *dentry,
             err = -ENOMEM;
             goto release_bh;
         }
-        raw_data = bh2->b_data;
-        for (j = 0; j < SFS_BLK_SIZE / SFS_FNAME_MAX; j++)
-            if (raw_data[j * SFS_FNAME_MAX] == '\0')
+        de = (struct sfs_dir_entry *)bh2->b_data;
+        for (j = 0; j < SFS_DIRENTS_PER_BLK(sb); j++)
+            if (de[j].name[0] == '\0')
                 break;
-        if (j != SFS_BLK_SIZE / SFS_FNAME_MAX) {
+        if (j != SFS_DIRENTS_PER_BLK(sb)) {
             /* then there is still some space left in this blk */
-            sprintf(raw_data + j * SFS_FNAME_MAX, "%s", filename);
-            *((uint16_t *)(raw_data + j * SFS_FNAME_MAX + 14)) = (uint16_t)ino_nr; /* wooo~~ */
-            printk(SFS_KERN_LEVEL "successfully update dir. added child entry\n");
+            memset(&de[j], 0, sizeof(struct sfs_dir_entry));
+            memcpy(de[j].name, filename, strlen(filename));
+            de[j].inode_no = (uint16_t)ino_nr;
+            sfs_dindex_add(dir, filename, ino_nr,
+                           k * SFS_DIRENTS_PER_BLK(sb) + j);
             break;
         } else {
             /* then no space left for a new entry, so we use the next blk */
             if (k == i - 1) { /* first time reach here */
-                mark_buffer_dirty(bh2);
-                sync_dirty_buffer(bh2);
                 brelse(bh2);
             }
         }
     }
 
+    /* a new entry change the dir's mtime/ctime. bh is written out below */
+    dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+    sfs_times_to_disk(dir, parent_sii);
+    sfs_times_to_disk(dir, tmp_sii);
+    mark_inode_dirty(dir);      /* for fsync() of the dir */
+
+    /* the dir may have got a new blk, and it has a new name */
+    sfs_rstat_update(dir);
+    sfs_rstat_link(dir, inode);
+    sfs_chlog_add(sb, ino_nr, dir->i_ino,
+                  S_ISDIR(mode) ? SFS_CHLOG_MKDIR : SFS_CHLOG_CREATE);
+
     inode_init_owner(inode, dir, mode);
-    d_add(dentry, inode);
+    /* sfs_lookup() may have hashed a negative dentry already */
+    d_instantiate(dentry, inode);
 
     err = 0;
-    SFSD(SFS_KERN_LEVEL "Going to sync/release bh2 and bh now\n");
 
-    mark_buffer_dirty(bh2);
-    sync_dirty_buffer(bh2);
+    /* the new entry is written out by fsync() of the dir, or writeback */
+    mark_buffer_dirty_inode(bh2, dir);
     brelse(bh2);
 
 release_bh:
     mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
     brelse(bh);
     return err;
 }
 
+static int sfs_create(struct inode *dir, struct dentry *dentry,
+                      umode_t mode, bool excl) {
+    u64 start = sfs_lat_start();
+    int err;
+
+    trace_sfs_create_enter(dir, dentry);
+    err = __sfs_create(dir, dentry, mode, excl);
+    if (!err && (SFS_S_INFO(dir->i_sb)->s_mount_opt & SFS_MOUNT_SYNC_META))
+        err = sfs_meta_sync(dir, dentry->d_inode);
+    trace_sfs_create_exit(dir, dentry, err);
+    sfs_lat_account(dir->i_sb, SFS_OP_CREATE, start);
+    return err;
+}
+
 /* 
  * @parent_inode: parent dir inode to search
  * @child_dentry: a negative dentry which we want to point to the found inode
- * (if inode found, we return this child_dentry after connecting it and the 
- * found inode, otherwise NULL is return )
+ * (connected to the found inode, or left negative if there is no such
+ * entry. NULL is returned either way, an ERR_PTR on real errors)
  */
-static struct dentry *sfs_lookup(struct inode *parent_inode,
-                                 struct dentry *child_dentry, unsigned int flags) {
-    struct buffer_head *bh;
+static struct dentry *__sfs_lookup(struct inode *parent_inode,
+                                   struct dentry *child_dentry) {
     struct super_block *sb;
-    struct sfs_inode_info *parent_sii, *sii, *tmp_sii;
+    struct sfs_inode_info *parent_sii;
     struct inode *inode;
     unsigned long ino;
 
@@ -638,148 +799,138 @@ static struct dentry *sfs_lookup(struct inode *parent_inode,
     }
     sb = parent_inode->i_sb;
 
-    ino = sfs_search_for_ino(sb, parent_sii, child_dentry->d_name.name);
+    /* large dirs answer from their name index, see dindex.c */
+    if (!sfs_dindex_lookup(parent_inode, child_dentry->d_name.name,
+                           child_dentry->d_name.len, &ino))
+        ino = sfs_search_for_ino(sb, parent_sii, child_dentry->d_name.name);
     if (ino == 0) { /* it can't be 0, which is root ino */
-        printk(SFS_KERN_LEVEL "FAIL: sfs_lookup() fail to find required child under dir\n");
+        /* a negative dentry, so the next lookup of it need no disk access */
+        d_add(child_dentry, NULL);
         return NULL;
     }
 
-    sii = (struct sfs_inode_info *)kzalloc(sizeof(struct sfs_inode_info),
-                                           GFP_KERNEL);
-    if (!sii) {
-        SFSD(SFS_KERN_LEVEL "FAIL kzalloc() !\n");
-        return NULL;
-    }
-    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_ino_start);
-    if (!bh) {
-        SFSD(SFS_KERN_LEVEL "FAIL sb_read() 4 !\n");
-        return NULL;
-    }
-    tmp_sii = (struct sfs_inode_info *)bh->b_data;
-    tmp_sii += parent_inode->i_ino;
-    memcpy(sii, tmp_sii, sizeof(struct sfs_inode_info));
-
-    /*
-     * every time we perform a loopup, and found that sfs_inode_info
-     * we create a new in-memory inode and sfs_inode_info for it
-     */
-    inode = new_inode(sb);
-    inode->i_ino = ino;
-    /* leave the i_count ... */
-    inode_init_owner(inode, parent_inode, sii->mode);
-    inode->i_sb = sb;
-    inode->i_op = &sfs_inode_ops;
-    if (S_ISDIR(inode->i_mode))
-        inode->i_fop = &sfs_dir_ops;
-    else if (S_ISREG(inode->i_mode))
-        inode->i_fop = &sfs_file_ops;
-    else {
-        SFSD(SFS_KERN_LEVEL "unknown inode type!(neither dir or regular "
-                             "file. i_mode: [0x%x]\n",
-                  (unsigned)inode->i_mode);
-        mark_buffer_dirty(bh);
-        sync_dirty_buffer(bh);
-        brelse(bh);
-        return NULL;
+    inode = sfs_iget(sb, ino);
+    if (IS_ERR(inode)) {
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_iget() !\n");
+        return ERR_CAST(inode);
     }
-    /* FIXME: we should store these time on disk and retrive them */
-    inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
-    inode->i_mode |= sii->mode;
-    inode->i_size = sii->file_size;
-    inode->i_private = sii;
-
-    /*
-     * FIXME: (from doc)If the named inode does not exist a NULL inode
-	 * should be inserted into the dentry (this is called a negative
-	 * dentry). Returning an error code from this routine must only
-	 * be done on a real error, otherwise creating inodes with system
-	 * calls like create(2), mknod(2), mkdir(2) and so on will fail.
-     */
     d_add(child_dentry, inode);
+    return NULL;
+}
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
-    return child_dentry;
+static struct dentry *sfs_lookup(struct inode *parent_inode,
+                                 struct dentry *child_dentry, unsigned int flags) {
+    u64 start = sfs_lat_start();
+    struct dentry *ret;
+
+    trace_sfs_lookup_enter(parent_inode, child_dentry);
+    ret = __sfs_lookup(parent_inode, child_dentry);
+    trace_sfs_lookup_exit(parent_inode, child_dentry, PTR_ERR_OR_ZERO(ret));
+    sfs_lat_account(parent_inode->i_sb, SFS_OP_LOOKUP, start);
+    return ret;
 }
 
 static int sfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode) {
     return sfs_create(dir, dentry, mode | S_IFDIR, 1);
 }
 
-/* helper function */
-static int sfs_remove(struct inode *dir, struct dentry *dentry) {
-    struct super_block *sb;
+/*
+ * clear the entry of `dentry' in dir blks [from, to) of `dir'. 1 if it was
+ * found, 0 if not, -errno
+ */
+static int sfs_clear_dirent(struct inode *dir, struct dentry *dentry,
+                            int from, int to) {
+    struct super_block *sb = dir->i_sb;
+    struct sfs_inode_info *parent_sii = SFS_I_INFO(dir);
     struct buffer_head *bh;
-    struct inode *inode;
-    struct sfs_inode_info *sii, *parent_sii;
-    char *data;
+    struct sfs_dir_entry *de;
     int i, j, set = 0;
 
-    inode = dentry->d_inode;
-    sii = SFS_I_INFO(inode);
-    parent_sii = SFS_I_INFO(dir);
-    sb = inode->i_sb;
-
-    /* clear all contents of this file */
-    for (i = 0; i < SFS_INO_NDIRECT; i++) {
-        bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + sii->directs[i]);
+    for (i = from; i < to && !set && parent_sii->directs[i]; i++) {
+        bh = sb_bread(sb,
+                      SFS_S_INFO(sb)->sfs_blk_start + parent_sii->directs[i]);
         if (!bh) {
             SFSD(SFS_KERN_LEVEL "FAIL sb_bread()\n");
             return -ENOMEM;
         }
-        data = bh->b_data;
-        memset(data, '\0', sb->s_blocksize);
-        sii->directs[i] = 0;
-        mark_buffer_dirty(bh);
-        sync_dirty_buffer(bh);
+        de = (struct sfs_dir_entry *)bh->b_data;
+        for (j = 0; j < SFS_DIRENTS_PER_BLK(sb); j++) {
+            /* FIXME: when fill in dir entry, we only use the last blk. but if
+             * we leave a hole here if would not get used */
+            if (sfs_dirent_match(&de[j], dentry->d_name.name,
+                                 dentry->d_name.len)) {
+                memset(&de[j], '\0', sizeof(struct sfs_dir_entry));
+                set = 1;
+                break;
+            }
+        }
+        if (set)
+            mark_buffer_dirty_inode(bh, dir);
         brelse(bh);
     }
-    /* clear inode */
-    bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_ino_start);
-    if (!bh) {
-        SFSD(SFS_KERN_LEVEL "FAIL sb_bread()\n");
-        return -ENOMEM;
-    }
-    data = (char *)((struct sfs_inode_info *)bh->b_data + sii->inode_no);
-    memset(data, '\0', sizeof(struct sfs_inode_info));
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
-    /* free sii memory */
-    kmem_cache_free(sfs_inode_cachep, sii);
+    return set;
+}
 
-    /* free dir entry */
-    for (i = 0; i < SFS_INO_NDIRECT; i++) {
-        if (set)
-            break;
-        bh = sb_bread(sb,
-                      SFS_S_INFO(sb)->sfs_blk_start + parent_sii->directs[i]);
-        if (!bh) {
-            SFSD(SFS_KERN_LEVEL "FAIL sb_bread()\n");
-            return -ENOMEM;
-        }
-        data = bh->b_data;
-        for (j = 0; j < SFS_BLK_SIZE / SFS_FNAME_MAX; j++) {
-            /* FIXME: when fill in dir entry, we only use the last blk. but if
-             * we leave a hole here if would not get used */
-            data += j * SFS_FNAME_MAX;
-            if (0 == strncmp(data, dentry->d_name.name, SFS_FNAME_MAX - 2)) {
-                memset(data, '\0', SFS_FNAME_MAX);
-                set = 1;
-                break;
-            }
+static int __sfs_remove(struct inode *dir, struct dentry *dentry) {
+    struct super_block *sb;
+    struct inode *inode;
+    long pos;
+    int err;
+
+    inode = dentry->d_inode;
+    sb = inode->i_sb;
+
+    /* free dir entry. The name index, if any, tell which blk it is in */
+    err = 0;
+    pos = sfs_dindex_del(dir, dentry->d_name.name, dentry->d_name.len);
+    if (pos >= 0) {
+        pos /= SFS_DIRENTS_PER_BLK(sb);
+        err = sfs_clear_dirent(dir, dentry, pos, pos + 1);
+        if (err == 0) {
+            printk(SFS_KERN_LEVEL "stale name index of dir [%lu], "
+                   "dropped\n", dir->i_ino);
+            sfs_dindex_drop(dir);
         }
-        mark_buffer_dirty(bh);
-        sync_dirty_buffer(bh);
-        brelse(bh);
     }
+    if (err == 0)
+        err = sfs_clear_dirent(dir, dentry, 0, SFS_INO_NDIRECT);
+    if (err < 0)
+        return err;
 
+    /*
+     * only the dir entry go away now. The blks and the inode nr are given
+     * back once the inode is evicted, by a work item(see orphan.c). Orphaned
+     * after the entry is gone: should this fail or not reach the disk, a
+     * crash leak the inode to fsck.sfs rather than free a linked one
+     */
+    if (sfs_orphan_add(inode))
+        printk(SFS_KERN_LEVEL "FAIL putting ino [%lu] on the orphan list\n",
+               inode->i_ino);
+    sfs_rstat_unlink(dir, inode);
+    sfs_chlog_add(sb, inode->i_ino, dir->i_ino,
+                  S_ISDIR(inode->i_mode) ? SFS_CHLOG_RMDIR : SFS_CHLOG_UNLINK);
+
+    dir->i_mtime = dir->i_ctime = inode->i_ctime = CURRENT_TIME;
+    mark_inode_dirty(dir);
     inode_dec_link_count(inode);
 
     return 0;
 }
 
+/* helper function of unlink/rmdir */
+static int sfs_remove(struct inode *dir, struct dentry *dentry) {
+    u64 start = sfs_lat_start();
+    int err;
+
+    trace_sfs_remove_enter(dir, dentry);
+    err = __sfs_remove(dir, dentry);
+    if (!err && (SFS_S_INFO(dir->i_sb)->s_mount_opt & SFS_MOUNT_SYNC_META))
+        err = sfs_meta_sync(dir, dentry->d_inode);
+    trace_sfs_remove_exit(dir, dentry, err);
+    sfs_lat_account(dir->i_sb, SFS_OP_REMOVE, start);
+    return err;
+}
+
 static int sfs_unlink(struct inode *dir, struct dentry *dentry) {
 
     if (!S_ISREG(dentry->d_inode->i_mode)) {
@@ -807,14 +958,14 @@ static int sfs_rmdir(struct inode *dir, struct dentry *dentry) {
 /*
  * called when the VFS needs to read the directory contents
  */
-static int sfs_iterate(struct file *filp, struct dir_context *ctx) {
+static int __sfs_iterate(struct file *filp, struct dir_context *ctx) {
     loff_t pos;
     struct buffer_head *bh;
     struct super_block *sb;
     struct inode *inode;
     struct sfs_inode_info *sii;
+    struct sfs_dir_entry *de;
     int i, j;
-    char *raw_data;
 
     pos = ctx->pos;
 
@@ -847,38 +998,59 @@ static int sfs_iterate(struct file *filp, struct dir_context *ctx) {
         return -ENOTDIR;
     }
 
-    SFSD(SFS_KERN_LEVEL "DEBUGGING: ctx->pos = %lu \n", (unsigned long)pos);
-
+    sfs_readahead(sb, sii, 1);
     /* NOTE: we are NOT using the indirect block here */
-    for (i = 0; sii->directs[i] != 0 && i < SFS_INO_NDIRECT; i++) {
-        char filename[SFS_FNAME_MAX + 1];
-        uint16_t ino;
+    for (i = 0; i < SFS_INO_NDIRECT && sii->directs[i] != 0; i++) {
         bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + sii->directs[i]);
         if (!bh) {
             SFSD(SFS_KERN_LEVEL "FAIL sb_bread() !\n");
             return -ENOMEM;
         }
-        raw_data = bh->b_data;
-        for (j = 0; j < SFS_BLK_SIZE / SFS_FNAME_MAX; j++) {
-            memset(filename, '\0', SFS_FNAME_MAX + 1);
-            if (raw_data[j * SFS_FNAME_MAX] == '\0')
-                goto release_and_break;
-            strncpy(filename, &raw_data[j * SFS_FNAME_MAX], SFS_FNAME_MAX);
-            printk(SFS_KERN_LEVEL "filename copied:[%s]\n", filename);
-            ino = *((uint16_t *)((&raw_data[j * SFS_FNAME_MAX]) + 14));
-            dir_emit(ctx, filename, SFS_FNAME_MAX, (uint32_t)ino, DT_UNKNOWN);
+        de = (struct sfs_dir_entry *)bh->b_data;
+        for (j = 0; j < SFS_DIRENTS_PER_BLK(sb); j++) {
+            /* sfs_remove() leave holes, skip them */
+            if (de[j].name[0] == '\0')
+                continue;
+            dir_emit(ctx, de[j].name, strnlen(de[j].name, SFS_DIRENT_NAME_LEN),
+                     (uint32_t)de[j].inode_no, DT_UNKNOWN);
             /* TODO: need clarification */
-            ctx->pos += SFS_FNAME_MAX;
+            ctx->pos += sizeof(struct sfs_dir_entry);
         }
         brelse(bh);
-        continue;
-    release_and_break:
-        brelse(bh);
-        break;
     }
     return 0;
 }
 
+static int sfs_iterate(struct file *filp, struct dir_context *ctx) {
+    struct inode *inode = file_inode(filp);
+    u64 start = sfs_lat_start();
+    loff_t pos = ctx->pos;
+    int err;
+
+    trace_sfs_iterate_enter(inode, pos, 0);
+    err = __sfs_iterate(filp, ctx);
+    /* report how far the position moved, or the error */
+    trace_sfs_iterate_exit(inode, pos, err ? err : ctx->pos - pos);
+    sfs_lat_account(inode->i_sb, SFS_OP_ITERATE, start);
+    return err;
+}
+
+static int sfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
+                       struct kstat *stat) {
+    struct inode *inode = dentry->d_inode;
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    int i;
+
+    generic_fillattr(inode, stat);
+    stat->blksize = inode->i_sb->s_blocksize;
+    /* blks really allocated, in 512-byte units(holes not counted) */
+    stat->blocks = 0;
+    for (i = 0; i < SFS_INO_NDIRECT; i++)
+        if (sii->directs[i])
+            stat->blocks += inode->i_sb->s_blocksize >> 9;
+    return 0;
+}
+
 /*
  * NOTE: when reading a large file, the kernel would through out such warning
  * and abort the reading:
@@ -886,8 +1058,8 @@ static int sfs_iterate(struct file *filp, struct dir_context *ctx) {
  * acess hardware directly
  * (but with small file it's really ok)
  */
-ssize_t sfs_read(struct file *filp, char __user *buf, size_t len,
-                 loff_t *ppos) {
+static ssize_t __sfs_read(struct file *filp, char __user *buf, size_t len,
+                          loff_t *ppos) {
     struct buffer_head *bh;
     struct super_block *sb;
     struct inode *inode;
@@ -901,42 +1073,45 @@ ssize_t sfs_read(struct file *filp, char __user *buf, size_t len,
      */
     inode = filp->f_path.dentry->d_inode;
     sii = SFS_I_INFO(inode);
+    /* only dirty the inode in memory, see sfs_update_inode() */
+    file_accessed(filp);
+    if (sii->i_flags & SFS_COMPR_FL)
+        return sfs_compr_read(filp, buf, len, ppos);
     if (*ppos >= sii->file_size) {
         return 0;
     }
     sb = inode->i_sb;
-    SFSD(SFS_KERN_LEVEL "file postion:[%ld], file size:[%ld]\n",
-              (long int)*ppos, sii->file_size);
 
     /*
      * The if clause can be omitted, since we have already check sii->file_size.
      * However we want to keep this for debugging in case file_size and
      * sii->indirects is not in agree
      */
-    slot = *ppos / SFS_BLK_SIZE;
-    if (slot > SFS_INO_NDIRECT) {
+    slot = *ppos / sb->s_blocksize;
+    if (slot >= SFS_INO_NDIRECT) {
         /* we only use direct slot now */
         SFSD(SFS_KERN_LEVEL "sfs_read() attempting to read more than 10 direct block !\n");
         return 0;
     }
     blk_nr = sii->directs[slot];
     /* we can read at most this frag from this blk */
-    frag_size = SFS_BLK_SIZE - (*ppos % SFS_BLK_SIZE);
+    frag_size = sb->s_blocksize - (*ppos % sb->s_blocksize);
     /* we can read at most this length from the file */
     nbytes = min((size_t)(sii->file_size - *ppos), len);
     /* assume that we have enough memory(or see sfs_write() ) */
-    kbuf = (char *)kzalloc(nbytes + SFS_BLK_SIZE, GFP_KERNEL);
+    kbuf = (char *)kzalloc(nbytes + sb->s_blocksize, GFP_KERNEL);
     if (!kbuf) {
         SFSD(SFS_KERN_LEVEL "FAIL kzalloc() \n");
         return 0;
     }
 
+    sfs_readahead(sb, sii, slot + 1);
     bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + blk_nr);
     if (!bh) {
         SFSD(SFS_KERN_LEVEL "FAIL sb_read() 5 !\n");
         return 0;
     }
-    raw_data = bh->b_data + SFS_BLK_SIZE - frag_size;
+    raw_data = bh->b_data + sb->s_blocksize - frag_size;
     if (nbytes < frag_size) { /* we can perform all read in this single blk */
         /*
          * copy_to_user() return 0 on success. return the number of bytes they
@@ -955,17 +1130,17 @@ ssize_t sfs_read(struct file *filp, char __user *buf, size_t len,
         kbuf += frag_size;
         nbytes -= frag_size;
         slot++;
-        for (i = 0; i <= nbytes / SFS_BLK_SIZE; i++) {
+        for (i = 0; i <= nbytes / sb->s_blocksize; i++) {
             k = __sfs_copy_single_blk_data(sb, kbuf, sii->directs[slot + i]);
             if (0 != k) {
                 SFSD(SFS_KERN_LEVEL "FAIL __sfs_copy_single_blk_data()!\n");
                 ret = 0;
                 goto release;
             }
-            kbuf += SFS_BLK_SIZE;
+            kbuf += sb->s_blocksize;
         }
         /* copy the data left */
-        if (nbytes % SFS_BLK_SIZE) {
+        if (nbytes % sb->s_blocksize) {
             k = __sfs_copy_single_blk_data(sb, kbuf, sii->directs[slot + i]);
             if (0 != k) {
                 SFSD(SFS_KERN_LEVEL "FAIL __sfs_copy_single_blk_data()!\n");
@@ -987,28 +1162,35 @@ ssize_t sfs_read(struct file *filp, char __user *buf, size_t len,
 
 release:
     kfree(kbuf);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
     brelse(bh);
     return ret;
 }
 
-ssize_t sfs_write(struct file *filp, const char __user *buf, size_t len,
-                  loff_t *ppos) {
+ssize_t sfs_read(struct file *filp, char __user *buf, size_t len,
+                 loff_t *ppos) {
+    struct inode *inode = file_inode(filp);
+    u64 start = sfs_lat_start();
+    loff_t pos = *ppos;
+    ssize_t ret;
+
+    trace_sfs_read_enter(inode, pos, len);
+    ret = __sfs_read(filp, buf, len, ppos);
+    trace_sfs_read_exit(inode, pos, ret);
+    sfs_lat_account(inode->i_sb, SFS_OP_READ, start);
+    return ret;
+}
+
+static ssize_t __sfs_write(struct file *filp, const char __user *buf,
+                           size_t len, loff_t *ppos) {
     struct super_block *sb;
     struct buffer_head *bh;
     struct inode *inode;
     struct sfs_inode_info *sii;
+    struct sfs_rsv_window *rsv;
     size_t slot, frag_size, chunk;
     char *data;
     int i, j, k, ret;
 
-    ret = generic_write_checks(filp, ppos, &len, 0);
-    if (ret) {
-        SFSD(SFS_KERN_LEVEL "FAIL generic_write_checks() !\n");
-        return 0;
-    }
-
     /*
      * in newer version kernel, we can use filp->f_inode instead of
      * f->f_path.dentry->d_inode 
@@ -1016,42 +1198,43 @@ ssize_t sfs_write(struct file *filp, const char __user *buf, size_t len,
     inode = filp->f_path.dentry->d_inode;
     sii = SFS_I_INFO(inode);
     sb = inode->i_sb;
+    rsv = filp->private_data;
 
-    if (*ppos + len > SFS_INO_NDIRECT * SFS_BLK_SIZE) {
+    if (*ppos + len > SFS_INO_NDIRECT * sb->s_blocksize) {
         SFSD(SFS_KERN_LEVEL "maximum file size exceed when writing!\n");
         return 0;
     }
-    slot = *ppos / SFS_BLK_SIZE;
+    slot = *ppos / sb->s_blocksize;
     if (sii->directs[slot] == 0) {
-        /* acquire new block */
-        sii->directs[slot] = __sfs_get_unused_blk(sb);
-        if (0 == sii->directs[slot]) {
-            SFSD(SFS_KERN_LEVEL "FAIL __sfs_get_unused_blk()!\n");
-            return 0;
-        }
-        ret = sfs_update_blk_bmp_bit(sb, sii->directs[slot]);
-        if (ret) {
-            SFSD(SFS_KERN_LEVEL "FAIL sfs_update_blk_bmp_bit()!|n");
-            return 0;
-        }
-
         /* also acquire new block for < slot (i.e., this file contain hole) */
         for (i = 0; i < slot; i++) {
-            sii->directs[i] = __sfs_get_unused_blk(sb);
+            if (sii->directs[i])
+                continue;
+            sii->directs[i] = sfs_new_blk(sb, rsv);
             if (0 == sii->directs[i]) {
                 /* FIXME: this situation is awkward, we have to roll back */
-                SFSD(SFS_KERN_LEVEL "FAIL __sfs_get_unused_blk()"
+                SFSD(SFS_KERN_LEVEL "FAIL sfs_new_blk()"
                                      "for < slot !...awkward...\n");
-                return 0;
-            }
-            ret = sfs_update_blk_bmp_bit(sb, sii->directs[slot]);
-            if (ret) {
-                SFSD(SFS_KERN_LEVEL "FAIL sfs_update_blk_bmp_bit()!|n");
-                return 0;
+                return -ENOSPC;
             }
+            /* a hole read as zeros */
+            sfs_zero_blk(sb, sii->directs[i], inode);
         }
-    }
-    frag_size = SFS_BLK_SIZE - (*ppos % SFS_BLK_SIZE);
+
+        /* acquire new block */
+        sii->directs[slot] = sfs_new_blk(sb, rsv);
+        if (0 == sii->directs[slot]) {
+            SFSD(SFS_KERN_LEVEL "FAIL sfs_new_blk()!\n");
+            return -ENOSPC;
+        }
+        /* also save the read of a blk we are about to write */
+        sfs_zero_blk(sb, sii->directs[slot], inode);
+    }
+    /* never write into a blk shared with a reflink clone */
+    ret = sfs_cow_blk(inode, slot, rsv);
+    if (ret)
+        return ret;
+    frag_size = sb->s_blocksize - (*ppos % sb->s_blocksize);
     bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + sii->directs[slot]);
     if (!bh) {
         SFSD(SFS_KERN_LEVEL "FAIL sb_bread() !\n");
@@ -1061,15 +1244,15 @@ ssize_t sfs_write(struct file *filp, const char __user *buf, size_t len,
     chunk = min(len, frag_size);
     /* we should probably check this return value to depress compiler warning
      * (unused return value) */
-    copy_from_user(data + (*ppos % SFS_BLK_SIZE), buf, chunk);
+    copy_from_user(data + (*ppos % sb->s_blocksize), buf, chunk);
     buf += chunk;
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    /* written out by fsync() or writeback, see sfs_fsync() */
+    mark_buffer_dirty_inode(bh, inode);
     brelse(bh);
     /* file size changed, record it into sii and inode */
     sii->file_size += chunk;
-    if (0 != sfs_update_prealloc_inodes(sb, sii)) {
-        SFSD(SFS_KERN_LEVEL "FAIL sfs_update_prealloc_inodes() !\n");
+    if (0 != sfs_update_inode(inode)) {
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_update_inode() !\n");
         return 0;
     }
     inode->i_size += chunk;
@@ -1083,26 +1266,25 @@ ssize_t sfs_write(struct file *filp, const char __user *buf, size_t len,
          * already done it above
          */
         chunk = len - chunk; /* how many bytes left to transfer */
-        k = chunk / SFS_BLK_SIZE;
+        k = chunk / sb->s_blocksize;
         for (j = 0; j < k + 1; j++) {
             slot++;
             if (sii->directs[slot] == 0) {
-                sii->directs[slot] = __sfs_get_unused_blk(sb);
+                sii->directs[slot] = sfs_new_blk(sb, rsv);
                 if (0 == sii->directs[slot]) {
-                    SFSD(SFS_KERN_LEVEL "FAIL __sfs_get_unused_blk()!\n");
-                    return 0;
-                }
-                ret = sfs_update_prealloc_inodes(sb, sii);
-                if (ret) {
-                    SFSD(SFS_KERN_LEVEL "FAIL sfs_update_prealloc_inodes()!|n");
-                    return 0;
+                    SFSD(SFS_KERN_LEVEL "FAIL sfs_new_blk()!\n");
+                    return -ENOSPC;
                 }
-                ret = sfs_update_blk_bmp_bit(sb, sii->directs[slot]);
+                sfs_zero_blk(sb, sii->directs[slot], inode);
+                ret = sfs_update_inode(inode);
                 if (ret) {
-                    SFSD(SFS_KERN_LEVEL "FAIL sfs_update_blk_bmp_bit()!|n");
+                    SFSD(SFS_KERN_LEVEL "FAIL sfs_update_inode()!\n");
                     return 0;
                 }
             }
+            ret = sfs_cow_blk(inode, slot, rsv);
+            if (ret)
+                return ret;
             bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + sii->directs[slot]);
             if (!bh) {
                 SFSD(SFS_KERN_LEVEL "FAIL sb_bread()!\n");
@@ -1110,17 +1292,16 @@ ssize_t sfs_write(struct file *filp, const char __user *buf, size_t len,
             }
             /* we should propably check this return value to depress compiler
              * warning(unused return value) */
-            copy_from_user(bh->b_data, buf, min(chunk, (size_t)SFS_BLK_SIZE));
-            sii->file_size += min(chunk, (size_t)SFS_BLK_SIZE);
+            copy_from_user(bh->b_data, buf, min(chunk, sb->s_blocksize));
+            sii->file_size += min(chunk, sb->s_blocksize);
             /* file size changed. recode that into sii and inode */
-            if (0 != sfs_update_prealloc_inodes(sb, sii)) {
-                SFSD(SFS_KERN_LEVEL "FAIL sfs_update_prealloc_inodes() !\n");
+            if (0 != sfs_update_inode(inode)) {
+                SFSD(SFS_KERN_LEVEL "FAIL sfs_update_inode() !\n");
                 return 0;
             }
-            inode->i_size += min(chunk, (size_t)SFS_BLK_SIZE);
-            chunk -= min(chunk, (size_t)SFS_BLK_SIZE);
-            mark_buffer_dirty(bh);
-            sync_dirty_buffer(bh);
+            inode->i_size += min(chunk, sb->s_blocksize);
+            chunk -= min(chunk, sb->s_blocksize);
+            mark_buffer_dirty_inode(bh, inode);
             brelse(bh);
         }
         *ppos += len;
@@ -1128,6 +1309,219 @@ ssize_t sfs_write(struct file *filp, const char __user *buf, size_t len,
     }
 }
 
+ssize_t sfs_write(struct file *filp, const char __user *buf, size_t len,
+                  loff_t *ppos) {
+    struct inode *inode = file_inode(filp);
+    u64 start = sfs_lat_start();
+    loff_t pos = *ppos;
+    ssize_t ret;
+    int err;
+
+    trace_sfs_write_enter(inode, pos, len);
+    /* picked up by the inode write the data write below do anyway */
+    file_update_time(filp);
+    /*
+     * clone and defrag swap blks of the file under i_mutex, and chattr may
+     * flip SFS_COMPR_FL of an empty file under it, so test it under it too
+     */
+    mutex_lock(&inode->i_mutex);
+    /* O_APPEND, RLIMIT_FSIZE and s_maxbytes, for both kinds of file */
+    ret = generic_write_checks(filp, ppos, &len, 0);
+    if (ret) {
+        SFSD(SFS_KERN_LEVEL "FAIL generic_write_checks() !\n");
+    } else if (SFS_I_INFO(inode)->i_flags & SFS_COMPR_FL) {
+        ret = sfs_compr_write(filp, buf, len, ppos);
+    } else {
+        ret = __sfs_write(filp, buf, len, ppos);
+    }
+    mutex_unlock(&inode->i_mutex);
+    if (ret > 0) {
+        sfs_drop_page_cache(inode, *ppos - ret, ret);
+        sfs_chlog_add(inode->i_sb, inode->i_ino, 0, SFS_CHLOG_WRITE);
+    }
+    /* the data itself is written back as usual, only the blks it got */
+    if (ret > 0 && (SFS_S_INFO(inode->i_sb)->s_mount_opt & SFS_MOUNT_SYNC_META)) {
+        err = sfs_meta_sync(NULL, inode);
+        if (err)
+            ret = err;
+    }
+    trace_sfs_write_exit(inode, pos, ret);
+    sfs_lat_account(inode->i_sb, SFS_OP_WRITE, start);
+    return ret;
+}
+
+static int sfs_readpage(struct file *filp, struct page *page) {
+    struct inode *inode = page->mapping->host;
+    struct super_block *sb = inode->i_sb;
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    struct buffer_head *bh;
+    loff_t pos = page_offset(page), isize = i_size_read(inode);
+    size_t bs = sb->s_blocksize, off, n;
+    unsigned int slot;
+    char *kaddr;
+    int err = 0;
+
+    kaddr = kmap(page);
+    if (sii->i_flags & SFS_COMPR_FL) {
+        err = sfs_compr_read_kernel(inode, kaddr, pos, PAGE_SIZE);
+        goto done;
+    }
+    for (off = 0; off < PAGE_SIZE; off += n) {
+        slot = (pos + off) / bs;
+        n = min_t(size_t, PAGE_SIZE - off, bs - (pos + off) % bs);
+        /* past EOF and holes read as zeros */
+        if (pos + off >= isize || slot >= SFS_INO_NDIRECT ||
+            !sii->directs[slot]) {
+            memset(kaddr + off, 0, n);
+            continue;
+        }
+        bh = sb_bread(sb, SFS_S_INFO(sb)->sfs_blk_start + sii->directs[slot]);
+        if (unlikely(!bh)) {
+            SFSD(SFS_KERN_LEVEL "FAIL sb_bread() !\n");
+            err = -EIO;
+            break;
+        }
+        memcpy(kaddr + off, bh->b_data + (pos + off) % bs, n);
+        brelse(bh);
+    }
+    /* a blk may hold stale bytes past EOF */
+    if (!err && pos < isize && isize - pos < PAGE_SIZE)
+        memset(kaddr + (isize - pos), 0, PAGE_SIZE - (isize - pos));
+done:
+    flush_dcache_page(page);
+    kunmap(page);
+    if (!err)
+        SetPageUptodate(page);
+    else
+        SetPageError(page);
+    unlock_page(page);
+    return err;
+}
+
+static int sfs_file_open(struct inode *inode, struct file *filp) {
+    if (!(filp->f_mode & FMODE_WRITE))
+        return 0;
+
+    /* if this fail, sfs_new_blk() simply fall back to the global bitmap */
+    filp->private_data = sfs_rsv_alloc(inode->i_sb);
+    return 0;
+}
+
+static int sfs_file_release(struct inode *inode, struct file *filp) {
+    struct sfs_rsv_window *rsv = filp->private_data;
+
+    if (rsv) {
+        sfs_rsv_release(inode->i_sb, rsv);
+        filp->private_data = NULL;
+    }
+    return 0;
+}
+
+/*
+ * write out the metadata blks shared with other files that `inode' depend on
+ * (its inode table blk, the inode bitmap, and the blk bitmap and refcount
+ * table blks covering its blks) if they are dirty. Blks not in the buffer
+ * cache can not be dirty, so they are not read in for this
+ */
+static int sfs_sync_meta_blks(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct sfs_inode_info *sii = SFS_I_INFO(inode);
+    struct buffer_head *bh;
+    unsigned long blks[2 + 2 * SFS_INO_NDIRECT];
+    unsigned long i, n = 0;
+    int err = 0, ret;
+
+    blks[n++] = sbi->sfs_ino_start +
+                inode->i_ino / SFS_INODES_PER_BLK(sb->s_blocksize);
+    blks[n++] = sbi->sfs_ino_bitmap;
+    for (i = 0; i < SFS_INO_NDIRECT; i++) {
+        if (!sii->directs[i])
+            continue;
+        blks[n++] = sbi->sfs_blk_bitmap +
+                    sii->directs[i] / (sb->s_blocksize * 8);
+        blks[n++] = sbi->sfs_refcnt_start + sii->directs[i] / sb->s_blocksize;
+    }
+
+    for (i = 0; i < n; i++) {
+        bh = sb_find_get_block(sb, blks[i]);
+        if (!bh)
+            continue;
+        if (buffer_dirty(bh)) {
+            ret = sync_dirty_buffer(bh);
+            if (ret && !err)
+                err = ret;
+        }
+        brelse(bh);
+    }
+    return err;
+}
+
+/*
+ * The file's own data blks(and a dir's entry blks) are tied to its inode by
+ * mark_buffer_dirty_inode(), so sync_mapping_buffers() write just those. Then
+ * the inode record: fdatasync() skip it when only timestamps changed
+ * (I_DIRTY_SYNC without I_DIRTY_DATASYNC, see sfs_update_inode()). The shared
+ * metadata blks go out only if something left them dirty, e.g. a blk
+ * allocation whose inode record writeback already wrote.
+ */
+static int sfs_fsync(struct file *filp, loff_t start, loff_t end, int datasync) {
+    struct inode *inode = filp->f_mapping->host;
+    struct super_block *sb = inode->i_sb;
+    int err, ret;
+
+    ret = sync_mapping_buffers(inode->i_mapping);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
+    if (!(inode->i_state & I_DIRTY_ALL))
+#else
+    if (!(inode->i_state & I_DIRTY))
+#endif
+        goto meta;
+    if (datasync && !(inode->i_state & I_DIRTY_DATASYNC))
+        goto meta;
+    err = sync_inode_metadata(inode, 1);
+    if (!ret)
+        ret = err;
+meta:
+    err = sfs_sync_meta_blks(inode);
+    if (!ret)
+        ret = err;
+    err = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+    /* a device without a write cache is not an error */
+    if (!ret && err != -EOPNOTSUPP)
+        ret = err;
+    return ret;
+}
+
+/*
+ * -o sync_meta: write out what a create/remove/write changed in the metadata
+ * before returning to user space. That is the dir's entry blks and record,
+ * the inode's record, and the bitmap/inode table blks they touch. Either of
+ * `dir' and `inode' may be NULL. No cache flush, fsync() is still for that
+ */
+static int sfs_meta_sync(struct inode *dir, struct inode *inode) {
+    int err, ret = 0;
+
+    if (dir) {
+        ret = sync_mapping_buffers(dir->i_mapping);
+        err = sync_inode_metadata(dir, 1);
+        if (!ret)
+            ret = err;
+        err = sfs_sync_meta_blks(dir);
+        if (!ret)
+            ret = err;
+    }
+    if (inode) {
+        err = sync_inode_metadata(inode, 1);
+        if (!ret)
+            ret = err;
+        err = sfs_sync_meta_blks(inode);
+        if (!ret)
+            ret = err;
+    }
+    return ret;
+}
+
 /* Usually, this is not needed if alloc_inode() is not defined */
 /*
 static void sfs_destroy_inode(struct inode *inode) {
@@ -1164,6 +1558,378 @@ static const struct super_operations sfs_sb_ops = {
 };
 */
 
+/*
+ * the VFS write a dirty inode back with this, at writeback time or on
+ * sync(2). Normally this only carry timestamps: everything else is written
+ * out as soon as it change. Under lazytime(4.0+) the VFS hold timestamp-only
+ * updates back(I_DIRTY_TIME) until the inode is dirtied for real, synced, or
+ * has been lazy for too long(dirtytime_expire_seconds), then call this.
+ */
+static int sfs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+    if (!SFS_I_INFO(inode))
+        return 0;
+    return __sfs_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+}
+
+/* the last reference to an inode is gone */
+static void sfs_evict_inode(struct inode *inode) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0)
+    truncate_inode_pages_final(&inode->i_data);
+#else
+    truncate_inode_pages(&inode->i_data, 0);
+#endif
+    /* dirty blks of a dead file are still written out by the bdev */
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+    /* its ino may be reused by another dir */
+    if (S_ISDIR(inode->i_mode))
+        sfs_dindex_drop(inode);
+    /*
+     * unlinked and no longer used by anyone: free it in the background. On
+     * a read-only sb it stay on the on-disk list until a read-write mount
+     */
+    if (!inode->i_nlink && inode->i_private &&
+        !(inode->i_sb->s_flags & MS_RDONLY))
+        sfs_orphan_queue(inode);
+    if (inode->i_private) {
+        kmem_cache_free(sfs_inode_cachep, inode->i_private);
+        inode->i_private = NULL;
+    }
+}
+
+/*
+ * write the in-memory super block(free counts included) back to disk. If
+ * `wait' is set, wait for the I/O
+ */
+void sfs_commit_super(struct super_block *sb, int wait) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, SFS_SB_START_NR);
+    if (unlikely(!bh)) {
+        SFSD(SFS_KERN_LEVEL "FAIL sb_bread() super block !!\n");
+        return;
+    }
+    sbi->s_free_blocks = percpu_counter_sum_positive(&sbi->s_freeblks_counter);
+    sbi->s_free_inodes =
+        percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+    memcpy(bh->b_data, sbi, SFS_SB_DISK_SIZE);
+    mark_buffer_dirty(bh);
+    if (wait)
+        sync_dirty_buffer(bh);
+    brelse(bh);
+}
+
+/*
+ * set up the free blk/inode counters. After a clean umount the counts in the
+ * super block can be trusted, otherwise we have to count the bitmaps
+ */
+static int sfs_init_counters(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    struct buffer_head *bh;
+    int err;
+
+    if (!(sbi->s_state & SFS_STATE_CLEAN)) {
+        printk(SFS_KERN_LEVEL "sfs not cleanly umounted, counting bitmaps\n");
+        sbi->s_free_blocks = sfs_bmap_count_free(sb);
+
+        bh = sb_bread(sb, sbi->sfs_ino_bitmap);
+        if (unlikely(!bh))
+            return -EIO;
+        sbi->s_free_inodes = sfs_bitmap_count_free(bh->b_data,
+                                                   sbi->s_inodes_count);
+        brelse(bh);
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+    err = percpu_counter_init(&sbi->s_freeblks_counter, sbi->s_free_blocks,
+                              GFP_KERNEL);
+    if (!err)
+        err = percpu_counter_init(&sbi->s_freeinodes_counter,
+                                  sbi->s_free_inodes, GFP_KERNEL);
+#else
+    err = percpu_counter_init(&sbi->s_freeblks_counter, sbi->s_free_blocks);
+    if (!err)
+        err = percpu_counter_init(&sbi->s_freeinodes_counter,
+                                  sbi->s_free_inodes);
+#endif
+    if (err)
+        percpu_counter_destroy(&sbi->s_freeblks_counter);
+    return err;
+}
+
+static void sfs_destroy_counters(struct super_block *sb) {
+    percpu_counter_destroy(&SFS_S_INFO(sb)->s_freeblks_counter);
+    percpu_counter_destroy(&SFS_S_INFO(sb)->s_freeinodes_counter);
+}
+
+/*
+ * called by sync(2) and friends. make the free counts durable. This is also
+ * where blks freed under `-o discard' get discarded in one batch
+ */
+static int sfs_sync_fs(struct super_block *sb, int wait) {
+    if (!(sb->s_flags & MS_RDONLY)) {
+        if (wait)
+            sfs_orphan_flush(sb);
+        sfs_flush_discards(sb);
+        sfs_commit_super(sb, wait);
+    }
+    return 0;
+}
+
+/*
+ * -o commit=N: every N secs write back the free counts and queued discards,
+ * and start writeback of the dirty metadata blks(bitmaps, inode table, dir
+ * blks), without waiting for it. So a crash lose at most about N secs of
+ * metadata even if nobody call sync(2)
+ */
+static void sfs_commit_work(struct work_struct *work) {
+    struct sfs_sb_info *sbi = container_of(to_delayed_work(work),
+                                           struct sfs_sb_info, s_commit_work);
+    struct super_block *sb = sbi->sb;
+
+    if (sb->s_flags & MS_RDONLY)
+        return;
+    sfs_flush_discards(sb);
+    sfs_commit_super(sb, 0);
+    filemap_fdatawrite(sb->s_bdev->bd_inode->i_mapping);
+    sfs_commit_schedule(sb);
+}
+
+/* (re)arm the commit work for the current s_commit_interval */
+void sfs_commit_schedule(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long interval = READ_ONCE(sbi->s_commit_interval);
+
+    if (interval && !(sb->s_flags & MS_RDONLY))
+        mod_delayed_work(system_wq, &sbi->s_commit_work, interval * HZ);
+    else
+        cancel_delayed_work(&sbi->s_commit_work);
+}
+
+/* called at umount, after all inodes are gone */
+static void sfs_put_super(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    /* nobody can change the tunables or re-arm the commit work after this */
+    sfs_sysfs_unregister(sb);
+    cancel_delayed_work_sync(&sbi->s_commit_work);
+    sfs_itable_stop(sb);
+    if (!(sb->s_flags & MS_RDONLY)) {
+        /* every inode is evicted by now, the last orphans are queued */
+        sfs_orphan_flush(sb);
+        sfs_flush_discards(sb);
+        sbi->s_state |= SFS_STATE_CLEAN;
+        sfs_commit_super(sb, 1);
+    }
+    sfs_fext_destroy(sb);
+    sfs_dindex_destroy(sb);
+    sfs_rstat_destroy(sb);
+    sfs_chlog_destroy(sb);
+    sfs_destroy_counters(sb);
+    sfs_stats_destroy(sb);
+    sb->s_fs_info = NULL;
+    kfree(sbi);
+}
+
+/*
+ * `df' call this. Everything here is kept in memory, so this is O(1) no
+ * matter how large the filesystem is
+ */
+static int sfs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+    struct super_block *sb = dentry->d_sb;
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+    buf->f_type = SFS_MAGIC_NUMBER;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = sbi->s_blocks_count;
+    buf->f_bfree = percpu_counter_sum_positive(&sbi->s_freeblks_counter);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = sbi->s_inodes_count;
+    buf->f_ffree = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+    buf->f_namelen = SFS_DIRENT_NAME_LEN;
+    buf->f_fsid.val[0] = (u32)id;
+    buf->f_fsid.val[1] = (u32)(id >> 32);
+    return 0;
+}
+
+/* what we actually implement, out of the list above */
+enum {
+    Opt_discard, Opt_nodiscard, Opt_discard_batch, Opt_commit, Opt_sync_meta,
+    Opt_async_meta, Opt_ra, Opt_rsv, Opt_rsv_max, Opt_err
+};
+
+static const match_table_t sfs_tokens = {
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_discard_batch, "discard_batch=%u"},
+    {Opt_commit, "commit=%u"},
+    {Opt_sync_meta, "sync_meta"},
+    {Opt_async_meta, "async_meta"},
+    {Opt_ra, "ra=%u"},
+    {Opt_rsv, "rsv=%u"},
+    {Opt_rsv_max, "rsv_max=%u"},
+    {Opt_err, NULL},
+};
+
+/* defaults of what the mount options and /sys/fs/sfs/<dev>/ can change */
+static void sfs_default_options(struct sfs_sb_info *sbi) {
+    sbi->s_mount_opt = 0;
+    sbi->s_commit_interval = 0;
+    sbi->s_ra_blks = 0;
+    sbi->s_rsv_blks = SFS_RSV_WINDOW_BLKS;
+    sbi->s_rsv_max = SFS_DEFAULT_RSV_MAX;
+    sbi->s_discard_batch = SFS_DISCARD_BATCH_BLKS;
+}
+
+/* parse the comma separated `-o' string into sbi */
+static int sfs_parse_options(char *options, struct sfs_sb_info *sbi) {
+    substring_t args[MAX_OPT_ARGS];
+    int token, n;
+    char *p;
+
+    if (!options)
+        return 0;
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        token = match_token(p, sfs_tokens, args);
+        if (token == Opt_discard_batch || token == Opt_commit ||
+            token == Opt_ra || token == Opt_rsv || token == Opt_rsv_max) {
+            if (match_int(&args[0], &n) || n < 0)
+                goto bad;
+        }
+        switch (token) {
+        case Opt_discard:
+            sbi->s_mount_opt |= SFS_MOUNT_DISCARD;
+            break;
+        case Opt_nodiscard:
+            sbi->s_mount_opt &= ~SFS_MOUNT_DISCARD;
+            break;
+        case Opt_discard_batch:
+            if (!n)
+                goto bad;
+            sbi->s_discard_batch = n;
+            break;
+        case Opt_commit:
+            if (n > SFS_MAX_COMMIT_INTERVAL)
+                goto bad;
+            sbi->s_commit_interval = n;
+            break;
+        case Opt_sync_meta:
+            sbi->s_mount_opt |= SFS_MOUNT_SYNC_META;
+            break;
+        case Opt_async_meta:
+            sbi->s_mount_opt &= ~SFS_MOUNT_SYNC_META;
+            break;
+        case Opt_ra:
+            if (n > SFS_INO_NDIRECT)
+                goto bad;
+            sbi->s_ra_blks = n;
+            break;
+        case Opt_rsv:
+            if (n > SFS_MAX_RSV_BLKS)
+                goto bad;
+            sbi->s_rsv_blks = n;
+            break;
+        case Opt_rsv_max:
+            sbi->s_rsv_max = n;
+            break;
+        default:
+            printk(SFS_KERN_LEVEL "unknown mount option: [%s]\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+bad:
+    printk(SFS_KERN_LEVEL "bad value for mount option: [%s]\n", p);
+    return -EINVAL;
+}
+
+/*
+ * mount options as shown in /proc/mounts. The tunables are shown as they
+ * are now, they may have been changed through sysfs since mount
+ */
+static int sfs_show_options(struct seq_file *seq, struct dentry *root) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(root->d_sb);
+
+    if (sbi->s_mount_opt & SFS_MOUNT_DISCARD)
+        seq_puts(seq, ",discard");
+    if (sbi->s_discard_batch != SFS_DISCARD_BATCH_BLKS)
+        seq_printf(seq, ",discard_batch=%lu", sbi->s_discard_batch);
+    if (sbi->s_commit_interval)
+        seq_printf(seq, ",commit=%lu", sbi->s_commit_interval);
+    if (sbi->s_mount_opt & SFS_MOUNT_SYNC_META)
+        seq_puts(seq, ",sync_meta");
+    if (sbi->s_ra_blks)
+        seq_printf(seq, ",ra=%lu", sbi->s_ra_blks);
+    if (sbi->s_rsv_blks != SFS_RSV_WINDOW_BLKS)
+        seq_printf(seq, ",rsv=%lu", sbi->s_rsv_blks);
+    if (sbi->s_rsv_max != SFS_DEFAULT_RSV_MAX)
+        seq_printf(seq, ",rsv_max=%lu", sbi->s_rsv_max);
+    return 0;
+}
+
+/*
+ * mount -o remount. The tunables are parsed on top of the current ones.
+ * Going read-only do what umount do to leave a clean fs behind, going
+ * read-write what a read-write mount do on top of a read-only one
+ */
+static int sfs_remount(struct super_block *sb, int *flags, char *data) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    unsigned long mount_opt = sbi->s_mount_opt;
+    unsigned long commit = sbi->s_commit_interval, ra = sbi->s_ra_blks;
+    unsigned long rsv = sbi->s_rsv_blks, rsv_max = sbi->s_rsv_max;
+    unsigned long batch = sbi->s_discard_batch;
+    int err;
+
+    sync_filesystem(sb);
+    err = sfs_parse_options(data, sbi);
+    if (err) {
+        sbi->s_mount_opt = mount_opt;
+        sbi->s_commit_interval = commit;
+        sbi->s_ra_blks = ra;
+        sbi->s_rsv_blks = rsv;
+        sbi->s_rsv_max = rsv_max;
+        sbi->s_discard_batch = batch;
+        return err;
+    }
+    sfs_discard_check(sb);
+
+    if ((*flags & MS_RDONLY) && !(sb->s_flags & MS_RDONLY)) {
+        /* no more commits, zeroing or orphan frees queued after this */
+        sb->s_flags |= MS_RDONLY;
+        cancel_delayed_work_sync(&sbi->s_commit_work);
+        sfs_itable_stop(sb);
+        sfs_orphan_flush(sb);
+        sfs_flush_discards(sb);
+        sync_blockdev(sb->s_bdev);
+        sbi->s_state |= SFS_STATE_CLEAN;
+        sfs_commit_super(sb, 1);
+    } else if (!(*flags & MS_RDONLY) && (sb->s_flags & MS_RDONLY)) {
+        sb->s_flags &= ~MS_RDONLY;
+        /* while the state still tell how the last umount went */
+        sfs_chlog_start(sb);
+        sbi->s_state &= ~SFS_STATE_CLEAN;
+        sfs_commit_super(sb, 1);
+        sfs_orphan_replay(sb);
+        sfs_itable_start(sb);
+    }
+    sfs_commit_schedule(sb);
+    return 0;
+}
+
+static const struct super_operations sfs_sb_ops = {
+    .write_inode = sfs_write_inode,
+    .evict_inode = sfs_evict_inode,
+    .put_super   = sfs_put_super,
+    .sync_fs     = sfs_sync_fs,
+    .statfs      = sfs_statfs,
+    .remount_fs  = sfs_remount,
+    .show_options = sfs_show_options,
+};
+
 /* 
  * when mounting sfs, VFS call `sfs_mount', which in turn call `mount_bdev',
  * which in turn call `sfs_fill_sb'. In these procedures, 
@@ -1171,6 +1937,49 @@ static const struct super_operations sfs_sb_ops = {
  *     corresponding device(think vfsmount)
  * - `sys_fill_sb' is the one who do the real initialization job for sb...
  */
+/*
+ * The blk size is chosen at mkfs time, and the super block sits in blk
+ * SFS_SB_START_NR of *that* size. So try every size we support, from the
+ * smallest the device allows, until we find a super block that agrees with
+ * the size we read it with. On success sb->s_blocksize is set and the disk
+ * part of `sbi' is filled in.
+ */
+static int sfs_probe_blksize(struct super_block *sb, struct sfs_sb_info *sbi,
+                             int silent) {
+    struct buffer_head *bh;
+    struct sfs_sb_info *dsbi;
+    unsigned long bs;
+
+    bs = max_t(unsigned long, SFS_MIN_BLK_SIZE,
+               bdev_logical_block_size(sb->s_bdev));
+    for (; bs <= SFS_MAX_BLK_SIZE; bs <<= 1) {
+        if (!sb_set_blocksize(sb, bs)) {
+            /* most kernels can not do blk size larger than PAGE_SIZE */
+            if (!silent)
+                printk(SFS_KERN_LEVEL "blk size [%lu] not supported by "
+                                      "this kernel/device\n", bs);
+            break;
+        }
+        bh = sb_bread(sb, SFS_SB_START_NR);
+        if (unlikely(!bh)) {
+            SFSD(SFS_KERN_LEVEL "FAIL sb_bread() super block !!\n");
+            continue;
+        }
+        dsbi = (struct sfs_sb_info *)bh->b_data;
+        if (dsbi->magic == SFS_MAGIC_NUMBER && dsbi->blk_size == bs) {
+            /* bh would eventually be freed, so we use other place */
+            memcpy(sbi, dsbi, SFS_SB_DISK_SIZE);
+            brelse(bh);
+            return 0;
+        }
+        brelse(bh);
+    }
+
+    if (!silent)
+        printk(SFS_KERN_LEVEL "FAIL find a sfs super block !!\n");
+    return -EINVAL;
+}
+
 /*
  * @sb: the superblock structure. should be initialize properly
  * @data: arbitrary mount options, usually comes as an ASCII string(see the doc)
@@ -1179,20 +1988,21 @@ static const struct super_operations sfs_sb_ops = {
 static int sfs_fill_sb(struct super_block *sb, void *data, int silent) {
     struct sfs_sb_info *sbi;
     struct inode *ri;
-    struct buffer_head *bh;
+    int err = -EINVAL;
 
     sbi = kzalloc(sizeof(struct sfs_sb_info), GFP_KERNEL);
     if (unlikely(!sbi)) {
         SFSD(SFS_KERN_LEVEL "FAIL alloca memory for sbi !!!");
-        return -EINVAL;
+        return -ENOMEM;
     }
 
     printk(SFS_KERN_LEVEL "The original sb blksize is:[%lu]", sb->s_blocksize);
-    bh = sb_bread(sb, SFS_SB_START_NR);
-    BUG_ON(!bh);
-
-    /* bh would eventually be freed, so we use other place to place info */
-    memcpy(sbi, (struct sfs_sb_info *)bh->b_data, sizeof(struct sfs_sb_info));
+    err = sfs_probe_blksize(sb, sbi, silent);
+    if (err) {
+        kfree(sbi);
+        return err;
+    }
+    err = -EINVAL;
     printk(SFS_KERN_LEVEL
            "Obtained from disk: magic[0x%lx],version[0x%lx] blk_size[%lu]\n",
            sbi->magic, sbi->version, sbi->blk_size);
@@ -1200,15 +2010,37 @@ static int sfs_fill_sb(struct super_block *sb, void *data, int silent) {
         printk(SFS_KERN_LEVEL "FAIL check magic number !!!"
                           "magic read:[0x%lx]\n",
                sbi->magic);
-        kfree(sbi);
-        brelse(bh);
-        return -EINVAL;
-    }
-    if (unlikely(sbi->blk_size != SFS_BLK_SIZE)) {
-        printk(SFS_KERN_LEVEL "FAIL check blk_size !!\n");
-        kfree(sbi);
-        brelse(bh);
-        return -EINVAL;
+        goto free_sbi;
+    }
+    if (unlikely(sbi->version != SFS_VERSION)) {
+        printk(SFS_KERN_LEVEL "FAIL check version: [%lu], we know [%d]. "
+                          "re-run mkfs.sfs !!\n",
+               sbi->version, SFS_VERSION);
+        goto free_sbi;
+    }
+    /* blk nrs are 32 bits in inode records */
+    if (unlikely(!sbi->s_blocks_count || sbi->s_blocks_count > UINT_MAX ||
+                 sbi->s_blocks_count > sbi->s_bmap_blocks * sbi->blk_size * 8 ||
+                 sbi->sfs_blk_bitmap + sbi->s_bmap_blocks >
+                     sbi->s_blocks_count ||
+                 sbi->s_blocks_count > (i_size_read(sb->s_bdev->bd_inode) >>
+                                        sb->s_blocksize_bits) ||
+                 !sbi->s_inodes_count ||
+                 sbi->s_inodes_count > sbi->blk_size * 8 ||
+                 sbi->s_inodes_count > SFS_MAX_INODES ||
+                 sbi->s_inodes_count > sbi->s_itable_blocks *
+                                       SFS_INODES_PER_BLK(sbi->blk_size) ||
+                 !sbi->s_itable_zeroed ||
+                 sbi->s_itable_zeroed > sbi->s_itable_blocks ||
+                 sbi->sfs_ino_start + sbi->s_itable_blocks >
+                     sbi->s_blocks_count ||
+                 sbi->s_refcnt_blocks * sbi->blk_size < sbi->s_blocks_count ||
+                 (sbi->s_chlog_blocks && sbi->s_chlog_start !=
+                     sbi->sfs_refcnt_start + sbi->s_refcnt_blocks) ||
+                 SFS_DATA_START(sbi) > sbi->s_blocks_count)) {
+        printk(SFS_KERN_LEVEL "FAIL check geometry: blocks[%lu] inodes[%lu]\n",
+               sbi->s_blocks_count, sbi->s_inodes_count);
+        goto free_sbi;
     }
 
     printk(SFS_KERN_LEVEL "sfs of version[%lu] with blk size [%lu] detected.\n",
@@ -1216,32 +2048,67 @@ static int sfs_fill_sb(struct super_block *sb, void *data, int silent) {
 
     sb->s_magic = SFS_MAGIC_NUMBER;
     sb->s_fs_info = sbi;
-    sbi->blk_size = sb->s_blocksize; /* s_blocksize is used by sb_bread() */
+    sbi->sb = sb;
+    mutex_init(&sbi->s_ibmap_lock);
 
     /* maximum file size of this file system. would change in the future */
-    sb->s_maxbytes = SFS_BLK_SIZE * 11;
-    /*sb->s_op = &sfs_sb_ops;*/
-
-    /* should we check mount options ? */
-
-    ri = new_inode(sb);
-    ri->i_ino = SFS_ROOTINO;
-    atomic_set(&ri->i_count, 1);
-    set_nlink(ri, 1);
-    inode_init_owner(ri, NULL, S_IFDIR);
-    ri->i_sb = sb;
-    ri->i_op = &sfs_inode_ops;
-    ri->i_fop = &sfs_dir_ops;
-    ri->i_atime = ri->i_mtime = ri->i_ctime = CURRENT_TIME;
-    ri->i_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH;
-    ri->i_size = (loff_t)SFS_BLK_SIZE;
-
-    ri->i_private = sfs_get_inode(sb, SFS_ROOTINO);
-    if (!ri->i_private) {
+    sb->s_maxbytes = (loff_t)sb->s_blocksize * SFS_INO_NDIRECT;
+    sb->s_op = &sfs_sb_ops;
+
+    sfs_default_options(sbi);
+    err = sfs_parse_options(data, sbi);
+    if (err)
+        goto free_sbi;
+    sfs_discard_check(sb);
+
+    /* before anything that allocate or free, see stats.c */
+    err = sfs_stats_init(sb);
+    if (err) {
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_stats_init() !!\n");
+        goto free_sbi;
+    }
+
+    err = sfs_init_counters(sb);
+    if (err) {
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_init_counters() !!\n");
+        goto destroy_stats;
+    }
+
+    err = sfs_rsv_init(sb);
+    if (err) {
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_rsv_init() !!\n");
+        goto destroy_counters;
+    }
+    /* before anything can free blks, i.e. the orphan replay */
+    sfs_fext_init(sb);
+    err = sfs_dindex_init(sb);
+    if (err) {
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_dindex_init() !!\n");
+        goto destroy_rsv;
+    }
+    sfs_rstat_init(sb);
+    /* while the state on disk still tell how the last umount went */
+    err = sfs_chlog_init(sb);
+    if (err) {
+        SFSD(SFS_KERN_LEVEL "FAIL sfs_chlog_init() !!\n");
+        goto destroy_dindex;
+    }
+
+    sfs_orphan_init(sb);
+    if (!(sb->s_flags & MS_RDONLY))
+        sfs_orphan_replay(sb);
+
+    ri = sfs_iget(sb, SFS_ROOTINO);
+    if (IS_ERR(ri)) {
         SFSD(SFS_KERN_LEVEL "FAIL get root inode from disk. check you disk \n");
-        kfree(sbi);
-        brelse(bh);
-        return -EINVAL;
+        err = PTR_ERR(ri);
+        goto destroy_chlog;
+    }
+    if (!S_ISDIR(ri->i_mode)) {
+        SFSD(SFS_KERN_LEVEL "root inode is not a dir. check you disk \n");
+        iput(ri);
+        err = -EINVAL;
+        goto destroy_chlog;
     }
 
     /*
@@ -1250,13 +2117,40 @@ static int sfs_fill_sb(struct super_block *sb, void *data, int silent) {
      */
     sb->s_root = d_make_root(ri);
     if (!sb->s_root) {
-        kfree(sbi);
-        brelse(bh);
-        return -EINVAL;
+        err = -ENOMEM;
+        goto destroy_chlog;
     }
 
-    brelse(bh);
+    sfs_itable_init(sb);
+
+    /* until a clean umount, the free counts on disk are not to be trusted */
+    if (!(sb->s_flags & MS_RDONLY)) {
+        sbi->s_state &= ~SFS_STATE_CLEAN;
+        sfs_commit_super(sb, 1);
+    }
+
+    INIT_DELAYED_WORK(&sbi->s_commit_work, sfs_commit_work);
+    sfs_commit_schedule(sb);
+    /* the tunables are only a convenience, mount anyway without them */
+    if (sfs_sysfs_register(sb))
+        printk(SFS_KERN_LEVEL "FAIL creating /sys/fs/sfs/%s\n", sb->s_id);
     return 0;
+
+destroy_chlog:
+    sfs_chlog_destroy(sb);
+destroy_dindex:
+    sfs_dindex_destroy(sb);
+destroy_rsv:
+    sfs_rsv_destroy(sb);
+    sfs_fext_destroy(sb);
+destroy_counters:
+    sfs_destroy_counters(sb);
+destroy_stats:
+    sfs_stats_destroy(sb);
+free_sbi:
+    sb->s_fs_info = NULL;
+    kfree(sbi);
+    return err;
 }
 
 /*
@@ -1285,15 +2179,12 @@ static struct dentry *sfs_mount(struct file_system_type *type, int flags,
 }
 
 static void sfs_kill_block_super(struct super_block *sb) {
-    struct inode *ri;
-    struct sfs_inode_info *root_sii;
-
     printk(SFS_KERN_LEVEL "sfs_kill_blcok_super() get called. \n");
 
-    ri = sb->s_root->d_inode;
-    root_sii = SFS_I_INFO(ri);
-    kmem_cache_free(sfs_inode_cachep, root_sii);
-    inode_dec_link_count(ri);
+    /* inodes, the root included, are freed by sfs_evict_inode() */
+    /* sfs_fill_sb() may have failed half way */
+    if (sb->s_fs_info)
+        sfs_rsv_destroy(sb);
     kill_block_super(sb);
 }
 
@@ -1324,6 +2215,15 @@ static int __init sfs_init(void) {
     if (!sfs_inode_cachep) {
         return -ENOMEM;
     }
+    ret = sfs_fext_cache_init();
+    if (ret) {
+        destroy_inodecache();
+        return ret;
+    }
+    sfs_debugfs_init();
+    ret = sfs_sysfs_init();
+    if (ret)
+        goto out;
     ret = register_filesystem(&sfs_filesystem_type);
     if (likely(ret == 0)) {
         printk(SFS_KERN_LEVEL "sfs module loaded\n");
@@ -1333,6 +2233,9 @@ static int __init sfs_init(void) {
         goto out;
     }
 out:
+    sfs_sysfs_exit();
+    sfs_debugfs_exit();
+    sfs_fext_cache_exit();
     destroy_inodecache();
 out1:
     return ret;
@@ -1340,11 +2243,15 @@ out1:
 
 static void __exit sfs_exit(void) {
     unregister_filesystem(&sfs_filesystem_type);
+    sfs_sysfs_exit();
+    sfs_debugfs_exit();
+    sfs_fext_cache_exit();
     destroy_inodecache();
     printk(SFS_KERN_LEVEL "sfs module unloaded\n");
 }
 
-/*MODULE_LICENSE("GPL");*/
+/* debugfs, per-cpu allocation and tracepoints are for GPL modules only */
+MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Yubin Ruan");
 module_init(sfs_init);
 module_exit(sfs_exit);
@@ -0,0 +1,240 @@
+/*
+ *  fs/sfs/sysfs.c
+ *
+ *  /sys/fs/sfs/<dev>/: the per-mount tunables(which start from the mount
+ *  options, see sfs_parse_options()) and some read-only counters. Each file
+ *  hold one number, e.g.
+ *      echo 32 > /sys/fs/sfs/loop0/rsv_blks
+ *
+ * This file is part of the sfs filesystem source code, which is targeted at
+ * Linux kernel version 3.1x-4.6x. All of the source code are licensed under
+ * the Creative Commons Zero License, a public domain license. You can
+ * redistribute it or modify in any way you want. It is distributed in the hope
+ * that it will be useful and educational for learning and hacking the Linux
+ * kernel, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/completion.h>
+#include <linux/percpu_counter.h>
+
+#include "sfs.h"
+
+struct sfs_attr {
+    struct attribute attr;
+    ssize_t (*show)(struct sfs_sb_info *sbi, struct sfs_attr *a, char *buf);
+    ssize_t (*store)(struct sfs_sb_info *sbi, struct sfs_attr *a,
+                     const char *buf, size_t len);
+    size_t offset;              /* of an unsigned long in sfs_sb_info */
+    unsigned long min, max;     /* accepted by store */
+};
+
+/* "/sys/fs/sfs", a kobject per mounted sfs go under it */
+static struct kset *sfs_kset;
+
+#define SFS_UL(sbi, a) ((unsigned long *)((char *)(sbi) + (a)->offset))
+
+static ssize_t sfs_ul_show(struct sfs_sb_info *sbi, struct sfs_attr *a,
+                           char *buf) {
+    return sprintf(buf, "%lu\n", READ_ONCE(*SFS_UL(sbi, a)));
+}
+
+static ssize_t sfs_ul_store(struct sfs_sb_info *sbi, struct sfs_attr *a,
+                            const char *buf, size_t len) {
+    unsigned long v;
+    int err;
+
+    err = kstrtoul(buf, 0, &v);
+    if (err)
+        return err;
+    if (v < a->min || v > a->max)
+        return -EINVAL;
+    WRITE_ONCE(*SFS_UL(sbi, a), v);
+    return len;
+}
+
+static ssize_t sfs_commit_store(struct sfs_sb_info *sbi, struct sfs_attr *a,
+                                const char *buf, size_t len) {
+    ssize_t ret = sfs_ul_store(sbi, a, buf, len);
+
+    /* so that a long interval can be cut short right away */
+    if (ret > 0)
+        sfs_commit_schedule(sbi->sb);
+    return ret;
+}
+
+/* `min' is the SFS_MOUNT_* bit for these */
+static ssize_t sfs_opt_show(struct sfs_sb_info *sbi, struct sfs_attr *a,
+                            char *buf) {
+    return sprintf(buf, "%d\n", !!(sbi->s_mount_opt & a->min));
+}
+
+static ssize_t sfs_opt_store(struct sfs_sb_info *sbi, struct sfs_attr *a,
+                             const char *buf, size_t len) {
+    unsigned long v;
+    int err;
+
+    err = kstrtoul(buf, 0, &v);
+    if (err)
+        return err;
+    if (v > 1)
+        return -EINVAL;
+    if (v)
+        set_bit(ilog2(a->min), &sbi->s_mount_opt);
+    else
+        clear_bit(ilog2(a->min), &sbi->s_mount_opt);
+    if (a->min == SFS_MOUNT_DISCARD && v) {
+        sfs_discard_check(sbi->sb);
+        if (!(sbi->s_mount_opt & SFS_MOUNT_DISCARD))
+            return -EOPNOTSUPP;
+    }
+    return len;
+}
+
+static ssize_t sfs_free_blocks_show(struct sfs_sb_info *sbi,
+                                    struct sfs_attr *a, char *buf) {
+    return sprintf(buf, "%lld\n",
+                   percpu_counter_sum_positive(&sbi->s_freeblks_counter));
+}
+
+static ssize_t sfs_free_inodes_show(struct sfs_sb_info *sbi,
+                                    struct sfs_attr *a, char *buf) {
+    return sprintf(buf, "%lld\n",
+                   percpu_counter_sum_positive(&sbi->s_freeinodes_counter));
+}
+
+static ssize_t sfs_rsv_reserved_show(struct sfs_sb_info *sbi,
+                                     struct sfs_attr *a, char *buf) {
+    return sprintf(buf, "%lu\n", sfs_rsv_reserved(sbi->sb));
+}
+
+#define SFS_ATTR(_name, _mode, _show, _store, _field, _min, _max)          \
+static struct sfs_attr sfs_attr_##_name = {                                 \
+    .attr = {.name = __stringify(_name), .mode = _mode},                    \
+    .show = _show,                                                          \
+    .store = _store,                                                        \
+    .offset = offsetof(struct sfs_sb_info, _field),                         \
+    .min = _min,                                                            \
+    .max = _max,                                                            \
+}
+
+/* a tunable number in [_min, _max] */
+#define SFS_ATTR_TUNE(_name, _field, _min, _max) \
+    SFS_ATTR(_name, 0644, sfs_ul_show, sfs_ul_store, _field, _min, _max)
+/* a SFS_MOUNT_* bit, 0 or 1 */
+#define SFS_ATTR_OPT(_name, _bit) \
+    SFS_ATTR(_name, 0644, sfs_opt_show, sfs_opt_store, s_mount_opt, _bit, 1)
+/* a counter kept in sfs_sb_info */
+#define SFS_ATTR_RO(_name, _field) \
+    SFS_ATTR(_name, 0444, sfs_ul_show, NULL, _field, 0, 0)
+/* computed by `_show' */
+#define SFS_ATTR_FUNC(_name, _show) \
+    SFS_ATTR(_name, 0444, _show, NULL, s_mount_opt, 0, 0)
+
+SFS_ATTR(commit_interval, 0644, sfs_ul_show, sfs_commit_store,
+         s_commit_interval, 0, SFS_MAX_COMMIT_INTERVAL);
+SFS_ATTR_OPT(sync_meta, SFS_MOUNT_SYNC_META);
+SFS_ATTR_TUNE(readahead_blks, s_ra_blks, 0, SFS_INO_NDIRECT);
+SFS_ATTR_TUNE(rsv_blks, s_rsv_blks, 0, SFS_MAX_RSV_BLKS);
+SFS_ATTR_TUNE(rsv_max_windows, s_rsv_max, 0, ULONG_MAX);
+SFS_ATTR_OPT(discard, SFS_MOUNT_DISCARD);
+SFS_ATTR_TUNE(discard_batch_blks, s_discard_batch, 1, ULONG_MAX);
+SFS_ATTR_FUNC(free_blocks, sfs_free_blocks_show);
+SFS_ATTR_FUNC(free_inodes, sfs_free_inodes_show);
+SFS_ATTR_RO(rsv_windows, s_rsv_nr);
+SFS_ATTR_FUNC(rsv_reserved_blks, sfs_rsv_reserved_show);
+SFS_ATTR_RO(discard_queued_blks, s_discard_blks);
+SFS_ATTR_RO(free_extents, s_fext_nr);
+SFS_ATTR_RO(dir_indexes, s_dindex_nr);
+
+static struct attribute *sfs_sb_attrs[] = {
+    &sfs_attr_commit_interval.attr,
+    &sfs_attr_sync_meta.attr,
+    &sfs_attr_readahead_blks.attr,
+    &sfs_attr_rsv_blks.attr,
+    &sfs_attr_rsv_max_windows.attr,
+    &sfs_attr_discard.attr,
+    &sfs_attr_discard_batch_blks.attr,
+    &sfs_attr_free_blocks.attr,
+    &sfs_attr_free_inodes.attr,
+    &sfs_attr_rsv_windows.attr,
+    &sfs_attr_rsv_reserved_blks.attr,
+    &sfs_attr_discard_queued_blks.attr,
+    &sfs_attr_free_extents.attr,
+    &sfs_attr_dir_indexes.attr,
+    NULL,
+};
+
+static ssize_t sfs_attr_show(struct kobject *kobj, struct attribute *attr,
+                             char *buf) {
+    struct sfs_sb_info *sbi = container_of(kobj, struct sfs_sb_info, s_kobj);
+    struct sfs_attr *a = container_of(attr, struct sfs_attr, attr);
+
+    return a->show(sbi, a, buf);
+}
+
+static ssize_t sfs_attr_store(struct kobject *kobj, struct attribute *attr,
+                              const char *buf, size_t len) {
+    struct sfs_sb_info *sbi = container_of(kobj, struct sfs_sb_info, s_kobj);
+    struct sfs_attr *a = container_of(attr, struct sfs_attr, attr);
+
+    return a->store ? a->store(sbi, a, buf, len) : -EIO;
+}
+
+static const struct sysfs_ops sfs_attr_ops = {
+    .show = sfs_attr_show,
+    .store = sfs_attr_store,
+};
+
+/* the kobject is embedded in sbi, which sfs_sysfs_unregister() wait for */
+static void sfs_sb_release(struct kobject *kobj) {
+    struct sfs_sb_info *sbi = container_of(kobj, struct sfs_sb_info, s_kobj);
+
+    complete(&sbi->s_kobj_unregister);
+}
+
+static struct kobj_type sfs_sb_ktype = {
+    .default_attrs = sfs_sb_attrs,
+    .sysfs_ops = &sfs_attr_ops,
+    .release = sfs_sb_release,
+};
+
+int sfs_sysfs_register(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+    int err;
+
+    init_completion(&sbi->s_kobj_unregister);
+    sbi->s_kobj.kset = sfs_kset;
+    err = kobject_init_and_add(&sbi->s_kobj, &sfs_sb_ktype, NULL, "%s",
+                               sb->s_id);
+    if (err) {
+        kobject_put(&sbi->s_kobj);
+        wait_for_completion(&sbi->s_kobj_unregister);
+        /* so that sfs_sysfs_unregister() know there is nothing to remove */
+        memset(&sbi->s_kobj, 0, sizeof(sbi->s_kobj));
+    }
+    return err;
+}
+
+/* no show()/store() is running or will run after this */
+void sfs_sysfs_unregister(struct super_block *sb) {
+    struct sfs_sb_info *sbi = SFS_S_INFO(sb);
+
+    if (!sbi->s_kobj.state_initialized)
+        return;
+    kobject_del(&sbi->s_kobj);
+    kobject_put(&sbi->s_kobj);
+    wait_for_completion(&sbi->s_kobj_unregister);
+}
+
+int sfs_sysfs_init(void) {
+    sfs_kset = kset_create_and_add("sfs", NULL, fs_kobj);
+    return sfs_kset ? 0 : -ENOMEM;
+}
+
+void sfs_sysfs_exit(void) {
+    kset_unregister(sfs_kset);
+}